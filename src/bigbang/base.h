@@ -17,6 +17,7 @@
 #include "destination.h"
 #include "error.h"
 #include "key.h"
+#include "leveldbeng.h"
 #include "param.h"
 #include "peer.h"
 #include "profile.h"
@@ -116,10 +117,12 @@ public:
     virtual bool GetLastBlockTime(const uint256& hashFork, int nDepth, std::vector<int64>& vTime) = 0;
     virtual bool GetBlock(const uint256& hashBlock, CBlock& block) = 0;
     virtual bool GetBlockEx(const uint256& hashBlock, CBlockEx& block) = 0;
+    virtual bool GetBlockEx(const uint256& hashBlock, std::shared_ptr<const CBlockEx>& spBlock) = 0;
     virtual bool GetOrigin(const uint256& hashFork, CBlock& block) = 0;
     virtual bool Exists(const uint256& hashBlock) = 0;
     virtual bool GetTransaction(const uint256& txid, CTransaction& tx) = 0;
     virtual bool GetTransaction(const uint256& txid, CTransaction& tx, uint256& hashFork, int& nHeight) = 0;
+    virtual bool GetTransaction(const uint256& hashFork, const std::vector<uint256>& vTxid, std::vector<CTransaction>& vTx) = 0;
     virtual bool GetTxLocation(const uint256& txid, uint256& hashFork, int& nHeight) = 0;
     virtual bool GetTxUnspent(const uint256& hashFork, const std::vector<CTxIn>& vInput,
                               std::vector<CTxOut>& vOutput)
@@ -162,6 +165,7 @@ public:
     virtual bool CheckForkValidLast(const uint256& hashFork, CBlockChainUpdate& update) = 0;
     virtual bool VerifyForkRefLongChain(const uint256& hashFork, const uint256& hashForkBlock, const uint256& hashPrimaryBlock) = 0;
     virtual bool GetPrimaryHeightBlockTime(const uint256& hashLastBlock, int nHeight, uint256& hashBlock, int64& nTime) = 0;
+    virtual bool ExportSnapshot(const boost::filesystem::path& pathSnapshot, int& nHeight, uint256& hashBlock) = 0;
     virtual bool IsVacantBlockBeforeCreatedForkHeight(const uint256& hashFork, const CBlock& block) = 0;
 
     const CBasicConfig* Config()
@@ -356,6 +360,8 @@ public:
     virtual bool ListForkUnspentBatch(const uint256& hashFork, uint32 nMax, std::map<CDestination, std::vector<CTxUnspent>>& mapUnspent) = 0;
     virtual bool GetVotes(const CDestination& destDelegate, int64& nVotes, string& strFailCause) = 0;
     virtual bool ListDelegate(uint32 nCount, std::multimap<int64, CDestination>& mapVotes) = 0;
+    virtual bool ExportSnapshot(const boost::filesystem::path& pathSnapshot, int& nHeight, uint256& hashBlock) = 0;
+    virtual void GetDBStat(const std::string& strName, std::vector<storage::CLevelDBStat>& vStat) = 0;
 
     /* Wallet */
     virtual bool HaveKey(const crypto::CPubKey& pubkey, const int32 nVersion = -1) = 0;
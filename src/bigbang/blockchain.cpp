@@ -63,12 +63,32 @@ void CBlockChain::HandleDeinitialize()
 
 bool CBlockChain::HandleInvoke()
 {
+    cntrBlock.SetBlockCacheSize((size_t)StorageConfig()->nBlockCacheSize << 20);
+    cntrBlock.SetBlockCompress(StorageConfig()->fBlockCompress);
+    cntrBlock.SetTxIndexCacheSize((size_t)StorageConfig()->nTxIndexCacheSize << 20);
+    cntrBlock.SetUnspentCacheSize((size_t)StorageConfig()->nUnspentCacheSize << 20);
+    storage::CLevelDBEngine::SetFilterBits(StorageConfig()->nDBFilterBits);
+    storage::CLevelDBEngine::SetSizing("blockindex", (size_t)StorageConfig()->nBlockIndexDBCacheSize << 20,
+                                       (size_t)StorageConfig()->nBlockIndexDBWriteBuffer << 20);
+    storage::CLevelDBEngine::SetSizing("unspent", (size_t)StorageConfig()->nUnspentDBCacheSize << 20,
+                                       (size_t)StorageConfig()->nUnspentDBWriteBuffer << 20);
     if (!cntrBlock.Initialize(Config()->pathData, Config()->fDebug))
     {
         Error("Failed to initialize container");
         return false;
     }
 
+    if (!StorageConfig()->strSnapshot.empty())
+    {
+        storage::CSnapshotManifest manifest;
+        if (!cntrBlock.ImportSnapshot(boost::filesystem::path(StorageConfig()->strSnapshot), manifest))
+        {
+            Error("Failed to load snapshot %s", StorageConfig()->strSnapshot.c_str());
+            return false;
+        }
+        Log("Snapshot loaded, resume from height %d (%s)", manifest.nHeight, manifest.hashLastBlock.GetHex().c_str());
+    }
+
     /*if (!CheckContainer())
     {
         cntrBlock.Clear();
@@ -214,14 +234,10 @@ bool CBlockChain::GetBlockLocation(const uint256& hashBlock, uint256& hashFork,
 bool CBlockChain::GetBlockHash(const uint256& hashFork, int nHeight, uint256& hashBlock)
 {
     CBlockIndex* pIndex = nullptr;
-    if (!cntrBlock.RetrieveFork(hashFork, &pIndex) || pIndex->GetBlockHeight() < nHeight)
+    if (!cntrBlock.RetrieveForkHeight(hashFork, nHeight, &pIndex))
     {
         return false;
     }
-    while (pIndex != nullptr && pIndex->GetBlockHeight() > nHeight)
-    {
-        pIndex = pIndex->pPrev;
-    }
     while (pIndex != nullptr && pIndex->GetBlockHeight() == nHeight && pIndex->IsExtended())
     {
         pIndex = pIndex->pPrev;
@@ -233,14 +249,10 @@ bool CBlockChain::GetBlockHash(const uint256& hashFork, int nHeight, uint256& ha
 bool CBlockChain::GetBlockHash(const uint256& hashFork, int nHeight, vector<uint256>& vBlockHash)
 {
     CBlockIndex* pIndex = nullptr;
-    if (!cntrBlock.RetrieveFork(hashFork, &pIndex) || pIndex->GetBlockHeight() < nHeight)
+    if (!cntrBlock.RetrieveForkHeight(hashFork, nHeight, &pIndex))
     {
         return false;
     }
-    while (pIndex != nullptr && pIndex->GetBlockHeight() > nHeight)
-    {
-        pIndex = pIndex->pPrev;
-    }
     while (pIndex != nullptr && pIndex->GetBlockHeight() == nHeight)
     {
         vBlockHash.push_back(pIndex->GetBlockHash());
@@ -253,14 +265,10 @@ bool CBlockChain::GetBlockHash(const uint256& hashFork, int nHeight, vector<uint
 bool CBlockChain::GetLastBlockOfHeight(const uint256& hashFork, const int nHeight, uint256& hashBlock, int64& nTime)
 {
     CBlockIndex* pIndex = nullptr;
-    if (!cntrBlock.RetrieveFork(hashFork, &pIndex) || pIndex->GetBlockHeight() < nHeight)
+    if (!cntrBlock.RetrieveForkHeight(hashFork, nHeight, &pIndex))
     {
         return false;
     }
-    while (pIndex != nullptr && pIndex->GetBlockHeight() > nHeight)
-    {
-        pIndex = pIndex->pPrev;
-    }
     if (pIndex == nullptr || pIndex->GetBlockHeight() != nHeight)
     {
         return false;
@@ -317,6 +325,11 @@ bool CBlockChain::GetBlockEx(const uint256& hashBlock, CBlockEx& block)
     return cntrBlock.Retrieve(hashBlock, block);
 }
 
+bool CBlockChain::GetBlockEx(const uint256& hashBlock, std::shared_ptr<const CBlockEx>& spBlock)
+{
+    return cntrBlock.Retrieve(hashBlock, spBlock);
+}
+
 bool CBlockChain::GetOrigin(const uint256& hashFork, CBlock& block)
 {
     return cntrBlock.RetrieveOrigin(hashFork, block);
@@ -337,6 +350,11 @@ bool CBlockChain::GetTransaction(const uint256& txid, CTransaction& tx, uint256&
     return cntrBlock.RetrieveTx(txid, tx, hashFork, nHeight);
 }
 
+bool CBlockChain::GetTransaction(const uint256& hashFork, const vector<uint256>& vTxid, vector<CTransaction>& vTx)
+{
+    return cntrBlock.RetrieveTx(hashFork, vTxid, vTx);
+}
+
 bool CBlockChain::ExistsTx(const uint256& txid)
 {
     return cntrBlock.ExistsTx(txid);
@@ -1264,6 +1282,18 @@ bool CBlockChain::GetPrimaryHeightBlockTime(const uint256& hashLastBlock, int nH
     return cntrBlock.GetPrimaryHeightBlockTime(hashLastBlock, nHeight, hashBlock, nTime);
 }
 
+bool CBlockChain::ExportSnapshot(const boost::filesystem::path& pathSnapshot, int& nHeight, uint256& hashBlock)
+{
+    storage::CSnapshotManifest manifest;
+    if (!cntrBlock.ExportSnapshot(pathSnapshot, manifest))
+    {
+        return false;
+    }
+    nHeight = manifest.nHeight;
+    hashBlock = manifest.hashLastBlock;
+    return true;
+}
+
 bool CBlockChain::IsVacantBlockBeforeCreatedForkHeight(const uint256& hashFork, const CBlock& block)
 {
     int nCreatedHeight = -1;
@@ -1378,11 +1408,8 @@ bool CBlockChain::GetBlockDelegateAgreement(const uint256& hashBlock, const CBlo
         return true;
     }
 
-    const CBlockIndex* pIndex = pIndexPrev;
-    for (int i = 0; i < CONSENSUS_DISTRIBUTE_INTERVAL; i++)
-    {
-        pIndex = pIndex->pPrev;
-    }
+    // the primary chain has no extended blocks, one height back is one block back
+    const CBlockIndex* pIndex = pIndexPrev->GetAncestor(pIndexPrev->GetBlockHeight() - CONSENSUS_DISTRIBUTE_INTERVAL);
 
     CDelegateEnrolled enrolled;
     if (!GetBlockDelegateEnrolled(pIndex->GetBlockHash(), enrolled))
@@ -1436,10 +1463,7 @@ bool CBlockChain::GetBlockDelegateAgreement(const uint256& hashBlock, CDelegateA
         return false;
     }
 
-    for (int i = 0; i < CONSENSUS_DISTRIBUTE_INTERVAL + 1; i++)
-    {
-        pIndex = pIndex->pPrev;
-    }
+    pIndex = pIndex->GetAncestor(pIndex->GetBlockHeight() - CONSENSUS_DISTRIBUTE_INTERVAL - 1);
 
     CDelegateEnrolled enrolled;
     if (!GetBlockDelegateEnrolled(pIndex->GetBlockHash(), enrolled))
@@ -33,10 +33,12 @@ public:
     bool GetLastBlockTime(const uint256& hashFork, int nDepth, std::vector<int64>& vTime) override;
     bool GetBlock(const uint256& hashBlock, CBlock& block) override;
     bool GetBlockEx(const uint256& hashBlock, CBlockEx& block) override;
+    bool GetBlockEx(const uint256& hashBlock, std::shared_ptr<const CBlockEx>& spBlock) override;
     bool GetOrigin(const uint256& hashFork, CBlock& block) override;
     bool Exists(const uint256& hashBlock) override;
     bool GetTransaction(const uint256& txid, CTransaction& tx) override;
     bool GetTransaction(const uint256& txid, CTransaction& tx, uint256& hashFork, int& nHeight) override;
+    bool GetTransaction(const uint256& hashFork, const std::vector<uint256>& vTxid, std::vector<CTransaction>& vTx) override;
     bool ExistsTx(const uint256& txid) override;
     bool GetTxLocation(const uint256& txid, uint256& hashFork, int& nHeight) override;
     bool GetTxUnspent(const uint256& hashFork, const std::vector<CTxIn>& vInput,
@@ -67,6 +69,7 @@ public:
     bool CheckForkValidLast(const uint256& hashFork, CBlockChainUpdate& update) override;
     bool VerifyForkRefLongChain(const uint256& hashFork, const uint256& hashForkBlock, const uint256& hashPrimaryBlock) override;
     bool GetPrimaryHeightBlockTime(const uint256& hashLastBlock, int nHeight, uint256& hashBlock, int64& nTime) override;
+    bool ExportSnapshot(const boost::filesystem::path& pathSnapshot, int& nHeight, uint256& hashBlock) override;
     bool IsVacantBlockBeforeCreatedForkHeight(const uint256& hashFork, const CBlock& block) override;
 
     /////////////    CheckPoints    /////////////////////
@@ -1570,6 +1570,7 @@ CBlockIndex* CCheckBlockWalker::AddNewIndex(const uint256& hash, const CBlock& b
         {
             pIndexPrev = (*miPrev).second;
             pIndexNew->pPrev = pIndexPrev;
+            pIndexNew->BuildSkip();
             if (!pIndexNew->IsOrigin())
             {
                 pIndexNew->pOrigin = pIndexPrev->pOrigin;
@@ -1615,6 +1616,7 @@ CBlockIndex* CCheckBlockWalker::AddNewIndex(const uint256& hash, const CBlockOut
             }
             pIndexNew->pPrev = miPrev->second;
         }
+        pIndexNew->BuildSkip();
 
         if (objBlockOutline.hashOrigin != 0)
         {
@@ -1857,6 +1859,8 @@ bool CCheckRepairData::FetchBlockData()
         return false;
     }
 
+    tsBlock.SetWalkThread(boost::thread::hardware_concurrency());
+
     uint32 nLastFileRet = 0;
     uint32 nLastPosRet = 0;
 
@@ -2246,51 +2250,53 @@ bool CCheckRepairData::CheckTxIndex()
             if (!block.IsNull() && (!block.IsVacant() || !block.txMint.sendTo.IsNull()))
             {
                 CBufStream ss;
-                CTxIndex txIndex;
+                vector<uint256> vTxid;
+                vector<CTxIndex> vTxIndex;
+                vector<uint32> vTxOffset;
 
                 uint32 nTxOffset = pBlockIndex->nOffset + block.GetTxSerializedOffset();
-                if (!dbTxIndex.Retrieve(hashFork, block.txMint.GetHash(), txIndex))
-                {
-                    StdLog("check", "Retrieve db tx index fail, height: %d, block: %s, mint tx: %s.",
-                           block.GetBlockHeight(), block.GetHash().GetHex().c_str(), block.txMint.GetHash().GetHex().c_str());
-
-                    mapTxNew[hashFork].push_back(make_pair(block.txMint.GetHash(), CTxIndex(block.GetBlockHeight(), pBlockIndex->nFile, nTxOffset)));
-                }
-                else
-                {
-                    if (!(txIndex.nFile == pBlockIndex->nFile && txIndex.nOffset == nTxOffset))
-                    {
-                        StdLog("check", "Check tx index fail, height: %d, block: %s, mint tx: %s, db offset: %d, block offset: %d.",
-                               block.GetBlockHeight(), block.GetHash().GetHex().c_str(),
-                               block.txMint.GetHash().GetHex().c_str(), txIndex.nOffset, nTxOffset);
-
-                        mapTxNew[hashFork].push_back(make_pair(block.txMint.GetHash(), CTxIndex(block.GetBlockHeight(), pBlockIndex->nFile, nTxOffset)));
-                    }
-                }
+                vTxid.reserve(block.vtx.size() + 1);
+                vTxOffset.reserve(block.vtx.size() + 1);
+                vTxid.push_back(block.txMint.GetHash());
+                vTxOffset.push_back(nTxOffset);
                 nTxOffset += ss.GetSerializeSize(block.txMint);
 
                 CVarInt var(block.vtx.size());
                 nTxOffset += ss.GetSerializeSize(var);
                 for (int i = 0; i < block.vtx.size(); i++)
                 {
-                    if (!dbTxIndex.Retrieve(pBlockIndex->GetOriginHash(), block.vtx[i].GetHash(), txIndex))
+                    vTxid.push_back(block.vtx[i].GetHash());
+                    vTxOffset.push_back(nTxOffset);
+                    nTxOffset += ss.GetSerializeSize(block.vtx[i]);
+                }
+
+                size_t nFound = 0;
+                if (!dbTxIndex.RetrieveBatch(hashFork, vTxid, vTxIndex, nFound))
+                {
+                    vTxIndex.assign(vTxid.size(), CTxIndex());
+                }
+                if (nFound < vTxid.size())
+                {
+                    StdLog("check", "CheckTxIndex: %lu of %lu tx index missing, height: %d, block: %s.",
+                           vTxid.size() - nFound, vTxid.size(), block.GetBlockHeight(), block.GetHash().GetHex().c_str());
+                }
+                for (int i = 0; i < vTxid.size(); i++)
+                {
+                    const CTxIndex& txIndex = vTxIndex[i];
+                    if (txIndex.IsNull())
                     {
                         StdLog("check", "Retrieve db tx index fail, height: %d, block: %s, txid: %s.",
-                               block.GetBlockHeight(), block.GetHash().GetHex().c_str(), block.vtx[i].GetHash().GetHex().c_str());
+                               block.GetBlockHeight(), block.GetHash().GetHex().c_str(), vTxid[i].GetHex().c_str());
 
-                        mapTxNew[hashFork].push_back(make_pair(block.vtx[i].GetHash(), CTxIndex(block.GetBlockHeight(), pBlockIndex->nFile, nTxOffset)));
+                        mapTxNew[hashFork].push_back(make_pair(vTxid[i], CTxIndex(block.GetBlockHeight(), pBlockIndex->nFile, vTxOffset[i])));
                     }
-                    else
+                    else if (!(txIndex.nFile == pBlockIndex->nFile && txIndex.nOffset == vTxOffset[i]))
                     {
-                        if (!(txIndex.nFile == pBlockIndex->nFile && txIndex.nOffset == nTxOffset))
-                        {
-                            StdLog("check", "Check tx index fail, height: %d, block: %s, txid: %s, db offset: %d, block offset: %d.",
-                                   block.GetBlockHeight(), block.GetHash().GetHex().c_str(), block.vtx[i].GetHash().GetHex().c_str(), txIndex.nOffset, nTxOffset);
+                        StdLog("check", "Check tx index fail, height: %d, block: %s, txid: %s, db offset: %d, block offset: %d.",
+                               block.GetBlockHeight(), block.GetHash().GetHex().c_str(), vTxid[i].GetHex().c_str(), txIndex.nOffset, vTxOffset[i]);
 
-                            mapTxNew[hashFork].push_back(make_pair(block.vtx[i].GetHash(), CTxIndex(block.GetBlockHeight(), pBlockIndex->nFile, nTxOffset)));
-                        }
+                        mapTxNew[hashFork].push_back(make_pair(vTxid[i], CTxIndex(block.GetBlockHeight(), pBlockIndex->nFile, vTxOffset[i])));
                     }
-                    nTxOffset += ss.GetSerializeSize(block.vtx[i]);
                 }
             }
             if (block.IsOrigin() || pBlockIndex == mt->second.pOrigin)
@@ -2421,6 +2427,27 @@ bool CCheckRepairData::RestructureWalletTx()
 }
 
 ////////////////////////////////////////////////////////////////
+bool CCheckRepairData::RebuildBlockFileIndex()
+{
+    CTimeSeriesCached tsBlock;
+    if (!tsBlock.Initialize(path(strDataPath) / "block", BLOCKFILE_PREFIX))
+    {
+        StdError("check", "tsBlock Initialize fail");
+        return false;
+    }
+
+    uint32 nLastFileRet = 0;
+    uint32 nLastPosRet = 0;
+    StdLog("check", "Rebuild block file index......");
+    if (!tsBlock.RebuildIndexFile(nLastFileRet, nLastPosRet))
+    {
+        StdError("check", "Rebuild block file index fail, file: %d, offset: %u.", nLastFileRet, nLastPosRet);
+        return false;
+    }
+    StdLog("check", "Rebuild block file index success, last file: %d, size: %u.", nLastFileRet, nLastPosRet);
+    return true;
+}
+
 bool CCheckRepairData::CheckRepairData()
 {
     StdLog("check", "Start check and repair, path: %s", strDataPath.c_str());
@@ -477,6 +477,7 @@ protected:
 
 public:
     bool CheckRepairData();
+    bool RebuildBlockFileIndex();
 
 protected:
     string strDataPath;
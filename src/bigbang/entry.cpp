@@ -163,9 +163,25 @@ bool CBbEntry::Initialize(int argc, char* argv[])
         return false;
     }
 
-    // check and repair data
+    // regenerate block file sidecar index
+    if (config.GetModeType() == EModeType::SERVER && config.GetConfig()->fRebuildBlockFileIndex)
+    {
+        CCheckRepairData check(pathData.string(), config.GetConfig()->fTestNet, false);
+        if (!check.RebuildBlockFileIndex())
+        {
+            StdError("Bigbang", "Rebuild block file index fail.");
+            return false;
+        }
+        StdLog("Bigbang", "Rebuild block file index complete.");
+        return false;
+    }
+
+    // check and repair data. The default startup check is not needed when the block journal can replay
+    // the changes lost by a crash, an explicit -checkrepair always runs
     if (config.GetModeType() == EModeType::SERVER
-        && (config.GetConfig()->fCheckRepair || config.GetConfig()->fOnlyCheck))
+        && ((config.GetConfig()->fCheckRepair
+             && (config.GetConfig()->IsSet("checkrepair") || !storage::CBlockDB::IsJournalReplayable(pathData)))
+            || config.GetConfig()->fOnlyCheck))
     {
         CCheckRepairData check(pathData.string(), config.GetConfig()->fTestNet, config.GetConfig()->fOnlyCheck);
         if (!check.CheckRepairData())
@@ -34,6 +34,43 @@ bool CStorageConfig::PostLoad()
         return false;
     }
 
+    if (!strSnapshot.empty() && !strRecoveryDir.empty())
+    {
+        printf("loadsnapshot and recoverydir can not be used together!\n");
+        return false;
+    }
+
+    if (nBlockCacheSize < 0)
+    {
+        printf("blockcache must be not less than 0!\n");
+        return false;
+    }
+
+    if (nTxIndexCacheSize < 0)
+    {
+        printf("txindexcache must be not less than 0!\n");
+        return false;
+    }
+
+    if (nUnspentCacheSize < 0)
+    {
+        printf("utxocache must be not less than 0!\n");
+        return false;
+    }
+
+    if (nDBFilterBits < 0 || nDBFilterBits > 32)
+    {
+        printf("dbfilterbits must be in [0, 32]!\n");
+        return false;
+    }
+
+    if (nBlockIndexDBCacheSize < 0 || nBlockIndexDBWriteBuffer < 0 || nUnspentDBCacheSize < 0
+        || nUnspentDBWriteBuffer < 0 || nWalletDBCacheSize < 0 || nWalletDBWriteBuffer < 0)
+    {
+        printf("database cache and write buffer size must be not less than 0!\n");
+        return false;
+    }
+
     return true;
 }
 
@@ -828,12 +828,47 @@ bool CNetChannel::HandleEvent(network::CEventPeerGetData& eventGetData)
     uint64 nNonce = eventGetData.nNonce;
     uint256& hashFork = eventGetData.hashFork;
     network::CEventPeerGetFail eventGetFail(nNonce, hashFork);
+
+    // tx not in the pool are read from the fork with one tx index lookup
+    map<uint256, CTransaction> mapTx;
+    vector<uint256> vTxid;
+    for (const network::CInv& inv : eventGetData.data)
+    {
+        if (inv.nType == network::CInv::MSG_TX && !mapTx.count(inv.nHash))
+        {
+            if (!pTxPool->Get(inv.nHash, mapTx[inv.nHash]))
+            {
+                mapTx.erase(inv.nHash);
+                vTxid.push_back(inv.nHash);
+            }
+        }
+    }
+    if (vTxid.size() > 1)
+    {
+        vector<CTransaction> vTx;
+        if (pBlockChain->GetTransaction(hashFork, vTxid, vTx))
+        {
+            for (size_t i = 0; i < vTxid.size(); i++)
+            {
+                if (!vTx[i].IsNull())
+                {
+                    mapTx[vTxid[i]] = vTx[i];
+                }
+            }
+        }
+    }
+
     for (const network::CInv& inv : eventGetData.data)
     {
         if (inv.nType == network::CInv::MSG_TX)
         {
             network::CEventPeerTx eventTx(nNonce, hashFork);
-            if (pTxPool->Get(inv.nHash, eventTx.data) || pBlockChain->GetTransaction(inv.nHash, eventTx.data))
+            map<uint256, CTransaction>::iterator it = mapTx.find(inv.nHash);
+            if (it != mapTx.end())
+            {
+                eventTx.data = (*it).second;
+            }
+            if (it != mapTx.end() || pBlockChain->GetTransaction(inv.nHash, eventTx.data))
             {
                 pPeerNet->DispatchEvent(&eventTx);
                 StdTrace("NetChannel", "CEventPeerGetData: get tx success, peer: %s, txid: %s",
@@ -111,6 +111,8 @@ bool CRecovery::HandleInvoke()
             return false;
         }
 
+        tsBlock.SetWalkThread(boost::thread::hardware_concurrency());
+
         size_t nSize = tsBlock.GetSize();
         CRecoveryWalker walker(pDispatcher, nSize);
         uint32 nLastFile;
@@ -218,6 +218,10 @@ CRPCMod::CRPCMod()
         ("getvotes", &CRPCMod::RPCGetVotes)
         //
         ("listdelegate", &CRPCMod::RPCListDelegate)
+        //
+        ("exportsnapshot", &CRPCMod::RPCExportSnapshot)
+        //
+        ("getdbstat", &CRPCMod::RPCGetDBStat)
         /* Wallet */
         ("listkey", &CRPCMod::RPCListKey)
         //
@@ -1054,6 +1058,60 @@ CRPCResultPtr CRPCMod::RPCListDelegate(CRPCParamPtr param)
     return spResult;
 }
 
+CRPCResultPtr CRPCMod::RPCExportSnapshot(CRPCParamPtr param)
+{
+    auto spParam = CastParamPtr<CExportSnapshotParam>(param);
+
+    fs::path pSave(string(spParam->strPath));
+    if (!pSave.is_absolute())
+    {
+        throw CRPCException(RPC_INVALID_PARAMETER, "Must be an absolute path.");
+    }
+    if (exists(pSave))
+    {
+        throw CRPCException(RPC_INVALID_PARAMETER, "Path has been existed.");
+    }
+
+    int nHeight = 0;
+    uint256 hashBlock;
+    if (!pService->ExportSnapshot(pSave, nHeight, hashBlock))
+    {
+        throw CRPCException(RPC_INTERNAL_ERROR, "Failed to export snapshot");
+    }
+
+    return MakeCExportSnapshotResultPtr((boost::format("Snapshot of height %1% (%2%) has been saved at: %3%")
+                                         % nHeight % hashBlock.GetHex() % pSave.string())
+                                            .str());
+}
+
+CRPCResultPtr CRPCMod::RPCGetDBStat(CRPCParamPtr param)
+{
+    auto spParam = CastParamPtr<CGetDBStatParam>(param);
+
+    vector<storage::CLevelDBStat> vStat;
+    pService->GetDBStat(spParam->strName, vStat);
+
+    auto spResult = MakeCGetDBStatResultPtr();
+    for (const storage::CLevelDBStat& stat : vStat)
+    {
+        CGetDBStatResult::CDb db;
+        db.strName = stat.strName;
+        db.strPath = stat.strPath;
+        db.nMemory = stat.nMemoryUsage;
+        db.nCacheusage = stat.nCacheUsage;
+        db.nCachesize = stat.nCacheSize;
+        db.nWritebuffer = stat.nWriteBufferSize;
+        db.nFilterbits = stat.nFilterBits;
+        for (int nFile : stat.vLevelFile)
+        {
+            db.vecFiles.push_back(nFile);
+        }
+        db.strCompaction = stat.strCompaction;
+        spResult->vecDb.push_back(db);
+    }
+    return spResult;
+}
+
 /* Wallet */
 CRPCResultPtr CRPCMod::RPCListKey(CRPCParamPtr param)
 {
@@ -94,6 +94,8 @@ private:
     rpc::CRPCResultPtr RPCGetForkHeight(rpc::CRPCParamPtr param);
     rpc::CRPCResultPtr RPCGetVotes(rpc::CRPCParamPtr param);
     rpc::CRPCResultPtr RPCListDelegate(rpc::CRPCParamPtr param);
+    rpc::CRPCResultPtr RPCExportSnapshot(rpc::CRPCParamPtr param);
+    rpc::CRPCResultPtr RPCGetDBStat(rpc::CRPCParamPtr param);
     /* Wallet */
     rpc::CRPCResultPtr RPCListKey(rpc::CRPCParamPtr param);
     rpc::CRPCResultPtr RPCGetNewKey(rpc::CRPCParamPtr param);
@@ -358,15 +358,14 @@ bool CService::GetTransaction(const uint256& txid, CTransaction& tx, uint256& ha
         }
         for (const auto& hash : vHashBlock)
         {
-            CBlockEx block;
-            uint256 tempHashFork;
-            int tempHeight = 0;
-            if (!GetBlockEx(hash, block, tempHashFork, tempHeight))
+            std::shared_ptr<const CBlockEx> spBlock;
+            if (!pBlockChain->GetBlockEx(hash, spBlock))
             {
                 StdLog("CService", "GetTransaction: GetBlockEx fail, txid: %s, block: %s",
                        txid.GetHex().c_str(), hash.GetHex().c_str());
                 return false;
             }
+            const CBlockEx& block = *spBlock;
             for (int i = 0; i < block.vtx.size(); i++)
             {
                 if (txid == block.vtx[i].GetHash())
@@ -469,6 +468,16 @@ bool CService::ListDelegate(uint32 nCount, std::multimap<int64, CDestination>& m
     return pBlockChain->ListDelegate(nCount, mapVotes);
 }
 
+bool CService::ExportSnapshot(const boost::filesystem::path& pathSnapshot, int& nHeight, uint256& hashBlock)
+{
+    return pBlockChain->ExportSnapshot(pathSnapshot, nHeight, hashBlock);
+}
+
+void CService::GetDBStat(const std::string& strName, std::vector<storage::CLevelDBStat>& vStat)
+{
+    storage::CLevelDBEngine::GetStat(strName, vStat);
+}
+
 bool CService::HaveKey(const crypto::CPubKey& pubkey, const int32 nVersion)
 {
     return pWallet->Have(pubkey, nVersion);
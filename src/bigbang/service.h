@@ -50,6 +50,8 @@ public:
     bool ListForkUnspentBatch(const uint256& hashFork, uint32 nMax, std::map<CDestination, std::vector<CTxUnspent>>& mapUnspent) override;
     bool GetVotes(const CDestination& destDelegate, int64& nVotes, string& strFailCause) override;
     bool ListDelegate(uint32 nCount, std::multimap<int64, CDestination>& mapVotes) override;
+    bool ExportSnapshot(const boost::filesystem::path& pathSnapshot, int& nHeight, uint256& hashBlock) override;
+    void GetDBStat(const std::string& strName, std::vector<storage::CLevelDBStat>& vStat) override;
     /* Wallet */
     bool HaveKey(const crypto::CPubKey& pubkey, const int32 nVersion = -1) override;
     void GetPubKeys(std::set<crypto::CPubKey>& setPubKey) override;
@@ -190,6 +190,8 @@ void CWallet::HandleDeinitialize()
 
 bool CWallet::HandleInvoke()
 {
+    storage::CLevelDBEngine::SetSizing("wallettx", (size_t)StorageConfig()->nWalletDBCacheSize << 20,
+                                       (size_t)StorageConfig()->nWalletDBWriteBuffer << 20);
     if (!dbWallet.Initialize(Config()->pathData / "wallet"))
     {
         Error("Failed to initialize wallet database");
@@ -238,6 +238,8 @@ public:
     CBlockIndex* pOrigin;
     CBlockIndex* pPrev;
     CBlockIndex* pNext;
+    // an ancestor further back, see GetSkipHeight
+    CBlockIndex* pSkip;
     uint256 txidMint;
     uint16 nMintType;
     uint16 nVersion;
@@ -259,6 +261,7 @@ public:
         pOrigin = this;
         pPrev = nullptr;
         pNext = nullptr;
+        pSkip = nullptr;
         txidMint = 0;
         nMintType = 0;
         nVersion = 0;
@@ -279,6 +282,7 @@ public:
         pOrigin = this;
         pPrev = nullptr;
         pNext = nullptr;
+        pSkip = nullptr;
         txidMint = (block.IsVacant() ? uint64(0) : block.txMint.GetHash());
         nMintType = block.txMint.nType;
         nVersion = block.nVersion;
@@ -347,6 +351,42 @@ public:
     {
         return (nMintType == CTransaction::TX_WORK);
     }
+    // the last block at or below nHeightIn on the pPrev chain, nullptr if nHeightIn is out of range.
+    // Extended blocks share the height of their previous block, so the result may be one of them
+    CBlockIndex* GetAncestor(int nHeightIn)
+    {
+        if (nHeightIn < 0 || nHeightIn > GetBlockHeight())
+        {
+            return nullptr;
+        }
+        CBlockIndex* pIndex = this;
+        while (pIndex != nullptr && pIndex->GetBlockHeight() > nHeightIn)
+        {
+            int nHeightSkip = GetSkipHeight(pIndex->GetBlockHeight());
+            int nHeightSkipPrev = GetSkipHeight(pIndex->GetBlockHeight() - 1);
+            // every block between a block and its skip is above the skip height, so any skip not below
+            // nHeightIn is safe. Skipping is avoided only when the previous block skips closer
+            if (pIndex->pSkip != nullptr && pIndex->pSkip->GetBlockHeight() >= nHeightIn
+                && (nHeightSkip == nHeightIn || !(nHeightSkipPrev < nHeightSkip - 2 && nHeightSkipPrev >= nHeightIn)))
+            {
+                pIndex = pIndex->pSkip;
+            }
+            else
+            {
+                pIndex = pIndex->pPrev;
+            }
+        }
+        return pIndex;
+    }
+    const CBlockIndex* GetAncestor(int nHeightIn) const
+    {
+        return const_cast<CBlockIndex*>(this)->GetAncestor(nHeightIn);
+    }
+    // pPrev must be set and have its own skip built
+    void BuildSkip()
+    {
+        pSkip = (pPrev != nullptr ? pPrev->GetAncestor(GetSkipHeight(GetBlockHeight())) : nullptr);
+    }
     bool IsEquivalent(const CBlockIndex* pIndexCompare) const
     {
         if (pIndexCompare != nullptr)
@@ -383,6 +423,21 @@ public:
             << " trust=" << nChainTrust.ToString();
         return oss.str();
     }
+
+protected:
+    // deterministic skip list : any height is reached from the tip in O(log n) jumps
+    static int InvertLowestOne(int n)
+    {
+        return (n & (n - 1));
+    }
+    static int GetSkipHeight(int nHeightIn)
+    {
+        if (nHeightIn < 2)
+        {
+            return 0;
+        }
+        return ((nHeightIn & 1) ? InvertLowestOne(InvertLowestOne(nHeightIn - 1)) + 1 : InvertLowestOne(nHeightIn));
+    }
 };
 
 class CBlockOutline : public CBlockIndex
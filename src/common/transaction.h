@@ -290,6 +290,8 @@ protected:
 
 class CTxUnspent : public CTxOutPoint
 {
+    friend class xengine::CStream;
+
 public:
     CTxOut output;
 
@@ -310,6 +312,14 @@ public:
     {
         return (CTxOutPoint::IsNull() || output.IsNull());
     }
+
+protected:
+    template <typename O>
+    void Serialize(xengine::CStream& s, O& opt)
+    {
+        CTxOutPoint::Serialize(s, opt);
+        s.Serialize(output, opt);
+    }
 };
 
 class CAssembledTx : public CTransaction
@@ -435,6 +445,8 @@ protected:
 
 class CTxIndex
 {
+    friend class xengine::CStream;
+
 public:
     int nBlockHeight;
     uint32 nFile;
@@ -461,6 +473,15 @@ public:
     {
         return (nFile == 0);
     };
+
+protected:
+    template <typename O>
+    void Serialize(xengine::CStream& s, O& opt)
+    {
+        s.Serialize(nBlockHeight, opt);
+        s.Serialize(nFile, opt);
+        s.Serialize(nOffset, opt);
+    }
 };
 
 class CTxFilter
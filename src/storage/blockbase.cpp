@@ -18,6 +18,7 @@ using namespace xengine;
 
 #define BLOCKFILE_PREFIX "block"
 #define LOGFILE_NAME "storage.log"
+#define SNAPSHOT_TXINDEX_BATCH (200000)
 
 namespace bigbang
 {
@@ -317,11 +318,98 @@ map<uint256, CBlockHeightIndex>* CForkHeightIndex::GetBlockMintList(uint32 nHeig
     return nullptr;
 }
 
+//////////////////////////////
+// CBlockExCache
+
+CBlockExCache::CBlockExCache(size_t nMaxSizeIn)
+  : nMaxSize(nMaxSizeIn), nSize(0), nHit(0), nMiss(0)
+{
+}
+
+void CBlockExCache::SetMaxSize(size_t nMaxSizeIn)
+{
+    boost::unique_lock<boost::mutex> lock(mtxCache);
+
+    nMaxSize = nMaxSizeIn;
+    Evict();
+}
+
+bool CBlockExCache::Retrieve(const uint256& hash, std::shared_ptr<const CBlockEx>& spBlock)
+{
+    boost::unique_lock<boost::mutex> lock(mtxCache);
+
+    map<uint256, CEntry>::iterator it = mapBlock.find(hash);
+    if (it == mapBlock.end())
+    {
+        nMiss++;
+        return false;
+    }
+    listLRU.splice(listLRU.end(), listLRU, (*it).second.itLRU);
+    spBlock = (*it).second.spBlock;
+    nHit++;
+    return true;
+}
+
+void CBlockExCache::AddNew(const uint256& hash, const std::shared_ptr<const CBlockEx>& spBlock)
+{
+    size_t nBlockSize = EstimateSize(*spBlock);
+
+    boost::unique_lock<boost::mutex> lock(mtxCache);
+
+    if (nBlockSize > nMaxSize || mapBlock.count(hash))
+    {
+        return;
+    }
+    CEntry& entry = mapBlock[hash];
+    entry.spBlock = spBlock;
+    entry.nSize = nBlockSize;
+    entry.itLRU = listLRU.insert(listLRU.end(), hash);
+    nSize += nBlockSize;
+    Evict();
+}
+
+void CBlockExCache::Clear()
+{
+    boost::unique_lock<boost::mutex> lock(mtxCache);
+
+    mapBlock.clear();
+    listLRU.clear();
+    nSize = 0;
+}
+
+void CBlockExCache::GetStat(size_t& nCountRet, size_t& nSizeRet, uint64& nHitRet, uint64& nMissRet)
+{
+    boost::unique_lock<boost::mutex> lock(mtxCache);
+
+    nCountRet = mapBlock.size();
+    nSizeRet = nSize;
+    nHitRet = nHit;
+    nMissRet = nMiss;
+}
+
+size_t CBlockExCache::EstimateSize(const CBlockEx& block)
+{
+    // decoded objects are larger than their serialized form, account for the containers
+    return sizeof(CBlockEx) + xengine::GetSerializeSize(block)
+           + block.vtx.size() * sizeof(CTransaction) + block.vTxContxt.size() * sizeof(CTxContxt);
+}
+
+void CBlockExCache::Evict()
+{
+    while (nSize > nMaxSize && !listLRU.empty())
+    {
+        map<uint256, CEntry>::iterator it = mapBlock.find(listLRU.front());
+        nSize -= (*it).second.nSize;
+        mapBlock.erase(it);
+        listLRU.pop_front();
+    }
+}
+
 //////////////////////////////
 // CBlockBase
 
 CBlockBase::CBlockBase()
-  : fDebugLog(false)
+  : fDebugLog(false), fBlockCompress(false)
 {
 }
 
@@ -339,6 +427,7 @@ bool CBlockBase::Initialize(const path& pathDataLocation, bool fDebug, bool fRen
     }
 
     Log("B", "Initializing... (Path : %s)", pathDataLocation.string().c_str());
+    pathData = pathDataLocation;
 
     if (!dbBlock.Initialize(pathDataLocation))
     {
@@ -353,6 +442,24 @@ bool CBlockBase::Initialize(const path& pathDataLocation, bool fDebug, bool fRen
         return false;
     }
 
+    uint32 nLastFile, nLastPos;
+    if (!tsBlock.CheckTail(nLastFile, nLastPos, true))
+    {
+        dbBlock.Deinitialize();
+        tsBlock.Deinitialize();
+        Error("B", "Failed to check block tsfile tail");
+        return false;
+    }
+
+    if (fBlockCompress)
+    {
+        tsBlock.SetCompress(true);
+        if (!tsBlock.StartCompressThread())
+        {
+            Warn("B", "Failed to start block file compress thread");
+        }
+    }
+
     if (fRenewDB)
     {
         Clear();
@@ -375,8 +482,16 @@ bool CBlockBase::Initialize(const path& pathDataLocation, bool fDebug, bool fRen
 
 void CBlockBase::Deinitialize()
 {
+    if (fBlockCompress)
+    {
+        CTimeSeriesCompressStat stat;
+        tsBlock.GetCompressStat(stat);
+        Log("B", "Block compress: records: %lu, compressed: %lu, raw size: %lu, stored size: %lu, ratio: %.3f",
+            stat.nRecord, stat.nCompressedRecord, stat.nRawSize, stat.nStoredSize, stat.GetRatio());
+    }
     dbBlock.Deinitialize();
     tsBlock.Deinitialize();
+    cacheBlock.Clear();
     {
         CWriteLock wlock(rwAccess);
 
@@ -412,6 +527,7 @@ void CBlockBase::Clear()
 
     dbBlock.RemoveAll();
     ClearCache();
+    cacheBlock.Clear();
 }
 
 bool CBlockBase::Initiate(const uint256& hashGenesis, const CBlock& blockGenesis, const uint256& nChainTrust)
@@ -521,7 +637,7 @@ bool CBlockBase::AddNew(const uint256& hash, CBlockEx& block, CBlockIndex** ppIn
     }
 
     uint32 nFile, nOffset;
-    if (!tsBlock.Write(block, nFile, nOffset))
+    if (!tsBlock.Write(block, nFile, nOffset, !cacheBlock.IsEnabled()))
     {
         StdError("BlockBase", "Add new block: write block failed, block: %s", hash.ToString().c_str());
         return false;
@@ -561,6 +677,11 @@ bool CBlockBase::AddNew(const uint256& hash, CBlockEx& block, CBlockIndex** ppIn
         *ppIndexNew = pIndexNew;
     }
 
+    if (cacheBlock.IsEnabled())
+    {
+        cacheBlock.AddNew(hash, std::make_shared<const CBlockEx>(block));
+    }
+
     Log("B", "AddNew block, hash=%s", hash.ToString().c_str());
     return true;
 }
@@ -615,6 +736,30 @@ bool CBlockBase::Retrieve(const uint256& hash, CBlockEx& block)
 {
     block.SetNull();
 
+    std::shared_ptr<const CBlockEx> spBlock;
+    if (!Retrieve(hash, spBlock))
+    {
+        return false;
+    }
+    block = *spBlock;
+    return true;
+}
+
+bool CBlockBase::Retrieve(const CBlockIndex* pIndex, CBlockEx& block)
+{
+    block.SetNull();
+
+    std::shared_ptr<const CBlockEx> spBlock;
+    if (!Retrieve(pIndex, spBlock))
+    {
+        return false;
+    }
+    block = *spBlock;
+    return true;
+}
+
+bool CBlockBase::Retrieve(const uint256& hash, std::shared_ptr<const CBlockEx>& spBlock)
+{
     CBlockIndex* pIndex;
     {
         CReadLock rlock(rwAccess);
@@ -625,26 +770,47 @@ bool CBlockBase::Retrieve(const uint256& hash, CBlockEx& block)
             return false;
         }
     }
-    if (!tsBlock.Read(block, pIndex->nFile, pIndex->nOffset))
+    return Retrieve(pIndex, spBlock);
+}
+
+bool CBlockBase::Retrieve(const CBlockIndex* pIndex, std::shared_ptr<const CBlockEx>& spBlock)
+{
+    const uint256 hash = pIndex->GetBlockHash();
+    if (cacheBlock.Retrieve(hash, spBlock))
     {
-        StdTrace("BlockBase", "RetrieveBlockEx::Read %s block failed", hash.ToString().c_str());
+        return true;
+    }
 
+    std::shared_ptr<CBlockEx> spNewBlock = std::make_shared<CBlockEx>();
+    if (!tsBlock.Read(*spNewBlock, pIndex->nFile, pIndex->nOffset, !cacheBlock.IsEnabled()))
+    {
+        StdTrace("BlockBase", "RetrieveBlockEx::Read %s block failed, File: %d, Offset: %d",
+                 hash.ToString().c_str(), pIndex->nFile, pIndex->nOffset);
         return false;
     }
+    spBlock = spNewBlock;
+    cacheBlock.AddNew(hash, spBlock);
     return true;
 }
 
-bool CBlockBase::Retrieve(const CBlockIndex* pIndex, CBlockEx& block)
+void CBlockBase::SetBlockCacheSize(size_t nSize)
 {
-    block.SetNull();
+    cacheBlock.SetMaxSize(nSize);
+}
 
-    if (!tsBlock.Read(block, pIndex->nFile, pIndex->nOffset))
-    {
-        StdTrace("BlockBase", "RetrieveFromIndex::GetIndex %s block failed", pIndex->GetBlockHash().ToString().c_str());
+void CBlockBase::SetBlockCompress(bool fCompress)
+{
+    fBlockCompress = fCompress;
+}
 
-        return false;
-    }
-    return true;
+void CBlockBase::SetTxIndexCacheSize(size_t nSize)
+{
+    dbBlock.SetTxIndexCacheSize(nSize);
+}
+
+void CBlockBase::SetUnspentCacheSize(size_t nSize)
+{
+    dbBlock.SetUnspentCacheSize(nSize);
 }
 
 bool CBlockBase::RetrieveIndex(const uint256& hash, CBlockIndex** ppIndex)
@@ -672,6 +838,25 @@ bool CBlockBase::RetrieveFork(const uint256& hash, CBlockIndex** ppIndex)
     return false;
 }
 
+bool CBlockBase::RetrieveForkHeight(const uint256& hashFork, int nHeight, CBlockIndex** ppIndex)
+{
+    CReadLock rlock(rwAccess);
+
+    boost::shared_ptr<CBlockFork> spFork = GetFork(hashFork);
+    if (spFork != nullptr)
+    {
+        CReadLock rForkLock(spFork->GetRWAccess());
+
+        if (nHeight >= 0 && nHeight <= spFork->GetLast()->GetBlockHeight())
+        {
+            *ppIndex = spFork->GetActiveOfHeight(nHeight);
+            return (*ppIndex != nullptr);
+        }
+    }
+
+    return false;
+}
+
 bool CBlockBase::RetrieveFork(const string& strName, CBlockIndex** ppIndex)
 {
     CReadLock rlock(rwAccess);
@@ -821,6 +1006,30 @@ bool CBlockBase::RetrieveTx(const uint256& hashFork, const uint256& txid, CTrans
     return true;
 }
 
+bool CBlockBase::RetrieveTx(const uint256& hashFork, const vector<uint256>& vTxid, vector<CTransaction>& vTx)
+{
+    // one index lookup for the whole batch, tx not found on the fork are left null
+    vTx.clear();
+    vTx.resize(vTxid.size());
+
+    vector<CTxIndex> vTxIndex;
+    size_t nFound = 0;
+    if (!dbBlock.RetrieveTxIndex(hashFork, vTxid, vTxIndex, nFound))
+    {
+        StdTrace("BlockBase", "RetrieveTxFromFork::RetrieveTxIndex fork:%s batch failed", hashFork.ToString().c_str());
+        return false;
+    }
+    for (size_t i = 0; i < vTxid.size() && nFound > 0; i++)
+    {
+        if (!vTxIndex[i].IsNull() && !tsBlock.Read(vTx[i], vTxIndex[i].nFile, vTxIndex[i].nOffset))
+        {
+            StdTrace("BlockBase", "RetrieveTxFromFork::Read %s tx failed", vTxid[i].ToString().c_str());
+            vTx[i].SetNull();
+        }
+    }
+    return true;
+}
+
 bool CBlockBase::RetrieveTxLocation(const uint256& txid, uint256& hashFork, int& nHeight)
 {
     CTxIndex txIndex;
@@ -1155,6 +1364,7 @@ bool CBlockBase::LoadIndex(CBlockOutline& outline)
 
     pIndexNew->phashBlock = &((*mi).first);
     pIndexNew->pPrev = nullptr;
+    pIndexNew->pSkip = nullptr;
     pIndexNew->pOrigin = pIndexNew;
 
     if (outline.hashPrev != 0)
@@ -1211,14 +1421,12 @@ bool CBlockBase::FilterTx(const uint256& hashFork, CTxFilter& filter)
 
     CReadLock rForkLock(spFork->GetRWAccess());
 
+    vector<CBlockIndex*> vIndex;
     for (CBlockIndex* pIndex = spFork->GetOrigin(); pIndex != nullptr; pIndex = pIndex->pNext)
     {
-        CBlockEx block;
-        if (!tsBlock.Read(block, pIndex->nFile, pIndex->nOffset))
-        {
-            StdLog("BlockBase", "FilterTx: Block read fail, nFile: %d, nOffset: %d.", pIndex->nFile, pIndex->nOffset);
-            return false;
-        }
+        vIndex.push_back(pIndex);
+    }
+    return ReadRange(vIndex, [&](const CBlockIndex* pIndex, const CBlockEx& block) -> bool {
         int nBlockHeight = pIndex->GetBlockHeight();
         if (block.txMint.nAmount > 0 && filter.setDest.count(block.txMint.sendTo))
         {
@@ -1230,8 +1438,8 @@ bool CBlockBase::FilterTx(const uint256& hashFork, CTxFilter& filter)
         }
         for (int i = 0; i < block.vtx.size(); i++)
         {
-            CTransaction& tx = block.vtx[i];
-            CTxContxt& ctxt = block.vTxContxt[i];
+            const CTransaction& tx = block.vtx[i];
+            const CTxContxt& ctxt = block.vTxContxt[i];
 
             if (filter.setDest.count(tx.sendTo) || filter.setDest.count(ctxt.destIn))
             {
@@ -1242,8 +1450,8 @@ bool CBlockBase::FilterTx(const uint256& hashFork, CTxFilter& filter)
                 }
             }
         }
-    }
-    return true;
+        return true;
+    });
 }
 
 bool CBlockBase::FilterTx(const uint256& hashFork, int nDepth, CTxFilter& filter)
@@ -1260,15 +1468,12 @@ bool CBlockBase::FilterTx(const uint256& hashFork, int nDepth, CTxFilter& filter
     CReadLock rForkLock(spFork->GetRWAccess());
 
     int nCount = 0;
+    vector<CBlockIndex*> vIndex;
     for (CBlockIndex* pIndex = spFork->GetLast(); pIndex != nullptr && nCount++ < nDepth; pIndex = pIndex->pPrev)
     {
-        CBlockEx block;
-        if (!tsBlock.Read(block, pIndex->nFile, pIndex->nOffset))
-        {
-            StdLog("BlockBase", "FilterTx2: Block read fail, nFile: %d, nOffset: %d, block: %s.",
-                   pIndex->nFile, pIndex->nOffset, pIndex->GetBlockHash().GetHex().c_str());
-            return false;
-        }
+        vIndex.push_back(pIndex);
+    }
+    return ReadRange(vIndex, [&](const CBlockIndex* pIndex, const CBlockEx& block) -> bool {
         int nBlockHeight = pIndex->GetBlockHeight();
         if (block.txMint.nAmount > 0 && filter.setDest.count(block.txMint.sendTo))
         {
@@ -1281,8 +1486,8 @@ bool CBlockBase::FilterTx(const uint256& hashFork, int nDepth, CTxFilter& filter
         }
         for (int i = 0; i < block.vtx.size(); i++)
         {
-            CTransaction& tx = block.vtx[i];
-            CTxContxt& ctxt = block.vTxContxt[i];
+            const CTransaction& tx = block.vtx[i];
+            const CTxContxt& ctxt = block.vTxContxt[i];
 
             if (filter.setDest.count(tx.sendTo) || filter.setDest.count(ctxt.destIn))
             {
@@ -1294,8 +1499,8 @@ bool CBlockBase::FilterTx(const uint256& hashFork, int nDepth, CTxFilter& filter
                 }
             }
         }
-    }
-    return true;
+        return true;
+    });
 }
 
 bool CBlockBase::ListForkContext(std::vector<CForkContext>& vForkCtxt)
@@ -1314,15 +1519,12 @@ bool CBlockBase::GetForkBlockLocator(const uint256& hashFork, CBlockLocator& loc
         return false;
     }
 
-    CBlockIndex* pIndex = nullptr;
+    CReadLock rForkLock(spFork->GetRWAccess());
+    CBlockIndex* pIndex = spFork->GetLast();
+    if (pIndex == nullptr)
     {
-        CReadLock rForkLock(spFork->GetRWAccess());
-        pIndex = spFork->GetLast();
-        if (pIndex == nullptr)
-        {
-            StdTrace("BlockBase", "GetForkBlockLocator GetLast failed, hashFork: %s", hashFork.ToString().c_str());
-            return false;
-        }
+        StdTrace("BlockBase", "GetForkBlockLocator GetLast failed, hashFork: %s", hashFork.ToString().c_str());
+        return false;
     }
 
     if (hashDepth != 0)
@@ -1334,41 +1536,27 @@ bool CBlockBase::GetForkBlockLocator(const uint256& hashFork, CBlockLocator& loc
         }
     }
 
-    while (pIndex)
+    // step back nIncStep blocks at a time on the active chain, the origin is at position 0
+    int nPos = spFork->GetActivePos(pIndex);
+    if (nPos < 0)
     {
-        if (pIndex->GetOriginHash() != hashFork)
-        {
-            hashDepth = 0;
-            break;
-        }
-        locator.vBlockHash.push_back(pIndex->GetBlockHash());
-        if (pIndex->IsOrigin())
+        hashDepth = 0;
+        return true;
+    }
+    for (;;)
+    {
+        locator.vBlockHash.push_back(spFork->GetActive(nPos)->GetBlockHash());
+        if (nPos == 0)
         {
             hashDepth = 0;
             break;
         }
         if (locator.vBlockHash.size() >= nIncStep / 2)
         {
-            pIndex = pIndex->pPrev;
-            if (pIndex == nullptr)
-            {
-                hashDepth = 0;
-            }
-            else
-            {
-                hashDepth = pIndex->GetBlockHash();
-            }
+            hashDepth = spFork->GetActive(nPos - 1)->GetBlockHash();
             break;
         }
-        for (int i = 0; i < nIncStep && !pIndex->IsOrigin(); i++)
-        {
-            pIndex = pIndex->pPrev;
-            if (pIndex == nullptr)
-            {
-                hashDepth = 0;
-                break;
-            }
-        }
+        nPos = max(nPos - nIncStep, 0);
     }
 
     return true;
@@ -1387,10 +1575,10 @@ bool CBlockBase::GetForkBlockInv(const uint256& hashFork, const CBlockLocator& l
 
     CReadLock rForkLock(spFork->GetRWAccess());
     CBlockIndex* pIndexLast = spFork->GetLast();
-    CBlockIndex* pIndex = nullptr;
+    int nPos = -1;
     for (const uint256& hash : locator.vBlockHash)
     {
-        pIndex = GetIndex(hash);
+        CBlockIndex* pIndex = GetIndex(hash);
         if (pIndex != nullptr && (pIndex == pIndexLast || pIndex->pNext != nullptr))
         {
             if (pIndex->GetOriginHash() != hashFork)
@@ -1398,19 +1586,21 @@ bool CBlockBase::GetForkBlockInv(const uint256& hashFork, const CBlockLocator& l
                 StdTrace("BlockBase", "GetForkBlockInv GetOriginHash error, fork: %s", hashFork.ToString().c_str());
                 return false;
             }
+            nPos = spFork->GetActivePos(pIndex);
             break;
         }
-        pIndex = nullptr;
     }
 
-    if (pIndex != nullptr)
+    if (nPos >= 0)
     {
-        pIndex = pIndex->pNext;
-        while (pIndex != nullptr && vBlockHash.size() < nMaxCount)
+        // the peer asks for these blocks next, start reading them into the page cache now
+        vector<CDiskPos> vPos;
+        for (CBlockIndex* pIndex = spFork->GetActive(++nPos); pIndex != nullptr && vBlockHash.size() < nMaxCount; pIndex = spFork->GetActive(++nPos))
         {
             vBlockHash.push_back(pIndex->GetBlockHash());
-            pIndex = pIndex->pNext;
+            vPos.push_back(CDiskPos(pIndex->nFile, pIndex->nOffset));
         }
+        tsBlock.Prefetch(vPos, 0, vPos.size());
     }
     return true;
 }
@@ -1744,7 +1934,7 @@ bool CBlockBase::CheckConsistency(int nCheckLevel, int nCheckDepth)
         {
             //compare unspent with transaction
             CForkUnspentCheckWalker walker(mapUnspentUTXO);
-            if (!dbBlock.WalkThroughUnspent(fork.first, walker))
+            if (!dbBlock.WalkThroughUnspent(fork.first, walker, true))
             {
                 Error("B", "{%d} ranged unspent records failed to walk through.", mapUnspentUTXO.size());
                 return false;
@@ -1849,16 +2039,24 @@ bool CBlockBase::CheckInputSingleAddressForTxWithChange(const uint256& txid)
 bool CBlockBase::ListForkUnspent(const uint256& hashFork, const CDestination& dest, uint32 nMax, std::vector<CTxUnspent>& vUnspent)
 {
     vUnspent.clear();
-    CListUnspentWalker walker(hashFork, dest, nMax);
-    dbBlock.WalkThroughUnspent(hashFork, walker);
-    vUnspent = walker.vUnspent;
+    if (!dbBlock.ListUnspent(hashFork, dest, nMax, vUnspent))
+    {
+        StdLog("BlockBase", "ListForkUnspent: List unspent fail, fork: %s", hashFork.GetHex().c_str());
+        return false;
+    }
     return true;
 }
 
 bool CBlockBase::ListForkUnspentBatch(const uint256& hashFork, uint32 nMax, std::map<CDestination, std::vector<CTxUnspent>>& mapUnspent)
 {
-    CListUnspentBatchWalker walker(hashFork, mapUnspent, nMax);
-    dbBlock.WalkThroughUnspent(hashFork, walker);
+    for (auto& unspent : mapUnspent)
+    {
+        if (!dbBlock.ListUnspent(hashFork, unspent.first, nMax, unspent.second))
+        {
+            StdLog("BlockBase", "ListForkUnspentBatch: List unspent fail, fork: %s", hashFork.GetHex().c_str());
+            return false;
+        }
+    }
     return true;
 }
 
@@ -2110,7 +2308,8 @@ bool CBlockBase::VerifySameChain(const uint256& hashPrevBlock, const uint256& ha
     {
         return false;
     }
-    while (pAfterIndex->GetBlockHeight() >= pPrevIndex->GetBlockHeight())
+    pAfterIndex = pAfterIndex->GetAncestor(pPrevIndex->GetBlockHeight());
+    while (pAfterIndex != nullptr && pAfterIndex->GetBlockHeight() == pPrevIndex->GetBlockHeight())
     {
         if (pAfterIndex == pPrevIndex)
         {
@@ -2179,17 +2378,276 @@ bool CBlockBase::GetPrimaryHeightBlockTime(const uint256& hashLastBlock, int nHe
     {
         return false;
     }
-    while (pIndex && pIndex->GetBlockHeight() >= nHeight)
+    pIndex = pIndex->GetAncestor(nHeight);
+    if (pIndex == nullptr || pIndex->GetBlockHeight() != nHeight)
+    {
+        return false;
+    }
+    hashBlock = pIndex->GetBlockHash();
+    nTime = pIndex->GetBlockTime();
+    return true;
+}
+
+bool CBlockBase::ExportSnapshot(const path& pathSnapshot, CSnapshotManifest& manifest)
+{
+    CReadLock rlock(rwAccess);
+
+    try
     {
-        if (pIndex->GetBlockHeight() == nHeight)
+        if (exists(pathSnapshot) || !create_directories(pathSnapshot / SNAPSHOT_UNSPENT_DIR)
+            || !create_directories(pathSnapshot / SNAPSHOT_BLOCK_DIR))
         {
-            hashBlock = pIndex->GetBlockHash();
-            nTime = pIndex->GetBlockTime();
-            return true;
+            Error("B", "ExportSnapshot: create directory fail, path: %s", pathSnapshot.string().c_str());
+            return false;
         }
-        pIndex = pIndex->pPrev;
     }
-    return false;
+    catch (exception& e)
+    {
+        Error("B", "ExportSnapshot: %s", e.what());
+        return false;
+    }
+
+    manifest = CSnapshotManifest();
+    manifest.nTime = GetTime();
+    for (map<uint256, boost::shared_ptr<CBlockFork>>::iterator it = mapFork.begin(); it != mapFork.end(); ++it)
+    {
+        CBlockIndex* pIndexLast = (*it).second->GetLast();
+        if (pIndexLast->IsPrimary())
+        {
+            manifest.hashLastBlock = pIndexLast->GetBlockHash();
+            manifest.nHeight = pIndexLast->GetBlockHeight();
+        }
+    }
+
+    if (!dbBlock.ExportSnapshot(pathSnapshot, manifest))
+    {
+        Error("B", "ExportSnapshot: export block db fail");
+        return false;
+    }
+
+    // block files are rewritten by the compress thread
+    if (fBlockCompress)
+    {
+        tsBlock.StopCompressThread();
+    }
+    bool fRet = true;
+    try
+    {
+        for (directory_iterator it(pathData / "block"); it != directory_iterator() && fRet; ++it)
+        {
+            if (is_regular_file(it->path()))
+            {
+                const string strName = it->path().filename().string();
+                manifest.vBlockFile.push_back(make_pair(strName, uint256()));
+                fRet = SnapshotCopyFile(it->path(), pathSnapshot / SNAPSHOT_BLOCK_DIR / strName, manifest.vBlockFile.back().second);
+            }
+        }
+    }
+    catch (exception& e)
+    {
+        Error("B", "ExportSnapshot: %s", e.what());
+        fRet = false;
+    }
+    if (fBlockCompress && !tsBlock.StartCompressThread())
+    {
+        Warn("B", "Failed to start block file compress thread");
+    }
+    if (!fRet)
+    {
+        Error("B", "ExportSnapshot: copy block file fail");
+        return false;
+    }
+
+    // the manifest marks a complete export, every file it lists is durable before it is written
+    if (!SnapshotSyncDir(pathSnapshot / SNAPSHOT_UNSPENT_DIR) || !SnapshotSyncDir(pathSnapshot / SNAPSHOT_BLOCK_DIR)
+        || !SnapshotSyncDir(pathSnapshot))
+    {
+        Error("B", "ExportSnapshot: sync directory fail");
+        return false;
+    }
+
+    CSnapshotWriter writer;
+    uint256 hashChecksum;
+    if (!writer.Open(pathSnapshot / SNAPSHOT_MANIFEST) || !writer.Write(manifest) || !writer.Close(hashChecksum))
+    {
+        Error("B", "ExportSnapshot: write manifest fail");
+        return false;
+    }
+    if (!SnapshotSyncDir(pathSnapshot)
+        || !SnapshotSyncDir(pathSnapshot.has_parent_path() ? pathSnapshot.parent_path() : current_path()))
+    {
+        Error("B", "ExportSnapshot: sync directory fail");
+        return false;
+    }
+
+    Log("B", "Export snapshot at height %d (%s), path : %s", manifest.nHeight,
+        manifest.hashLastBlock.GetHex().c_str(), pathSnapshot.string().c_str());
+    return true;
+}
+
+bool CBlockBase::ImportSnapshot(const path& pathSnapshot, CSnapshotManifest& manifest)
+{
+    {
+        CSnapshotReader reader;
+        CSnapshotManifest manifestTail;
+        if (!reader.Open(pathSnapshot / SNAPSHOT_MANIFEST, uint256()) || !reader.Read(manifest)
+            || reader.Read(manifestTail) || !reader.IsCompleted())
+        {
+            Error("B", "ImportSnapshot: read manifest fail, path: %s", pathSnapshot.string().c_str());
+            return false;
+        }
+        if (manifest.nVersion != SNAPSHOT_VERSION)
+        {
+            Error("B", "ImportSnapshot: unsupported version %u", manifest.nVersion);
+            return false;
+        }
+    }
+
+    if (Exists(manifest.hashLastBlock))
+    {
+        Log("B", "Snapshot at height %d (%s) is already applied, import skipped", manifest.nHeight,
+            manifest.hashLastBlock.GetHex().c_str());
+        return true;
+    }
+
+    Log("B", "Import snapshot at height %d (%s), path : %s", manifest.nHeight,
+        manifest.hashLastBlock.GetHex().c_str(), pathSnapshot.string().c_str());
+
+    // the node keeps its data until every file of the snapshot is verified
+    path pathStage = pathData / "block.import";
+    if (!StageSnapshot(pathSnapshot, manifest, pathStage))
+    {
+        Error("B", "ImportSnapshot: verify snapshot fail, path: %s", pathSnapshot.string().c_str());
+        boost::system::error_code ec;
+        remove_all(pathStage, ec);
+        return false;
+    }
+
+    {
+        CWriteLock wlock(rwAccess);
+
+        if (!dbBlock.MarkImport(manifest))
+        {
+            Error("B", "ImportSnapshot: write import journal fail");
+            return false;
+        }
+
+        ClearCache();
+        cacheBlock.Clear();
+        tsBlock.Deinitialize();
+
+        path pathBlock = pathData / "block";
+        path pathBlockOld = pathData / "block.old";
+        try
+        {
+            remove_all(pathBlockOld);
+            if (exists(pathBlock))
+            {
+                rename(pathBlock, pathBlockOld);
+            }
+            rename(pathStage, pathBlock);
+            remove_all(pathBlockOld);
+        }
+        catch (exception& e)
+        {
+            Error("B", "ImportSnapshot: %s", e.what());
+            return false;
+        }
+
+        uint32 nLastFile, nLastPos;
+        if (!tsBlock.Initialize(pathBlock, BLOCKFILE_PREFIX) || !tsBlock.CheckTail(nLastFile, nLastPos, true))
+        {
+            Error("B", "ImportSnapshot: initialize block tsfile fail");
+            return false;
+        }
+        if (fBlockCompress && !tsBlock.StartCompressThread())
+        {
+            Warn("B", "Failed to start block file compress thread");
+        }
+
+        if (!dbBlock.ImportSnapshot(pathSnapshot, manifest))
+        {
+            Error("B", "ImportSnapshot: import block db fail");
+            return false;
+        }
+    }
+
+    if (!LoadDB())
+    {
+        Error("B", "ImportSnapshot: load block db fail");
+        return false;
+    }
+
+    // one worker per fork loads the unspent set and rebuilds the tx index from the block files
+    vector<int> vResult(manifest.vFork.size(), 0);
+    boost::thread_group threadGroup;
+    for (size_t i = 0; i < manifest.vFork.size(); i++)
+    {
+        threadGroup.create_thread(boost::bind(&CBlockBase::ImportForkProc, this, boost::cref(pathSnapshot),
+                                              boost::cref(manifest.vFork[i]), boost::ref(vResult[i])));
+    }
+    threadGroup.join_all();
+
+    for (size_t i = 0; i < manifest.vFork.size(); i++)
+    {
+        if (!vResult[i])
+        {
+            Error("B", "ImportSnapshot: import fork fail, fork: %s", manifest.vFork[i].hashFork.GetHex().c_str());
+            return false;
+        }
+    }
+
+    if (!dbBlock.Checkpoint())
+    {
+        Error("B", "ImportSnapshot: checkpoint block db fail");
+        return false;
+    }
+
+    Log("B", "Import snapshot completed, forks: %lu, blocks: %lu", manifest.vFork.size(), manifest.nBlock);
+    return true;
+}
+
+bool CBlockBase::StageSnapshot(const path& pathSnapshot, const CSnapshotManifest& manifest, const path& pathStage)
+{
+    try
+    {
+        remove_all(pathStage);
+        create_directories(pathStage);
+    }
+    catch (exception& e)
+    {
+        Error("B", "StageSnapshot: %s", e.what());
+        return false;
+    }
+
+    for (vector<pair<string, uint256>>::const_iterator it = manifest.vBlockFile.begin(); it != manifest.vBlockFile.end(); ++it)
+    {
+        uint256 hashChecksum;
+        if (!SnapshotCopyFile(pathSnapshot / SNAPSHOT_BLOCK_DIR / (*it).first, pathStage / (*it).first, hashChecksum)
+            || hashChecksum != (*it).second)
+        {
+            Error("B", "StageSnapshot: copy block file fail, file: %s", (*it).first.c_str());
+            return false;
+        }
+    }
+
+    vector<pair<path, uint256>> vFile;
+    vFile.push_back(make_pair(pathSnapshot / SNAPSHOT_BLOCKINDEX, manifest.hashBlockChecksum));
+    vFile.push_back(make_pair(pathSnapshot / SNAPSHOT_DELEGATE, manifest.hashDelegateChecksum));
+    for (const CSnapshotFork& fork : manifest.vFork)
+    {
+        vFile.push_back(make_pair(pathSnapshot / SNAPSHOT_UNSPENT_DIR / (fork.hashFork.GetHex() + ".dat"), fork.hashChecksum));
+    }
+    for (const pair<path, uint256>& file : vFile)
+    {
+        CSnapshotReader reader;
+        if (!reader.Open(file.first, file.second) || !reader.Verify())
+        {
+            Error("B", "StageSnapshot: verify file fail, file: %s", file.first.string().c_str());
+            return false;
+        }
+    }
+    return true;
 }
 
 CBlockIndex* CBlockBase::GetIndex(const uint256& hash) const
@@ -2238,6 +2696,19 @@ CBlockIndex* CBlockBase::GetBranch(CBlockIndex* pIndexRef, CBlockIndex* pIndex,
     return pIndex;
 }
 
+bool CBlockBase::ReadRange(const vector<CBlockIndex*>& vIndex, const CBlockRangeFunc& fnRead)
+{
+    vector<CDiskPos> vPos;
+    vPos.reserve(vIndex.size());
+    for (const CBlockIndex* pIndex : vIndex)
+    {
+        vPos.push_back(CDiskPos(pIndex->nFile, pIndex->nOffset));
+    }
+    return tsBlock.ReadRange<CBlockEx>(vPos, [&](size_t n, const CBlockEx& block) -> bool {
+        return fnRead(vIndex[n], block);
+    });
+}
+
 CBlockIndex* CBlockBase::GetOriginIndex(const uint256& txidMint) const
 {
     for (map<uint256, boost::shared_ptr<CBlockFork>>::const_iterator mi = mapFork.begin(); mi != mapFork.end(); ++mi)
@@ -2291,6 +2762,7 @@ CBlockIndex* CBlockBase::AddNewIndex(const uint256& hash, const CBlock& block, u
         {
             pIndexPrev = (*miPrev).second;
             pIndexNew->pPrev = pIndexPrev;
+            pIndexNew->BuildSkip();
             if (!pIndexNew->IsOrigin())
             {
                 pIndexNew->pOrigin = pIndexPrev->pOrigin;
@@ -2319,6 +2791,24 @@ CBlockIndex* CBlockBase::AddNewIndex(const uint256& hash, const CBlock& block, u
     return pIndexNew;
 }
 
+void CBlockBase::BuildIndexSkip()
+{
+    // the index is loaded in hash order, so build each chain from its oldest block without a skip
+    vector<CBlockIndex*> vChain;
+    for (map<uint256, CBlockIndex*>::iterator mi = mapIndex.begin(); mi != mapIndex.end(); ++mi)
+    {
+        for (CBlockIndex* pIndex = (*mi).second; pIndex->pPrev != nullptr && pIndex->pSkip == nullptr; pIndex = pIndex->pPrev)
+        {
+            vChain.push_back(pIndex);
+        }
+        for (vector<CBlockIndex*>::reverse_iterator it = vChain.rbegin(); it != vChain.rend(); ++it)
+        {
+            (*it)->BuildSkip();
+        }
+        vChain.clear();
+    }
+}
+
 boost::shared_ptr<CBlockFork> CBlockBase::GetFork(const uint256& hash)
 {
     map<uint256, boost::shared_ptr<CBlockFork>>::iterator mi = mapFork.find(hash);
@@ -2344,6 +2834,7 @@ boost::shared_ptr<CBlockFork> CBlockBase::AddNewFork(const CProfile& profileIn,
     if (spFork != nullptr)
     {
         spFork->UpdateNext();
+        spFork->UpdateActive();
         mapFork.insert(make_pair(pIndexLast->GetOriginHash(), spFork));
     }
 
@@ -2511,39 +3002,101 @@ bool CBlockBase::GetTxNewIndex(CBlockView& view, CBlockIndex* pIndexNew, vector<
         vPath.push_back(pIndexNew);
     }
 
-    CBufStream ss;
     for (int i = vPath.size() - 1; i >= 0; i--)
     {
-        CBlockIndex* pIndex = vPath[i];
-        CBlockEx block;
-        if (!tsBlock.Read(block, pIndex->nFile, pIndex->nOffset))
+        if (!GetBlockTxIndex(vPath[i], vTxNew))
         {
             return false;
         }
-        int nHeight = pIndex->GetBlockHeight();
-        uint32 nOffset = pIndex->nOffset + block.GetTxSerializedOffset();
+    }
+    return true;
+}
+
+bool CBlockBase::GetBlockTxIndex(const CBlockIndex* pIndex, vector<pair<uint256, CTxIndex>>& vTxNew)
+{
+    CBlockEx block;
+    if (!tsBlock.Read(block, pIndex->nFile, pIndex->nOffset))
+    {
+        return false;
+    }
+    CBufStream ss;
+    int nHeight = pIndex->GetBlockHeight();
+    uint32 nOffset = pIndex->nOffset + block.GetTxSerializedOffset();
+
+    if (!block.txMint.sendTo.IsNull())
+    {
+        CTxIndex txIndex(nHeight, pIndex->nFile, nOffset);
+        vTxNew.push_back(make_pair(block.txMint.GetHash(), txIndex));
+    }
+    nOffset += ss.GetSerializeSize(block.txMint);
 
-        if (!block.txMint.sendTo.IsNull())
+    CVarInt var(block.vtx.size());
+    nOffset += ss.GetSerializeSize(var);
+    for (int i = 0; i < block.vtx.size(); i++)
+    {
+        CTransaction& tx = block.vtx[i];
+        uint256 txid = tx.GetHash();
+        CTxIndex txIndex(nHeight, pIndex->nFile, nOffset);
+        vTxNew.push_back(make_pair(txid, txIndex));
+        nOffset += ss.GetSerializeSize(tx);
+    }
+    return true;
+}
+
+bool CBlockBase::RebuildTxIndex(const uint256& hashFork)
+{
+    vector<CBlockIndex*> vIndex;
+    {
+        CReadLock rlock(rwAccess);
+
+        boost::shared_ptr<CBlockFork> spFork = GetFork(hashFork);
+        if (spFork == nullptr)
+        {
+            return false;
+        }
+        for (CBlockIndex* pIndex = spFork->GetLast(); pIndex != nullptr; pIndex = pIndex->pPrev)
         {
-            CTxIndex txIndex(nHeight, pIndex->nFile, nOffset);
-            vTxNew.push_back(make_pair(block.txMint.GetHash(), txIndex));
+            vIndex.push_back(pIndex);
+            if (pIndex->IsOrigin())
+            {
+                break;
+            }
         }
-        nOffset += ss.GetSerializeSize(block.txMint);
+    }
 
-        CVarInt var(block.vtx.size());
-        nOffset += ss.GetSerializeSize(var);
-        for (int i = 0; i < block.vtx.size(); i++)
+    vector<pair<uint256, CTxIndex>> vTxNew;
+    for (vector<CBlockIndex*>::reverse_iterator it = vIndex.rbegin(); it != vIndex.rend(); ++it)
+    {
+        if (!GetBlockTxIndex(*it, vTxNew))
         {
-            CTransaction& tx = block.vtx[i];
-            uint256 txid = tx.GetHash();
-            CTxIndex txIndex(nHeight, pIndex->nFile, nOffset);
-            vTxNew.push_back(make_pair(txid, txIndex));
-            nOffset += ss.GetSerializeSize(tx);
+            return false;
+        }
+        if (vTxNew.size() >= SNAPSHOT_TXINDEX_BATCH)
+        {
+            if (!dbBlock.UpdateTxIndex(hashFork, vTxNew))
+            {
+                return false;
+            }
+            dbBlock.FlushTxIndex(hashFork);
+            vTxNew.clear();
         }
     }
+    if (!dbBlock.UpdateTxIndex(hashFork, vTxNew))
+    {
+        return false;
+    }
+    dbBlock.FlushTxIndex(hashFork);
     return true;
 }
 
+void CBlockBase::ImportForkProc(const path& pathSnapshot, const CSnapshotFork& fork, int& nResult)
+{
+    xengine::CTicks tImport;
+    nResult = (dbBlock.ImportUnspent(pathSnapshot, fork) && RebuildTxIndex(fork.hashFork)) ? 1 : 0;
+    Log("B", "Import fork %s %s, unspent: %lu, %ld ms", fork.hashFork.GetHex().c_str(), (nResult ? "completed" : "failed"),
+        fork.nUnspent, tImport.Elapse() / 1000);
+}
+
 bool CBlockBase::IsValidBlock(CBlockIndex* pForkLast, const uint256& hashBlock)
 {
     if (hashBlock != 0)
@@ -2679,6 +3232,7 @@ bool CBlockBase::LoadDB()
         ClearCache();
         return false;
     }
+    BuildIndexSkip();
 
     vector<pair<uint256, uint256>> vFork;
     if (!dbBlock.ListFork(vFork))
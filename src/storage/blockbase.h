@@ -9,6 +9,7 @@
 #include <boost/thread/thread.hpp>
 #include <list>
 #include <map>
+#include <memory>
 #include <numeric>
 
 #include "block.h"
@@ -80,6 +81,7 @@ public:
     {
         pIndexLast = pIndexLastIn;
         UpdateNext();
+        UpdateActive();
     }
     void UpdateNext()
     {
@@ -113,12 +115,92 @@ public:
             }
         }
     }
+    // the active chain from the origin to the last block, rebuilt from the branch point after a reorg
+    void UpdateActive()
+    {
+        if (pIndexLast == nullptr)
+        {
+            vActive.clear();
+            vHeightEnd.clear();
+            return;
+        }
+
+        std::vector<CBlockIndex*> vBranch;
+        int nPos = -1;
+        for (CBlockIndex* pIndex = pIndexLast; pIndex != nullptr && (nPos = GetActivePos(pIndex)) < 0; pIndex = pIndex->pPrev)
+        {
+            vBranch.push_back(pIndex);
+            if (pIndex == pIndexOrigin)
+            {
+                break;
+            }
+        }
+
+        vActive.resize(nPos + 1);
+        vHeightEnd.resize(vActive.empty() ? 0 : vActive.back()->GetBlockHeight() - pIndexOrigin->GetBlockHeight() + 1);
+        if (!vActive.empty())
+        {
+            vHeightEnd.back() = vActive.size();
+        }
+        for (std::vector<CBlockIndex*>::reverse_iterator it = vBranch.rbegin(); it != vBranch.rend(); ++it)
+        {
+            vActive.push_back(*it);
+            std::size_t nOffset = (*it)->GetBlockHeight() - pIndexOrigin->GetBlockHeight();
+            if (nOffset >= vHeightEnd.size())
+            {
+                vHeightEnd.resize(nOffset + 1, vActive.size() - 1);
+            }
+            vHeightEnd[nOffset] = vActive.size();
+        }
+    }
+    // position on the active chain, the origin is 0, -1 if the block is not on it
+    int GetActivePos(const CBlockIndex* pIndex) const
+    {
+        int nOffset = pIndex->GetBlockHeight() - pIndexOrigin->GetBlockHeight();
+        if (nOffset < 0 || nOffset >= (int)vHeightEnd.size())
+        {
+            return -1;
+        }
+        for (std::size_t i = (nOffset > 0 ? vHeightEnd[nOffset - 1] : 0); i < vHeightEnd[nOffset]; i++)
+        {
+            if (vActive[i] == pIndex)
+            {
+                return i;
+            }
+        }
+        return -1;
+    }
+    CBlockIndex* GetActive(int nPos) const
+    {
+        return ((nPos >= 0 && nPos < (int)vActive.size()) ? vActive[nPos] : nullptr);
+    }
+    std::size_t GetActiveCount() const
+    {
+        return vActive.size();
+    }
+    // the last active block at or below nHeight, heights below the origin are on the parent forks
+    CBlockIndex* GetActiveOfHeight(int nHeight) const
+    {
+        int nOffset = nHeight - pIndexOrigin->GetBlockHeight();
+        if (nOffset < 0)
+        {
+            return (pIndexOrigin->pPrev != nullptr ? pIndexOrigin->pPrev->GetAncestor(nHeight) : nullptr);
+        }
+        if (nOffset >= (int)vHeightEnd.size() || vHeightEnd[nOffset] == 0)
+        {
+            return nullptr;
+        }
+        return vActive[vHeightEnd[nOffset] - 1];
+    }
 
 protected:
     mutable xengine::CRWAccess rwAccess;
     CProfile forkProfile;
     CBlockIndex* pIndexLast;
     CBlockIndex* pIndexOrigin;
+    std::vector<CBlockIndex*> vActive;
+    // one past the position of the last active block of each height, from the origin height
+    std::vector<std::size_t> vHeightEnd;
 };
 
 class CBlockView
@@ -227,6 +309,47 @@ protected:
     std::map<uint32, std::map<uint256, CBlockHeightIndex>> mapHeightIndex;
 };
 
+class CBlockExCache
+{
+public:
+    enum
+    {
+        DEFAULT_MAX_SIZE = 0x4000000
+    };
+    CBlockExCache(std::size_t nMaxSizeIn = DEFAULT_MAX_SIZE);
+    void SetMaxSize(std::size_t nMaxSizeIn);
+    bool IsEnabled() const
+    {
+        return (nMaxSize != 0);
+    }
+    bool Retrieve(const uint256& hash, std::shared_ptr<const CBlockEx>& spBlock);
+    void AddNew(const uint256& hash, const std::shared_ptr<const CBlockEx>& spBlock);
+    void Clear();
+    void GetStat(std::size_t& nCountRet, std::size_t& nSizeRet, uint64& nHitRet, uint64& nMissRet);
+
+protected:
+    class CEntry
+    {
+    public:
+        std::shared_ptr<const CBlockEx> spBlock;
+        std::size_t nSize;
+        std::list<uint256>::iterator itLRU;
+    };
+    static std::size_t EstimateSize(const CBlockEx& block);
+    void Evict();
+
+protected:
+    boost::mutex mtxCache;
+    std::atomic<std::size_t> nMaxSize;
+    std::size_t nSize;
+    uint64 nHit;
+    uint64 nMiss;
+    std::list<uint256> listLRU;
+    std::map<uint256, CEntry> mapBlock;
+};
+
+typedef boost::function<bool(const CBlockIndex*, const CBlockEx&)> CBlockRangeFunc;
+
 class CBlockBase
 {
     friend class CBlockView;
@@ -247,9 +370,17 @@ public:
     bool Retrieve(const CBlockIndex* pIndex, CBlock& block);
     bool Retrieve(const uint256& hash, CBlockEx& block);
     bool Retrieve(const CBlockIndex* pIndex, CBlockEx& block);
+    bool Retrieve(const uint256& hash, std::shared_ptr<const CBlockEx>& spBlock);
+    bool Retrieve(const CBlockIndex* pIndex, std::shared_ptr<const CBlockEx>& spBlock);
+    void SetBlockCacheSize(std::size_t nSize);
+    void SetBlockCompress(bool fCompress);
+    void SetTxIndexCacheSize(std::size_t nSize);
+    void SetUnspentCacheSize(std::size_t nSize);
     bool RetrieveIndex(const uint256& hash, CBlockIndex** ppIndex);
     bool RetrieveFork(const uint256& hash, CBlockIndex** ppIndex);
     bool RetrieveFork(const std::string& strName, CBlockIndex** ppIndex);
+    // the last block at or below nHeight on the active chain of the fork
+    bool RetrieveForkHeight(const uint256& hashFork, int nHeight, CBlockIndex** ppIndex);
     bool RetrieveProfile(const uint256& hash, CProfile& profile);
     bool RetrieveForkContext(const uint256& hash, CForkContext& ctxt);
     bool RetrieveAncestry(const uint256& hash, std::vector<std::pair<uint256, uint256>> vAncestry);
@@ -257,6 +388,7 @@ public:
     bool RetrieveTx(const uint256& txid, CTransaction& tx);
     bool RetrieveTx(const uint256& txid, CTransaction& tx, uint256& hashFork, int& nHeight);
     bool RetrieveTx(const uint256& hashFork, const uint256& txid, CTransaction& tx);
+    bool RetrieveTx(const uint256& hashFork, const std::vector<uint256>& vTxid, std::vector<CTransaction>& vTx);
     bool RetrieveTxLocation(const uint256& txid, uint256& hashFork, int& nHeight);
     bool RetrieveAvailDelegate(const uint256& hash, int height, const std::vector<uint256>& vBlockRange,
                                int64 nMinEnrollAmount,
@@ -292,16 +424,20 @@ public:
     bool VerifySameChain(const uint256& hashPrevBlock, const uint256& hashAfterBlock);
     bool GetLastRefBlockHash(const uint256& hashFork, const uint256& hashBlock, uint256& hashRefBlock, bool& fOrigin);
     bool GetPrimaryHeightBlockTime(const uint256& hashLastBlock, int nHeight, uint256& hashBlock, int64& nTime);
+    bool ExportSnapshot(const boost::filesystem::path& pathSnapshot, CSnapshotManifest& manifest);
+    bool ImportSnapshot(const boost::filesystem::path& pathSnapshot, CSnapshotManifest& manifest);
 
 protected:
     CBlockIndex* GetIndex(const uint256& hash) const;
     CBlockIndex* GetOrCreateIndex(const uint256& hash);
     CBlockIndex* GetBranch(CBlockIndex* pIndexRef, CBlockIndex* pIndex, std::vector<CBlockIndex*>& vPath);
+    bool ReadRange(const std::vector<CBlockIndex*>& vIndex, const CBlockRangeFunc& fnRead);
     CBlockIndex* GetOriginIndex(const uint256& txidMint) const;
     void UpdateBlockHeightIndex(const uint256& hashFork, const uint256& hashBlock, uint32 nBlockTimeStamp, const CDestination& destMint, const uint256& hashRefBlock);
     void RemoveBlockIndex(const uint256& hashFork, const uint256& hashBlock);
     void UpdateBlockRef(const uint256& hashFork, const uint256& hashBlock, const uint256& hashRefBlock);
     CBlockIndex* AddNewIndex(const uint256& hash, const CBlock& block, uint32 nFile, uint32 nOffset, uint256 nChainTrust);
+    void BuildIndexSkip();
     boost::shared_ptr<CBlockFork> GetFork(const uint256& hash);
     boost::shared_ptr<CBlockFork> GetFork(const std::string& strName);
     boost::shared_ptr<CBlockFork> AddNewFork(const CProfile& profileIn, CBlockIndex* pIndexLast);
@@ -310,6 +446,12 @@ protected:
     bool UpdateDelegate(const uint256& hash, CBlockEx& block, const CDiskPos& posBlock, CDelegateContext& ctxtDelegate);
     bool GetTxUnspent(const uint256 fork, const CTxOutPoint& out, CTxOut& unspent);
     bool GetTxNewIndex(CBlockView& view, CBlockIndex* pIndexNew, std::vector<std::pair<uint256, CTxIndex>>& vTxNew);
+    bool GetBlockTxIndex(const CBlockIndex* pIndex, std::vector<std::pair<uint256, CTxIndex>>& vTxNew);
+    bool RebuildTxIndex(const uint256& hashFork);
+    // block files copied to pathStage, the other files read through, all checked against the manifest
+    bool StageSnapshot(const boost::filesystem::path& pathSnapshot, const CSnapshotManifest& manifest,
+                       const boost::filesystem::path& pathStage);
+    void ImportForkProc(const boost::filesystem::path& pathSnapshot, const CSnapshotFork& fork, int& nResult);
     bool IsValidBlock(CBlockIndex* pForkLast, const uint256& hashBlock);
     bool VerifyValidBlock(CBlockIndex* pIndexGenesisLast, const CBlockIndex* pIndex);
     CBlockIndex* GetLongChainLastBlock(const uint256& hashFork, int nStartHeight, CBlockIndex* pIndexGenesisLast, const std::set<uint256>& setInvalidHash);
@@ -351,9 +493,12 @@ protected:
 protected:
     mutable xengine::CRWAccess rwAccess;
     xengine::CLog log;
+    boost::filesystem::path pathData;
     bool fDebugLog;
+    bool fBlockCompress;
     CBlockDB dbBlock;
     CTimeSeriesCached tsBlock;
+    CBlockExCache cacheBlock;
     std::map<uint256, CBlockIndex*> mapIndex;
     std::map<uint256, CForkHeightIndex> mapForkHeightIndex;
     std::map<uint256, boost::shared_ptr<CBlockFork>> mapFork;
@@ -5,19 +5,77 @@
 #include "blockdb.h"
 
 #include "stream/datastream.h"
+#include "timeseries.h"
 
 using namespace std;
+using namespace boost::filesystem;
 
 namespace bigbang
 {
 namespace storage
 {
 
+#define SNAPSHOT_UNSPENT_BATCH (100000)
+#define JOURNAL_FILE "journal.dat"
+#define JOURNAL_CHECKPOINT_FILE "journal.ckp"
+#define JOURNAL_CHECKPOINT_RETRY (60)
+#define JOURNAL_CHECKPOINT_SIZE (0x2000000)
+#define BLOCKFILE_PREFIX "block"
+
+//////////////////////////////
+// Snapshot walkers
+
+class CSnapshotBlockWalker : public CBlockDBWalker
+{
+public:
+    CSnapshotBlockWalker(CSnapshotWriter& writerIn)
+      : writer(writerIn) {}
+    bool Walk(CBlockOutline& outline) override
+    {
+        return writer.Write(outline);
+    }
+
+protected:
+    CSnapshotWriter& writer;
+};
+
+class CSnapshotDelegateWalker : public CDelegateDBWalker
+{
+public:
+    CSnapshotDelegateWalker(CSnapshotWriter& writerIn)
+      : writer(writerIn) {}
+    bool Walk(const uint256& hashBlock, const CDelegateContext& ctxtDelegate) override
+    {
+        return writer.Write(make_pair(hashBlock, ctxtDelegate));
+    }
+
+protected:
+    CSnapshotWriter& writer;
+};
+
+class CSnapshotUnspentWalker : public CForkUnspentDBWalker
+{
+public:
+    CSnapshotUnspentWalker(CSnapshotWriter& writerIn)
+      : writer(writerIn) {}
+    bool Walk(const CTxOutPoint& txout, const CTxOut& output) override
+    {
+        return writer.Write(make_pair(txout, CCompactTxOut(output)));
+    }
+
+protected:
+    CSnapshotWriter& writer;
+};
+
 //////////////////////////////
 // CBlockDB
 
 CBlockDB::CBlockDB()
 {
+    nUpdating = 0;
+    pThreadCheckpoint = nullptr;
+    fStopCheckpoint = true;
+    fCheckpointPending = false;
 }
 
 CBlockDB::~CBlockDB()
@@ -51,11 +109,67 @@ bool CBlockDB::Initialize(const boost::filesystem::path& pathData)
         return false;
     }
 
-    return LoadFork();
+    if (!LoadFork())
+    {
+        return false;
+    }
+
+    // resumed before the replay, so the flushes of a parent fork save the records its children copied
+    dbUnspent.ResumeMerge();
+
+    if (!LoadJournal(pathData))
+    {
+        return false;
+    }
+
+    if (dbUnspent.IsMerging())
+    {
+        // the journal can not restore a merge torn by a crash
+        boost::unique_lock<boost::mutex> lock(mtxJournal);
+        xengine::CBufStream ss;
+        if (!WriteJournal(JOURNAL_MERGE, ss, true))
+        {
+            return false;
+        }
+    }
+
+    fStopCheckpoint = false;
+    pThreadCheckpoint = new boost::thread(boost::bind(&CBlockDB::CheckpointProc, this));
+    if (pThreadCheckpoint == nullptr)
+    {
+        fStopCheckpoint = true;
+        return false;
+    }
+
+    return true;
 }
 
 void CBlockDB::Deinitialize()
 {
+    if (pThreadCheckpoint)
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mtxCheckpoint);
+            fStopCheckpoint = true;
+        }
+        condCheckpoint.notify_all();
+        pThreadCheckpoint->join();
+        delete pThreadCheckpoint;
+        pThreadCheckpoint = nullptr;
+    }
+
+    // the merges resume from their saved progress, the journal is emptied at the checkpoint
+    dbUnspent.StopMerge();
+
+    {
+        boost::unique_lock<boost::mutex> lock(mtxJournal);
+        if (journal.IsOpen())
+        {
+            CheckpointJournal();
+            journal.Close();
+        }
+    }
+
     dbDelegate.Deinitialize();
     dbUnspent.Deinitialize();
     dbTxIndex.Deinitialize();
@@ -71,11 +185,20 @@ bool CBlockDB::RemoveAll()
     dbBlockIndex.Clear();
     dbFork.Clear();
 
-    return true;
+    boost::unique_lock<boost::mutex> lock(mtxJournal);
+    return (RemoveCheckpointFile() && (!journal.IsOpen() || journal.Reset()));
 }
 
 bool CBlockDB::AddNewForkContext(const CForkContext& ctxt)
 {
+    boost::unique_lock<boost::mutex> lock(mtxJournal);
+
+    xengine::CBufStream ss;
+    ss << ctxt;
+    if (!WriteJournal(JOURNAL_ADDFORKCONTEXT, ss, false))
+    {
+        return false;
+    }
     return dbFork.AddNewForkContext(ctxt);
 }
 
@@ -92,6 +215,111 @@ bool CBlockDB::ListForkContext(vector<CForkContext>& vForkCtxt)
 }
 
 bool CBlockDB::AddNewFork(const uint256& hash)
+{
+    boost::unique_lock<boost::mutex> lock(mtxJournal);
+
+    xengine::CBufStream ss;
+    ss << hash;
+    if (!WriteJournal(JOURNAL_ADDFORK, ss, false))
+    {
+        return false;
+    }
+    return ApplyAddNewFork(hash);
+}
+
+bool CBlockDB::RemoveFork(const uint256& hash)
+{
+    boost::unique_lock<boost::mutex> lock(mtxJournal);
+
+    xengine::CBufStream ss;
+    ss << hash;
+    if (!WriteJournal(JOURNAL_REMOVEFORK, ss, false))
+    {
+        return false;
+    }
+    return ApplyRemoveFork(hash);
+}
+
+bool CBlockDB::ListFork(vector<pair<uint256, uint256>>& vFork)
+{
+    vFork.clear();
+    return dbFork.ListFork(vFork);
+}
+
+bool CBlockDB::UpdateFork(const uint256& hash, const uint256& hashRefBlock, const uint256& hashForkBased,
+                          const vector<pair<uint256, CTxIndex>>& vTxNew, const vector<uint256>& vTxDel,
+                          const vector<CTxUnspent>& vAddNew, const vector<CTxOutPoint>& vRemove)
+{
+    xengine::CBufStream ss;
+    ss << hash << hashRefBlock << hashForkBased << vTxNew << vTxDel << vAddNew << vRemove;
+
+    uint64 nAppended = 0;
+    {
+        boost::unique_lock<boost::mutex> lock(mtxJournal);
+
+        bool fCopy = (hashForkBased != hash && hashForkBased != 0);
+        if (!WriteJournal(fCopy ? JOURNAL_COPYFORK : JOURNAL_UPDATEFORK, ss, false))
+        {
+            return false;
+        }
+        nAppended = journal.GetAppended();
+        nUpdating++;
+    }
+
+    // synced as the commit point of the block, it also makes the records of the block before it durable.
+    // Blocks committed on other forks meanwhile share the sync
+    bool fRet = (journal.SyncTo(nAppended)
+                 && ApplyUpdateFork(hash, hashRefBlock, hashForkBased, vTxNew, vTxDel, vAddNew, vRemove));
+
+    boost::unique_lock<boost::mutex> lock(mtxJournal);
+    nUpdating--;
+    if (fRet && nUpdating == 0 && journal.GetSize() >= JOURNAL_CHECKPOINT_SIZE && !RotateJournal())
+    {
+        xengine::StdError("CBlockDB", "UpdateFork: rotate journal fail");
+    }
+    return fRet;
+}
+
+bool CBlockDB::AddNewBlock(const CBlockOutline& outline)
+{
+    boost::unique_lock<boost::mutex> lock(mtxJournal);
+
+    xengine::CBufStream ss;
+    ss << outline;
+    if (!WriteJournal(JOURNAL_ADDBLOCK, ss, false))
+    {
+        return false;
+    }
+    return dbBlockIndex.AddNewBlock(outline);
+}
+
+bool CBlockDB::RemoveBlock(const uint256& hash)
+{
+    boost::unique_lock<boost::mutex> lock(mtxJournal);
+
+    xengine::CBufStream ss;
+    ss << hash;
+    if (!WriteJournal(JOURNAL_REMOVEBLOCK, ss, false))
+    {
+        return false;
+    }
+    return dbBlockIndex.RemoveBlock(hash);
+}
+
+bool CBlockDB::UpdateDelegateContext(const uint256& hash, const CDelegateContext& ctxtDelegate)
+{
+    boost::unique_lock<boost::mutex> lock(mtxJournal);
+
+    xengine::CBufStream ss;
+    ss << hash << ctxtDelegate;
+    if (!WriteJournal(JOURNAL_DELEGATE, ss, false))
+    {
+        return false;
+    }
+    return dbDelegate.AddNew(hash, ctxtDelegate);
+}
+
+bool CBlockDB::ApplyAddNewFork(const uint256& hash)
 {
     if (!dbFork.UpdateFork(hash))
     {
@@ -113,7 +341,7 @@ bool CBlockDB::AddNewFork(const uint256& hash)
     return true;
 }
 
-bool CBlockDB::RemoveFork(const uint256& hash)
+bool CBlockDB::ApplyRemoveFork(const uint256& hash)
 {
     if (!dbUnspent.RemoveFork(hash))
     {
@@ -123,15 +351,9 @@ bool CBlockDB::RemoveFork(const uint256& hash)
     return dbFork.RemoveFork(hash);
 }
 
-bool CBlockDB::ListFork(vector<pair<uint256, uint256>>& vFork)
-{
-    vFork.clear();
-    return dbFork.ListFork(vFork);
-}
-
-bool CBlockDB::UpdateFork(const uint256& hash, const uint256& hashRefBlock, const uint256& hashForkBased,
-                          const vector<pair<uint256, CTxIndex>>& vTxNew, const vector<uint256>& vTxDel,
-                          const vector<CTxUnspent>& vAddNew, const vector<CTxOutPoint>& vRemove)
+bool CBlockDB::ApplyUpdateFork(const uint256& hash, const uint256& hashRefBlock, const uint256& hashForkBased,
+                               const vector<pair<uint256, CTxIndex>>& vTxNew, const vector<uint256>& vTxDel,
+                               const vector<CTxUnspent>& vAddNew, const vector<CTxOutPoint>& vRemove)
 {
     if (!dbUnspent.Exists(hash))
     {
@@ -168,36 +390,36 @@ bool CBlockDB::UpdateFork(const uint256& hash, const uint256& hashRefBlock, cons
     return true;
 }
 
-bool CBlockDB::AddNewBlock(const CBlockOutline& outline)
+bool CBlockDB::WalkThroughBlock(CBlockDBWalker& walker)
 {
-    return dbBlockIndex.AddNewBlock(outline);
+    return dbBlockIndex.WalkThroughBlock(walker);
 }
 
-bool CBlockDB::RemoveBlock(const uint256& hash)
+bool CBlockDB::RetrieveTxIndex(const uint256& txid, CTxIndex& txIndex, uint256& fork)
 {
-    return dbBlockIndex.RemoveBlock(hash);
+    txIndex.SetNull();
+    return dbTxIndex.Retrieve(txid, txIndex, fork);
 }
 
-bool CBlockDB::UpdateDelegateContext(const uint256& hash, const CDelegateContext& ctxtDelegate)
+bool CBlockDB::RetrieveTxIndex(const uint256& fork, const uint256& txid, CTxIndex& txIndex)
 {
-    return dbDelegate.AddNew(hash, ctxtDelegate);
+    txIndex.SetNull();
+    return dbTxIndex.Retrieve(fork, txid, txIndex);
 }
 
-bool CBlockDB::WalkThroughBlock(CBlockDBWalker& walker)
+bool CBlockDB::RetrieveTxIndex(const uint256& fork, const vector<uint256>& vTxid, vector<CTxIndex>& vTxIndex, size_t& nFound)
 {
-    return dbBlockIndex.WalkThroughBlock(walker);
+    return dbTxIndex.RetrieveBatch(fork, vTxid, vTxIndex, nFound);
 }
 
-bool CBlockDB::RetrieveTxIndex(const uint256& txid, CTxIndex& txIndex, uint256& fork)
+void CBlockDB::SetTxIndexCacheSize(size_t nSize)
 {
-    txIndex.SetNull();
-    return dbTxIndex.Retrieve(txid, txIndex, fork);
+    dbTxIndex.SetChunkCacheSize(nSize);
 }
 
-bool CBlockDB::RetrieveTxIndex(const uint256& fork, const uint256& txid, CTxIndex& txIndex)
+void CBlockDB::SetUnspentCacheSize(size_t nSize)
 {
-    txIndex.SetNull();
-    return dbTxIndex.Retrieve(fork, txid, txIndex);
+    dbUnspent.SetCacheSize(nSize);
 }
 
 bool CBlockDB::RetrieveTxUnspent(const uint256& fork, const CTxOutPoint& out, CTxOut& unspent)
@@ -205,9 +427,14 @@ bool CBlockDB::RetrieveTxUnspent(const uint256& fork, const CTxOutPoint& out, CT
     return dbUnspent.Retrieve(fork, out, unspent);
 }
 
-bool CBlockDB::WalkThroughUnspent(const uint256& hashFork, CForkUnspentDBWalker& walker)
+bool CBlockDB::WalkThroughUnspent(const uint256& hashFork, CForkUnspentDBWalker& walker, bool fWaitMerged)
+{
+    return dbUnspent.WalkThrough(hashFork, walker, fWaitMerged);
+}
+
+bool CBlockDB::ListUnspent(const uint256& hashFork, const CDestination& dest, uint32 nMax, vector<CTxUnspent>& vUnspent)
 {
-    return dbUnspent.WalkThrough(hashFork, walker);
+    return dbUnspent.ListUnspent(hashFork, dest, nMax, vUnspent);
 }
 
 bool CBlockDB::RetrieveDelegate(const uint256& hash, map<CDestination, int64>& mapDelegate)
@@ -226,6 +453,251 @@ bool CBlockDB::RetrieveEnroll(int height, const vector<uint256>& vBlockRange,
     return dbDelegate.RetrieveEnrollTx(height, vBlockRange, mapEnrollTxPos);
 }
 
+bool CBlockDB::ExportSnapshot(const path& pathSnapshot, CSnapshotManifest& manifest)
+{
+    if (!dbFork.ListForkContext(manifest.vForkCtxt))
+    {
+        return false;
+    }
+
+    vector<pair<uint256, uint256>> vFork;
+    if (!dbFork.ListFork(vFork))
+    {
+        return false;
+    }
+
+    {
+        CSnapshotWriter writer;
+        CSnapshotBlockWalker walker(writer);
+        if (!writer.Open(pathSnapshot / SNAPSHOT_BLOCKINDEX) || !dbBlockIndex.WalkThroughBlock(walker)
+            || !writer.Close(manifest.hashBlockChecksum))
+        {
+            return false;
+        }
+        manifest.nBlock = writer.GetCount();
+    }
+
+    {
+        CSnapshotWriter writer;
+        CSnapshotDelegateWalker walker(writer);
+        if (!writer.Open(pathSnapshot / SNAPSHOT_DELEGATE) || !dbDelegate.WalkThroughDelegate(walker)
+            || !writer.Close(manifest.hashDelegateChecksum))
+        {
+            return false;
+        }
+        manifest.nDelegate = writer.GetCount();
+    }
+
+    manifest.vFork.clear();
+    for (const pair<uint256, uint256>& fork : vFork)
+    {
+        CSnapshotFork snapshotFork(fork.first, fork.second);
+        CSnapshotWriter writer;
+        CSnapshotUnspentWalker walker(writer);
+        if (!writer.Open(pathSnapshot / SNAPSHOT_UNSPENT_DIR / (fork.first.GetHex() + ".dat"))
+            || !dbUnspent.WalkThrough(fork.first, walker) || !writer.Close(snapshotFork.hashChecksum))
+        {
+            return false;
+        }
+        snapshotFork.nUnspent = writer.GetCount();
+        manifest.vFork.push_back(snapshotFork);
+    }
+    return true;
+}
+
+bool CBlockDB::MarkImport(const CSnapshotManifest& manifest)
+{
+    boost::unique_lock<boost::mutex> lock(mtxJournal);
+
+    xengine::CBufStream ss;
+    ss << manifest.hashLastBlock;
+    return WriteJournal(JOURNAL_IMPORT, ss, true);
+}
+
+bool CBlockDB::ImportSnapshot(const path& pathSnapshot, const CSnapshotManifest& manifest)
+{
+    // the journal keeps the import record written by MarkImport
+    dbDelegate.Clear();
+    dbUnspent.Clear();
+    dbTxIndex.Clear();
+    dbBlockIndex.Clear();
+    dbFork.Clear();
+
+    for (const CForkContext& ctxt : manifest.vForkCtxt)
+    {
+        if (!dbFork.AddNewForkContext(ctxt))
+        {
+            return false;
+        }
+    }
+
+    {
+        CSnapshotReader reader;
+        if (!reader.Open(pathSnapshot / SNAPSHOT_BLOCKINDEX, manifest.hashBlockChecksum))
+        {
+            return false;
+        }
+        CBlockOutline outline;
+        uint64 nBlock = 0;
+        while (reader.Read(outline))
+        {
+            if (!dbBlockIndex.AddNewBlock(outline))
+            {
+                return false;
+            }
+            nBlock++;
+        }
+        if (!reader.IsCompleted() || nBlock != manifest.nBlock)
+        {
+            xengine::StdError("CBlockDB", "Import snapshot block index failed");
+            return false;
+        }
+    }
+
+    {
+        CSnapshotReader reader;
+        if (!reader.Open(pathSnapshot / SNAPSHOT_DELEGATE, manifest.hashDelegateChecksum))
+        {
+            return false;
+        }
+        pair<uint256, CDelegateContext> delegate;
+        uint64 nDelegate = 0;
+        while (reader.Read(delegate))
+        {
+            if (!dbDelegate.AddNew(delegate.first, delegate.second))
+            {
+                return false;
+            }
+            nDelegate++;
+        }
+        if (!reader.IsCompleted() || nDelegate != manifest.nDelegate)
+        {
+            xengine::StdError("CBlockDB", "Import snapshot delegate failed");
+            return false;
+        }
+    }
+
+    for (const CSnapshotFork& fork : manifest.vFork)
+    {
+        if (!ApplyAddNewFork(fork.hashFork) || !dbFork.UpdateFork(fork.hashFork, fork.hashLastBlock))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool CBlockDB::ImportUnspent(const path& pathSnapshot, const CSnapshotFork& fork)
+{
+    CSnapshotReader reader;
+    if (!reader.Open(pathSnapshot / SNAPSHOT_UNSPENT_DIR / (fork.hashFork.GetHex() + ".dat"), fork.hashChecksum))
+    {
+        return false;
+    }
+
+    vector<CTxUnspent> vUnspent;
+    vUnspent.reserve(SNAPSHOT_UNSPENT_BATCH);
+    pair<CTxOutPoint, CCompactTxOut> record;
+    uint64 nUnspent = 0;
+    while (reader.Read(record))
+    {
+        vUnspent.push_back(CTxUnspent(record.first, record.second.output));
+        if (vUnspent.size() >= SNAPSHOT_UNSPENT_BATCH)
+        {
+            if (!dbUnspent.RepairUnspent(fork.hashFork, vUnspent, vector<CTxOutPoint>()))
+            {
+                return false;
+            }
+            nUnspent += vUnspent.size();
+            vUnspent.clear();
+        }
+    }
+    if (!reader.IsCompleted())
+    {
+        xengine::StdError("CBlockDB", "Import snapshot unspent failed, fork: %s", fork.hashFork.GetHex().c_str());
+        return false;
+    }
+    if (!vUnspent.empty() && !dbUnspent.RepairUnspent(fork.hashFork, vUnspent, vector<CTxOutPoint>()))
+    {
+        return false;
+    }
+    nUnspent += vUnspent.size();
+    return (nUnspent == fork.nUnspent);
+}
+
+bool CBlockDB::UpdateTxIndex(const uint256& hashFork, const vector<pair<uint256, CTxIndex>>& vTxNew)
+{
+    return dbTxIndex.Update(hashFork, vTxNew, vector<uint256>());
+}
+
+void CBlockDB::FlushTxIndex(const uint256& hashFork)
+{
+    dbTxIndex.Flush(hashFork);
+}
+
+bool CBlockDB::Checkpoint()
+{
+    boost::unique_lock<boost::mutex> lock(mtxJournal);
+    return CheckpointJournal();
+}
+
+bool CBlockDB::IsJournalReplayable(const path& pathData)
+{
+    vector<CBlockJournal::CRecord> vRecord;
+    if (!ReadJournal(pathData, vRecord))
+    {
+        return false;
+    }
+    // block files are not journaled, a block index record must not point past the valid tail
+    // of the block files, which a crash may have torn or lost
+    bool fTail = false;
+    uint32 nLastFile = 0, nLastPos = 0;
+    for (const CBlockJournal::CRecord& record : vRecord)
+    {
+        if (record.nType == JOURNAL_COPYFORK || record.nType == JOURNAL_IMPORT || record.nType == JOURNAL_MERGE)
+        {
+            return false;
+        }
+        if (record.nType == JOURNAL_ADDBLOCK)
+        {
+            if (!fTail)
+            {
+                CTimeSeriesCached tsBlock;
+                if (!tsBlock.Initialize(pathData / "block", BLOCKFILE_PREFIX))
+                {
+                    return false;
+                }
+                tsBlock.CheckTail(nLastFile, nLastPos, false);
+                tsBlock.Deinitialize();
+                fTail = true;
+            }
+
+            CBlockOutline outline;
+            try
+            {
+                xengine::CBufStream ss;
+                if (!record.vData.empty())
+                {
+                    ss.Write(&record.vData[0], record.vData.size());
+                }
+                ss >> outline;
+            }
+            catch (exception& e)
+            {
+                xengine::StdError("CBlockDB", "Journal block record error: %s", e.what());
+                return false;
+            }
+            if (outline.nFile > nLastFile || (outline.nFile == nLastFile && outline.nOffset >= nLastPos))
+            {
+                xengine::StdWarn("CBlockDB", "Journal block %s is past the block file tail, file: %u, offset: %u",
+                                 outline.hashBlock.GetHex().c_str(), outline.nFile, outline.nOffset);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
 bool CBlockDB::LoadFork()
 {
     vector<pair<uint256, uint256>> vFork;
@@ -249,5 +721,241 @@ bool CBlockDB::LoadFork()
     return true;
 }
 
+bool CBlockDB::LoadJournal(const path& pathData)
+{
+    pathCheckpoint = pathData / JOURNAL_CHECKPOINT_FILE;
+
+    bool fReplay = IsJournalReplayable(pathData);
+    if (!fReplay && (exists(pathData / JOURNAL_FILE) || exists(pathCheckpoint)))
+    {
+        xengine::StdWarn("CBlockDB", "Journal can not be replayed, the databases are left as repaired by checkrepair");
+    }
+
+    boost::unique_lock<boost::mutex> lock(mtxJournal);
+    if (!journal.Open(pathData / JOURNAL_FILE))
+    {
+        return false;
+    }
+
+    if (fReplay)
+    {
+        vector<CBlockJournal::CRecord> vRecord;
+        if (!ReadJournal(pathData, vRecord))
+        {
+            return false;
+        }
+        for (const CBlockJournal::CRecord& record : vRecord)
+        {
+            if (!ApplyJournal(record))
+            {
+                xengine::StdError("CBlockDB", "Replay journal fail, record type: %d", record.nType);
+                return false;
+            }
+        }
+        if (!vRecord.empty())
+        {
+            xengine::StdLog("CBlockDB", "Replay journal: %lu records", vRecord.size());
+        }
+    }
+
+    return CheckpointJournal();
+}
+
+bool CBlockDB::ReadJournal(const path& pathData, vector<CBlockJournal::CRecord>& vRecord)
+{
+    vRecord.clear();
+
+    bool fFound = false;
+    const path vPathFile[] = { pathData / JOURNAL_CHECKPOINT_FILE, pathData / JOURNAL_FILE };
+    for (const path& pathFile : vPathFile)
+    {
+        if (exists(pathFile))
+        {
+            vector<CBlockJournal::CRecord> vFileRecord;
+            uint64 nValidSize = 0;
+            if (!CBlockJournal::Read(pathFile, vFileRecord, nValidSize))
+            {
+                return false;
+            }
+            vRecord.insert(vRecord.end(), vFileRecord.begin(), vFileRecord.end());
+            fFound = true;
+        }
+    }
+    return fFound;
+}
+
+bool CBlockDB::WriteJournal(uint8 nType, xengine::CBufStream& ss, bool fSync)
+{
+    if (!journal.Append(nType, ss, fSync))
+    {
+        xengine::StdError("CBlockDB", "Write journal fail, record type: %d", nType);
+        return false;
+    }
+    return true;
+}
+
+bool CBlockDB::ApplyJournal(const CBlockJournal::CRecord& record)
+{
+    xengine::CBufStream ss;
+    if (!record.vData.empty())
+    {
+        ss.Write(&record.vData[0], record.vData.size());
+    }
+
+    try
+    {
+        switch (record.nType)
+        {
+        case JOURNAL_ADDFORKCONTEXT:
+        {
+            CForkContext ctxt;
+            ss >> ctxt;
+            return dbFork.AddNewForkContext(ctxt);
+        }
+        case JOURNAL_ADDFORK:
+        {
+            uint256 hash;
+            ss >> hash;
+            return ApplyAddNewFork(hash);
+        }
+        case JOURNAL_REMOVEFORK:
+        {
+            uint256 hash;
+            ss >> hash;
+            // removing a fork again finds nothing in the unspent set
+            ApplyRemoveFork(hash);
+            return true;
+        }
+        case JOURNAL_UPDATEFORK:
+        {
+            uint256 hash, hashRefBlock, hashForkBased;
+            vector<pair<uint256, CTxIndex>> vTxNew;
+            vector<uint256> vTxDel;
+            vector<CTxUnspent> vAddNew;
+            vector<CTxOutPoint> vRemove;
+            ss >> hash >> hashRefBlock >> hashForkBased >> vTxNew >> vTxDel >> vAddNew >> vRemove;
+            return ApplyUpdateFork(hash, hashRefBlock, hashForkBased, vTxNew, vTxDel, vAddNew, vRemove);
+        }
+        case JOURNAL_ADDBLOCK:
+        {
+            CBlockOutline outline;
+            ss >> outline;
+            return dbBlockIndex.AddNewBlock(outline);
+        }
+        case JOURNAL_REMOVEBLOCK:
+        {
+            uint256 hash;
+            ss >> hash;
+            return dbBlockIndex.RemoveBlock(hash);
+        }
+        case JOURNAL_DELEGATE:
+        {
+            uint256 hash;
+            CDelegateContext ctxtDelegate;
+            ss >> hash >> ctxtDelegate;
+            return dbDelegate.AddNew(hash, ctxtDelegate);
+        }
+        default:
+            break;
+        }
+    }
+    catch (exception& e)
+    {
+        xengine::StdError("CBlockDB", "Apply journal record: %s", e.what());
+    }
+    return false;
+}
+
+bool CBlockDB::CheckpointJournal()
+{
+    boost::unique_lock<boost::mutex> lock(mtxCheckpoint);
+
+    // no merge can start while the journal is locked, one finished before is on disk after the sync
+    bool fMerging = dbUnspent.IsMerging();
+
+    if (!FlushJournaled() || !RemoveCheckpointFile())
+    {
+        return false;
+    }
+    fCheckpointPending = false;
+
+    // the copy record stays until the unspent set copied from the parent fork has been merged,
+    // a fork update written but not applied yet stays as well
+    return (fMerging || nUpdating > 0 || journal.Reset());
+}
+
+bool CBlockDB::RotateJournal()
+{
+    // a merging fork keeps its copy record in the journal, a checkpoint still running keeps its file
+    if (exists(pathCheckpoint) || dbUnspent.IsMerging())
+    {
+        return true;
+    }
+
+    if (!journal.Rotate(pathCheckpoint))
+    {
+        return false;
+    }
+
+    {
+        boost::unique_lock<boost::mutex> lock(mtxCheckpoint);
+        fCheckpointPending = true;
+    }
+    condCheckpoint.notify_all();
+    return true;
+}
+
+bool CBlockDB::FlushJournaled()
+{
+    if (!dbUnspent.FlushAll() || !dbTxIndex.FlushAll()
+        || !dbBlockIndex.Sync() || !dbDelegate.Sync() || !dbFork.Sync())
+    {
+        xengine::StdError("CBlockDB", "Checkpoint: flush databases fail");
+        return false;
+    }
+    return true;
+}
+
+bool CBlockDB::RemoveCheckpointFile()
+{
+    try
+    {
+        remove(pathCheckpoint);
+    }
+    catch (const filesystem_error& e)
+    {
+        xengine::StdError("CBlockDB", "Checkpoint: remove checkpoint file fail, %s", e.what());
+        return false;
+    }
+    return true;
+}
+
+void CBlockDB::CheckpointProc()
+{
+    // the records of a rotated journal have all been applied, once the databases are flushed
+    // and synced the file is not needed any more. Block commit goes on with the new journal
+    xengine::SetThreadName("BlockCheckpoint");
+    boost::unique_lock<boost::mutex> lock(mtxCheckpoint);
+    while (!fStopCheckpoint)
+    {
+        if (!fCheckpointPending)
+        {
+            condCheckpoint.wait(lock);
+            continue;
+        }
+
+        if (FlushJournaled() && RemoveCheckpointFile())
+        {
+            fCheckpointPending = false;
+        }
+        else
+        {
+            xengine::StdError("CBlockDB", "Checkpoint: background checkpoint fail, retry in %d seconds",
+                              JOURNAL_CHECKPOINT_RETRY);
+            condCheckpoint.timed_wait(lock, boost::posix_time::seconds(JOURNAL_CHECKPOINT_RETRY));
+        }
+    }
+}
+
 } // namespace storage
 } // namespace bigbang
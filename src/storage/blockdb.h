@@ -10,6 +10,8 @@
 #include "delegatedb.h"
 #include "forkcontext.h"
 #include "forkdb.h"
+#include "journal.h"
+#include "snapshot.h"
 #include "transaction.h"
 #include "txindexdb.h"
 #include "unspentdb.h"
@@ -42,15 +44,59 @@ public:
     bool WalkThroughBlock(CBlockDBWalker& walker);
     bool RetrieveTxIndex(const uint256& txid, CTxIndex& txIndex, uint256& fork);
     bool RetrieveTxIndex(const uint256& fork, const uint256& txid, CTxIndex& txIndex);
+    bool RetrieveTxIndex(const uint256& fork, const std::vector<uint256>& vTxid, std::vector<CTxIndex>& vTxIndex, std::size_t& nFound);
+    void SetTxIndexCacheSize(std::size_t nSize);
+    void SetUnspentCacheSize(std::size_t nSize);
     bool RetrieveTxUnspent(const uint256& fork, const CTxOutPoint& out, CTxOut& unspent);
-    bool WalkThroughUnspent(const uint256& hashFork, CForkUnspentDBWalker& walker);
+    bool WalkThroughUnspent(const uint256& hashFork, CForkUnspentDBWalker& walker, bool fWaitMerged = false);
+    bool ListUnspent(const uint256& hashFork, const CDestination& dest, uint32 nMax, std::vector<CTxUnspent>& vUnspent);
     bool RetrieveDelegate(const uint256& hash, std::map<CDestination, int64>& mapDelegate);
     bool RetrieveEnroll(const uint256& hash, std::map<int, std::map<CDestination, CDiskPos>>& mapEnrollTxPos);
     bool RetrieveEnroll(int height, const std::vector<uint256>& vBlockRange,
                         std::map<CDestination, CDiskPos>& mapEnrollTxPos);
+    bool ExportSnapshot(const boost::filesystem::path& pathSnapshot, CSnapshotManifest& manifest);
+    // the journal can not be replayed from here until the import is checkpointed
+    bool MarkImport(const CSnapshotManifest& manifest);
+    bool ImportSnapshot(const boost::filesystem::path& pathSnapshot, const CSnapshotManifest& manifest);
+    bool ImportUnspent(const boost::filesystem::path& pathSnapshot, const CSnapshotFork& fork);
+    bool UpdateTxIndex(const uint256& hashFork, const std::vector<std::pair<uint256, CTxIndex>>& vTxNew);
+    void FlushTxIndex(const uint256& hashFork);
+    // write all cached changes to disk and empty the journal
+    bool Checkpoint();
+    // the journal can bring the databases back to a consistent state after a crash
+    static bool IsJournalReplayable(const boost::filesystem::path& pathData);
 
 protected:
+    enum
+    {
+        JOURNAL_ADDFORKCONTEXT = 1,
+        JOURNAL_ADDFORK = 2,
+        JOURNAL_REMOVEFORK = 3,
+        JOURNAL_UPDATEFORK = 4,
+        JOURNAL_ADDBLOCK = 5,
+        JOURNAL_REMOVEBLOCK = 6,
+        JOURNAL_DELEGATE = 7,
+        // the records below can not be replayed, the databases must be repaired
+        JOURNAL_COPYFORK = 0x80,
+        JOURNAL_IMPORT = 0x81,
+        JOURNAL_MERGE = 0x82
+    };
     bool LoadFork();
+    bool LoadJournal(const boost::filesystem::path& pathData);
+    // records of a checkpoint still running first, then the records of the journal
+    static bool ReadJournal(const boost::filesystem::path& pathData, std::vector<CBlockJournal::CRecord>& vRecord);
+    bool WriteJournal(uint8 nType, xengine::CBufStream& ss, bool fSync);
+    bool ApplyJournal(const CBlockJournal::CRecord& record);
+    bool CheckpointJournal();
+    bool RotateJournal();
+    bool FlushJournaled();
+    bool RemoveCheckpointFile();
+    void CheckpointProc();
+    bool ApplyAddNewFork(const uint256& hash);
+    bool ApplyRemoveFork(const uint256& hash);
+    bool ApplyUpdateFork(const uint256& hash, const uint256& hashRefBlock, const uint256& hashForkBased,
+                         const std::vector<std::pair<uint256, CTxIndex>>& vTxNew, const std::vector<uint256>& vTxDel,
+                         const std::vector<CTxUnspent>& vAddNew, const std::vector<CTxOutPoint>& vRemove);
 
 protected:
     CForkDB dbFork;
@@ -58,6 +104,15 @@ protected:
     CTxIndexDB dbTxIndex;
     CUnspentDB dbUnspent;
     CDelegateDB dbDelegate;
+    boost::mutex mtxJournal;
+    CBlockJournal journal;
+    boost::filesystem::path pathCheckpoint;
+    int nUpdating;
+    boost::mutex mtxCheckpoint;
+    boost::condition_variable condCheckpoint;
+    boost::thread* pThreadCheckpoint;
+    bool fStopCheckpoint;
+    bool fCheckpointPending;
 };
 
 } // namespace storage
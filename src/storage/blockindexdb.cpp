@@ -20,6 +20,7 @@ namespace storage
 bool CBlockIndexDB::Initialize(const boost::filesystem::path& pathData)
 {
     CLevelDBArguments args;
+    args.name = "blockindex";
     args.path = (pathData / "blockindex").string();
     args.syncwrite = false;
     CLevelDBEngine* engine = new CLevelDBEngine(args);
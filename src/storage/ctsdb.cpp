@@ -30,6 +30,7 @@ CCTSIndex::~CCTSIndex()
 bool CCTSIndex::Initialize(const boost::filesystem::path& pathCTSDB)
 {
     CLevelDBArguments args;
+    args.name = "txindex";
     args.path = (pathCTSDB / "index").string();
     args.syncwrite = false;
     CLevelDBEngine* engine = new CLevelDBEngine(args);
@@ -48,11 +49,21 @@ void CCTSIndex::Deinitialize()
     Close();
 }
 
-bool CCTSIndex::Update(const vector<int64>& vTime, const vector<CDiskPos>& vPos, const vector<int64>& vDel)
+bool CCTSIndex::Update(const map<int64, CCTSBucketPos>& mapBucket, const map<uint32, uint64>& mapDeadSize,
+                       uint32 nFullDeadFile, uint64 nFullDeadSize)
 {
-    if (vTime.size() != vPos.size())
+    // until the sizes are first counted by a walk, the walk also covers what dies now
+    map<uint32, uint64> mapFileDead;
+    if ((!mapDeadSize.empty() || nFullDeadFile != 0) && Read(string("deadsize"), mapFileDead))
     {
-        return false;
+        for (map<uint32, uint64>::const_iterator it = mapDeadSize.begin(); it != mapDeadSize.end(); ++it)
+        {
+            mapFileDead[(*it).first] += (*it).second;
+        }
+        if (nFullDeadFile != 0)
+        {
+            mapFileDead[nFullDeadFile] = nFullDeadSize;
+        }
     }
 
     if (!TxnBegin())
@@ -60,14 +71,31 @@ bool CCTSIndex::Update(const vector<int64>& vTime, const vector<CDiskPos>& vPos,
         return false;
     }
 
-    for (int i = 0; i < vTime.size(); i++)
+    for (map<int64, CCTSBucketPos>::const_iterator it = mapBucket.begin(); it != mapBucket.end(); ++it)
     {
-        Write(vTime[i], vPos[i]);
+        const int64 nTime = (*it).first;
+        const CCTSBucketPos& posBucket = (*it).second;
+        if (posBucket.IsNull())
+        {
+            Erase(nTime);
+        }
+        else
+        {
+            Write(nTime, posBucket.posBase);
+        }
+        if (posBucket.vDelta.empty())
+        {
+            Erase(make_pair(string("delta"), nTime));
+        }
+        else
+        {
+            Write(make_pair(string("delta"), nTime), posBucket.vDelta);
+        }
     }
 
-    for (int i = 0; i < vDel.size(); i++)
+    if (!mapFileDead.empty())
     {
-        Erase(vDel[i]);
+        Write(string("deadsize"), mapFileDead);
     }
 
     if (!TxnCommit())
@@ -78,9 +106,65 @@ bool CCTSIndex::Update(const vector<int64>& vTime, const vector<CDiskPos>& vPos,
     return true;
 }
 
-bool CCTSIndex::Retrieve(const int64 nTime, CDiskPos& pos)
+bool CCTSIndex::Retrieve(const int64 nTime, CCTSBucketPos& posBucket)
+{
+    // the base key is the plain time, as written before delta chunks existed
+    if (!Read(nTime, posBucket.posBase))
+    {
+        return false;
+    }
+    posBucket.vDelta.clear();
+    Read(make_pair(string("delta"), nTime), posBucket.vDelta);
+    return true;
+}
+
+bool CCTSIndex::WalkThroughBucket(CCTSBucketWalker fnWalker)
+{
+    return WalkThrough(boost::bind(&CCTSIndex::BucketWalker, this, _1, _2, boost::ref(fnWalker)));
+}
+
+bool CCTSIndex::IsDeadSizeReady()
+{
+    map<uint32, uint64> mapDeadSize;
+    return Read(string("deadsize"), mapDeadSize);
+}
+
+bool CCTSIndex::SetDeadSize(const map<uint32, uint64>& mapDeadSize)
+{
+    return Write(string("deadsize"), mapDeadSize);
+}
+
+bool CCTSIndex::GetDeadSize(map<uint32, uint64>& mapDeadSize)
+{
+    mapDeadSize.clear();
+    Read(string("deadsize"), mapDeadSize);
+    return true;
+}
+
+bool CCTSIndex::RemoveDeadSize(uint32 nFile)
 {
-    return Read(nTime, pos);
+    map<uint32, uint64> mapDeadSize;
+    if (Read(string("deadsize"), mapDeadSize) && mapDeadSize.erase(nFile) != 0)
+    {
+        return Write(string("deadsize"), mapDeadSize);
+    }
+    return true;
+}
+
+bool CCTSIndex::BucketWalker(CBufStream& ssKey, CBufStream& ssValue, CCTSBucketWalker& fnWalker)
+{
+    // delta and dead size keys are longer than a time
+    if (ssKey.GetSize() != sizeof(int64))
+    {
+        return true;
+    }
+
+    int64 nTime;
+    CCTSBucketPos posBucket;
+    ssKey >> nTime;
+    ssValue >> posBucket.posBase;
+    Read(make_pair(string("delta"), nTime), posBucket.vDelta);
+    return fnWalker(nTime, posBucket);
 }
 
 } // namespace storage
@@ -5,21 +5,46 @@
 #ifndef STORAGE_CTSDB_H
 #define STORAGE_CTSDB_H
 
+#include <algorithm>
+#include <boost/bind.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/range/algorithm.hpp>
+#include <boost/thread/thread.hpp>
 #include <iostream>
+#include <list>
+#include <memory>
+#include <set>
 #include <snappy.h>
 
 #include "timeseries.h"
 #include "xengine.h"
 
 #define FLUSH_THRESH (1000)
+#define CTS_MAX_DELTA (8)
+#define CTS_COMPACT_LIMIT (1000)
 
 namespace bigbang
 {
 namespace storage
 {
 
+class CCTSBucketPos
+{
+public:
+    CCTSBucketPos(const CDiskPos& posBaseIn = CDiskPos())
+      : posBase(posBaseIn) {}
+    bool IsNull() const
+    {
+        return (posBase.IsNull() && vDelta.empty());
+    }
+
+public:
+    CDiskPos posBase;
+    std::vector<CDiskPos> vDelta;
+};
+
+typedef boost::function<bool(const int64, const CCTSBucketPos&)> CCTSBucketWalker;
+
 class CCTSIndex : public xengine::CKVDB
 {
 public:
@@ -27,9 +52,17 @@ public:
     ~CCTSIndex();
     bool Initialize(const boost::filesystem::path& pathCTSDB);
     void Deinitialize();
-    bool Update(const std::vector<int64>& vTime, const std::vector<CDiskPos>& vPos,
-                const std::vector<int64>& vDel);
-    bool Retrieve(const int64, CDiskPos& pos);
+    bool Update(const std::map<int64, CCTSBucketPos>& mapBucket, const std::map<uint32, uint64>& mapDeadSize,
+                uint32 nFullDeadFile = 0, uint64 nFullDeadSize = 0);
+    bool Retrieve(const int64 nTime, CCTSBucketPos& posBucket);
+    bool WalkThroughBucket(CCTSBucketWalker fnWalker);
+    bool IsDeadSizeReady();
+    bool SetDeadSize(const std::map<uint32, uint64>& mapDeadSize);
+    bool GetDeadSize(std::map<uint32, uint64>& mapDeadSize);
+    bool RemoveDeadSize(uint32 nFile);
+
+protected:
+    bool BucketWalker(xengine::CBufStream& ssKey, xengine::CBufStream& ssValue, CCTSBucketWalker& fnWalker);
 };
 
 template <typename K, typename V>
@@ -45,7 +78,7 @@ public:
       : basetype(first, last)
     {
     }
-    bool Find(const K& k, V& v)
+    bool Find(const K& k, V& v) const
     {
         int s = 0, m = 0, e = basetype::size() - 1;
         while (s <= e)
@@ -67,6 +100,10 @@ public:
         }
         return false;
     }
+    std::size_t GetMemorySize() const
+    {
+        return sizeof(*this) + basetype::size() * sizeof(std::pair<K, V>);
+    }
 
 protected:
     void Serialize(xengine::CStream& s, xengine::SaveType& opt)
@@ -129,10 +166,248 @@ protected:
     }
 };
 
+template <typename K>
+class CCTSKeyPrefix
+{
+public:
+    // most significant 64 bits of a base_uint key, ordered like K::operator<
+    static uint64 Get(const K& k)
+    {
+        const int n = K::size() / sizeof(uint32);
+        return ((uint64)k.Get32(n - 1) << 32) | k.Get32(n - 2);
+    }
+};
+
+template <typename K, typename V, typename P = CCTSChunkSnappy<K, V>>
+class CCTSChunkEytzinger : public P
+{
+    typedef std::vector<std::pair<K, V>> basetype;
+    friend class xengine::CStream;
+
+public:
+    CCTSChunkEytzinger()
+    {
+        BuildSearchIndex();
+    }
+    template <class InputIterator>
+    CCTSChunkEytzinger(InputIterator first, InputIterator last)
+      : P(first, last)
+    {
+        BuildSearchIndex();
+    }
+    bool Find(const K& k, V& v) const
+    {
+        // branchless lower bound over the key prefixes in BFS order, record is touched only on a prefix match
+        const uint64 nPrefix = CCTSKeyPrefix<K>::Get(k);
+        const std::size_t n = vIndex.size() - 1;
+        const uint64* pPrefix = &vPrefix[0];
+        std::size_t i = 1;
+        while (i <= n)
+        {
+#if defined(__GNUC__)
+            __builtin_prefetch(pPrefix + std::min(i * 8, n));
+#endif
+            i = (i << 1) + (pPrefix[i] < nPrefix);
+        }
+        i >>= FindFirstZero(i);
+        if (i == 0)
+        {
+            return false;
+        }
+        // keys sharing the prefix are adjacent in the sorted records
+        for (std::size_t m = vIndex[i]; m < basetype::size(); m++)
+        {
+            const std::pair<K, V>& item = (*this)[m];
+            if (!(item.first < k))
+            {
+                if (item.first == k)
+                {
+                    v = item.second;
+                    return true;
+                }
+                break;
+            }
+        }
+        return false;
+    }
+    std::size_t GetMemorySize() const
+    {
+        // the search index adds 12 bytes per record
+        return P::GetMemorySize() + (sizeof(*this) - sizeof(P))
+               + vPrefix.size() * sizeof(uint64) + vIndex.size() * sizeof(uint32);
+    }
+
+protected:
+    using P::Serialize;
+    void Serialize(xengine::CStream& s, xengine::LoadType& opt)
+    {
+        P::Serialize(s, opt);
+        BuildSearchIndex();
+    }
+    void BuildSearchIndex()
+    {
+        vPrefix.assign(basetype::size() + 1, 0);
+        vIndex.assign(basetype::size() + 1, 0);
+        std::size_t m = 0;
+        BuildSearchIndex(1, m);
+    }
+    void BuildSearchIndex(const std::size_t i, std::size_t& m)
+    {
+        if (i < vIndex.size())
+        {
+            BuildSearchIndex(i << 1, m);
+            vPrefix[i] = CCTSKeyPrefix<K>::Get((*this)[m].first);
+            vIndex[i] = m++;
+            BuildSearchIndex((i << 1) + 1, m);
+        }
+    }
+    static int FindFirstZero(std::size_t i)
+    {
+        int nShift = 1;
+        while (i & 1)
+        {
+            i >>= 1;
+            nShift++;
+        }
+        return nShift;
+    }
+
+protected:
+    std::vector<uint64> vPrefix;
+    std::vector<uint32> vIndex;
+};
+
+template <typename C>
+class CCTSChunkCache
+{
+public:
+    enum
+    {
+        DEFAULT_MAX_SIZE = 0x1000000
+    };
+    CCTSChunkCache(std::size_t nMaxSizeIn = DEFAULT_MAX_SIZE)
+      : nMaxSize(nMaxSizeIn), nSize(0), nHit(0), nMiss(0)
+    {
+    }
+    void SetMaxSize(std::size_t nMaxSizeIn)
+    {
+        boost::unique_lock<boost::mutex> lock(mtxCache);
+        nMaxSize = nMaxSizeIn;
+        Evict();
+    }
+    bool IsEnabled()
+    {
+        boost::unique_lock<boost::mutex> lock(mtxCache);
+        return (nMaxSize != 0);
+    }
+    bool Retrieve(const int64 nTime, std::shared_ptr<const C>& spChunk)
+    {
+        boost::unique_lock<boost::mutex> lock(mtxCache);
+        typename std::map<int64, CEntry>::iterator it = mapChunk.find(nTime);
+        if (it == mapChunk.end())
+        {
+            nMiss++;
+            return false;
+        }
+        listLRU.splice(listLRU.begin(), listLRU, (*it).second.itLRU);
+        spChunk = (*it).second.spChunk;
+        nHit++;
+        return true;
+    }
+    void AddNew(const int64 nTime, const std::shared_ptr<const C>& spChunk)
+    {
+        boost::unique_lock<boost::mutex> lock(mtxCache);
+        std::size_t nChunkSize = spChunk->GetMemorySize();
+        if (nChunkSize > nMaxSize)
+        {
+            return;
+        }
+        RemoveEntry(nTime);
+        listLRU.push_front(nTime);
+        CEntry& entry = mapChunk[nTime];
+        entry.spChunk = spChunk;
+        entry.nSize = nChunkSize;
+        entry.itLRU = listLRU.begin();
+        nSize += nChunkSize;
+        Evict();
+    }
+    void Remove(const int64 nTime)
+    {
+        boost::unique_lock<boost::mutex> lock(mtxCache);
+        RemoveEntry(nTime);
+    }
+    void Clear()
+    {
+        boost::unique_lock<boost::mutex> lock(mtxCache);
+        mapChunk.clear();
+        listLRU.clear();
+        nSize = 0;
+    }
+    void GetStat(std::size_t& nCountRet, std::size_t& nSizeRet, uint64& nHitRet, uint64& nMissRet)
+    {
+        boost::unique_lock<boost::mutex> lock(mtxCache);
+        nCountRet = mapChunk.size();
+        nSizeRet = nSize;
+        nHitRet = nHit;
+        nMissRet = nMiss;
+    }
+
+protected:
+    class CEntry
+    {
+    public:
+        std::shared_ptr<const C> spChunk;
+        std::size_t nSize;
+        std::list<int64>::iterator itLRU;
+    };
+    void RemoveEntry(const int64 nTime)
+    {
+        typename std::map<int64, CEntry>::iterator it = mapChunk.find(nTime);
+        if (it != mapChunk.end())
+        {
+            nSize -= (*it).second.nSize;
+            listLRU.erase((*it).second.itLRU);
+            mapChunk.erase(it);
+        }
+    }
+    void Evict()
+    {
+        while (nSize > nMaxSize && !listLRU.empty())
+        {
+            RemoveEntry(listLRU.back());
+        }
+    }
+
+protected:
+    boost::mutex mtxCache;
+    std::size_t nMaxSize;
+    std::size_t nSize;
+    uint64 nHit;
+    uint64 nMiss;
+    std::list<int64> listLRU;
+    std::map<int64, CEntry> mapChunk;
+};
+
 template <typename K, typename V, typename C = CCTSChunk<K, V>>
 class CCTSDB
 {
-    typedef std::map<int64, std::map<K, V>> MapType;
+    class CUpdateBucket
+    {
+    public:
+        CUpdateBucket()
+          : fFull(false) {}
+
+    public:
+        std::map<K, V> mapValue;
+        // mapValue holds the whole bucket, otherwise only the updates on top of the disk chunks
+        bool fFull;
+    };
+    typedef std::map<int64, CUpdateBucket> MapType;
+
+public:
+    typedef CCTSChunkCache<C> CChunkCache;
+
+protected:
     class CDblMap
     {
     public:
@@ -194,75 +469,213 @@ public:
         dbIndex.Deinitialize();
         tsChunk.Deinitialize();
         dblMeta.Clear();
+        cacheChunk.Clear();
+        setCompact.clear();
     }
     void RemoveAll()
     {
         dbIndex.RemoveAll();
         dblMeta.Clear();
+        cacheChunk.Clear();
+        setCompact.clear();
+    }
+    void SetChunkCacheSize(std::size_t nSize)
+    {
+        cacheChunk.SetMaxSize(nSize);
+    }
+    void GetChunkCacheStat(std::size_t& nCountRet, std::size_t& nSizeRet, uint64& nHitRet, uint64& nMissRet)
+    {
+        cacheChunk.GetStat(nCountRet, nSizeRet, nHitRet, nMissRet);
+    }
+    void SetChunkFileSize(uint32 nSize)
+    {
+        tsChunk.SetMaxFileSize(nSize);
+    }
+    uint64 GetWriteSize() const
+    {
+        return tsChunk.GetAppendSize();
     }
     void Update(const int64 nTime, const K& key, const V& value)
     {
         xengine::CWriteLock wlock(rwMap);
 
-        GetUpdateMap(nTime)[key] = value;
+        GetUpdateBucket(nTime, false).mapValue[key] = value;
     }
     void Erase(const int64 nTime, const K& key)
     {
         xengine::CWriteLock wlock(rwMap);
 
-        GetUpdateMap(nTime).erase(key);
+        GetUpdateBucket(nTime, true).mapValue.erase(key);
     }
     bool Retrieve(const int64 nTime, const K& key, V& value)
     {
-        
         xengine::CReadLock rlock(rwMap);
         MapType& mapUpper = dblMeta.GetUpperMap();
         typename MapType::iterator it = mapUpper.find(nTime);
         if (it != mapUpper.end())
         {
-            std::map<K, V>& mapValue = (*it).second;
+            std::map<K, V>& mapValue = (*it).second.mapValue;
             typename std::map<K, V>::iterator mi = mapValue.find(key);
             if (mi != mapValue.end())
             {
                 value = (*mi).second;
                 return true;
             }
+            if ((*it).second.fFull)
+            {
+                return false;
+            }
+        }
+
+        std::shared_ptr<const C> spChunk;
+        if (!GetChunk(nTime, spChunk, true))
+        {
             return false;
         }
-        
-        C chunk;
-        if (LoadFromFile(nTime, chunk))
+        return spChunk->Find(key, value);
+    }
+    std::size_t RetrieveBatch(const std::vector<std::pair<int64, K>>& vKey, std::vector<V>& vValue)
+    {
+        // keys not found are left as V(), each bucket is looked up once
+        std::map<int64, std::vector<std::size_t>> mapBucketKey;
+        for (std::size_t i = 0; i < vKey.size(); i++)
         {
-            return chunk.Find(key, value);
+            mapBucketKey[vKey[i].first].push_back(i);
         }
+        vValue.assign(vKey.size(), V());
 
-        return false;
+        std::size_t nFound = 0;
+        xengine::CReadLock rlock(rwMap);
+        MapType& mapUpper = dblMeta.GetUpperMap();
+        for (std::map<int64, std::vector<std::size_t>>::iterator it = mapBucketKey.begin(); it != mapBucketKey.end(); ++it)
+        {
+            std::vector<std::size_t>& vIndex = (*it).second;
+            typename MapType::iterator mi = mapUpper.find((*it).first);
+            if (mi != mapUpper.end())
+            {
+                std::vector<std::size_t> vMissing;
+                for (const std::size_t n : vIndex)
+                {
+                    typename std::map<K, V>::iterator vi = (*mi).second.mapValue.find(vKey[n].second);
+                    if (vi != (*mi).second.mapValue.end())
+                    {
+                        vValue[n] = (*vi).second;
+                        nFound++;
+                    }
+                    else
+                    {
+                        vMissing.push_back(n);
+                    }
+                }
+                if ((*mi).second.fFull || vMissing.empty())
+                {
+                    continue;
+                }
+                vIndex.swap(vMissing);
+            }
+
+            std::shared_ptr<const C> spChunk;
+            if (!GetChunk((*it).first, spChunk, true))
+            {
+                continue;
+            }
+            for (const std::size_t n : vIndex)
+            {
+                if (spChunk->Find(vKey[n].second, vValue[n]))
+                {
+                    nFound++;
+                }
+            }
+        }
+        return nFound;
+    }
+    bool ListKeys(const int64 nTime, std::vector<K>& vKey)
+    {
+        xengine::CReadLock rlock(rwMap);
+        MapType& mapUpper = dblMeta.GetUpperMap();
+        typename MapType::iterator it = mapUpper.find(nTime);
+        if (it != mapUpper.end())
+        {
+            for (typename std::map<K, V>::iterator mi = (*it).second.mapValue.begin(); mi != (*it).second.mapValue.end(); ++mi)
+            {
+                vKey.push_back((*mi).first);
+            }
+            if ((*it).second.fFull)
+            {
+                return true;
+            }
+        }
+
+        std::shared_ptr<const C> spChunk;
+        if (!GetChunk(nTime, spChunk, false))
+        {
+            return (it != mapUpper.end());
+        }
+        for (typename C::const_iterator ci = spChunk->begin(); ci != spChunk->end(); ++ci)
+        {
+            vKey.push_back((*ci).first);
+        }
+        return true;
+    }
+
+    // times of the buckets on disk and in the update maps
+    bool ListTime(std::set<int64>& setTime)
+    {
+        xengine::CReadLock rlock(rwMap);
+        for (int i = 0; i < 2; i++)
+        {
+            MapType& mapUpdate = (i == 0) ? dblMeta.GetUpperMap() : dblMeta.GetLowerMap();
+            for (typename MapType::iterator it = mapUpdate.begin(); it != mapUpdate.end(); ++it)
+            {
+                setTime.insert((*it).first);
+            }
+        }
+        return dbIndex.WalkThroughBucket(boost::bind(&CCTSDB::TimeWalker, this, _1, _2, boost::ref(setTime)));
     }
 
     bool Flush(bool fAll = true)
     {
         xengine::CUpgradeLock ulock(rwMap);
 
-        std::vector<int64> vTime, vDel;
-        std::vector<C> vChunk;
         MapType& flushMap = dblMeta.GetUpperMap();
         if (!fAll && flushMap.size() < FLUSH_THRESH)
         {
             return false;
         }
 
+        // Updates of a bucket already on disk are appended as a delta chunk, a bucket with erased keys
+        // is written again as a whole. Compact folds long delta chains back into one chunk.
+        std::vector<int64> vTime;
+        std::vector<bool> vDelta;
+        std::vector<C> vChunk;
+        std::map<int64, CCTSBucketPos> mapBucket;
+        std::map<uint32, uint64> mapDeadSize;
         for (typename MapType::iterator it = flushMap.begin(); it != flushMap.end(); ++it)
         {
-            std::map<K, V>& mapValue = (*it).second;
-            if (mapValue.empty())
+            const int64 nTime = (*it).first;
+            CUpdateBucket& bucket = (*it).second;
+
+            CCTSBucketPos posBucket;
+            bool fExist = dbIndex.Retrieve(nTime, posBucket);
+            if (bucket.mapValue.empty())
             {
-                vDel.push_back((*it).first);
+                if (bucket.fFull && fExist)
+                {
+                    AddRecordSize(posBucket, mapDeadSize);
+                    mapBucket[nTime] = CCTSBucketPos();
+                }
+                continue;
             }
-            else
+
+            if (bucket.fFull && fExist)
             {
-                vTime.push_back((*it).first);
-                vChunk.push_back(C(mapValue.begin(), mapValue.end()));
+                AddRecordSize(posBucket, mapDeadSize);
+                posBucket = CCTSBucketPos();
             }
+            vTime.push_back(nTime);
+            vDelta.push_back(!bucket.fFull && fExist);
+            vChunk.push_back(C(bucket.mapValue.begin(), bucket.mapValue.end()));
+            mapBucket[nTime] = posBucket;
         }
 
         std::vector<CDiskPos> vPos;
@@ -274,55 +687,309 @@ public:
             }
         }
 
-        if (!vPos.empty() || !vDel.empty())
+        for (std::size_t i = 0; i < vTime.size(); i++)
         {
-            if (!dbIndex.Update(vTime, vPos, vDel))
+            CCTSBucketPos& posBucket = mapBucket[vTime[i]];
+            if (vDelta[i])
+            {
+                posBucket.vDelta.push_back(vPos[i]);
+                if (posBucket.vDelta.size() >= CTS_MAX_DELTA)
+                {
+                    setCompact.insert(vTime[i]);
+                }
+            }
+            else
+            {
+                posBucket.posBase = vPos[i];
+            }
+        }
+
+        if (!mapBucket.empty())
+        {
+            if (!dbIndex.Update(mapBucket, mapDeadSize))
             {
                 return false;
             }
         }
 
         ulock.Upgrade();
+        // rewritten chunks are no longer valid, readers are excluded by the write lock
+        for (typename std::map<int64, CCTSBucketPos>::iterator it = mapBucket.begin(); it != mapBucket.end(); ++it)
+        {
+            cacheChunk.Remove((*it).first);
+        }
         flushMap.clear();
-       
+
         return true;
     }
+    bool Compact()
+    {
+        xengine::CUpgradeLock ulock(rwMap);
 
+        std::map<int64, CCTSBucketPos> mapBucket;
+        std::map<uint32, uint64> mapDeadSize;
 
-protected:
-    std::map<K, V>& GetUpdateMap(const int64 nTime)
-    {
-        MapType& mapUpdate = dblMeta.GetUpperMap();
+        // long delta chains
+        while (!setCompact.empty() && mapBucket.size() < CTS_COMPACT_LIMIT)
+        {
+            const int64 nTime = *setCompact.begin();
+            setCompact.erase(setCompact.begin());
+            CCTSBucketPos posBucket;
+            if (dbIndex.Retrieve(nTime, posBucket) && !posBucket.vDelta.empty())
+            {
+                mapBucket[nTime] = posBucket;
+            }
+        }
+
+        // a file that is mostly dead is emptied and removed
+        uint32 nReclaimFile = 0;
+        uint64 nReclaimSize = 0;
+        if (!InitDeadSize())
+        {
+            return false;
+        }
+        std::map<uint32, uint64> mapFileDead;
+        if (!dbIndex.GetDeadSize(mapFileDead))
+        {
+            return false;
+        }
+        for (std::map<uint32, uint64>::iterator it = mapFileDead.begin(); it != mapFileDead.end(); ++it)
+        {
+            uint64 nFileSize = 0;
+            if (!tsChunk.GetFileSize((*it).first, nFileSize))
+            {
+                dbIndex.RemoveDeadSize((*it).first);
+            }
+            else if ((*it).second * 2 >= nFileSize && tsChunk.IsSealedFile((*it).first))
+            {
+                nReclaimFile = (*it).first;
+                nReclaimSize = nFileSize;
+                break;
+            }
+        }
+        if (nReclaimFile != 0)
+        {
+            if (!dbIndex.WalkThroughBucket(boost::bind(&CCTSDB::ReclaimWalker, this, _1, _2, nReclaimFile,
+                                                       boost::ref(mapBucket))))
+            {
+                return false;
+            }
+        }
+
+        if (mapBucket.empty() && nReclaimFile == 0)
+        {
+            return true;
+        }
+
+        std::vector<int64> vTime;
+        std::vector<C> vChunk;
+        for (typename std::map<int64, CCTSBucketPos>::iterator it = mapBucket.begin(); it != mapBucket.end(); ++it)
+        {
+            // the records read are all dead once the merged chunk is written
+            C chunk;
+            if (!LoadFromDisk((*it).second, chunk, &mapDeadSize))
+            {
+                xengine::StdError("CTSDB", "Compact: load bucket fail, time: %ld", (*it).first);
+                return false;
+            }
+            vTime.push_back((*it).first);
+            vChunk.push_back(chunk);
+        }
+
+        std::vector<CDiskPos> vPos;
+        if (!vChunk.empty())
+        {
+            if (!tsChunk.WriteBatch(vChunk, vPos))
+            {
+                return false;
+            }
+        }
+        for (std::size_t i = 0; i < vTime.size(); i++)
+        {
+            mapBucket[vTime[i]] = CCTSBucketPos(vPos[i]);
+        }
+        if (nReclaimFile != 0)
+        {
+            // counted as all dead until the file is gone, so an interrupted reclaim is retried
+            mapDeadSize.erase(nReclaimFile);
+        }
+
+        if (!dbIndex.Update(mapBucket, mapDeadSize, nReclaimFile, nReclaimSize))
+        {
+            return false;
+        }
 
-        typename MapType::iterator it = mapUpdate.find(nTime);
-        if (it != mapUpdate.end())
+        if (nReclaimFile != 0)
         {
-            return (*it).second;
+            // readers still on the old positions are excluded by the write lock
+            ulock.Upgrade();
+            if (!tsChunk.RemoveFile(nReclaimFile) || !dbIndex.RemoveDeadSize(nReclaimFile))
+            {
+                xengine::StdError("CTSDB", "Compact: remove file fail, file: %u", nReclaimFile);
+                return false;
+            }
         }
+        return true;
+    }
 
-        C chunk;
-        if (LoadFromFile(nTime, chunk))
+protected:
+    bool GetChunk(const int64 nTime, std::shared_ptr<const C>& spChunk, bool fAddCache)
+    {
+        if (cacheChunk.Retrieve(nTime, spChunk))
         {
-            mapUpdate[nTime].insert(chunk.begin(), chunk.end());
+            return true;
         }
-        return mapUpdate[nTime];
+        std::shared_ptr<C> spNewChunk(new C());
+        if (!LoadFromFile(nTime, *spNewChunk))
+        {
+            return false;
+        }
+        spChunk = spNewChunk;
+        if (fAddCache && cacheChunk.IsEnabled())
+        {
+            cacheChunk.AddNew(nTime, spChunk);
+        }
+        return true;
+    }
+    CUpdateBucket& GetUpdateBucket(const int64 nTime, bool fFull)
+    {
+        CUpdateBucket& bucket = dblMeta.GetUpperMap()[nTime];
+        if (fFull && !bucket.fFull)
+        {
+            C chunk;
+            if (LoadFromFile(nTime, chunk))
+            {
+                // updates since the last flush are newer than the disk chunks and are kept by insert
+                bucket.mapValue.insert(chunk.begin(), chunk.end());
+            }
+            bucket.fFull = true;
+        }
+        return bucket;
     }
-    
     bool LoadFromFile(const int64 nTime, C& chunk)
     {
-        CDiskPos pos;
-        if (dbIndex.Retrieve(nTime, pos))
+        CCTSBucketPos posBucket;
+        if (dbIndex.Retrieve(nTime, posBucket))
         {
-            return tsChunk.Read(chunk, pos);
+            return LoadFromDisk(posBucket, chunk);
         }
         return false;
     }
+    bool LoadFromDisk(const CCTSBucketPos& posBucket, C& chunk, std::map<uint32, uint64>* pmapSize = nullptr)
+    {
+        uint32 nSize = 0;
+        if (!posBucket.posBase.IsNull())
+        {
+            if (!tsChunk.Read(chunk, posBucket.posBase, nSize))
+            {
+                return false;
+            }
+            if (pmapSize != nullptr)
+            {
+                (*pmapSize)[posBucket.posBase.nFile] += nSize;
+            }
+        }
+        if (posBucket.vDelta.empty())
+        {
+            return true;
+        }
+
+        std::map<K, V> mapValue(chunk.begin(), chunk.end());
+        for (const CDiskPos& pos : posBucket.vDelta)
+        {
+            C delta;
+            if (!tsChunk.Read(delta, pos, nSize))
+            {
+                return false;
+            }
+            if (pmapSize != nullptr)
+            {
+                (*pmapSize)[pos.nFile] += nSize;
+            }
+            for (typename C::iterator it = delta.begin(); it != delta.end(); ++it)
+            {
+                mapValue[(*it).first] = (*it).second;
+            }
+        }
+        chunk = C(mapValue.begin(), mapValue.end());
+        return true;
+    }
+    void AddRecordSize(const CCTSBucketPos& posBucket, std::map<uint32, uint64>& mapDeadSize)
+    {
+        std::vector<CDiskPos> vPos(posBucket.vDelta);
+        if (!posBucket.posBase.IsNull())
+        {
+            vPos.push_back(posBucket.posBase);
+        }
+        for (const CDiskPos& pos : vPos)
+        {
+            uint32 nSize = 0;
+            if (tsChunk.GetRecordSize(pos, nSize))
+            {
+                mapDeadSize[pos.nFile] += nSize;
+            }
+        }
+    }
+    bool InitDeadSize()
+    {
+        // Chunk files written before delta chunks hold overwritten copies that were never counted.
+        // The live records are summed once and the rest of each file is counted as dead.
+        if (dbIndex.IsDeadSizeReady())
+        {
+            return true;
+        }
+        std::map<uint32, uint64> mapLiveSize;
+        if (!dbIndex.WalkThroughBucket(boost::bind(&CCTSDB::LiveSizeWalker, this, _1, _2, boost::ref(mapLiveSize))))
+        {
+            return false;
+        }
+        std::map<uint32, uint64> mapDeadSize;
+        for (std::map<uint32, uint64>::iterator it = mapLiveSize.begin(); it != mapLiveSize.end(); ++it)
+        {
+            uint64 nFileSize = 0;
+            if (tsChunk.GetFileSize((*it).first, nFileSize) && nFileSize > (*it).second)
+            {
+                mapDeadSize[(*it).first] = nFileSize - (*it).second;
+            }
+        }
+        return dbIndex.SetDeadSize(mapDeadSize);
+    }
+    bool TimeWalker(const int64 nTime, const CCTSBucketPos& posBucket, std::set<int64>& setTime)
+    {
+        setTime.insert(nTime);
+        return true;
+    }
+    bool LiveSizeWalker(const int64 nTime, const CCTSBucketPos& posBucket, std::map<uint32, uint64>& mapLiveSize)
+    {
+        AddRecordSize(posBucket, mapLiveSize);
+        return true;
+    }
+    bool ReclaimWalker(const int64 nTime, const CCTSBucketPos& posBucket, uint32 nFile,
+                       std::map<int64, CCTSBucketPos>& mapBucket)
+    {
+        if (posBucket.posBase.nFile == nFile)
+        {
+            mapBucket[nTime] = posBucket;
+            return true;
+        }
+        for (const CDiskPos& pos : posBucket.vDelta)
+        {
+            if (pos.nFile == nFile)
+            {
+                mapBucket[nTime] = posBucket;
+                break;
+            }
+        }
+        return true;
+    }
 
 protected:
     xengine::CRWAccess rwMap;
     CCTSIndex dbIndex;
     CTimeSeriesChunk tsChunk;
     CDblMap dblMeta;
+    CChunkCache cacheChunk;
+    std::set<int64> setCompact;
 };
 
 } // namespace storage
@@ -22,6 +22,7 @@ namespace storage
 bool CDelegateDB::Initialize(const boost::filesystem::path& pathData)
 {
     CLevelDBArguments args;
+    args.name = "delegate";
     args.path = (pathData / "delegate").string();
     args.syncwrite = false;
     CLevelDBEngine* engine = new CLevelDBEngine(args);
@@ -116,11 +117,26 @@ bool CDelegateDB::RetrieveEnrollTx(int height, const vector<uint256>& vBlockRang
     return true;
 }
 
+bool CDelegateDB::WalkThroughDelegate(CDelegateDBWalker& walker)
+{
+    CBufStream ssBegin, ssEnd;
+    return Scan(ssBegin, ssEnd, boost::bind(&CDelegateDB::LoadDelegateWalker, this, _1, _2, boost::ref(walker)));
+}
+
 void CDelegateDB::Clear()
 {
     cacheDelegate.Clear();
     RemoveAll();
 }
 
+bool CDelegateDB::LoadDelegateWalker(CMemoryStream& ssKey, CMemoryStream& ssValue, CDelegateDBWalker& walker)
+{
+    uint256 hashBlock;
+    CDelegateContext ctxtDelegate;
+    ssKey >> hashBlock;
+    ssValue >> ctxtDelegate;
+    return walker.Walk(hashBlock, ctxtDelegate);
+}
+
 } // namespace storage
 } // namespace bigbang
@@ -34,6 +34,12 @@ protected:
     }
 };
 
+class CDelegateDBWalker
+{
+public:
+    virtual bool Walk(const uint256& hashBlock, const CDelegateContext& ctxtDelegate) = 0;
+};
+
 class CDelegateDB : public xengine::CKVDB
 {
 public:
@@ -47,10 +53,12 @@ public:
     bool RetrieveDelegatedEnrollTx(const uint256& hashBlock, std::map<int, std::map<CDestination, CDiskPos>>& mapEnrollTxPos);
     bool RetrieveEnrollTx(int height, const std::vector<uint256>& vBlockRange,
                           std::map<CDestination, CDiskPos>& mapEnrollTxPos);
+    bool WalkThroughDelegate(CDelegateDBWalker& walker);
     void Clear();
 
 protected:
     bool Retrieve(const uint256& hashBlock, CDelegateContext& ctxtDelegate);
+    bool LoadDelegateWalker(xengine::CMemoryStream& ssKey, xengine::CMemoryStream& ssValue, CDelegateDBWalker& walker);
 
 protected:
     enum
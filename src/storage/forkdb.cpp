@@ -22,6 +22,7 @@ namespace storage
 bool CForkDB::Initialize(const boost::filesystem::path& pathData)
 {
     CLevelDBArguments args;
+    args.name = "fork";
     args.path = (pathData / "fork").string();
     args.syncwrite = false;
     args.files = 16;
@@ -62,7 +63,7 @@ bool CForkDB::ListForkContext(vector<CForkContext>& vForkCtxt)
 {
     multimap<int, CForkContext> mapCtxt;
 
-    if (!WalkThrough(boost::bind(&CForkDB::LoadCtxtWalker, this, _1, _2, boost::ref(mapCtxt))))
+    if (!ScanPrefix(string("ctxt"), boost::bind(&CForkDB::LoadCtxtWalker, this, _1, _2, boost::ref(mapCtxt))))
     {
         return false;
     }
@@ -118,17 +119,11 @@ void CForkDB::Clear()
     RemoveAll();
 }
 
-bool CForkDB::LoadCtxtWalker(CBufStream& ssKey, CBufStream& ssValue, multimap<int, CForkContext>& mapCtxt)
+bool CForkDB::LoadCtxtWalker(CMemoryStream& ssKey, CMemoryStream& ssValue, multimap<int, CForkContext>& mapCtxt)
 {
-    string strPrefix;
-    ssKey >> strPrefix;
-
-    if (strPrefix == "ctxt")
-    {
-        CForkContext ctxt;
-        ssValue >> ctxt;
-        mapCtxt.insert(make_pair(ctxt.nJointHeight, ctxt));
-    }
+    CForkContext ctxt;
+    ssValue >> ctxt;
+    mapCtxt.insert(make_pair(ctxt.nJointHeight, ctxt));
     return true;
 }
 
@@ -33,7 +33,7 @@ public:
     void Clear();
 
 protected:
-    bool LoadCtxtWalker(xengine::CBufStream& ssKey, xengine::CBufStream& ssValue,
+    bool LoadCtxtWalker(xengine::CMemoryStream& ssKey, xengine::CMemoryStream& ssValue,
                         std::multimap<int, CForkContext>& mapCtxt);
     bool LoadForkWalker(xengine::CBufStream& ssKey, xengine::CBufStream& ssValue,
                         std::multimap<int, uint256>& mapJoint, std::map<uint256, uint256>& mapFork);
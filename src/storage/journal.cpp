@@ -0,0 +1,282 @@
+// Copyright (c) 2019-2020 The Bigbang developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "journal.h"
+
+#include "crc24q.h"
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#else
+#include <io.h>
+#endif
+
+using namespace std;
+using namespace boost::filesystem;
+using namespace xengine;
+
+namespace bigbang
+{
+namespace storage
+{
+
+//////////////////////////////
+// CBlockJournal
+
+CBlockJournal::CBlockJournal()
+  : fp(nullptr), nSize(0), nAppended(0), nSynced(0)
+{
+}
+
+CBlockJournal::~CBlockJournal()
+{
+    Close();
+}
+
+bool CBlockJournal::Open(const path& pathFileIn)
+{
+    boost::unique_lock<boost::mutex> lock(mtxSync);
+
+    CloseFile();
+    pathFile = pathFileIn;
+
+    vector<CRecord> vRecord;
+    uint64 nValidSize = 0;
+    if (exists(pathFile) && Read(pathFile, vRecord, nValidSize))
+    {
+        if (nValidSize < file_size(pathFile))
+        {
+            StdWarn("CBlockJournal", "Open: cut off damaged tail, file: %s, size: %lu, valid size: %lu",
+                    pathFile.string().c_str(), file_size(pathFile), nValidSize);
+            resize_file(pathFile, nValidSize);
+        }
+        fp = fopen(pathFile.string().c_str(), "r+b");
+        if (fp == nullptr || fseek(fp, 0, SEEK_END) != 0)
+        {
+            StdError("CBlockJournal", "Open: fopen fail, file: %s", pathFile.string().c_str());
+            CloseFile();
+            return false;
+        }
+        nSize = nValidSize;
+        return true;
+    }
+
+    return ResetFile();
+}
+
+void CBlockJournal::Close()
+{
+    boost::unique_lock<boost::mutex> lock(mtxSync);
+    CloseFile();
+}
+
+bool CBlockJournal::Append(uint8 nType, CBufStream& ss, bool fSync)
+{
+    if (fp == nullptr)
+    {
+        return false;
+    }
+
+    vector<char> vBuf(ss.GetSize() + 1);
+    vBuf[0] = (char)nType;
+    if (ss.GetSize() > 0)
+    {
+        memcpy(&vBuf[1], ss.GetData(), ss.GetSize());
+    }
+    uint32 nRecordSize = vBuf.size();
+    uint32 nCheck = crypto::crc24q((const unsigned char*)&vBuf[0], vBuf.size());
+    if (fwrite(&nRecordSize, sizeof(nRecordSize), 1, fp) != 1 || fwrite(&nCheck, sizeof(nCheck), 1, fp) != 1
+        || fwrite(&vBuf[0], vBuf.size(), 1, fp) != 1 || fflush(fp) != 0)
+    {
+        StdError("CBlockJournal", "Append: fwrite fail, file: %s", pathFile.string().c_str());
+        return false;
+    }
+    nSize += sizeof(nRecordSize) + sizeof(nCheck) + vBuf.size();
+    nAppended += sizeof(nRecordSize) + sizeof(nCheck) + vBuf.size();
+
+    return (!fSync || SyncTo(nAppended));
+}
+
+bool CBlockJournal::SyncTo(uint64 nAppendedTo)
+{
+    boost::unique_lock<boost::mutex> lock(mtxSync);
+    if (nSynced >= nAppendedTo)
+    {
+        return true;
+    }
+    if (fp == nullptr)
+    {
+        return false;
+    }
+
+    // everything appended up to now is written out, it is covered by this sync
+    uint64 nAppendedNow = nAppended;
+    if (!Sync())
+    {
+        return false;
+    }
+    nSynced = nAppendedNow;
+    return true;
+}
+
+bool CBlockJournal::Load(vector<CRecord>& vRecord)
+{
+    uint64 nValidSize = 0;
+    return (fp != nullptr && Read(pathFile, vRecord, nValidSize));
+}
+
+bool CBlockJournal::Reset()
+{
+    boost::unique_lock<boost::mutex> lock(mtxSync);
+    return ResetFile();
+}
+
+bool CBlockJournal::Rotate(const path& pathRotated)
+{
+    boost::unique_lock<boost::mutex> lock(mtxSync);
+    if (fp == nullptr || !Sync())
+    {
+        return false;
+    }
+    CloseFile();
+
+    try
+    {
+        rename(pathFile, pathRotated);
+    }
+    catch (const filesystem_error& e)
+    {
+        StdError("CBlockJournal", "Rotate: rename fail, %s", e.what());
+        return false;
+    }
+    if (!SyncDir(pathFile.parent_path()))
+    {
+        return false;
+    }
+    return ResetFile();
+}
+
+bool CBlockJournal::Read(const path& pathFile, vector<CRecord>& vRecord, uint64& nValidSize)
+{
+    vRecord.clear();
+    nValidSize = 0;
+
+    FILE* fpRead = fopen(pathFile.string().c_str(), "rb");
+    if (fpRead == nullptr)
+    {
+        return false;
+    }
+
+    uint32 nMagic = 0, nVersion = 0;
+    if (fread(&nMagic, sizeof(nMagic), 1, fpRead) != 1 || fread(&nVersion, sizeof(nVersion), 1, fpRead) != 1
+        || nMagic != JOURNAL_MAGIC || nVersion != JOURNAL_VERSION)
+    {
+        StdError("CBlockJournal", "Read: invalid header, file: %s", pathFile.string().c_str());
+        fclose(fpRead);
+        return false;
+    }
+    nValidSize = JOURNAL_HEADER_SIZE;
+
+    uint32 nRecordSize = 0, nCheck = 0;
+    while (fread(&nRecordSize, sizeof(nRecordSize), 1, fpRead) == 1 && fread(&nCheck, sizeof(nCheck), 1, fpRead) == 1)
+    {
+        if (nRecordSize == 0 || nRecordSize > JOURNAL_MAX_RECORD_SIZE)
+        {
+            break;
+        }
+        vector<char> vBuf(nRecordSize);
+        if (fread(&vBuf[0], nRecordSize, 1, fpRead) != 1
+            || nCheck != crypto::crc24q((const unsigned char*)&vBuf[0], nRecordSize))
+        {
+            break;
+        }
+
+        CRecord record;
+        record.nType = (uint8)vBuf[0];
+        record.vData.assign(vBuf.begin() + 1, vBuf.end());
+        vRecord.push_back(record);
+        nValidSize += sizeof(nRecordSize) + sizeof(nCheck) + nRecordSize;
+    }
+    fclose(fpRead);
+    return true;
+}
+
+bool CBlockJournal::WriteHeader()
+{
+    uint32 nMagic = JOURNAL_MAGIC, nVersion = JOURNAL_VERSION;
+    return (fwrite(&nMagic, sizeof(nMagic), 1, fp) == 1 && fwrite(&nVersion, sizeof(nVersion), 1, fp) == 1);
+}
+
+void CBlockJournal::CloseFile()
+{
+    if (fp != nullptr)
+    {
+        fclose(fp);
+        fp = nullptr;
+    }
+    nSize = 0;
+}
+
+bool CBlockJournal::ResetFile()
+{
+    CloseFile();
+
+    fp = fopen(pathFile.string().c_str(), "w+b");
+    if (fp == nullptr)
+    {
+        StdError("CBlockJournal", "Reset: fopen fail, file: %s", pathFile.string().c_str());
+        return false;
+    }
+    if (!WriteHeader() || !Sync())
+    {
+        CloseFile();
+        return false;
+    }
+    nSize = JOURNAL_HEADER_SIZE;
+    nSynced = nAppended;
+    return true;
+}
+
+bool CBlockJournal::SyncDir(const path& pathDir)
+{
+#ifndef WIN32
+    int fd = open(pathDir.string().c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        StdError("CBlockJournal", "SyncDir: open fail, dir: %s", pathDir.string().c_str());
+        return false;
+    }
+    bool fRet = (fsync(fd) == 0);
+    close(fd);
+    if (!fRet)
+    {
+        StdError("CBlockJournal", "SyncDir: fsync fail, dir: %s", pathDir.string().c_str());
+    }
+    return fRet;
+#else
+    return true;
+#endif
+}
+
+bool CBlockJournal::Sync()
+{
+    if (fflush(fp) != 0)
+    {
+        return false;
+    }
+#ifndef WIN32
+    if (fsync(fileno(fp)) != 0)
+#else
+    if (_commit(_fileno(fp)) != 0)
+#endif
+    {
+        StdError("CBlockJournal", "Sync: fsync fail, file: %s", pathFile.string().c_str());
+        return false;
+    }
+    return true;
+}
+
+} // namespace storage
+} // namespace bigbang
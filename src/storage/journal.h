@@ -0,0 +1,89 @@
+// Copyright (c) 2019-2020 The Bigbang developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef STORAGE_JOURNAL_H
+#define STORAGE_JOURNAL_H
+
+#include <atomic>
+#include <boost/filesystem.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include "xengine.h"
+
+namespace bigbang
+{
+namespace storage
+{
+
+//////////////////////////////
+// CBlockJournal
+
+// Write-ahead record file : magic, version and records of (size, crc24q, type, payload).
+// A record that was torn by a crash fails the check and ends the journal.
+class CBlockJournal
+{
+public:
+    class CRecord
+    {
+    public:
+        uint8 nType;
+        std::vector<char> vData;
+    };
+
+    CBlockJournal();
+    ~CBlockJournal();
+    bool Open(const boost::filesystem::path& pathFileIn);
+    void Close();
+    bool IsOpen() const
+    {
+        return (fp != nullptr);
+    }
+    uint64 GetSize() const
+    {
+        return nSize;
+    }
+    // end of the appended records, counted over the life of the object
+    uint64 GetAppended() const
+    {
+        return nAppended;
+    }
+    bool Append(uint8 nType, xengine::CBufStream& ss, bool fSync);
+    // group commit : records appended by other threads while one sync runs share the next one,
+    // a sync that already covered nAppendedTo is not repeated
+    bool SyncTo(uint64 nAppendedTo);
+    // valid records in order, the damaged tail is cut off
+    bool Load(std::vector<CRecord>& vRecord);
+    bool Reset();
+    // syncs and moves the records to pathRotated, the journal goes on empty
+    bool Rotate(const boost::filesystem::path& pathRotated);
+
+    static bool Read(const boost::filesystem::path& pathFile, std::vector<CRecord>& vRecord, uint64& nValidSize);
+
+protected:
+    void CloseFile();
+    bool ResetFile();
+    bool WriteHeader();
+    bool Sync();
+    static bool SyncDir(const boost::filesystem::path& pathDir);
+
+protected:
+    enum
+    {
+        JOURNAL_MAGIC = 0x4a4e4242,
+        JOURNAL_VERSION = 1,
+        JOURNAL_HEADER_SIZE = 8,
+        JOURNAL_MAX_RECORD_SIZE = 0x10000000
+    };
+    boost::filesystem::path pathFile;
+    FILE* fp;
+    uint64 nSize;
+    std::atomic<uint64> nAppended;
+    uint64 nSynced;
+    boost::mutex mtxSync;
+};
+
+} // namespace storage
+} // namespace bigbang
+
+#endif //STORAGE_JOURNAL_H
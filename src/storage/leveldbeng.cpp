@@ -9,6 +9,7 @@
 #include "leveldb/cache.h"
 #include "leveldb/filter_policy.h"
 
+using namespace std;
 using namespace xengine;
 
 namespace bigbang
@@ -16,10 +17,22 @@ namespace bigbang
 namespace storage
 {
 
+#define LEVELDB_MAX_LEVEL (7)
+
+namespace
+{
+boost::mutex mtxEngine;
+int nEngineFilterBits = 10;
+map<string, pair<size_t, size_t>> mapEngineSizing;
+set<CLevelDBEngine*> setEngineOpened;
+} // namespace
+
 CLevelDBArguments::CLevelDBArguments()
 {
     cache = 32 << 20;
+    writebuffer = 0;
     syncwrite = false;
+    syncbatch = true;
     files = 256;
 }
 
@@ -28,11 +41,25 @@ CLevelDBArguments::~CLevelDBArguments()
 }
 
 CLevelDBEngine::CLevelDBEngine(CLevelDBArguments& arguments)
-  : path(arguments.path)
+  : name(arguments.name), path(arguments.path)
 {
-    options.block_cache = leveldb::NewLRUCache(arguments.cache / 2);
-    options.write_buffer_size = arguments.cache / 4;
-    options.filter_policy = leveldb::NewBloomFilterPolicy(10);
+    size_t nCache = arguments.cache / 2;
+    size_t nWriteBuffer = (arguments.writebuffer != 0 ? arguments.writebuffer : arguments.cache / 4);
+    {
+        boost::unique_lock<boost::mutex> lock(mtxEngine);
+        map<string, pair<size_t, size_t>>::iterator it = mapEngineSizing.find(name);
+        if (it != mapEngineSizing.end())
+        {
+            nCache = ((*it).second.first != 0 ? (*it).second.first : nCache);
+            nWriteBuffer = ((*it).second.second != 0 ? (*it).second.second : nWriteBuffer);
+        }
+        filterbits = nEngineFilterBits;
+    }
+
+    cachesize = nCache;
+    options.block_cache = leveldb::NewLRUCache(nCache);
+    options.write_buffer_size = nWriteBuffer;
+    options.filter_policy = (filterbits > 0 ? leveldb::NewBloomFilterPolicy(filterbits) : nullptr);
     options.create_if_missing = true;
     options.compression = leveldb::kNoCompression;
     options.max_open_files = arguments.files;
@@ -44,11 +71,16 @@ CLevelDBEngine::CLevelDBEngine(CLevelDBArguments& arguments)
     readoptions.verify_checksums = true;
 
     writeoptions.sync = arguments.syncwrite;
-    batchoptions.sync = true;
+    batchoptions.sync = arguments.syncbatch;
 }
 
 CLevelDBEngine::~CLevelDBEngine()
 {
+    {
+        boost::unique_lock<boost::mutex> lock(mtxEngine);
+        setEngineOpened.erase(this);
+    }
+
     delete pbatch;
     pbatch = nullptr;
     delete piter;
@@ -61,6 +93,31 @@ CLevelDBEngine::~CLevelDBEngine()
     options.block_cache = nullptr;
 }
 
+void CLevelDBEngine::SetFilterBits(int nBits)
+{
+    boost::unique_lock<boost::mutex> lock(mtxEngine);
+    nEngineFilterBits = nBits;
+}
+
+void CLevelDBEngine::SetSizing(const string& strName, size_t nCache, size_t nWriteBuffer)
+{
+    boost::unique_lock<boost::mutex> lock(mtxEngine);
+    mapEngineSizing[strName] = make_pair(nCache, nWriteBuffer);
+}
+
+void CLevelDBEngine::GetStat(const string& strName, vector<CLevelDBStat>& vStat)
+{
+    boost::unique_lock<boost::mutex> lock(mtxEngine);
+    for (CLevelDBEngine* engine : setEngineOpened)
+    {
+        CLevelDBStat stat;
+        if ((strName.empty() || engine->name == strName) && engine->GetStat(stat))
+        {
+            vStat.push_back(stat);
+        }
+    }
+}
+
 bool CLevelDBEngine::Open()
 {
     leveldb::Status status = leveldb::DB::Open(options, path, &pdb);
@@ -69,11 +126,18 @@ bool CLevelDBEngine::Open()
         return false;
     }
 
+    boost::unique_lock<boost::mutex> lock(mtxEngine);
+    setEngineOpened.insert(this);
     return true;
 }
 
 void CLevelDBEngine::Close()
 {
+    {
+        boost::unique_lock<boost::mutex> lock(mtxEngine);
+        setEngineOpened.erase(this);
+    }
+
     delete pbatch;
     pbatch = nullptr;
     delete piter;
@@ -112,10 +176,32 @@ void CLevelDBEngine::TxnAbort()
 }
 
 bool CLevelDBEngine::Get(CBufStream& ssKey, CBufStream& ssValue)
+{
+    return Get(ssKey, ssValue, nullptr);
+}
+
+CKVDBSnapshot* CLevelDBEngine::NewSnapshot()
+{
+    return new CLevelDBSnapshot(pdb->GetSnapshot());
+}
+
+void CLevelDBEngine::ReleaseSnapshot(CKVDBSnapshot* snapshot)
+{
+    CLevelDBSnapshot* p = static_cast<CLevelDBSnapshot*>(snapshot);
+    pdb->ReleaseSnapshot(p->snapshot);
+    delete p;
+}
+
+bool CLevelDBEngine::Get(CBufStream& ssKey, CBufStream& ssValue, const CKVDBSnapshot* snapshot)
 {
     leveldb::Slice slKey(ssKey.GetData(), ssKey.GetSize());
+    leveldb::ReadOptions options = readoptions;
+    if (snapshot != nullptr)
+    {
+        options.snapshot = static_cast<const CLevelDBSnapshot*>(snapshot)->snapshot;
+    }
     std::string strValue;
-    leveldb::Status status = pdb->Get(readoptions, slKey, &strValue);
+    leveldb::Status status = pdb->Get(options, slKey, &strValue);
     if (status.ok())
     {
         ssValue.Write(strValue.data(), strValue.size());
@@ -223,5 +309,72 @@ bool CLevelDBEngine::MoveNext(CBufStream& ssKey, CBufStream& ssValue)
     return true;
 }
 
+bool CLevelDBEngine::Scan(CBufStream& ssBegin, CBufStream& ssEnd, ScanFunc fnScan)
+{
+    leveldb::Slice slBegin(ssBegin.GetData(), ssBegin.GetSize());
+    leveldb::Slice slEnd(ssEnd.GetData(), ssEnd.GetSize());
+
+    // a private iterator leaves the walk cursor alone, the views point into its blocks
+    std::unique_ptr<leveldb::Iterator> it(pdb->NewIterator(readoptions));
+    CMemoryStream ssKey(nullptr, 0), ssValue(nullptr, 0);
+    for (it->Seek(slBegin); it->Valid(); it->Next())
+    {
+        leveldb::Slice slKey = it->key();
+        if (!slEnd.empty() && slKey.compare(slEnd) >= 0)
+        {
+            break;
+        }
+        leveldb::Slice slValue = it->value();
+        ssKey.Attach(slKey.data(), slKey.size());
+        ssValue.Attach(slValue.data(), slValue.size());
+        if (!fnScan(ssKey, ssValue))
+        {
+            break;
+        }
+    }
+    return it->status().ok();
+}
+
+bool CLevelDBEngine::Sync()
+{
+    // an empty batch written with sync flushes the log holding every write before it
+    leveldb::WriteOptions syncoptions;
+    syncoptions.sync = true;
+    leveldb::WriteBatch batch;
+    leveldb::Status status = pdb->Write(syncoptions, &batch);
+    return status.ok();
+}
+
+bool CLevelDBEngine::GetStat(CLevelDBStat& stat)
+{
+    if (pdb == nullptr)
+    {
+        return false;
+    }
+
+    stat.strName = name;
+    stat.strPath = path;
+    stat.nCacheUsage = options.block_cache->TotalCharge();
+    stat.nCacheSize = cachesize;
+    stat.nWriteBufferSize = options.write_buffer_size;
+    stat.nFilterBits = filterbits;
+
+    string strValue;
+    if (pdb->GetProperty("leveldb.approximate-memory-usage", &strValue))
+    {
+        stat.nMemoryUsage = strtoull(strValue.c_str(), nullptr, 10);
+    }
+    for (int i = 0; i < LEVELDB_MAX_LEVEL; i++)
+    {
+        if (!pdb->GetProperty("leveldb.num-files-at-level" + to_string(i), &strValue))
+        {
+            break;
+        }
+        stat.vLevelFile.push_back(atoi(strValue.c_str()));
+    }
+    pdb->GetProperty("leveldb.stats", &stat.strCompaction);
+    return true;
+}
+
 } // namespace storage
 } // namespace bigbang
@@ -5,6 +5,7 @@
 #ifndef STORAGE_LEVELDBENG_H
 #define STORAGE_LEVELDBENG_H
 #include <boost/filesystem/path.hpp>
+#include <boost/thread/mutex.hpp>
 #include <leveldb/db.h>
 #include <leveldb/write_batch.h>
 
@@ -22,18 +23,59 @@ public:
     ~CLevelDBArguments();
 
 public:
+    // database name for the sizing overrides and stats
+    std::string name;
     std::string path;
     size_t cache;
+    // 0 : a quarter of cache
+    size_t writebuffer;
     bool syncwrite;
+    // transaction commits are synced, a store covered by the block journal is synced by its checkpoints
+    bool syncbatch;
     int files;
 };
 
+class CLevelDBStat
+{
+public:
+    CLevelDBStat()
+      : nMemoryUsage(0), nCacheUsage(0), nCacheSize(0), nWriteBufferSize(0), nFilterBits(0) {}
+
+public:
+    std::string strName;
+    std::string strPath;
+    uint64 nMemoryUsage;
+    uint64 nCacheUsage;
+    uint64 nCacheSize;
+    uint64 nWriteBufferSize;
+    int nFilterBits;
+    std::vector<int> vLevelFile;
+    std::string strCompaction;
+};
+
+class CLevelDBSnapshot : public xengine::CKVDBSnapshot
+{
+public:
+    CLevelDBSnapshot(const leveldb::Snapshot* snapshotIn)
+      : snapshot(snapshotIn) {}
+
+public:
+    const leveldb::Snapshot* snapshot;
+};
+
 class CLevelDBEngine : public xengine::CKVDBEngine
 {
 public:
     CLevelDBEngine(CLevelDBArguments& arguments);
     ~CLevelDBEngine();
 
+    // bloom filter bits per key of the databases opened later, 0 disables the filter
+    static void SetFilterBits(int nBits);
+    // cache and write buffer of the databases named strName opened later, 0 keeps the arguments
+    static void SetSizing(const std::string& strName, size_t nCache, size_t nWriteBuffer);
+    // stats of the open databases, all of them if strName is empty
+    static void GetStat(const std::string& strName, std::vector<CLevelDBStat>& vStat);
+
     bool Open() override;
     void Close() override;
     bool TxnBegin() override;
@@ -46,9 +88,20 @@ public:
     bool MoveFirst() override;
     bool MoveTo(xengine::CBufStream& ssKey) override;
     bool MoveNext(xengine::CBufStream& ssKey, xengine::CBufStream& ssValue) override;
+    bool Scan(xengine::CBufStream& ssBegin, xengine::CBufStream& ssEnd, ScanFunc fnScan) override;
+    bool Sync() override;
+    xengine::CKVDBSnapshot* NewSnapshot() override;
+    void ReleaseSnapshot(xengine::CKVDBSnapshot* snapshot) override;
+    bool Get(xengine::CBufStream& ssKey, xengine::CBufStream& ssValue, const xengine::CKVDBSnapshot* snapshot) override;
+
+protected:
+    bool GetStat(CLevelDBStat& stat);
 
 protected:
+    std::string name;
     std::string path;
+    int filterbits;
+    size_t cachesize;
     leveldb::DB* pdb;
     leveldb::Iterator* piter;
     leveldb::WriteBatch* pbatch;
@@ -0,0 +1,361 @@
+// Copyright (c) 2019-2020 The Bigbang developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "mappedeng.h"
+
+#include <boost/bind.hpp>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#else
+#include <io.h>
+#endif
+
+using namespace std;
+using namespace boost::filesystem;
+using namespace xengine;
+
+namespace bigbang
+{
+namespace storage
+{
+
+namespace
+{
+int CompareTableKey(const char* pKey, size_t nKeySize, const char* pTarget, size_t nTargetSize)
+{
+    int ret = memcmp(pKey, pTarget, min(nKeySize, nTargetSize));
+    if (ret != 0)
+    {
+        return ret;
+    }
+    return (nKeySize < nTargetSize ? -1 : (nKeySize > nTargetSize ? 1 : 0));
+}
+
+bool SyncDir(const path& pathDir)
+{
+#ifndef WIN32
+    int fd = open(pathDir.string().c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        StdError("CMappedTableEngine", "SyncDir: open fail, dir: %s", pathDir.string().c_str());
+        return false;
+    }
+    bool fRet = (fsync(fd) == 0);
+    close(fd);
+    if (!fRet)
+    {
+        StdError("CMappedTableEngine", "SyncDir: fsync fail, dir: %s", pathDir.string().c_str());
+    }
+    return fRet;
+#else
+    return true;
+#endif
+}
+
+bool BuildWalker(CMemoryStream& ssKey, CMemoryStream& ssValue, FILE* fp, uint64& nOffset, vector<uint64>& vIndex, bool& fError)
+{
+    uint32 nKeySize = ssKey.GetSize(), nValueSize = ssValue.GetSize();
+    if (fwrite(&nKeySize, sizeof(nKeySize), 1, fp) != 1 || fwrite(&nValueSize, sizeof(nValueSize), 1, fp) != 1
+        || (nKeySize != 0 && fwrite(ssKey.GetData(), nKeySize, 1, fp) != 1)
+        || (nValueSize != 0 && fwrite(ssValue.GetData(), nValueSize, 1, fp) != 1))
+    {
+        fError = true;
+        return false;
+    }
+    vIndex.push_back(nOffset);
+    nOffset += sizeof(nKeySize) + sizeof(nValueSize) + nKeySize + nValueSize;
+    return true;
+}
+} // namespace
+
+//////////////////////////////
+// CMappedTableEngine
+
+CMappedTableEngine::CMappedTableEngine(const path& pathFileIn)
+  : pathFile(pathFileIn), pData(nullptr), pIndex(nullptr), nCount(0), nCursor(0)
+{
+}
+
+CMappedTableEngine::~CMappedTableEngine()
+{
+    Close();
+}
+
+bool CMappedTableEngine::Build(CKVDBEngine& source, const path& pathFile)
+{
+    // write aside and rename, so an open table is never seen half written
+    path pathTemp = pathFile.string() + ".tmp";
+    FILE* fp = fopen(pathTemp.string().c_str(), "wb");
+    if (fp == nullptr)
+    {
+        StdError("CMappedTableEngine", "Build: fopen fail, file: %s", pathTemp.string().c_str());
+        return false;
+    }
+
+    uint32 nMagic = TABLE_MAGIC, nVersion = TABLE_VERSION;
+    uint64 nCountWrite = 0, nIndexOffset = 0;
+    bool fError = (fwrite(&nMagic, sizeof(nMagic), 1, fp) != 1 || fwrite(&nVersion, sizeof(nVersion), 1, fp) != 1
+                   || fwrite(&nCountWrite, sizeof(nCountWrite), 1, fp) != 1 || fwrite(&nIndexOffset, sizeof(nIndexOffset), 1, fp) != 1);
+
+    vector<uint64> vIndex;
+    uint64 nOffset = TABLE_HEADER_SIZE;
+    if (!fError)
+    {
+        CBufStream ssBegin, ssEnd;
+        if (!source.Scan(ssBegin, ssEnd, boost::bind(&BuildWalker, _1, _2, fp, boost::ref(nOffset), boost::ref(vIndex), boost::ref(fError))))
+        {
+            fError = true;
+        }
+    }
+
+    if (!fError)
+    {
+        // keep the index aligned for the mapped reads
+        uint64 nPadding = (8 - nOffset % 8) % 8;
+        char padding[8] = { 0 };
+        nCountWrite = vIndex.size();
+        nIndexOffset = nOffset + nPadding;
+        fError = ((nPadding != 0 && fwrite(padding, nPadding, 1, fp) != 1)
+                  || (!vIndex.empty() && fwrite(&vIndex[0], sizeof(uint64), vIndex.size(), fp) != vIndex.size())
+                  || fseek(fp, sizeof(nMagic) + sizeof(nVersion), SEEK_SET) != 0
+                  || fwrite(&nCountWrite, sizeof(nCountWrite), 1, fp) != 1
+                  || fwrite(&nIndexOffset, sizeof(nIndexOffset), 1, fp) != 1);
+    }
+    // the data reaches the disk before the rename publishes it
+#ifndef WIN32
+    fError = (fError || fflush(fp) != 0 || fsync(fileno(fp)) != 0);
+#else
+    fError = (fError || fflush(fp) != 0 || _commit(_fileno(fp)) != 0);
+#endif
+    fError = (fclose(fp) != 0 || fError);
+
+    if (fError)
+    {
+        StdError("CMappedTableEngine", "Build: write fail, file: %s", pathTemp.string().c_str());
+        remove(pathTemp);
+        return false;
+    }
+
+    try
+    {
+        rename(pathTemp, pathFile);
+    }
+    catch (exception& e)
+    {
+        StdError("CMappedTableEngine", "Build: rename fail, file: %s, err: %s", pathFile.string().c_str(), e.what());
+        return false;
+    }
+    // and the rename itself survives a crash
+    return SyncDir(pathFile.has_parent_path() ? pathFile.parent_path() : current_path());
+}
+
+bool CMappedTableEngine::Open()
+{
+    Close();
+
+    try
+    {
+        spMapped.reset(new CTimeSeriesMappedFile(pathFile.string()));
+    }
+    catch (exception& e)
+    {
+        StdError("CMappedTableEngine", "Open: map fail, file: %s, err: %s", pathFile.string().c_str(), e.what());
+        return false;
+    }
+
+    const char* p = spMapped->GetData();
+    size_t nSize = spMapped->GetSize();
+    uint32 nMagic = 0, nVersion = 0;
+    uint64 nCountRead = 0, nIndexOffset = 0;
+    if (nSize >= TABLE_HEADER_SIZE)
+    {
+        memcpy(&nMagic, p, sizeof(nMagic));
+        memcpy(&nVersion, p + 4, sizeof(nVersion));
+        memcpy(&nCountRead, p + 8, sizeof(nCountRead));
+        memcpy(&nIndexOffset, p + 16, sizeof(nIndexOffset));
+    }
+    if (nMagic != TABLE_MAGIC || nVersion != TABLE_VERSION || nIndexOffset < TABLE_HEADER_SIZE || nIndexOffset % 8 != 0
+        || nIndexOffset > nSize || nCountRead > (nSize - nIndexOffset) / sizeof(uint64))
+    {
+        StdError("CMappedTableEngine", "Open: invalid table, file: %s", pathFile.string().c_str());
+        spMapped.reset();
+        return false;
+    }
+
+    pData = p;
+    pIndex = reinterpret_cast<const uint64*>(p + nIndexOffset);
+    nCount = nCountRead;
+
+    // the records must lie before the index, checked once so the lookups need not
+    for (uint64 i = 0; i < nCount; i++)
+    {
+        uint32 nKeySize = 0, nValueSize = 0;
+        uint64 nBody = pIndex[i] + sizeof(nKeySize) + sizeof(nValueSize);
+        if (pIndex[i] >= TABLE_HEADER_SIZE && nBody <= nIndexOffset)
+        {
+            memcpy(&nKeySize, pData + pIndex[i], sizeof(nKeySize));
+            memcpy(&nValueSize, pData + pIndex[i] + sizeof(nKeySize), sizeof(nValueSize));
+            if (nBody + nKeySize + nValueSize <= nIndexOffset)
+            {
+                continue;
+            }
+        }
+        StdError("CMappedTableEngine", "Open: invalid record, file: %s, index: %lu", pathFile.string().c_str(), i);
+        Close();
+        return false;
+    }
+    return true;
+}
+
+void CMappedTableEngine::Close()
+{
+    spMapped.reset();
+    pData = nullptr;
+    pIndex = nullptr;
+    nCount = 0;
+    nCursor = 0;
+}
+
+bool CMappedTableEngine::TxnBegin()
+{
+    return false;
+}
+
+bool CMappedTableEngine::TxnCommit()
+{
+    return false;
+}
+
+void CMappedTableEngine::TxnAbort()
+{
+}
+
+bool CMappedTableEngine::Get(CBufStream& ssKey, CBufStream& ssValue)
+{
+    uint64 nIndex = LowerBound(ssKey.GetData(), ssKey.GetSize());
+    if (nIndex >= nCount)
+    {
+        return false;
+    }
+
+    const char *pKey, *pValue;
+    uint32 nKeySize, nValueSize;
+    GetRecord(nIndex, pKey, nKeySize, pValue, nValueSize);
+    if (CompareTableKey(pKey, nKeySize, ssKey.GetData(), ssKey.GetSize()) != 0)
+    {
+        return false;
+    }
+    ssValue.Write(pValue, nValueSize);
+    return true;
+}
+
+bool CMappedTableEngine::Put(CBufStream& ssKey, CBufStream& ssValue, bool fOverwrite)
+{
+    return false;
+}
+
+bool CMappedTableEngine::Remove(CBufStream& ssKey)
+{
+    return false;
+}
+
+bool CMappedTableEngine::RemoveAll()
+{
+    return false;
+}
+
+bool CMappedTableEngine::MoveFirst()
+{
+    nCursor = 0;
+    return (pData != nullptr);
+}
+
+bool CMappedTableEngine::MoveTo(CBufStream& ssKey)
+{
+    nCursor = LowerBound(ssKey.GetData(), ssKey.GetSize());
+    return (pData != nullptr);
+}
+
+bool CMappedTableEngine::MoveNext(CBufStream& ssKey, CBufStream& ssValue)
+{
+    if (nCursor >= nCount)
+    {
+        return false;
+    }
+
+    const char *pKey, *pValue;
+    uint32 nKeySize, nValueSize;
+    GetRecord(nCursor++, pKey, nKeySize, pValue, nValueSize);
+    ssKey.Write(pKey, nKeySize);
+    ssValue.Write(pValue, nValueSize);
+    return true;
+}
+
+bool CMappedTableEngine::Scan(CBufStream& ssBegin, CBufStream& ssEnd, ScanFunc fnScan)
+{
+    if (pData == nullptr)
+    {
+        return false;
+    }
+
+    // the views point into the mapping
+    CMemoryStream ssKey(nullptr, 0), ssValue(nullptr, 0);
+    for (uint64 i = LowerBound(ssBegin.GetData(), ssBegin.GetSize()); i < nCount; i++)
+    {
+        const char *pKey, *pValue;
+        uint32 nKeySize, nValueSize;
+        GetRecord(i, pKey, nKeySize, pValue, nValueSize);
+        if (ssEnd.GetSize() != 0 && CompareTableKey(pKey, nKeySize, ssEnd.GetData(), ssEnd.GetSize()) >= 0)
+        {
+            break;
+        }
+        ssKey.Attach(pKey, nKeySize);
+        ssValue.Attach(pValue, nValueSize);
+        if (!fnScan(ssKey, ssValue))
+        {
+            break;
+        }
+    }
+    return true;
+}
+
+bool CMappedTableEngine::Sync()
+{
+    return true;
+}
+
+uint64 CMappedTableEngine::LowerBound(const char* pKey, size_t nKeySize) const
+{
+    uint64 nBegin = 0, nEnd = nCount;
+    while (nBegin < nEnd)
+    {
+        uint64 nMid = nBegin + (nEnd - nBegin) / 2;
+        const char *pMidKey, *pMidValue;
+        uint32 nMidKeySize, nMidValueSize;
+        GetRecord(nMid, pMidKey, nMidKeySize, pMidValue, nMidValueSize);
+        if (CompareTableKey(pMidKey, nMidKeySize, pKey, nKeySize) < 0)
+        {
+            nBegin = nMid + 1;
+        }
+        else
+        {
+            nEnd = nMid;
+        }
+    }
+    return nBegin;
+}
+
+void CMappedTableEngine::GetRecord(uint64 nIndex, const char*& pKey, uint32& nKeySize, const char*& pValue, uint32& nValueSize) const
+{
+    const char* p = pData + pIndex[nIndex];
+    memcpy(&nKeySize, p, sizeof(nKeySize));
+    memcpy(&nValueSize, p + sizeof(nKeySize), sizeof(nValueSize));
+    pKey = p + sizeof(nKeySize) + sizeof(nValueSize);
+    pValue = pKey + nKeySize;
+}
+
+} // namespace storage
+} // namespace bigbang
@@ -0,0 +1,77 @@
+// Copyright (c) 2019-2020 The Bigbang developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef STORAGE_MAPPEDENG_H
+#define STORAGE_MAPPEDENG_H
+
+#include <boost/filesystem.hpp>
+
+#include "timeseries.h"
+#include "xengine.h"
+
+namespace bigbang
+{
+namespace storage
+{
+
+//////////////////////////////
+// CMappedTableEngine
+
+// Immutable sorted table read through a read-only mapping.
+// File : header (magic, version, count, index offset), records of (key size, value size, key, value)
+// in key order and the offsets of the records for the binary search.
+// Every write fails, the table is replaced by building a new file
+class CMappedTableEngine : public xengine::CKVDBEngine
+{
+public:
+    CMappedTableEngine(const boost::filesystem::path& pathFileIn);
+    ~CMappedTableEngine();
+
+    // write the records of the source in key order to pathFile.
+    // A leveldb source is read through one iterator, which is a consistent snapshot
+    static bool Build(xengine::CKVDBEngine& source, const boost::filesystem::path& pathFile);
+
+    bool Open() override;
+    void Close() override;
+    bool TxnBegin() override;
+    bool TxnCommit() override;
+    void TxnAbort() override;
+    bool Get(xengine::CBufStream& ssKey, xengine::CBufStream& ssValue) override;
+    bool Put(xengine::CBufStream& ssKey, xengine::CBufStream& ssValue, bool fOverwrite) override;
+    bool Remove(xengine::CBufStream& ssKey) override;
+    bool RemoveAll() override;
+    bool MoveFirst() override;
+    bool MoveTo(xengine::CBufStream& ssKey) override;
+    bool MoveNext(xengine::CBufStream& ssKey, xengine::CBufStream& ssValue) override;
+    bool Scan(xengine::CBufStream& ssBegin, xengine::CBufStream& ssEnd, ScanFunc fnScan) override;
+    bool Sync() override;
+    uint64 GetCount() const
+    {
+        return nCount;
+    }
+
+protected:
+    // index of the first record not less than the key
+    uint64 LowerBound(const char* pKey, std::size_t nKeySize) const;
+    void GetRecord(uint64 nIndex, const char*& pKey, uint32& nKeySize, const char*& pValue, uint32& nValueSize) const;
+
+protected:
+    enum
+    {
+        TABLE_MAGIC = 0x4d544242,
+        TABLE_VERSION = 1,
+        TABLE_HEADER_SIZE = 24
+    };
+    boost::filesystem::path pathFile;
+    std::unique_ptr<CTimeSeriesMappedFile> spMapped;
+    const char* pData;
+    const uint64* pIndex;
+    uint64 nCount;
+    uint64 nCursor;
+};
+
+} // namespace storage
+} // namespace bigbang
+
+#endif //STORAGE_MAPPEDENG_H
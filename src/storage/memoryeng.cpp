@@ -0,0 +1,228 @@
+// Copyright (c) 2019-2020 The Bigbang developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "memoryeng.h"
+
+using namespace std;
+using namespace xengine;
+
+namespace bigbang
+{
+namespace storage
+{
+
+//////////////////////////////
+// CMemoryEngine
+
+CMemoryEngine::CMemoryEngine()
+  : fTxn(false), fCursor(false), fCursorInclusive(false)
+{
+}
+
+CMemoryEngine::~CMemoryEngine()
+{
+}
+
+bool CMemoryEngine::Open()
+{
+    return true;
+}
+
+void CMemoryEngine::Close()
+{
+    CWriteLock wlock(rwAccess);
+    mapRecord.clear();
+    fTxn = false;
+    vTxnOp.clear();
+    fCursor = false;
+}
+
+bool CMemoryEngine::TxnBegin()
+{
+    if (fTxn)
+    {
+        return false;
+    }
+    fTxn = true;
+    vTxnOp.clear();
+    return true;
+}
+
+bool CMemoryEngine::TxnCommit()
+{
+    if (!fTxn)
+    {
+        return false;
+    }
+
+    {
+        CWriteLock wlock(rwAccess);
+        for (auto& op : vTxnOp)
+        {
+            if (op.second)
+            {
+                mapRecord[op.first].swap(*op.second);
+            }
+            else
+            {
+                mapRecord.erase(op.first);
+            }
+        }
+    }
+    fTxn = false;
+    vTxnOp.clear();
+    return true;
+}
+
+void CMemoryEngine::TxnAbort()
+{
+    fTxn = false;
+    vTxnOp.clear();
+}
+
+bool CMemoryEngine::Get(CBufStream& ssKey, CBufStream& ssValue)
+{
+    string strKey(ssKey.GetData(), ssKey.GetSize());
+
+    CReadLock rlock(rwAccess);
+    map<string, string>::const_iterator it = mapRecord.find(strKey);
+    if (it == mapRecord.end())
+    {
+        return false;
+    }
+    ssValue.Write((*it).second.data(), (*it).second.size());
+    return true;
+}
+
+bool CMemoryEngine::Put(CBufStream& ssKey, CBufStream& ssValue, bool fOverwrite)
+{
+    string strKey(ssKey.GetData(), ssKey.GetSize());
+    string strValue(ssValue.GetData(), ssValue.GetSize());
+
+    // like leveldb, the overwrite check sees the committed records only
+    if (!fOverwrite)
+    {
+        CReadLock rlock(rwAccess);
+        if (mapRecord.count(strKey))
+        {
+            return false;
+        }
+    }
+
+    if (fTxn)
+    {
+        vTxnOp.push_back(make_pair(strKey, boost::optional<string>(strValue)));
+        return true;
+    }
+
+    CWriteLock wlock(rwAccess);
+    mapRecord[strKey].swap(strValue);
+    return true;
+}
+
+bool CMemoryEngine::Remove(CBufStream& ssKey)
+{
+    string strKey(ssKey.GetData(), ssKey.GetSize());
+
+    if (fTxn)
+    {
+        vTxnOp.push_back(make_pair(strKey, boost::optional<string>()));
+        return true;
+    }
+
+    CWriteLock wlock(rwAccess);
+    mapRecord.erase(strKey);
+    return true;
+}
+
+bool CMemoryEngine::RemoveAll()
+{
+    Close();
+    return true;
+}
+
+bool CMemoryEngine::MoveFirst()
+{
+    fCursor = true;
+    fCursorInclusive = true;
+    strCursor.clear();
+    return true;
+}
+
+bool CMemoryEngine::MoveTo(CBufStream& ssKey)
+{
+    fCursor = true;
+    fCursorInclusive = true;
+    strCursor.assign(ssKey.GetData(), ssKey.GetSize());
+    return true;
+}
+
+bool CMemoryEngine::MoveNext(CBufStream& ssKey, CBufStream& ssValue)
+{
+    string strKey, strValue;
+    if (!fCursor || !Seek(strCursor, fCursorInclusive, strKey, strValue))
+    {
+        fCursor = false;
+        return false;
+    }
+
+    ssKey.Write(strKey.data(), strKey.size());
+    ssValue.Write(strValue.data(), strValue.size());
+
+    fCursorInclusive = false;
+    strCursor.swap(strKey);
+    return true;
+}
+
+bool CMemoryEngine::Scan(CBufStream& ssBegin, CBufStream& ssEnd, ScanFunc fnScan)
+{
+    string strEnd(ssEnd.GetData(), ssEnd.GetSize());
+    string strKey(ssBegin.GetData(), ssBegin.GetSize()), strValue;
+
+    // the callback runs unlocked and may write, the buffers are reused between records
+    CMemoryStream ssKeyView(nullptr, 0), ssValueView(nullptr, 0);
+    bool fInclusive = true;
+    while (Seek(strKey, fInclusive, strKey, strValue))
+    {
+        if (!strEnd.empty() && strKey.compare(strEnd) >= 0)
+        {
+            break;
+        }
+        ssKeyView.Attach(strKey.data(), strKey.size());
+        ssValueView.Attach(strValue.data(), strValue.size());
+        if (!fnScan(ssKeyView, ssValueView))
+        {
+            break;
+        }
+        fInclusive = false;
+    }
+    return true;
+}
+
+bool CMemoryEngine::Sync()
+{
+    return true;
+}
+
+size_t CMemoryEngine::GetCount()
+{
+    CReadLock rlock(rwAccess);
+    return mapRecord.size();
+}
+
+bool CMemoryEngine::Seek(const string& strKey, bool fInclusive, string& strKeyRet, string& strValueRet)
+{
+    CReadLock rlock(rwAccess);
+    map<string, string>::const_iterator it = (fInclusive ? mapRecord.lower_bound(strKey) : mapRecord.upper_bound(strKey));
+    if (it == mapRecord.end())
+    {
+        return false;
+    }
+    strKeyRet.assign((*it).first);
+    strValueRet.assign((*it).second);
+    return true;
+}
+
+} // namespace storage
+} // namespace bigbang
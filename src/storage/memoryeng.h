@@ -0,0 +1,63 @@
+// Copyright (c) 2019-2020 The Bigbang developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef STORAGE_MEMORYENG_H
+#define STORAGE_MEMORYENG_H
+
+#include <boost/optional.hpp>
+
+#include "xengine.h"
+
+namespace bigbang
+{
+namespace storage
+{
+
+//////////////////////////////
+// CMemoryEngine
+
+// Sorted in-memory engine for tests and benchmarks, nothing survives Close.
+// Get may run beside the serialized writes, so the map is guarded by a read/write lock
+class CMemoryEngine : public xengine::CKVDBEngine
+{
+public:
+    CMemoryEngine();
+    ~CMemoryEngine();
+
+    bool Open() override;
+    void Close() override;
+    bool TxnBegin() override;
+    bool TxnCommit() override;
+    void TxnAbort() override;
+    bool Get(xengine::CBufStream& ssKey, xengine::CBufStream& ssValue) override;
+    bool Put(xengine::CBufStream& ssKey, xengine::CBufStream& ssValue, bool fOverwrite) override;
+    bool Remove(xengine::CBufStream& ssKey) override;
+    bool RemoveAll() override;
+    bool MoveFirst() override;
+    bool MoveTo(xengine::CBufStream& ssKey) override;
+    bool MoveNext(xengine::CBufStream& ssKey, xengine::CBufStream& ssValue) override;
+    bool Scan(xengine::CBufStream& ssBegin, xengine::CBufStream& ssEnd, ScanFunc fnScan) override;
+    bool Sync() override;
+    std::size_t GetCount();
+
+protected:
+    // the record at or after strKey (after it if fInclusive is false), copied out under the lock
+    bool Seek(const std::string& strKey, bool fInclusive, std::string& strKeyRet, std::string& strValueRet);
+
+protected:
+    xengine::CRWAccess rwAccess;
+    std::map<std::string, std::string> mapRecord;
+    // pending writes of the open transaction, none means remove
+    bool fTxn;
+    std::vector<std::pair<std::string, boost::optional<std::string>>> vTxnOp;
+    // the walk cursor keeps the key only, so writes during a walk leave it valid
+    bool fCursor;
+    bool fCursorInclusive;
+    std::string strCursor;
+};
+
+} // namespace storage
+} // namespace bigbang
+
+#endif //STORAGE_MEMORYENG_H
@@ -0,0 +1,275 @@
+// Copyright (c) 2019-2020 The Bigbang developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "snapshot.h"
+
+#include "crypto.h"
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#else
+#include <io.h>
+#endif
+
+using namespace std;
+using namespace boost::filesystem;
+using namespace xengine;
+
+namespace bigbang
+{
+namespace storage
+{
+
+#define SNAPSHOT_MAX_CHUNK_SIZE (0x4000000)
+
+//////////////////////////////
+// CSnapshotWriter
+
+CSnapshotWriter::CSnapshotWriter()
+  : fp(nullptr), nCount(0)
+{
+}
+
+CSnapshotWriter::~CSnapshotWriter()
+{
+    if (fp != nullptr)
+    {
+        fclose(fp);
+    }
+}
+
+bool CSnapshotWriter::Open(const path& pathFile)
+{
+    fp = fopen(pathFile.string().c_str(), "wb");
+    if (fp == nullptr)
+    {
+        StdError("CSnapshotWriter", "Open: fopen fail, file: %s", pathFile.string().c_str());
+        return false;
+    }
+    ss.Clear();
+    hashChecksum = 0;
+    nCount = 0;
+    return true;
+}
+
+bool CSnapshotWriter::Close(uint256& hashChecksumRet)
+{
+    if (fp == nullptr)
+    {
+        return false;
+    }
+
+    bool fRet = (ss.GetSize() == 0 || WriteChunk());
+    if (fRet)
+    {
+        uint32 nEnd = 0;
+        fRet = (fwrite(&nEnd, sizeof(nEnd), 1, fp) == 1
+                && fwrite(hashChecksum.begin(), hashChecksum.size(), 1, fp) == 1
+                && fflush(fp) == 0);
+    }
+    // the file is on disk before the manifest refers to it
+#ifndef WIN32
+    if (fRet && fsync(fileno(fp)) != 0)
+#else
+    if (fRet && _commit(_fileno(fp)) != 0)
+#endif
+    {
+        StdError("CSnapshotWriter", "Close: fsync fail");
+        fRet = false;
+    }
+    if (fclose(fp) != 0)
+    {
+        fRet = false;
+    }
+    fp = nullptr;
+
+    hashChecksumRet = hashChecksum;
+    return fRet;
+}
+
+bool CSnapshotWriter::WriteChunk()
+{
+    uint32 nSize = ss.GetSize();
+    if (fwrite(&nSize, sizeof(nSize), 1, fp) != 1 || fwrite(ss.GetData(), nSize, 1, fp) != 1)
+    {
+        StdError("CSnapshotWriter", "WriteChunk: fwrite fail");
+        return false;
+    }
+    hashChecksum = crypto::CryptoHash(hashChecksum, crypto::CryptoHash(ss.GetData(), nSize));
+    ss.Clear();
+    return true;
+}
+
+//////////////////////////////
+// CSnapshotReader
+
+CSnapshotReader::CSnapshotReader()
+  : fp(nullptr), fCompleted(false)
+{
+}
+
+CSnapshotReader::~CSnapshotReader()
+{
+    Close();
+}
+
+bool CSnapshotReader::Open(const path& pathFile, const uint256& hashChecksumIn)
+{
+    fp = fopen(pathFile.string().c_str(), "rb");
+    if (fp == nullptr)
+    {
+        StdError("CSnapshotReader", "Open: fopen fail, file: %s", pathFile.string().c_str());
+        return false;
+    }
+    ss.Clear();
+    hashExpected = hashChecksumIn;
+    hashChecksum = 0;
+    fCompleted = false;
+    return true;
+}
+
+void CSnapshotReader::Close()
+{
+    if (fp != nullptr)
+    {
+        fclose(fp);
+        fp = nullptr;
+    }
+}
+
+bool CSnapshotReader::Verify()
+{
+    while (ReadChunk())
+    {
+        ss.Clear();
+    }
+    return fCompleted;
+}
+
+bool CSnapshotReader::ReadChunk()
+{
+    if (fp == nullptr || fCompleted)
+    {
+        return false;
+    }
+
+    uint32 nSize = 0;
+    if (fread(&nSize, sizeof(nSize), 1, fp) != 1 || nSize > SNAPSHOT_MAX_CHUNK_SIZE)
+    {
+        StdError("CSnapshotReader", "ReadChunk: invalid chunk header");
+        return false;
+    }
+
+    if (nSize == 0)
+    {
+        uint256 hashStored;
+        if (fread(hashStored.begin(), hashStored.size(), 1, fp) != 1)
+        {
+            StdError("CSnapshotReader", "ReadChunk: missing checksum");
+            return false;
+        }
+        if (hashStored != hashChecksum || (hashExpected != 0 && hashExpected != hashChecksum))
+        {
+            StdError("CSnapshotReader", "ReadChunk: checksum mismatch");
+            return false;
+        }
+        fCompleted = true;
+        return false;
+    }
+
+    vector<char> vChunk(nSize);
+    if (fread(&vChunk[0], nSize, 1, fp) != 1)
+    {
+        StdError("CSnapshotReader", "ReadChunk: truncated chunk");
+        return false;
+    }
+    hashChecksum = crypto::CryptoHash(hashChecksum, crypto::CryptoHash(&vChunk[0], nSize));
+    ss.Write(&vChunk[0], nSize);
+    return true;
+}
+
+//////////////////////////////
+// SnapshotCopyFile
+
+bool SnapshotCopyFile(const path& pathFrom, const path& pathTo, uint256& hashChecksumRet)
+{
+    FILE* fpFrom = fopen(pathFrom.string().c_str(), "rb");
+    if (fpFrom == nullptr)
+    {
+        StdError("Snapshot", "CopyFile: fopen fail, file: %s", pathFrom.string().c_str());
+        return false;
+    }
+    FILE* fpTo = fopen(pathTo.string().c_str(), "wb");
+    if (fpTo == nullptr)
+    {
+        fclose(fpFrom);
+        StdError("Snapshot", "CopyFile: fopen fail, file: %s", pathTo.string().c_str());
+        return false;
+    }
+
+    vector<unsigned char> vBuf(0x100000);
+    uint256 hashChecksum;
+    bool fRet = true;
+    size_t nRead = 0;
+    while ((nRead = fread(&vBuf[0], 1, vBuf.size(), fpFrom)) > 0)
+    {
+        if (fwrite(&vBuf[0], nRead, 1, fpTo) != 1)
+        {
+            StdError("Snapshot", "CopyFile: fwrite fail, file: %s", pathTo.string().c_str());
+            fRet = false;
+            break;
+        }
+        hashChecksum = crypto::CryptoHash(hashChecksum, crypto::CryptoHash(&vBuf[0], nRead));
+    }
+    if (fRet && ferror(fpFrom))
+    {
+        StdError("Snapshot", "CopyFile: fread fail, file: %s", pathFrom.string().c_str());
+        fRet = false;
+    }
+    fclose(fpFrom);
+#ifndef WIN32
+    if (fRet && (fflush(fpTo) != 0 || fsync(fileno(fpTo)) != 0))
+#else
+    if (fRet && (fflush(fpTo) != 0 || _commit(_fileno(fpTo)) != 0))
+#endif
+    {
+        StdError("Snapshot", "CopyFile: fsync fail, file: %s", pathTo.string().c_str());
+        fRet = false;
+    }
+    if (fclose(fpTo) != 0)
+    {
+        fRet = false;
+    }
+
+    hashChecksumRet = hashChecksum;
+    return fRet;
+}
+
+//////////////////////////////
+// SnapshotSyncDir
+
+bool SnapshotSyncDir(const path& pathDir)
+{
+#ifndef WIN32
+    int fd = open(pathDir.string().c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        StdError("Snapshot", "SyncDir: open fail, dir: %s", pathDir.string().c_str());
+        return false;
+    }
+    bool fRet = (fsync(fd) == 0);
+    close(fd);
+    if (!fRet)
+    {
+        StdError("Snapshot", "SyncDir: fsync fail, dir: %s", pathDir.string().c_str());
+    }
+    return fRet;
+#else
+    return true;
+#endif
+}
+
+} // namespace storage
+} // namespace bigbang
@@ -0,0 +1,193 @@
+// Copyright (c) 2019-2020 The Bigbang developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef STORAGE_SNAPSHOT_H
+#define STORAGE_SNAPSHOT_H
+
+#include <boost/filesystem.hpp>
+
+#include "forkcontext.h"
+#include "uint256.h"
+#include "xengine.h"
+
+namespace bigbang
+{
+namespace storage
+{
+
+#define SNAPSHOT_VERSION (1)
+#define SNAPSHOT_MANIFEST "manifest.dat"
+#define SNAPSHOT_BLOCKINDEX "blockindex.dat"
+#define SNAPSHOT_DELEGATE "delegate.dat"
+#define SNAPSHOT_UNSPENT_DIR "unspent"
+#define SNAPSHOT_BLOCK_DIR "block"
+
+//////////////////////////////
+// CSnapshotFork
+
+class CSnapshotFork
+{
+    friend class xengine::CStream;
+
+public:
+    CSnapshotFork()
+      : nUnspent(0) {}
+    CSnapshotFork(const uint256& hashForkIn, const uint256& hashLastBlockIn)
+      : hashFork(hashForkIn), hashLastBlock(hashLastBlockIn), nUnspent(0) {}
+
+protected:
+    template <typename O>
+    void Serialize(xengine::CStream& s, O& opt)
+    {
+        s.Serialize(hashFork, opt);
+        s.Serialize(hashLastBlock, opt);
+        s.Serialize(nUnspent, opt);
+        s.Serialize(hashChecksum, opt);
+    }
+
+public:
+    uint256 hashFork;
+    uint256 hashLastBlock;
+    uint64 nUnspent;
+    uint256 hashChecksum;
+};
+
+//////////////////////////////
+// CSnapshotManifest
+
+class CSnapshotManifest
+{
+    friend class xengine::CStream;
+
+public:
+    CSnapshotManifest()
+      : nVersion(SNAPSHOT_VERSION), nTime(0), nHeight(0), nBlock(0), nDelegate(0) {}
+
+protected:
+    template <typename O>
+    void Serialize(xengine::CStream& s, O& opt)
+    {
+        s.Serialize(nVersion, opt);
+        s.Serialize(nTime, opt);
+        s.Serialize(hashLastBlock, opt);
+        s.Serialize(nHeight, opt);
+        s.Serialize(vForkCtxt, opt);
+        s.Serialize(vFork, opt);
+        s.Serialize(nBlock, opt);
+        s.Serialize(hashBlockChecksum, opt);
+        s.Serialize(nDelegate, opt);
+        s.Serialize(hashDelegateChecksum, opt);
+        s.Serialize(vBlockFile, opt);
+    }
+
+public:
+    uint32 nVersion;
+    int64 nTime;
+    // last block of the primary fork
+    uint256 hashLastBlock;
+    int32 nHeight;
+    std::vector<CForkContext> vForkCtxt;
+    std::vector<CSnapshotFork> vFork;
+    uint64 nBlock;
+    uint256 hashBlockChecksum;
+    uint64 nDelegate;
+    uint256 hashDelegateChecksum;
+    // block file name and checksum
+    std::vector<std::pair<std::string, uint256>> vBlockFile;
+};
+
+//////////////////////////////
+// CSnapshotWriter
+
+// Record file : chunks of (size, serialized records), a zero size terminator and the checksum
+// chained over all chunks
+class CSnapshotWriter
+{
+public:
+    CSnapshotWriter();
+    ~CSnapshotWriter();
+    bool Open(const boost::filesystem::path& pathFile);
+    bool Close(uint256& hashChecksumRet);
+    uint64 GetCount() const
+    {
+        return nCount;
+    }
+    template <typename T>
+    bool Write(const T& t)
+    {
+        ss << t;
+        nCount++;
+        return (ss.GetSize() < CHUNK_SIZE || WriteChunk());
+    }
+
+protected:
+    bool WriteChunk();
+
+protected:
+    enum
+    {
+        CHUNK_SIZE = 0x100000
+    };
+    FILE* fp;
+    xengine::CBufStream ss;
+    uint256 hashChecksum;
+    uint64 nCount;
+};
+
+//////////////////////////////
+// CSnapshotReader
+
+class CSnapshotReader
+{
+public:
+    CSnapshotReader();
+    ~CSnapshotReader();
+    bool Open(const boost::filesystem::path& pathFile, const uint256& hashChecksumIn);
+    void Close();
+    // false at the end of file or on a damaged file, tell them apart by IsCompleted
+    bool IsCompleted() const
+    {
+        return fCompleted;
+    }
+    // reads the remaining chunks without parsing them, true if the file is complete and its checksum matches
+    bool Verify();
+    template <typename T>
+    bool Read(T& t)
+    {
+        if (ss.GetSize() == 0 && !ReadChunk())
+        {
+            return false;
+        }
+        try
+        {
+            ss >> t;
+        }
+        catch (std::exception& e)
+        {
+            xengine::StdError("CSnapshotReader", "Read record failed: %s", e.what());
+            return false;
+        }
+        return true;
+    }
+
+protected:
+    bool ReadChunk();
+
+protected:
+    FILE* fp;
+    xengine::CBufStream ss;
+    uint256 hashExpected;
+    uint256 hashChecksum;
+    bool fCompleted;
+};
+
+// copy a file and compute its checksum in the snapshot chunk scheme
+bool SnapshotCopyFile(const boost::filesystem::path& pathFrom, const boost::filesystem::path& pathTo, uint256& hashChecksumRet);
+// make the entries of a directory durable, the files in it are synced by their writers
+bool SnapshotSyncDir(const boost::filesystem::path& pathDir);
+
+} // namespace storage
+} // namespace bigbang
+
+#endif //STORAGE_SNAPSHOT_H
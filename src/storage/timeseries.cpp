@@ -4,16 +4,18 @@
 
 #include "timeseries.h"
 
-/*#ifndef WIN32
+#include <snappy.h>
+
+#include "crc24q.h"
+#include "crypto.h"
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #else
-#include <fcntl.h>
 #include <io.h>
-#include <share.h>
-#include <stdio.h>
-#include <sys/stat.h>
-#include <sys/types.h>
-#endif*/
+#endif
 
 using namespace std;
 using namespace boost::filesystem;
@@ -24,16 +26,32 @@ namespace bigbang
 namespace storage
 {
 
+#define TIMESERIES_COMPRESS_INTERVAL (60) // 1 minute check
+
 //////////////////////////////
 // CTimeSeriesBase
 
+const uint32 CTimeSeriesBase::nMagicNum = 0x5E33A1EF;
+
 CTimeSeriesBase::CTimeSeriesBase()
 {
     nLastFile = 0;
+    nMaxFileSize = MAX_FILE_SIZE;
+    nAppendSize = 0;
+    pAppendFile = nullptr;
+    nAppendFile = 0;
+    nAppendOffset = 0;
+    fIndexFile = false;
+    pIndexFile = nullptr;
+    nSyncPolicy = SYNC_INTERVAL;
+    nSyncInterval = 1000;
+    nLastSyncTime = 0;
+    nSyncedSize = 0;
 }
 
 CTimeSeriesBase::~CTimeSeriesBase()
 {
+    CloseAppendFile();
 }
 
 bool CTimeSeriesBase::Initialize(const path& pathLocationIn, const string& strPrefixIn)
@@ -57,6 +75,55 @@ bool CTimeSeriesBase::Initialize(const path& pathLocationIn, const string& strPr
 
 void CTimeSeriesBase::Deinitialize()
 {
+    CloseAppendFile();
+}
+
+void CTimeSeriesBase::SetSyncPolicy(int nSyncPolicyIn, int64 nSyncIntervalIn)
+{
+    nSyncPolicy = nSyncPolicyIn;
+    nSyncInterval = nSyncIntervalIn;
+}
+
+void CTimeSeriesBase::SetMaxFileSize(uint32 nMaxFileSizeIn)
+{
+    // records never span files, the limit must leave room for a full chunk
+    nMaxFileSize = std::min(std::max(nMaxFileSizeIn, (uint32)(MAX_CHUNK_SIZE * 2)), (uint32)MAX_FILE_SIZE);
+}
+
+bool CTimeSeriesBase::RebuildIndexFile(uint32& nLastFileRet, uint32& nLastPosRet)
+{
+    CloseAppendFile();
+
+    uint32 nFile = 1;
+    nLastFileRet = 0;
+    nLastPosRet = 0;
+    string pathFile;
+    while (GetFilePath(nFile, pathFile))
+    {
+        string pathIndex = IndexFilePath(nFile);
+        if (exists(path(pathIndex)) && !boost::filesystem::remove(path(pathIndex)))
+        {
+            StdError("TimeSeriesBase", "RebuildIndexFile: remove fail, file: %s", pathIndex.c_str());
+            return false;
+        }
+        uint32 nValidSize = 0;
+        if (!UpdateIndexFile(nFile, nValidSize))
+        {
+            StdError("TimeSeriesBase", "RebuildIndexFile: update fail, file: %s", pathIndex.c_str());
+            return false;
+        }
+        nLastFileRet = nFile;
+        nLastPosRet = nValidSize;
+        if (nValidSize != file_size(path(pathFile)))
+        {
+            // the following files are not reachable by a walk either
+            StdError("TimeSeriesBase", "RebuildIndexFile: record error, nFile: %d, nOffset: %u", nFile, nValidSize);
+            return false;
+        }
+        StdLog("TimeSeriesBase", "RebuildIndexFile: file: %d, size: %u", nFile, nValidSize);
+        nFile++;
+    }
+    return true;
 }
 
 bool CTimeSeriesBase::CheckDiskSpace()
@@ -72,6 +139,11 @@ const std::string CTimeSeriesBase::FileName(uint32 nFile)
     return oss.str();
 }
 
+string CTimeSeriesBase::IndexFilePath(uint32 nFile)
+{
+    return (pathLocation / FileName(nFile)).replace_extension(".idx").string();
+}
+
 bool CTimeSeriesBase::GetFilePath(uint32 nFile, string& strPath)
 {
     path current = pathLocation / FileName(nFile);
@@ -97,7 +169,7 @@ bool CTimeSeriesBase::GetLastFilePath(uint32& nFile, std::string& strPath)
             }
             fclose(fp);
         }
-        if (is_regular_file(last) && file_size(last) < MAX_FILE_SIZE - MAX_CHUNK_SIZE - 8)
+        if (is_regular_file(last) && file_size(last) < nMaxFileSize - MAX_CHUNK_SIZE - 8)
         {
             nFile = nLastFile;
             strPath = last.string();
@@ -118,6 +190,7 @@ bool CTimeSeriesBase::RemoveFollowUpFile(uint32 nBeginFile)
             xengine::StdError("TimeSeriesBase", "RemoveFollowUpFile: remove fail fail, file: %s", pathFile.c_str());
             return false;
         }
+        boost::filesystem::remove(path(IndexFilePath(nBeginFile)));
         ++nBeginFile;
     }
     return true;
@@ -153,48 +226,16 @@ bool CTimeSeriesBase::TruncateFile(const string& pathFile, uint32 nOffset)
     _close(fh);
 #endif*/
 
-    string strTempFilePath = pathFile + ".temp";
-    boost::filesystem::rename(path(pathFile), path(strTempFilePath));
-
-    FILE* pReadFd = nullptr;
-    FILE* pWriteFd = nullptr;
-    pReadFd = fopen(strTempFilePath.c_str(), "rb");
-    if (pReadFd == nullptr)
+    // resize in place, the kept range is not copied and sparse holes stay sparse
+    try
     {
-        xengine::StdError("TimeSeriesBase", "TruncateFile: fopen fail1, file: %s", strTempFilePath.c_str());
-        return false;
+        boost::filesystem::resize_file(path(pathFile), nOffset);
     }
-    pWriteFd = fopen(pathFile.c_str(), "wb");
-    if (pWriteFd == nullptr)
+    catch (exception& e)
     {
-        xengine::StdError("TimeSeriesBase", "TruncateFile: fopen fail2, file: %s", pathFile.c_str());
-        fclose(pReadFd);
+        xengine::StdError("TimeSeriesBase", "TruncateFile: resize fail, file: %s, msg: %s", pathFile.c_str(), e.what());
         return false;
     }
-    uint32 nReadLen = 0;
-    uint8 uReadBuf[4096] = { 0 };
-    while (nReadLen < nOffset && !feof(pReadFd))
-    {
-        size_t nNeedReadLen = nOffset - nReadLen;
-        if (nNeedReadLen > sizeof(uReadBuf))
-        {
-            nNeedReadLen = sizeof(uReadBuf);
-        }
-        size_t nLen = fread(uReadBuf, 1, nNeedReadLen, pReadFd);
-        if (nLen > 0)
-        {
-            fwrite(uReadBuf, 1, nLen, pWriteFd);
-            nReadLen += nLen;
-        }
-        if (nLen != nNeedReadLen && ferror(pReadFd))
-        {
-            break;
-        }
-    }
-    fclose(pReadFd);
-    fclose(pWriteFd);
-
-    boost::filesystem::remove(path(strTempFilePath));
     return true;
 }
 
@@ -213,6 +254,11 @@ bool CTimeSeriesBase::RepairFile(uint32 nFile, uint32 nOffset)
             xengine::StdError("TimeSeriesBase", "RepairFile: TruncateFile fail");
             return false;
         }
+        if (fIndexFile && !TruncateIndexFile(nFile, nOffset))
+        {
+            xengine::StdError("TimeSeriesBase", "RepairFile: TruncateIndexFile fail");
+            return false;
+        }
         return RemoveFollowUpFile(nFile + 1);
     }
     else
@@ -221,86 +267,1570 @@ bool CTimeSeriesBase::RepairFile(uint32 nFile, uint32 nOffset)
     }
 }
 
-//////////////////////////////
-// CTimeSeriesCached
+bool CTimeSeriesBase::OpenAppendFile(uint32& nFile, uint32& nOffset)
+{
+    if (pAppendFile != nullptr && nAppendOffset < nMaxFileSize - MAX_CHUNK_SIZE - 8)
+    {
+        nFile = nAppendFile;
+        nOffset = nAppendOffset;
+        return true;
+    }
 
-const uint32 CTimeSeriesCached::nMagicNum = 0x5E33A1EF;
+    CloseAppendFile();
 
-CTimeSeriesCached::CTimeSeriesCached()
-  : cacheStream(FILE_CACHE_SIZE)
-{
+    string pathFile;
+    if (!GetLastFilePath(nAppendFile, pathFile))
+    {
+        return false;
+    }
+    pAppendFile = fopen(pathFile.c_str(), "ab");
+    if (pAppendFile == nullptr)
+    {
+        StdError("TimeSeriesBase", "OpenAppendFile: fopen fail, file: %s", pathFile.c_str());
+        return false;
+    }
+    nAppendOffset = file_size(path(pathFile));
+    nLastSyncTime = GetTimeMillis();
+
+    if (fIndexFile)
+    {
+        // The sidecar is an aid only. Behind a bad tail new entries would leave a gap, so they are
+        // not written and the file is indexed again once the tail is repaired.
+        uint32 nValidSize = 0;
+        if (UpdateIndexFile(nAppendFile, nValidSize) && nValidSize == nAppendOffset)
+        {
+            pIndexFile = fopen(IndexFilePath(nAppendFile).c_str(), "ab");
+        }
+        else
+        {
+            StdWarn("TimeSeriesBase", "OpenAppendFile: index incomplete, file: %d, indexed: %u, size: %u",
+                    nAppendFile, nValidSize, nAppendOffset);
+        }
+    }
+
+    nFile = nAppendFile;
+    nOffset = nAppendOffset;
+    return true;
 }
 
-CTimeSeriesCached::~CTimeSeriesCached()
+bool CTimeSeriesBase::AppendToFile(CBufStream& ss)
 {
+    size_t nSize = ss.GetSize();
+    if (pAppendFile == nullptr)
+    {
+        return false;
+    }
+    // hand the whole group to the OS at once, so that readers see the records on return
+    if (fwrite(ss.GetData(), 1, nSize, pAppendFile) != nSize || fflush(pAppendFile) != 0)
+    {
+        StdError("TimeSeriesBase", "AppendToFile: fwrite fail, file: %d, size: %lu", nAppendFile, nSize);
+        CloseAppendFile();
+        return false;
+    }
+    if (pIndexFile != nullptr)
+    {
+        AppendIndex(ss.GetData(), nSize, nAppendOffset);
+    }
+    nAppendOffset += nSize;
+    nAppendSize += nSize;
+    return true;
 }
 
-bool CTimeSeriesCached::Initialize(const path& pathLocationIn, const string& strPrefixIn)
+bool CTimeSeriesBase::AppendHole(uint32 nSize)
 {
-
-    if (!CTimeSeriesBase::Initialize(pathLocationIn, strPrefixIn))
+    if (pAppendFile == nullptr)
     {
         return false;
     }
+    // extend the file without writing, the skipped range stays sparse on disk
+#ifndef WIN32
+    if (fflush(pAppendFile) != 0 || ftruncate(fileno(pAppendFile), (off_t)nAppendOffset + nSize) != 0)
+#else
+    if (fflush(pAppendFile) != 0 || _chsize_s(_fileno(pAppendFile), (int64)nAppendOffset + nSize) != 0)
+#endif
+    {
+        StdError("TimeSeriesBase", "AppendHole: extend fail, file: %d, size: %u", nAppendFile, nSize);
+        CloseAppendFile();
+        return false;
+    }
+    nAppendOffset += nSize;
+    return true;
+}
 
+void CTimeSeriesBase::SyncAppendFile(bool fForce)
+{
+    if (pAppendFile == nullptr)
+    {
+        return;
+    }
+    int64 nNow = GetTimeMillis();
+    if (fForce || nSyncPolicy == SYNC_PER_WRITE
+        || (nSyncPolicy == SYNC_INTERVAL && nAppendSize != nSyncedSize && nNow - nLastSyncTime >= nSyncInterval))
     {
-        boost::unique_lock<boost::mutex> lock(mtxCache);
+#ifndef WIN32
+        if (fsync(fileno(pAppendFile)) != 0)
+#else
+        if (_commit(_fileno(pAppendFile)) != 0)
+#endif
+        {
+            StdError("TimeSeriesBase", "SyncAppendFile: sync fail, file: %d", nAppendFile);
+        }
+        nLastSyncTime = nNow;
+        nSyncedSize = nAppendSize;
+    }
+}
 
-        ResetCache();
+void CTimeSeriesBase::CloseAppendFile()
+{
+    if (pAppendFile != nullptr)
+    {
+        SyncAppendFile(true);
+        fclose(pAppendFile);
+        pAppendFile = nullptr;
+    }
+    if (pIndexFile != nullptr)
+    {
+        fclose(pIndexFile);
+        pIndexFile = nullptr;
     }
-    return true;
 }
 
-void CTimeSeriesCached::Deinitialize()
+bool CTimeSeriesBase::UpdateIndexFile(uint32 nFile, uint32& nValidSize)
 {
-    boost::unique_lock<boost::mutex> lock(mtxCache);
+    // Entries are only ever written after the records they describe, so the sidecar may lag
+    // the data file but never lead it. The last entry is checked against the data, entries
+    // past the data end or not matching it are dropped, and the records after it are indexed.
+    nValidSize = 0;
+    string pathFile;
+    if (!GetFilePath(nFile, pathFile))
+    {
+        return false;
+    }
+    string pathIndex = IndexFilePath(nFile);
+    size_t nFileSize = file_size(path(pathFile));
+    size_t nEntry = exists(path(pathIndex)) ? file_size(path(pathIndex)) / INDEX_ENTRY_SIZE : 0;
 
-    ResetCache();
+    FILE* fpData = fopen(pathFile.c_str(), "rb");
+    if (fpData == nullptr)
+    {
+        StdError("TimeSeriesBase", "UpdateIndexFile: fopen fail, file: %s", pathFile.c_str());
+        return false;
+    }
+    FILE* fpIndex = fopen(pathIndex.c_str(), (nEntry != 0 ? "r+b" : "w+b"));
+    if (fpIndex == nullptr)
+    {
+        StdError("TimeSeriesBase", "UpdateIndexFile: fopen fail, file: %s", pathIndex.c_str());
+        fclose(fpData);
+        return false;
+    }
+
+    while (nEntry > 0)
+    {
+        CTimeSeriesIndexEntry entry, scanned;
+        if (ReadIndexEntry(fpIndex, nEntry - 1, entry) && entry.GetEnd() <= nFileSize
+            && ScanIndexEntry(fpData, entry.nOffset, nFileSize, scanned)
+            && scanned.nSize == entry.nSize && scanned.nHash == entry.nHash)
+        {
+            nValidSize = entry.GetEnd();
+            break;
+        }
+        nEntry--;
+    }
+
+    bool fRet = true;
+#ifndef WIN32
+    if (fflush(fpIndex) != 0 || ftruncate(fileno(fpIndex), (off_t)nEntry * INDEX_ENTRY_SIZE) != 0
+#else
+    if (fflush(fpIndex) != 0 || _chsize_s(_fileno(fpIndex), (int64)nEntry * INDEX_ENTRY_SIZE) != 0
+#endif
+        || fseek(fpIndex, nEntry * INDEX_ENTRY_SIZE, SEEK_SET) != 0)
+    {
+        StdError("TimeSeriesBase", "UpdateIndexFile: truncate fail, file: %s", pathIndex.c_str());
+        fRet = false;
+    }
+    while (fRet && nValidSize < nFileSize)
+    {
+        CTimeSeriesIndexEntry entry;
+        if (!ScanIndexEntry(fpData, nValidSize, nFileSize, entry))
+        {
+            break;
+        }
+        if (!WriteIndexEntry(fpIndex, entry))
+        {
+            StdError("TimeSeriesBase", "UpdateIndexFile: write fail, file: %s", pathIndex.c_str());
+            fRet = false;
+            break;
+        }
+        nValidSize = entry.GetEnd();
+    }
+    fclose(fpData);
+    fclose(fpIndex);
+    return fRet;
 }
 
-void CTimeSeriesCached::ResetCache()
+bool CTimeSeriesBase::TruncateIndexFile(uint32 nFile, uint32 nOffset)
 {
-    cacheStream.Clear();
-    mapCachePos.clear();
+    string pathIndex = IndexFilePath(nFile);
+    if (!exists(path(pathIndex)))
+    {
+        return true;
+    }
+    FILE* fp = fopen(pathIndex.c_str(), "r+b");
+    if (fp == nullptr)
+    {
+        return false;
+    }
+    uint32 nEntry = file_size(path(pathIndex)) / INDEX_ENTRY_SIZE;
+    CTimeSeriesIndexEntry entry;
+    while (nEntry > 0 && !(ReadIndexEntry(fp, nEntry - 1, entry) && entry.GetEnd() <= nOffset))
+    {
+        nEntry--;
+    }
+    fclose(fp);
+    try
+    {
+        boost::filesystem::resize_file(path(pathIndex), (uint64)nEntry * INDEX_ENTRY_SIZE);
+    }
+    catch (exception& e)
+    {
+        StdError("TimeSeriesBase", "TruncateIndexFile: resize fail, file: %s, msg: %s", pathIndex.c_str(), e.what());
+        return false;
+    }
+    return true;
 }
 
-bool CTimeSeriesCached::VacateCache(uint32 nNeeded)
+bool CTimeSeriesBase::ReadIndexEntry(FILE* fp, uint32 nEntry, CTimeSeriesIndexEntry& entry)
 {
-    const size_t nHdrSize = 12;
+    char buf[INDEX_ENTRY_SIZE];
+    if (fseek(fp, (long)nEntry * INDEX_ENTRY_SIZE, SEEK_SET) != 0 || fread(buf, 1, INDEX_ENTRY_SIZE, fp) != INDEX_ENTRY_SIZE)
+    {
+        return false;
+    }
+    try
+    {
+        CMemoryStream ms(buf, INDEX_ENTRY_SIZE);
+        ms >> entry;
+    }
+    catch (exception& e)
+    {
+        return false;
+    }
+    return (entry.nCheck == crypto::crc24q((const unsigned char*)buf, INDEX_ENTRY_SIZE - 4));
+}
 
-    while (cacheStream.GetBufFreeSpace() < nNeeded + nHdrSize)
+bool CTimeSeriesBase::ScanIndexEntry(FILE* fp, uint32 nOffset, size_t nFileSize, CTimeSeriesIndexEntry& entry)
+{
+    // the hash covers the stored payload, that is the snappy data of a compressed record
+    uint32 nHeader[2];
+    if (fseek(fp, nOffset, SEEK_SET) != 0 || fread(nHeader, 1, sizeof(nHeader), fp) != sizeof(nHeader)
+        || nHeader[0] != nMagicNum || (uint64)nOffset + 8 + (nHeader[1] & ~COMPRESSED_FLAG) > nFileSize)
+    {
+        return false;
+    }
+    uint32 nSize = (nHeader[1] & ~COMPRESSED_FLAG);
+    uint32 nStored = nSize;
+    if (nHeader[1] & COMPRESSED_FLAG)
+    {
+        uint32 nCompressed = 0;
+        if (fread(&nCompressed, 1, 4, fp) != 4 || (uint64)nCompressed + 4 > nSize || fseek(fp, nOffset + 8, SEEK_SET) != 0)
+        {
+            return false;
+        }
+        nStored = nCompressed + 4;
+    }
+    vector<char> vData(nStored);
+    if (nStored != 0 && fread(vData.data(), 1, nStored, fp) != nStored)
     {
-        CDiskPos diskpos;
-        uint32 nSize = 0;
+        return false;
+    }
+    entry = CTimeSeriesIndexEntry(nOffset, nHeader[1], RecordHash(vData.data(), nStored));
+    return true;
+}
 
-        try
+void CTimeSeriesBase::AppendIndex(const char* pData, size_t nSize, uint32 nOffset)
+{
+    // pData holds whole records as written, the hole after a compressed record is not included
+    size_t nPos = 0;
+    while (nPos + 8 <= nSize)
+    {
+        uint32 nHeader[2];
+        memcpy(nHeader, pData + nPos, 8);
+        uint32 nStored = (nHeader[1] & ~COMPRESSED_FLAG);
+        if ((nHeader[1] & COMPRESSED_FLAG) && nPos + 12 <= nSize)
         {
-            cacheStream.Rewind();
-            cacheStream >> diskpos >> nSize;
+            memcpy(&nStored, pData + nPos + 8, 4);
+            nStored += 4;
         }
-        catch (exception& e)
+        if (nPos + 8 + nStored > nSize)
         {
-            StdError(__PRETTY_FUNCTION__, e.what());
-            return false;
+            break;
         }
+        CTimeSeriesIndexEntry entry(nOffset, nHeader[1], RecordHash(pData + nPos + 8, nStored));
+        if (!WriteIndexEntry(pIndexFile, entry))
+        {
+            StdError("TimeSeriesBase", "AppendIndex: write fail, file: %d", nAppendFile);
+            fclose(pIndexFile);
+            pIndexFile = nullptr;
+            return;
+        }
+        nPos += 8 + nStored;
+        nOffset = entry.GetEnd();
+    }
+    fflush(pIndexFile);
+}
+
+bool CTimeSeriesBase::WriteIndexEntry(FILE* fp, CTimeSeriesIndexEntry& entry)
+{
+    CBufStream ss;
+    ss << entry;
+    entry.nCheck = crypto::crc24q((const unsigned char*)ss.GetData(), INDEX_ENTRY_SIZE - 4);
+    memcpy(ss.GetData() + INDEX_ENTRY_SIZE - 4, &entry.nCheck, 4);
+    return (fwrite(ss.GetData(), 1, INDEX_ENTRY_SIZE, fp) == INDEX_ENTRY_SIZE);
+}
+
+uint64 CTimeSeriesBase::RecordHash(const char* pData, size_t nSize)
+{
+    return crypto::CryptoHash(pData, nSize).Get64();
+}
+
+//////////////////////////////
+// CTimeSeriesMappedFile
 
-        mapCachePos.erase(diskpos);
-        cacheStream.Consume(nSize + nHdrSize);
+CTimeSeriesMappedFile::CTimeSeriesMappedFile(const string& strPath)
+  : mapping(strPath.c_str(), boost::interprocess::read_only),
+    region(mapping, boost::interprocess::read_only)
+{
+}
+
+void CTimeSeriesMappedFile::AdviseWillNeed(size_t nOffset, size_t nSize)
+{
+#ifndef WIN32
+    size_t nPageSize = boost::interprocess::mapped_region::get_page_size();
+    size_t nBegin = nOffset - nOffset % nPageSize;
+    size_t nEnd = min(nOffset + nSize, region.get_size());
+    if (nBegin < nEnd)
+    {
+        madvise(static_cast<char*>(region.get_address()) + nBegin, nEnd - nBegin, MADV_WILLNEED);
     }
-    return true;
+#endif
 }
 
 //////////////////////////////
-// CTimeSeriesChunk
+// CTimeSeriesCache
 
-const uint32 CTimeSeriesChunk::nMagicNum = 0x5E33A1EF;
+CTimeSeriesCache::CTimeSeriesCache(size_t nMaxSizeIn)
+  : nShardMaxSize(nMaxSizeIn / SHARD_COUNT), nHit(0), nMiss(0), nEviction(0)
+{
+}
 
-CTimeSeriesChunk::CTimeSeriesChunk()
+void CTimeSeriesCache::SetMaxSize(size_t nMaxSizeIn)
 {
+    nShardMaxSize = nMaxSizeIn / SHARD_COUNT;
+    for (int i = 0; i < SHARD_COUNT; i++)
+    {
+        CWriteLock wlock(vShard[i].rwAccess);
+
+        Evict(vShard[i], nShardMaxSize);
+    }
 }
 
-CTimeSeriesChunk::~CTimeSeriesChunk()
+CTimeSeriesCache::CRecord CTimeSeriesCache::Retrieve(const CDiskPos& pos)
+{
+    CShard& shard = GetShard(pos);
+    CReadLock rlock(shard.rwAccess);
+
+    map<CDiskPos, CEntry>::iterator it = shard.mapRecord.find(pos);
+    if (it != shard.mapRecord.end())
+    {
+        ++nHit;
+        return (*it).second.spRecord;
+    }
+    ++nMiss;
+    return nullptr;
+}
+
+void CTimeSeriesCache::AddNew(const CDiskPos& pos, const CRecord& spRecord)
+{
+    size_t nMaxSize = nShardMaxSize;
+    if (spRecord->size() > nMaxSize)
+    {
+        return;
+    }
+
+    CShard& shard = GetShard(pos);
+    CWriteLock wlock(shard.rwAccess);
+
+    pair<map<CDiskPos, CEntry>::iterator, bool> ret = shard.mapRecord.insert(make_pair(pos, CEntry()));
+    if (!ret.second)
+    {
+        return;
+    }
+    (*ret.first).second.spRecord = spRecord;
+    (*ret.first).second.itFifo = shard.listFifo.insert(shard.listFifo.end(), pos);
+    shard.nSize += spRecord->size();
+
+    Evict(shard, nMaxSize);
+}
+
+void CTimeSeriesCache::Remove(const CDiskPos& pos)
+{
+    CShard& shard = GetShard(pos);
+    CWriteLock wlock(shard.rwAccess);
+
+    map<CDiskPos, CEntry>::iterator it = shard.mapRecord.find(pos);
+    if (it != shard.mapRecord.end())
+    {
+        EraseEntry(shard, it);
+    }
+}
+
+void CTimeSeriesCache::Clear()
+{
+    for (int i = 0; i < SHARD_COUNT; i++)
+    {
+        CWriteLock wlock(vShard[i].rwAccess);
+
+        vShard[i].mapRecord.clear();
+        vShard[i].listFifo.clear();
+        vShard[i].nSize = 0;
+    }
+}
+
+void CTimeSeriesCache::Evict(CShard& shard, size_t nMaxSize)
+{
+    while (shard.nSize > nMaxSize && !shard.listFifo.empty())
+    {
+        EraseEntry(shard, shard.mapRecord.find(shard.listFifo.front()));
+        ++nEviction;
+    }
+}
+
+void CTimeSeriesCache::EraseEntry(CShard& shard, map<CDiskPos, CEntry>::iterator it)
+{
+    shard.nSize -= (*it).second.spRecord->size();
+    shard.listFifo.erase((*it).second.itFifo);
+    shard.mapRecord.erase(it);
+}
+
+void CTimeSeriesCache::GetStat(CTimeSeriesCacheStat& stat)
+{
+    stat.nHit = nHit;
+    stat.nMiss = nMiss;
+    stat.nEviction = nEviction;
+    stat.nCount = 0;
+    stat.nSize = 0;
+    stat.nMaxSize = nShardMaxSize * SHARD_COUNT;
+    for (int i = 0; i < SHARD_COUNT; i++)
+    {
+        CReadLock rlock(vShard[i].rwAccess);
+
+        stat.nCount += vShard[i].mapRecord.size();
+        stat.nSize += vShard[i].nSize;
+    }
+}
+
+//////////////////////////////
+// CTimeSeriesWalkPool
+
+CTimeSeriesWalkPool::CTimeSeriesWalkPool(size_t nThreadIn, size_t nWindowIn)
+  : nThread(nThreadIn), nWindow(nWindowIn), nJob(0), nNextJob(0), nConsumed(0), fStop(false)
+{
+}
+
+CTimeSeriesWalkPool::~CTimeSeriesWalkPool()
+{
+    Stop();
+}
+
+bool CTimeSeriesWalkPool::Start(size_t nJobIn, const JobFunc& fnJobIn)
 {
+    nJob = nJobIn;
+    nNextJob = 0;
+    nConsumed = 0;
+    vDone.assign(nJob, false);
+    fnJob = fnJobIn;
+    fStop = false;
+
+    try
+    {
+        for (size_t i = 0; i < nThread && i < nJob; i++)
+        {
+            threadGroup.create_thread(boost::bind(&CTimeSeriesWalkPool::WorkerProc, this));
+        }
+    }
+    catch (exception& e)
+    {
+        StdError(__PRETTY_FUNCTION__, e.what());
+        Stop();
+        return false;
+    }
+    return true;
+}
+
+void CTimeSeriesWalkPool::WaitFor(size_t nJobWait)
+{
+    boost::unique_lock<boost::mutex> lock(mtxJob);
+
+    // jobs before nJobWait have been consumed, slide the window forward
+    if (nJobWait > nConsumed)
+    {
+        nConsumed = nJobWait;
+        condWork.notify_all();
+    }
+    while (nJobWait < nJob && !vDone[nJobWait])
+    {
+        condDone.wait(lock);
+    }
+}
+
+void CTimeSeriesWalkPool::Stop()
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mtxJob);
+        fStop = true;
+    }
+    condWork.notify_all();
+    threadGroup.join_all();
+}
+
+void CTimeSeriesWalkPool::WorkerProc()
+{
+    SetThreadName("TimeSeriesWalk");
+
+    boost::unique_lock<boost::mutex> lock(mtxJob);
+    while (!fStop && nNextJob < nJob)
+    {
+        if (nNextJob >= nConsumed + nWindow)
+        {
+            condWork.wait(lock);
+            continue;
+        }
+        size_t n = nNextJob++;
+
+        lock.unlock();
+        fnJob(n);
+        lock.lock();
+
+        vDone[n] = true;
+        condDone.notify_all();
+    }
+}
+
+//////////////////////////////
+// CTimeSeriesCached
+
+CTimeSeriesCached::CTimeSeriesCached()
+  : cache(FILE_CACHE_SIZE), nReading(0), fRepairing(false), fMappedRead(true), nWalkThread(0),
+    fCompress(false), nCompressMinSize(DEFAULT_COMPRESS_MIN_SIZE), nCompressedGeneration(0)
+{
+    fIndexFile = true;
+    pThreadCompress = nullptr;
+    fStopCompress = true;
+    pThreadSync = nullptr;
+    fStopSync = true;
+}
+
+CTimeSeriesCached::~CTimeSeriesCached()
+{
+    StopCompressThread();
+    StopSyncThread();
+}
+
+bool CTimeSeriesCached::Initialize(const path& pathLocationIn, const string& strPrefixIn)
+{
+
+    if (!CTimeSeriesBase::Initialize(pathLocationIn, strPrefixIn))
+    {
+        return false;
+    }
+
+    {
+        boost::unique_lock<boost::mutex> lock(mtxWriter);
+
+        ResetCache();
+    }
+    return StartSyncThread();
+}
+
+void CTimeSeriesCached::Deinitialize()
+{
+    StopCompressThread();
+    StopSyncThread();
+
+    boost::unique_lock<boost::mutex> lock(mtxWriter);
+
+    ResetCache();
+    ResetMappedFile();
+    ResetCompressedRecord();
+    CloseAppendFile();
+}
+
+void CTimeSeriesCached::SetMappedRead(bool fMappedReadIn)
+{
+    boost::unique_lock<boost::mutex> lock(mtxWriter);
+
+    fMappedRead = fMappedReadIn;
+    if (!fMappedRead)
+    {
+        ResetMappedFile();
+    }
+}
+
+void CTimeSeriesCached::SetWalkThread(size_t nWalkThreadIn)
+{
+    nWalkThread = nWalkThreadIn;
+}
+
+void CTimeSeriesCached::SetCacheSize(size_t nCacheSize)
+{
+    cache.SetMaxSize(nCacheSize);
+}
+
+void CTimeSeriesCached::GetCacheStat(CTimeSeriesCacheStat& stat)
+{
+    cache.GetStat(stat);
+}
+
+void CTimeSeriesCached::SetCompress(bool fCompressIn, uint32 nCompressMinSizeIn)
+{
+    boost::unique_lock<boost::mutex> lock(mtxWriter);
+
+    fCompress = fCompressIn;
+    nCompressMinSize = nCompressMinSizeIn;
+}
+
+bool CTimeSeriesCached::StartCompressThread()
+{
+    StopCompressThread();
+
+    fStopCompress = false;
+    pThreadCompress = new boost::thread(boost::bind(&CTimeSeriesCached::CompressProc, this));
+    if (pThreadCompress == nullptr)
+    {
+        fStopCompress = true;
+        return false;
+    }
+    return true;
+}
+
+void CTimeSeriesCached::StopCompressThread()
+{
+    if (pThreadCompress)
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mtxCompressThread);
+            fStopCompress = true;
+        }
+        condCompress.notify_all();
+        pThreadCompress->join();
+        delete pThreadCompress;
+        pThreadCompress = nullptr;
+    }
+}
+
+bool CTimeSeriesCached::CompressFile(uint32 nFile)
+{
+    if (!IsSealedFile(nFile))
+    {
+        return false;
+    }
+
+    string pathFile;
+    if (!GetFilePath(nFile, pathFile))
+    {
+        return false;
+    }
+    string pathTemp = pathFile + ".temp";
+    size_t nFileSize = file_size(path(pathFile));
+
+    FILE* pReadFd = fopen(pathFile.c_str(), "rb");
+    if (pReadFd == nullptr)
+    {
+        StdError("TimeSeriesCached", "CompressFile: fopen fail, file: %s", pathFile.c_str());
+        return false;
+    }
+    FILE* pWriteFd = fopen(pathTemp.c_str(), "wb");
+    if (pWriteFd == nullptr)
+    {
+        StdError("TimeSeriesCached", "CompressFile: fopen fail, file: %s", pathTemp.c_str());
+        fclose(pReadFd);
+        return false;
+    }
+
+    boost::shared_ptr<map<uint32, uint32>> spRecord(new map<uint32, uint32>());
+    vector<CTimeSeriesIndexEntry> vEntry;
+    CTimeSeriesCompressStat stat;
+    bool fRet = true;
+    uint32 nOffset = 0;
+    vector<char> vData;
+    string strCompressed;
+    while (nOffset < nFileSize)
+    {
+        uint32 nHeader[2];
+        if (fseek(pReadFd, nOffset, SEEK_SET) != 0 || fread(nHeader, 1, sizeof(nHeader), pReadFd) != sizeof(nHeader)
+            || nHeader[0] != nMagicNum || nOffset + 8 + (nHeader[1] & ~COMPRESSED_FLAG) > nFileSize)
+        {
+            StdError("TimeSeriesCached", "CompressFile: record error, file: %d, offset: %u", nFile, nOffset);
+            fRet = false;
+            break;
+        }
+        uint32 nSize = (nHeader[1] & ~COMPRESSED_FLAG);
+        uint32 nStored = nSize;
+        if (nHeader[1] & COMPRESSED_FLAG)
+        {
+            uint32 nCompressed = 0;
+            if (fread(&nCompressed, 1, 4, pReadFd) != 4 || nCompressed + 4 > nSize)
+            {
+                fRet = false;
+                break;
+            }
+            vData.resize(nCompressed);
+            if (fread(vData.data(), 1, nCompressed, pReadFd) != nCompressed)
+            {
+                fRet = false;
+                break;
+            }
+            strCompressed.assign(vData.begin(), vData.end());
+        }
+        else
+        {
+            vData.resize(nSize);
+            if (fread(vData.data(), 1, nSize, pReadFd) != nSize)
+            {
+                fRet = false;
+                break;
+            }
+            strCompressed.clear();
+            if (nSize >= nCompressMinSize)
+            {
+                snappy::Compress(vData.data(), nSize, &strCompressed);
+            }
+        }
+
+        if (!strCompressed.empty() && strCompressed.size() + 4 + COMPRESS_MIN_SAVING <= nSize)
+        {
+            uint32 nCompressed = strCompressed.size();
+            nHeader[1] = (nSize | COMPRESSED_FLAG);
+            fRet = (fseek(pWriteFd, nOffset, SEEK_SET) == 0
+                    && fwrite(nHeader, 1, sizeof(nHeader), pWriteFd) == sizeof(nHeader)
+                    && fwrite(&nCompressed, 1, 4, pWriteFd) == 4
+                    && fwrite(strCompressed.data(), 1, nCompressed, pWriteFd) == nCompressed);
+            spRecord->insert(make_pair(nOffset + 8, nSize));
+            nStored = nCompressed + 4;
+            stat.nCompressedRecord++;
+            strCompressed.insert(0, (const char*)&nCompressed, 4);
+            vEntry.push_back(CTimeSeriesIndexEntry(nOffset, nHeader[1], RecordHash(strCompressed.data(), nStored)));
+        }
+        else
+        {
+            nHeader[1] = nSize;
+            fRet = (fseek(pWriteFd, nOffset, SEEK_SET) == 0
+                    && fwrite(nHeader, 1, sizeof(nHeader), pWriteFd) == sizeof(nHeader)
+                    && fwrite(vData.data(), 1, nSize, pWriteFd) == nSize);
+            vEntry.push_back(CTimeSeriesIndexEntry(nOffset, nHeader[1], RecordHash(vData.data(), nSize)));
+        }
+        if (!fRet)
+        {
+            StdError("TimeSeriesCached", "CompressFile: write error, file: %s", pathTemp.c_str());
+            break;
+        }
+        stat.nRecord++;
+        stat.nRawSize += nSize;
+        stat.nStoredSize += nStored;
+        nOffset += 8 + nSize;
+    }
+    fclose(pReadFd);
+
+#ifndef WIN32
+    if (fRet && (fflush(pWriteFd) != 0 || ftruncate(fileno(pWriteFd), nOffset) != 0 || fsync(fileno(pWriteFd)) != 0))
+#else
+    if (fRet && (fflush(pWriteFd) != 0 || _chsize_s(_fileno(pWriteFd), nOffset) != 0 || _commit(_fileno(pWriteFd)) != 0))
+#endif
+    {
+        StdError("TimeSeriesCached", "CompressFile: sync fail, file: %s", pathTemp.c_str());
+        fRet = false;
+    }
+    fclose(pWriteFd);
+
+    if (!fRet)
+    {
+        boost::filesystem::remove(path(pathTemp));
+        return false;
+    }
+
+    // The record table is in place before the data file is replaced, readers of the old file content
+    // fall back to the raw record through the header flag. The mark is written once the rename succeeded,
+    // a pending mark left by a crash in between is taken as the mark.
+    string pathMark = CompressedMarkPath(nFile);
+    FILE* fp = fopen((pathMark + ".temp").c_str(), "ab");
+    if (fp == nullptr)
+    {
+        boost::filesystem::remove(path(pathTemp));
+        return false;
+    }
+    fclose(fp);
+    {
+        CWriteLock wlock(rwCompressed);
+
+        mapCompressedRecord[nFile] = spRecord;
+        nCompressedGeneration++;
+    }
+    try
+    {
+        boost::filesystem::rename(path(pathTemp), path(pathFile));
+    }
+    catch (exception& e)
+    {
+        StdError("TimeSeriesCached", "CompressFile: rename fail, file: %s, msg: %s", pathTemp.c_str(), e.what());
+        boost::filesystem::remove(path(pathTemp));
+        boost::filesystem::remove(path(pathMark + ".temp"));
+        CWriteLock wlock(rwCompressed);
+        mapCompressedRecord.erase(nFile);
+        nCompressedGeneration++;
+        return false;
+    }
+    InvalidateMappedFile(nFile);
+    try
+    {
+        boost::filesystem::rename(path(pathMark + ".temp"), path(pathMark));
+    }
+    catch (exception& e)
+    {
+        StdError("TimeSeriesCached", "CompressFile: mark rename fail, file: %s, msg: %s", pathMark.c_str(), e.what());
+    }
+    boost::system::error_code ec;
+    boost::filesystem::remove(path(RawMarkPath(nFile)), ec);
+
+    // entries of the old file no longer match the stored payload, a sidecar left behind by a
+    // failure here is dropped and rebuilt on the next check
+    string pathIndex = IndexFilePath(nFile);
+    FILE* fpIndex = fopen((pathIndex + ".temp").c_str(), "wb");
+    if (fpIndex != nullptr)
+    {
+        bool fIndexRet = true;
+        for (size_t i = 0; i < vEntry.size() && fIndexRet; i++)
+        {
+            fIndexRet = WriteIndexEntry(fpIndex, vEntry[i]);
+        }
+        fclose(fpIndex);
+        try
+        {
+            if (fIndexRet)
+            {
+                boost::filesystem::rename(path(pathIndex + ".temp"), path(pathIndex));
+            }
+            else
+            {
+                boost::filesystem::remove(path(pathIndex + ".temp"));
+            }
+        }
+        catch (exception& e)
+        {
+            StdError("TimeSeriesCached", "CompressFile: index rename fail, file: %s, msg: %s", pathIndex.c_str(), e.what());
+        }
+    }
+
+    {
+        boost::unique_lock<boost::mutex> lock(mtxCompressed);
+
+        statCompress.nRecord += stat.nRecord;
+        statCompress.nCompressedRecord += stat.nCompressedRecord;
+        statCompress.nRawSize += stat.nRawSize;
+        statCompress.nStoredSize += stat.nStoredSize;
+    }
+    StdLog("TimeSeriesCached", "CompressFile: file: %d, records: %lu, compressed: %lu, ratio: %.3f",
+           nFile, stat.nRecord, stat.nCompressedRecord, stat.GetRatio());
+    return true;
+}
+
+void CTimeSeriesCached::GetCompressStat(CTimeSeriesCompressStat& stat)
+{
+    boost::unique_lock<boost::mutex> lock(mtxCompressed);
+
+    stat = statCompress;
+}
+
+bool CTimeSeriesCached::CheckTail(uint32& nLastFileRet, uint32& nLastPosRet, bool fRepairFile)
+{
+    // record boundaries come from the sidecar, only the last indexed record of each file
+    // and the records after it are read
+    boost::unique_lock<boost::mutex> lock(mtxWriter);
+
+    bool fRet = true;
+    uint32 nFile = 1;
+    nLastFileRet = 0;
+    nLastPosRet = 0;
+    string pathFile;
+    while (GetFilePath(nFile, pathFile))
+    {
+        uint32 nValidSize = 0;
+        if (!UpdateIndexFile(nFile, nValidSize))
+        {
+            StdError("TimeSeriesCached", "CheckTail: update index fail, nFile: %d", nFile);
+            return false;
+        }
+        nLastFileRet = nFile;
+        nLastPosRet = nValidSize;
+        size_t nFileSize = file_size(path(pathFile));
+        if (nValidSize != nFileSize)
+        {
+            StdError("TimeSeriesCached", "CheckTail: record error, nFile: %d, nOffset: %u, nFileSize: %lu",
+                     nFile, nValidSize, nFileSize);
+            fRet = false;
+            if (fRepairFile)
+            {
+                if (!RepairTail(nFile, nValidSize))
+                {
+                    StdError("TimeSeriesCached", "CheckTail: RepairFile fail");
+                    return false;
+                }
+                StdLog("TimeSeriesCached", "CheckTail: RepairFile success");
+                fRet = true;
+            }
+            break;
+        }
+        nFile++;
+    }
+    return fRet;
+}
+
+void CTimeSeriesCached::Prefetch(const vector<CDiskPos>& vPos, size_t nBegin, size_t nEnd)
+{
+    // Positions close together in one file are hinted as a single span, a record is assumed to
+    // end within PREFETCH_RECORD_SIZE of its position. Hints are asynchronous, nothing is read here.
+    size_t i = nBegin;
+    while (i < nEnd)
+    {
+        uint32 nFile = vPos[i].nFile;
+        uint32 nSpanBegin = vPos[i].nOffset;
+        uint32 nSpanEnd = vPos[i].nOffset;
+        for (i++; i < nEnd && vPos[i].nFile == nFile; i++)
+        {
+            uint32 nNewBegin = min(nSpanBegin, vPos[i].nOffset);
+            uint32 nNewEnd = max(nSpanEnd, vPos[i].nOffset);
+            if (nNewEnd - nNewBegin > PREFETCH_SPAN)
+            {
+                break;
+            }
+            nSpanBegin = nNewBegin;
+            nSpanEnd = nNewEnd;
+        }
+        PrefetchFile(nFile, (nSpanBegin >= 8 ? nSpanBegin - 8 : 0), nSpanEnd + PREFETCH_RECORD_SIZE);
+    }
+}
+
+void CTimeSeriesCached::PrefetchFile(uint32 nFile, uint32 nBegin, uint32 nEnd)
+{
+    if (fMappedRead)
+    {
+        boost::shared_ptr<CTimeSeriesMappedFile> spMapped = GetMappedFile(nFile, nBegin);
+        if (spMapped != nullptr)
+        {
+            spMapped->AdviseWillNeed(nBegin, nEnd - nBegin);
+            return;
+        }
+    }
+#if !defined(WIN32) && !defined(__APPLE__)
+    string pathFile;
+    if (GetFilePath(nFile, pathFile))
+    {
+        int fd = open(pathFile.c_str(), O_RDONLY);
+        if (fd >= 0)
+        {
+            // the hint outlives the descriptor, pages are read into the page cache in background
+            posix_fadvise(fd, nBegin, nEnd - nBegin, POSIX_FADV_WILLNEED);
+            close(fd);
+        }
+    }
+#endif
+}
+
+void CTimeSeriesCached::ResetCache()
+{
+    cache.Clear();
+}
+
+void CTimeSeriesCached::BeginRead()
+{
+    for (;;)
+    {
+        ++nReading;
+        if (!fRepairing)
+        {
+            return;
+        }
+        EndRead();
+
+        boost::unique_lock<boost::mutex> lock(mtxRepair);
+        while (fRepairing)
+        {
+            condRepair.wait(lock);
+        }
+    }
+}
+
+void CTimeSeriesCached::EndRead()
+{
+    if (--nReading == 0 && fRepairing)
+    {
+        boost::unique_lock<boost::mutex> lock(mtxRepair);
+        condRepair.notify_all();
+    }
+}
+
+bool CTimeSeriesCached::RepairTail(uint32 nFile, uint32 nOffset)
+{
+    // no reader is left on a mapping of the file, and none reinserts a record read before the reset
+    boost::unique_lock<boost::mutex> lock(mtxRepair);
+    fRepairing = true;
+    while (nReading != 0)
+    {
+        condRepair.wait(lock);
+    }
+
+    ResetCache();
+    ResetMappedFile();
+    ResetCompressedRecord();
+    CloseAppendFile();
+    bool fRet = RepairFile(nFile, nOffset);
+
+    fRepairing = false;
+    condRepair.notify_all();
+    return fRet;
+}
+
+bool CTimeSeriesCached::AppendCompressed(CBufStream& ss, CDiskPos& pos)
+{
+    uint32 nSize = ss.GetSize();
+    string strCompressed;
+    if (nSize >= nCompressMinSize)
+    {
+        snappy::Compress(ss.GetData(), nSize, &strCompressed);
+    }
+
+    uint32 nOffset;
+    if (!OpenAppendFile(pos.nFile, nOffset))
+    {
+        return false;
+    }
+
+    CBufStream ssRecord;
+    uint32 nStored = nSize;
+    if (!strCompressed.empty() && strCompressed.size() + 4 + COMPRESS_MIN_SAVING <= nSize)
+    {
+        // Records in front of the first compressed one stay raw, most often because compression was
+        // enabled while the file was appended. The raw mark keeps the file on the list of the convert pass.
+        string pathMark = CompressedMarkPath(pos.nFile);
+        if (!exists(path(pathMark)))
+        {
+            if (nOffset > 0 && !CreateMark(RawMarkPath(pos.nFile)))
+            {
+                StdError("TimeSeriesCached", "AppendCompressed: create raw mark fail, file: %d", pos.nFile);
+                return false;
+            }
+            if (!CreateMark(pathMark))
+            {
+                StdError("TimeSeriesCached", "AppendCompressed: create mark fail, file: %d", pos.nFile);
+                return false;
+            }
+        }
+
+        nStored = strCompressed.size() + 4;
+        ssRecord << nMagicNum << (uint32)(nSize | COMPRESSED_FLAG) << (uint32)strCompressed.size();
+        ssRecord.Write(strCompressed.data(), strCompressed.size());
+        if (!AppendToFile(ssRecord) || !AppendHole(nSize - nStored))
+        {
+            return false;
+        }
+        AddCompressedRecord(pos.nFile, nOffset + 8, nSize);
+    }
+    else
+    {
+        ssRecord << nMagicNum << nSize;
+        ssRecord.Write(ss.GetData(), nSize);
+        if (!AppendToFile(ssRecord))
+        {
+            return false;
+        }
+    }
+    pos.nOffset = nOffset + 8;
+    SyncAppendFile(false);
+
+    boost::unique_lock<boost::mutex> lock(mtxCompressed);
+    statCompress.nRecord++;
+    statCompress.nCompressedRecord += (nStored != nSize);
+    statCompress.nRawSize += nSize;
+    statCompress.nStoredSize += nStored;
+    return true;
+}
+
+string CTimeSeriesCached::CompressedMarkPath(uint32 nFile)
+{
+    return (pathLocation / FileName(nFile)).replace_extension(".cmp").string();
+}
+
+string CTimeSeriesCached::RawMarkPath(uint32 nFile)
+{
+    return (pathLocation / FileName(nFile)).replace_extension(".raw").string();
+}
+
+bool CTimeSeriesCached::CreateMark(const string& pathMark)
+{
+    FILE* fp = fopen(pathMark.c_str(), "ab");
+    if (fp == nullptr)
+    {
+        return false;
+    }
+    fclose(fp);
+    return true;
+}
+
+bool CTimeSeriesCached::IsSealedFile(uint32 nFile)
+{
+    boost::unique_lock<boost::mutex> lock(mtxWriter);
+
+    // the last file is still appended
+    return (nFile < nLastFile && (pAppendFile == nullptr || nFile < nAppendFile));
+}
+
+bool CTimeSeriesCached::GetCompressedRecord(uint32 nFile, uint32 nOffset, uint32& nStart, uint32& nSize)
+{
+    for (;;)
+    {
+        uint64 nGeneration = 0;
+        {
+            CReadLock rlock(rwCompressed);
+
+            map<uint32, boost::shared_ptr<map<uint32, uint32>>>::iterator it = mapCompressedRecord.find(nFile);
+            if (it != mapCompressedRecord.end())
+            {
+                if ((*it).second == nullptr)
+                {
+                    return false;
+                }
+                map<uint32, uint32>::iterator mi = (*it).second->upper_bound(nOffset);
+                if (mi == (*it).second->begin())
+                {
+                    return false;
+                }
+                --mi;
+                nStart = (*mi).first;
+                nSize = (*mi).second;
+                return (nOffset < nStart + nSize);
+            }
+            nGeneration = nCompressedGeneration;
+        }
+
+        // Files that ever got a compressed record carry a mark, only those are scanned for record headers.
+        // The scan runs unlocked, its table is dropped if a record was added or a file replaced meanwhile.
+        boost::shared_ptr<map<uint32, uint32>> spRecord;
+        string pathFile, pathMark = CompressedMarkPath(nFile);
+        if ((exists(path(pathMark)) || exists(path(pathMark + ".temp"))) && GetFilePath(nFile, pathFile))
+        {
+            spRecord.reset(new map<uint32, uint32>());
+            FILE* fp = fopen(pathFile.c_str(), "rb");
+            if (fp != nullptr)
+            {
+                uint32 nHeader[2];
+                uint32 nPos = 0;
+                while (fseek(fp, nPos, SEEK_SET) == 0 && fread(nHeader, 1, sizeof(nHeader), fp) == sizeof(nHeader)
+                       && nHeader[0] == nMagicNum)
+                {
+                    if (nHeader[1] & COMPRESSED_FLAG)
+                    {
+                        spRecord->insert(make_pair(nPos + 8, nHeader[1] & ~COMPRESSED_FLAG));
+                    }
+                    nPos += 8 + (nHeader[1] & ~COMPRESSED_FLAG);
+                }
+                fclose(fp);
+            }
+        }
+
+        CWriteLock wlock(rwCompressed);
+        if (nGeneration == nCompressedGeneration && !mapCompressedRecord.count(nFile))
+        {
+            mapCompressedRecord.insert(make_pair(nFile, spRecord));
+        }
+    }
+}
+
+void CTimeSeriesCached::AddCompressedRecord(uint32 nFile, uint32 nStart, uint32 nSize)
+{
+    CWriteLock wlock(rwCompressed);
+
+    // a file not loaded yet is scanned on first access
+    map<uint32, boost::shared_ptr<map<uint32, uint32>>>::iterator it = mapCompressedRecord.find(nFile);
+    if (it != mapCompressedRecord.end())
+    {
+        if ((*it).second == nullptr)
+        {
+            (*it).second.reset(new map<uint32, uint32>());
+        }
+        (*it).second->insert(make_pair(nStart, nSize));
+    }
+    nCompressedGeneration++;
+}
+
+void CTimeSeriesCached::ResetCompressedRecord()
+{
+    CWriteLock wlock(rwCompressed);
+
+    mapCompressedRecord.clear();
+    nCompressedGeneration++;
+}
+
+bool CTimeSeriesCached::ReadCompressedRecord(uint32 nFile, uint32 nStart, string& strData)
+{
+    // returns the logical record, the header flag decides whether the stored bytes are compressed
+    if (fMappedRead)
+    {
+        boost::shared_ptr<CTimeSeriesMappedFile> spMapped = GetMappedFile(nFile, nStart);
+        if (spMapped != nullptr && nStart >= 8 && nStart + 4 <= spMapped->GetSize())
+        {
+            const char* p = spMapped->GetData() + nStart;
+            uint32 nHeader[2];
+            memcpy(nHeader, p - 8, 8);
+            uint32 nSize = (nHeader[1] & ~COMPRESSED_FLAG);
+            if (nHeader[0] != nMagicNum)
+            {
+                StdError("TimeSeriesCached", "ReadCompressedRecord: header error, file: %d, offset: %u", nFile, nStart);
+                return false;
+            }
+            // a record cut by the end of the mapping was mid-append when mapped, it is read from the file
+            if (nStart + nSize <= spMapped->GetSize())
+            {
+                if (!(nHeader[1] & COMPRESSED_FLAG))
+                {
+                    strData.assign(p, nSize);
+                    return true;
+                }
+                if (!UncompressRecord(p, nSize, strData))
+                {
+                    StdError("TimeSeriesCached", "ReadCompressedRecord: uncompress fail, file: %d, offset: %u", nFile, nStart);
+                    return false;
+                }
+                return true;
+            }
+        }
+    }
+
+    string pathFile;
+    if (!GetFilePath(nFile, pathFile))
+    {
+        return false;
+    }
+    try
+    {
+        CFileStream fs(pathFile.c_str());
+        fs.Seek(nStart - 8);
+        uint32 nMagic, nSize;
+        fs >> nMagic >> nSize;
+        if (nMagic != nMagicNum)
+        {
+            StdError("TimeSeriesCached", "ReadCompressedRecord: header error, file: %d, offset: %u", nFile, nStart);
+            return false;
+        }
+        if (!(nSize & COMPRESSED_FLAG))
+        {
+            strData.resize(nSize);
+            fs.Read(&strData[0], nSize);
+            return true;
+        }
+        return ReadCompressedPayload(fs, nSize & ~COMPRESSED_FLAG, strData);
+    }
+    catch (exception& e)
+    {
+        StdError(__PRETTY_FUNCTION__, e.what());
+    }
+    return false;
+}
+
+bool CTimeSeriesCached::UncompressRecord(const char* pData, uint32 nSize, string& strData)
+{
+    // pData points to the stored payload of a compressed record in memory, nSize is its logical size
+    uint32 nCompressed;
+    memcpy(&nCompressed, pData, 4);
+    size_t nLength = 0;
+    return (nCompressed + 4 <= nSize && snappy::GetUncompressedLength(pData + 4, nCompressed, &nLength)
+            && nLength == nSize && snappy::Uncompress(pData + 4, nCompressed, &strData));
+}
+
+bool CTimeSeriesCached::ScanWalkFrame(uint32 nFile, const char* pData, size_t nFileSize, vector<CWalkFrame>& vFrame, uint32& nEnd)
+{
+    nEnd = 0;
+    while (nEnd < nFileSize)
+    {
+        uint32 nHeader[2];
+        if (nEnd + 8 > nFileSize)
+        {
+            StdError("TimeSeriesCached", "WalkThrough: header truncated, nFile: %d, nOffset: %u", nFile, nEnd);
+            return false;
+        }
+        memcpy(nHeader, pData + nEnd, 8);
+        if (nHeader[0] != nMagicNum)
+        {
+            StdError("TimeSeriesCached", "WalkThrough: nMagic error, nFile: %d, nMagic=%x, right magic: %x",
+                     nFile, nHeader[0], nMagicNum);
+            return false;
+        }
+        bool fCompressed = ((nHeader[1] & COMPRESSED_FLAG) != 0);
+        uint32 nSize = (nHeader[1] & ~COMPRESSED_FLAG);
+        if ((uint64)nEnd + 8 + nSize > nFileSize || (fCompressed && nSize < 4))
+        {
+            StdError("TimeSeriesCached", "WalkThrough: record size error, nFile: %d, nOffset: %u, nSize: %u", nFile, nEnd, nSize);
+            return false;
+        }
+        vFrame.push_back(CWalkFrame(nEnd + 8, nSize, fCompressed));
+        nEnd += 8 + nSize;
+    }
+    return true;
+}
+
+bool CTimeSeriesCached::ReadCompressedPayload(CFileStream& fs, uint32 nSize, string& strData)
+{
+    uint32 nCompressed;
+    fs >> nCompressed;
+    if (nCompressed + 4 > nSize)
+    {
+        return false;
+    }
+    string strCompressed;
+    strCompressed.resize(nCompressed);
+    fs.Read(&strCompressed[0], nCompressed);
+
+    size_t nLength = 0;
+    return (snappy::GetUncompressedLength(strCompressed.data(), nCompressed, &nLength) && nLength == nSize
+            && snappy::Uncompress(strCompressed.data(), nCompressed, &strData));
+}
+
+void CTimeSeriesCached::CompressProc()
+{
+    SetThreadName("TimeSeriesCompress");
+    boost::system_time timeout = boost::get_system_time();
+    uint32 nFile = 1;
+
+    boost::unique_lock<boost::mutex> lock(mtxCompressThread);
+    while (!fStopCompress)
+    {
+        timeout += boost::posix_time::seconds(TIMESERIES_COMPRESS_INTERVAL);
+
+        while (!fStopCompress)
+        {
+            if (!condCompress.timed_wait(lock, timeout))
+            {
+                break;
+            }
+        }
+
+        // convert the sealed files that were never touched by compression or still hold raw records
+        // in front of the mark, one file per round. A file that fails is skipped until the next start.
+        string pathFile;
+        while (!fStopCompress && GetFilePath(nFile, pathFile))
+        {
+            if (!exists(path(CompressedMarkPath(nFile))) || exists(path(RawMarkPath(nFile))))
+            {
+                if (!IsSealedFile(nFile))
+                {
+                    break;
+                }
+                if (!CompressFile(nFile))
+                {
+                    StdWarn("TimeSeriesCached", "CompressProc: convert fail, skip file: %d", nFile);
+                }
+                nFile++;
+                break;
+            }
+            nFile++;
+        }
+    }
+}
+
+bool CTimeSeriesCached::StartSyncThread()
+{
+    StopSyncThread();
+
+    fStopSync = false;
+    pThreadSync = new boost::thread(boost::bind(&CTimeSeriesCached::SyncProc, this));
+    if (pThreadSync == nullptr)
+    {
+        fStopSync = true;
+        return false;
+    }
+    return true;
+}
+
+void CTimeSeriesCached::StopSyncThread()
+{
+    if (pThreadSync)
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mtxSyncThread);
+            fStopSync = true;
+        }
+        condSync.notify_all();
+        pThreadSync->join();
+        delete pThreadSync;
+        pThreadSync = nullptr;
+    }
+}
+
+void CTimeSeriesCached::SyncProc()
+{
+    // under SYNC_INTERVAL a write is synced by the next write after the interval,
+    // the last writes before an idle period are synced here
+    SetThreadName("TimeSeriesSync");
+
+    boost::unique_lock<boost::mutex> lock(mtxSyncThread);
+    while (!fStopSync)
+    {
+        boost::system_time timeout = boost::get_system_time() + boost::posix_time::milliseconds(max(nSyncInterval, (int64)100));
+        while (!fStopSync)
+        {
+            if (!condSync.timed_wait(lock, timeout))
+            {
+                break;
+            }
+        }
+        if (!fStopSync && nSyncPolicy == SYNC_INTERVAL)
+        {
+            boost::unique_lock<boost::mutex> wlock(mtxWriter);
+            SyncAppendFile(false);
+        }
+    }
+}
+
+boost::shared_ptr<CTimeSeriesMappedFile> CTimeSeriesCached::GetMappedFile(uint32 nFile, uint32 nOffset)
+{
+    boost::unique_lock<boost::mutex> lock(mtxMapped);
+
+    map<uint32, boost::shared_ptr<CTimeSeriesMappedFile>>::iterator it = mapMappedFile.find(nFile);
+    if (it != mapMappedFile.end())
+    {
+        if (nOffset < (*it).second->GetSize())
+        {
+            return (*it).second;
+        }
+        // the file has grown since it was mapped
+        mapMappedFile.erase(it);
+    }
+
+    string pathFile;
+    if (!GetFilePath(nFile, pathFile))
+    {
+        return nullptr;
+    }
+    try
+    {
+        boost::shared_ptr<CTimeSeriesMappedFile> spMapped(new CTimeSeriesMappedFile(pathFile));
+        if (nOffset >= spMapped->GetSize())
+        {
+            return nullptr;
+        }
+        mapMappedFile.insert(make_pair(nFile, spMapped));
+        return spMapped;
+    }
+    catch (exception& e)
+    {
+        StdTrace("TimeSeriesCached", "GetMappedFile: map file fail, file: %s, msg: %s", pathFile.c_str(), e.what());
+    }
+    return nullptr;
+}
+
+void CTimeSeriesCached::InvalidateMappedFile(uint32 nFile)
+{
+    boost::unique_lock<boost::mutex> lock(mtxMapped);
+
+    mapMappedFile.erase(nFile);
+}
+
+void CTimeSeriesCached::ResetMappedFile()
+{
+    boost::unique_lock<boost::mutex> lock(mtxMapped);
+
+    mapMappedFile.clear();
+}
+
+//////////////////////////////
+// CTimeSeriesChunk
+
+CTimeSeriesChunk::CTimeSeriesChunk()
+{
+    // smaller files let compaction give back the space of overwritten chunks file by file
+    nMaxFileSize = CHUNK_FILE_SIZE;
+}
+
+CTimeSeriesChunk::~CTimeSeriesChunk()
+{
+}
+
+bool CTimeSeriesChunk::GetRecordSize(const CDiskPos& pos, uint32& nSize)
+{
+    std::string pathFile;
+    if (pos.nOffset < 8 || !GetFilePath(pos.nFile, pathFile))
+    {
+        return false;
+    }
+    try
+    {
+        uint32 nMagic;
+        xengine::CFileStream fs(pathFile.c_str());
+        fs.Seek(pos.nOffset - 8);
+        fs >> nMagic >> nSize;
+        if (nMagic != nMagicNum)
+        {
+            return false;
+        }
+        nSize += 8;
+    }
+    catch (std::exception& e)
+    {
+        xengine::StdError(__PRETTY_FUNCTION__, e.what());
+        return false;
+    }
+    return true;
+}
+
+bool CTimeSeriesChunk::GetFileSize(uint32 nFile, uint64& nSize)
+{
+    std::string pathFile;
+    if (!GetFilePath(nFile, pathFile))
+    {
+        return false;
+    }
+    nSize = file_size(path(pathFile));
+    return true;
+}
+
+bool CTimeSeriesChunk::IsSealedFile(uint32 nFile)
+{
+    boost::unique_lock<boost::mutex> lock(mtxWriter);
+
+    // only full files are skipped by GetLastFilePath and never appended to again
+    std::string pathFile;
+    return ((pAppendFile == nullptr || nFile != nAppendFile) && GetFilePath(nFile, pathFile)
+            && file_size(path(pathFile)) >= nMaxFileSize - MAX_CHUNK_SIZE - 8);
+}
+
+bool CTimeSeriesChunk::RemoveFile(uint32 nFile)
+{
+    boost::unique_lock<boost::mutex> lock(mtxWriter);
+
+    if (pAppendFile != nullptr && nFile == nAppendFile)
+    {
+        return false;
+    }
+    std::string pathFile;
+    if (GetFilePath(nFile, pathFile) && !boost::filesystem::remove(path(pathFile)))
+    {
+        StdError("TimeSeriesChunk", "RemoveFile: remove fail, file: %s", pathFile.c_str());
+        return false;
+    }
+    // a removed file before the append file is created again by GetLastFilePath and reused
+    if (nFile < nLastFile)
+    {
+        nLastFile = nFile;
+    }
+    return true;
 }
 
 } // namespace storage
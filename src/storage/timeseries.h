@@ -6,7 +6,12 @@
 #define STORAGE_TIMESERIES_H
 
 #include <boost/filesystem.hpp>
+#include <boost/function.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <atomic>
 #include <boost/thread/thread.hpp>
+#include <list>
 #include <xengine.h>
 
 #include "uint256.h"
@@ -53,6 +58,35 @@ protected:
     }
 };
 
+class CTimeSeriesIndexEntry
+{
+    friend class xengine::CStream;
+
+public:
+    uint32 nOffset;
+    uint32 nSize;
+    uint64 nHash;
+    uint32 nCheck;
+
+public:
+    CTimeSeriesIndexEntry(uint32 nOffsetIn = 0, uint32 nSizeIn = 0, uint64 nHashIn = 0)
+      : nOffset(nOffsetIn), nSize(nSizeIn), nHash(nHashIn), nCheck(0) {}
+    uint32 GetEnd() const
+    {
+        return (nOffset + 8 + (nSize & 0x7FFFFFFF));
+    }
+
+protected:
+    template <typename O>
+    void Serialize(xengine::CStream& s, O& opt)
+    {
+        s.Serialize(nOffset, opt);
+        s.Serialize(nSize, opt);
+        s.Serialize(nHash, opt);
+        s.Serialize(nCheck, opt);
+    }
+};
+
 template <typename T>
 class CTSWalker
 {
@@ -63,29 +97,270 @@ public:
 class CTimeSeriesBase
 {
 public:
+    enum
+    {
+        SYNC_PER_WRITE,
+        SYNC_INTERVAL,
+        SYNC_ON_CLOSE
+    };
     CTimeSeriesBase();
     ~CTimeSeriesBase();
     virtual bool Initialize(const boost::filesystem::path& pathLocationIn, const std::string& strPrefixIn);
     virtual void Deinitialize();
+    void SetSyncPolicy(int nSyncPolicyIn, int64 nSyncIntervalIn = 1000);
+    void SetMaxFileSize(uint32 nMaxFileSizeIn);
+    uint64 GetAppendSize() const
+    {
+        return nAppendSize;
+    }
+    bool RebuildIndexFile(uint32& nLastFileRet, uint32& nLastPosRet);
 
 protected:
     bool CheckDiskSpace();
     const std::string FileName(uint32 nFile);
+    std::string IndexFilePath(uint32 nFile);
     bool GetFilePath(uint32 nFile, std::string& strPath);
     bool GetLastFilePath(uint32& nFile, std::string& strPath);
     bool RemoveFollowUpFile(uint32 nBeginFile);
     bool TruncateFile(const std::string& pathFile, uint32 nOffset);
     bool RepairFile(uint32 nFile, uint32 nOffset);
+    bool OpenAppendFile(uint32& nFile, uint32& nOffset);
+    bool AppendToFile(xengine::CBufStream& ss);
+    bool AppendHole(uint32 nSize);
+    void SyncAppendFile(bool fForce);
+    void CloseAppendFile();
+    bool UpdateIndexFile(uint32 nFile, uint32& nValidSize);
+    bool TruncateIndexFile(uint32 nFile, uint32 nOffset);
+    bool ReadIndexEntry(FILE* fp, uint32 nEntry, CTimeSeriesIndexEntry& entry);
+    bool ScanIndexEntry(FILE* fp, uint32 nOffset, std::size_t nFileSize, CTimeSeriesIndexEntry& entry);
+    void AppendIndex(const char* pData, std::size_t nSize, uint32 nOffset);
+    static bool WriteIndexEntry(FILE* fp, CTimeSeriesIndexEntry& entry);
+    static uint64 RecordHash(const char* pData, std::size_t nSize);
+    template <typename T>
+    bool Append(const T& t, CDiskPos& pos)
+    {
+        uint32 nOffset;
+        if (!OpenAppendFile(pos.nFile, nOffset))
+        {
+            return false;
+        }
+        xengine::CBufStream ss;
+        try
+        {
+            uint32 nSize = ss.GetSerializeSize(t);
+            ss << nMagicNum << nSize << t;
+        }
+        catch (std::exception& e)
+        {
+            xengine::StdError(__PRETTY_FUNCTION__, e.what());
+            return false;
+        }
+        if (!AppendToFile(ss))
+        {
+            return false;
+        }
+        pos.nOffset = nOffset + 8;
+        SyncAppendFile(false);
+        return true;
+    }
+    template <typename T>
+    bool AppendBatch(const typename std::vector<T>& vBatch, std::vector<CDiskPos>& vPos)
+    {
+        size_t n = 0;
+        while (n < vBatch.size())
+        {
+            uint32 nFile, nOffset;
+            if (!OpenAppendFile(nFile, nOffset))
+            {
+                return false;
+            }
+            xengine::CBufStream ss;
+            try
+            {
+                do
+                {
+                    uint32 nSize = ss.GetSerializeSize(vBatch[n]);
+                    ss << nMagicNum << nSize;
+                    vPos.push_back(CDiskPos(nFile, nOffset + ss.GetSize()));
+                    ss << vBatch[n++];
+                } while (n < vBatch.size() && nOffset + ss.GetSize() < nMaxFileSize - MAX_CHUNK_SIZE - 8);
+            }
+            catch (std::exception& e)
+            {
+                xengine::StdError(__PRETTY_FUNCTION__, e.what());
+                return false;
+            }
+            if (!AppendToFile(ss))
+            {
+                return false;
+            }
+        }
+        SyncAppendFile(false);
+        return true;
+    }
 
 protected:
     enum
     {
         MAX_FILE_SIZE = 0x7F000000,
-        MAX_CHUNK_SIZE = 0x200000
+        MAX_CHUNK_SIZE = 0x200000,
+        INDEX_ENTRY_SIZE = 20
     };
+    static const uint32 COMPRESSED_FLAG = 0x80000000;
     boost::filesystem::path pathLocation;
     std::string strPrefix;
     uint32 nLastFile;
+    uint32 nMaxFileSize;
+    uint64 nAppendSize;
+    FILE* pAppendFile;
+    uint32 nAppendFile;
+    uint32 nAppendOffset;
+    bool fIndexFile;
+    FILE* pIndexFile;
+    int nSyncPolicy;
+    int64 nSyncInterval;
+    int64 nLastSyncTime;
+    uint64 nSyncedSize;
+    static const uint32 nMagicNum;
+};
+
+class CTimeSeriesMappedFile
+{
+public:
+    CTimeSeriesMappedFile(const std::string& strPath);
+    const char* GetData() const
+    {
+        return static_cast<const char*>(region.get_address());
+    }
+    std::size_t GetSize() const
+    {
+        return region.get_size();
+    }
+    void AdviseSequential()
+    {
+        region.advise(boost::interprocess::mapped_region::advice_sequential);
+    }
+    void AdviseWillNeed(std::size_t nOffset, std::size_t nSize);
+
+protected:
+    boost::interprocess::file_mapping mapping;
+    boost::interprocess::mapped_region region;
+};
+
+class CTimeSeriesCompressStat
+{
+public:
+    CTimeSeriesCompressStat()
+      : nRecord(0), nCompressedRecord(0), nRawSize(0), nStoredSize(0) {}
+    double GetRatio() const
+    {
+        return (nRawSize != 0 ? (double)nStoredSize / nRawSize : 1.0);
+    }
+
+public:
+    uint64 nRecord;
+    uint64 nCompressedRecord;
+    uint64 nRawSize;
+    uint64 nStoredSize;
+};
+
+class CTimeSeriesCacheStat
+{
+public:
+    CTimeSeriesCacheStat()
+      : nHit(0), nMiss(0), nEviction(0), nCount(0), nSize(0), nMaxSize(0) {}
+
+public:
+    uint64 nHit;
+    uint64 nMiss;
+    uint64 nEviction;
+    std::size_t nCount;
+    std::size_t nSize;
+    std::size_t nMaxSize;
+};
+
+class CTimeSeriesCache
+{
+public:
+    typedef boost::shared_ptr<const std::vector<char>> CRecord;
+
+    CTimeSeriesCache(std::size_t nMaxSizeIn);
+    void SetMaxSize(std::size_t nMaxSizeIn);
+    CRecord Retrieve(const CDiskPos& pos);
+    void AddNew(const CDiskPos& pos, const CRecord& spRecord);
+    void Remove(const CDiskPos& pos);
+    void Clear();
+    void GetStat(CTimeSeriesCacheStat& stat);
+
+protected:
+    enum
+    {
+        SHARD_COUNT = 16
+    };
+    class CEntry
+    {
+    public:
+        CRecord spRecord;
+        std::list<CDiskPos>::iterator itFifo;
+    };
+    class CShard
+    {
+    public:
+        CShard()
+          : nSize(0) {}
+
+    public:
+        xengine::CRWAccess rwAccess;
+        std::map<CDiskPos, CEntry> mapRecord;
+        std::list<CDiskPos> listFifo;
+        std::size_t nSize;
+    };
+    CShard& GetShard(const CDiskPos& pos)
+    {
+        uint64 nKey = ((uint64)pos.nFile << 32) | pos.nOffset;
+        nKey ^= nKey >> 33;
+        nKey *= 0xFF51AFD7ED558CCDULL;
+        nKey ^= nKey >> 33;
+        return vShard[nKey % SHARD_COUNT];
+    }
+    void Evict(CShard& shard, std::size_t nMaxSize);
+    void EraseEntry(CShard& shard, std::map<CDiskPos, CEntry>::iterator it);
+
+protected:
+    CShard vShard[SHARD_COUNT];
+    std::atomic<std::size_t> nShardMaxSize;
+    std::atomic<uint64> nHit;
+    std::atomic<uint64> nMiss;
+    std::atomic<uint64> nEviction;
+};
+
+class CTimeSeriesWalkPool
+{
+public:
+    typedef boost::function<void(std::size_t)> JobFunc;
+
+    CTimeSeriesWalkPool(std::size_t nThreadIn, std::size_t nWindowIn);
+    ~CTimeSeriesWalkPool();
+    bool Start(std::size_t nJobIn, const JobFunc& fnJobIn);
+    void WaitFor(std::size_t nJob);
+    void Stop();
+
+protected:
+    void WorkerProc();
+
+protected:
+    std::size_t nThread;
+    std::size_t nWindow;
+    std::size_t nJob;
+    std::size_t nNextJob;
+    std::size_t nConsumed;
+    std::vector<bool> vDone;
+    JobFunc fnJob;
+    bool fStop;
+    boost::mutex mtxJob;
+    boost::condition_variable condWork;
+    boost::condition_variable condDone;
+    boost::thread_group threadGroup;
 };
 
 class CTimeSeriesCached : public CTimeSeriesBase
@@ -98,146 +373,99 @@ public:
     template <typename T>
     bool Write(const T& t, uint32& nFile, uint32& nOffset, bool fWriteCache = true)
     {
-        boost::unique_lock<boost::mutex> lock(mtxCache);
-
-        std::string pathFile;
-        if (!GetLastFilePath(nFile, pathFile))
-        {
-            return false;
-        }
-        try
+        CDiskPos pos;
+        if (!Write(t, pos, fWriteCache))
         {
-            xengine::CFileStream fs(pathFile.c_str());
-            fs.SeekToEnd();
-            uint32 nSize = fs.GetSerializeSize(t);
-            fs << nMagicNum << nSize;
-            nOffset = fs.GetCurPos();
-            fs << t;
-        }
-        catch (std::exception& e)
-        {
-            xengine::StdError(__PRETTY_FUNCTION__, e.what());
             return false;
         }
-        if (fWriteCache)
-        {
-            if (!WriteToCache(t, CDiskPos(nFile, nOffset)))
-            {
-                ResetCache();
-            }
-        }
+        nFile = pos.nFile;
+        nOffset = pos.nOffset;
         return true;
     }
     template <typename T>
     bool Write(const T& t, CDiskPos& pos, bool fWriteCache = true)
     {
-        boost::unique_lock<boost::mutex> lock(mtxCache);
+        boost::unique_lock<boost::mutex> lock(mtxWriter);
 
-        std::string pathFile;
-        if (!GetLastFilePath(pos.nFile, pathFile))
+        if (!AppendRecord(t, pos))
         {
             return false;
         }
-        try
-        {
-            xengine::CFileStream fs(pathFile.c_str());
-            fs.SeekToEnd();
-            uint32 nSize = fs.GetSerializeSize(t);
-            fs << nMagicNum << nSize;
-            pos.nOffset = fs.GetCurPos();
-            fs << t;
-        }
-        catch (std::exception& e)
-        {
-            xengine::StdError(__PRETTY_FUNCTION__, e.what());
-            return false;
-        }
         if (fWriteCache)
         {
-            if (!WriteToCache(t, pos))
-            {
-                ResetCache();
-            }
+            WriteToCache(t, pos);
         }
         return true;
     }
     template <typename T>
-    bool Read(T& t, uint32 nFile, uint32 nOffset, bool fWriteCache = true)
+    bool WriteBatch(const typename std::vector<T>& vBatch, std::vector<CDiskPos>& vPos, bool fWriteCache = true)
     {
-        boost::unique_lock<boost::mutex> lock(mtxCache);
-
-        if (ReadFromCache(t, CDiskPos(nFile, nOffset)))
-        {
-            return true;
-        }
+        boost::unique_lock<boost::mutex> lock(mtxWriter);
 
-        std::string pathFile;
-        if (!GetFilePath(nFile, pathFile))
+        size_t nBegin = vPos.size();
+        bool fRet = true;
+        if (!fCompress)
         {
-            return false;
+            fRet = AppendBatch(vBatch, vPos);
         }
-        try
+        else
         {
-            // Open history file to read
-            xengine::CFileStream fs(pathFile.c_str());
-            fs.Seek(nOffset);
-            fs >> t;
+            for (size_t i = 0; i < vBatch.size() && fRet; i++)
+            {
+                CDiskPos pos;
+                if ((fRet = AppendRecord(vBatch[i], pos)))
+                {
+                    vPos.push_back(pos);
+                }
+            }
         }
-        catch (std::exception& e)
+        if (!fRet)
         {
-            xengine::StdError(__PRETTY_FUNCTION__, e.what());
             return false;
         }
-
         if (fWriteCache)
         {
-            if (!WriteToCache(t, CDiskPos(nFile, nOffset)))
+            for (size_t i = 0; i < vBatch.size(); i++)
             {
-                ResetCache();
+                WriteToCache(vBatch[i], vPos[nBegin + i]);
             }
         }
         return true;
     }
     template <typename T>
+    bool Read(T& t, uint32 nFile, uint32 nOffset, bool fWriteCache = true)
+    {
+        return Read(t, CDiskPos(nFile, nOffset), fWriteCache);
+    }
+    template <typename T>
     bool Read(T& t, const CDiskPos& pos, bool fWriteCache = true)
     {
-        boost::unique_lock<boost::mutex> lock(mtxCache);
+        CReadGuard guard(*this);
 
         if (ReadFromCache(t, pos))
         {
             return true;
         }
 
-        std::string pathFile;
-        if (!GetFilePath(pos.nFile, pathFile))
-        {
-            return false;
-        }
-        try
-        {
-            // Open history file to read
-            xengine::CFileStream fs(pathFile.c_str());
-            fs.Seek(pos.nOffset);
-            fs >> t;
-        }
-        catch (std::exception& e)
+        if (!ReadFromFile(t, pos))
         {
-            xengine::StdError(__PRETTY_FUNCTION__, e.what());
             return false;
         }
 
         if (fWriteCache)
         {
-            if (!WriteToCache(t, pos))
-            {
-                ResetCache();
-            }
+            WriteToCache(t, pos);
         }
         return true;
     }
     template <typename T>
     bool WalkThrough(CTSWalker<T>& walker, uint32& nLastFileRet, uint32& nLastPosRet, bool fRepairFile)
     {
+        if (nWalkThread > 1)
+        {
+            return WalkThroughParallel(walker, nLastFileRet, nLastPosRet, fRepairFile);
+        }
+
         bool fRet = true;
         uint32 nFile = 1;
         uint32 nOffset = 0;
@@ -267,7 +495,24 @@ public:
                     T t;
                     try
                     {
-                        fs >> nMagic >> nSize >> t;
+                        fs >> nMagic >> nSize;
+                        if (nMagic == nMagicNum && (nSize & COMPRESSED_FLAG))
+                        {
+                            nSize &= ~COMPRESSED_FLAG;
+                            std::string strData;
+                            if (nOffset + 8 + nSize > nFileSize || !ReadCompressedPayload(fs, nSize, strData))
+                            {
+                                throw std::runtime_error("compressed record error");
+                            }
+                            xengine::CMemoryStream ms(strData.data(), strData.size());
+                            ms >> t;
+                            // skip the sparse tail, bytes left in the record fail the size check below
+                            fs.Seek(nOffset + 8 + nSize - ms.GetSize());
+                        }
+                        else
+                        {
+                            fs >> t;
+                        }
                     }
                     catch (std::exception& e)
                     {
@@ -316,7 +561,7 @@ public:
             {
                 if (fRepairFile)
                 {
-                    if (!RepairFile(nFile, nOffset))
+                    if (!RepairTail(nFile, nOffset))
                     {
                         xengine::StdError("TimeSeriesCached", "WalkThrough: RepairFile fail");
                         fRet = false;
@@ -333,6 +578,14 @@ public:
     template <typename T>
     bool ReadDirect(T& t, uint32 nFile, uint32 nOffset)
     {
+        CReadGuard guard(*this);
+
+        uint32 nStart, nSize;
+        if (GetCompressedRecord(nFile, nOffset, nStart, nSize))
+        {
+            return ReadFromCompressed(t, CDiskPos(nFile, nOffset), nStart);
+        }
+
         std::string pathFile;
         if (!GetFilePath(nFile, pathFile))
         {
@@ -350,6 +603,55 @@ public:
         }
         return true;
     }
+    template <typename T>
+    bool ReadRange(const std::vector<CDiskPos>& vPos, const boost::function<bool(std::size_t, const T&)>& fnRead)
+    {
+        // records are read and decoded by the pool ahead of the consumer, the segment after the
+        // one being decoded is hinted to the kernel so that its pages arrive in the meantime
+        std::size_t nSegment = (vPos.size() + READ_RANGE_SEGMENT - 1) / READ_RANGE_SEGMENT;
+        std::vector<std::vector<T>> vRecord(nSegment);
+        std::vector<std::size_t> vDecoded(nSegment, 0);
+        Prefetch(vPos, 0, std::min(vPos.size(), (std::size_t)READ_RANGE_SEGMENT));
+
+        CTimeSeriesWalkPool pool(std::max(nWalkThread, (std::size_t)1), READ_RANGE_WINDOW);
+        if (!pool.Start(nSegment, [&](std::size_t n) {
+                std::size_t nBegin = n * READ_RANGE_SEGMENT;
+                std::size_t nEnd = std::min(vPos.size(), nBegin + READ_RANGE_SEGMENT);
+                Prefetch(vPos, nEnd, std::min(vPos.size(), nEnd + READ_RANGE_SEGMENT));
+                vRecord[n].resize(nEnd - nBegin);
+                while (nBegin + vDecoded[n] < nEnd && Read(vRecord[n][vDecoded[n]], vPos[nBegin + vDecoded[n]], false))
+                {
+                    vDecoded[n]++;
+                }
+            }))
+        {
+            xengine::StdError("TimeSeriesCached", "ReadRange: Start read pool fail");
+            return false;
+        }
+        bool fRet = true;
+        for (std::size_t n = 0; n < nSegment && fRet; n++)
+        {
+            pool.WaitFor(n);
+            std::size_t nBegin = n * READ_RANGE_SEGMENT;
+            for (std::size_t i = 0; i < vRecord[n].size() && fRet; i++)
+            {
+                if (i >= vDecoded[n])
+                {
+                    xengine::StdError("TimeSeriesCached", "ReadRange: Read fail, nFile: %d, nOffset: %d",
+                                      vPos[nBegin + i].nFile, vPos[nBegin + i].nOffset);
+                    fRet = false;
+                }
+                else
+                {
+                    fRet = fnRead(nBegin + i, vRecord[n][i]);
+                }
+            }
+            std::vector<T>().swap(vRecord[n]);
+        }
+        pool.Stop();
+        return fRet;
+    }
+    void Prefetch(const std::vector<CDiskPos>& vPos, std::size_t nBegin, std::size_t nEnd);
     size_t GetSize(const uint32 nFile = -1)
     {
         uint32 nFileNo = (nFile == -1) ? 1 : nFile;
@@ -380,93 +682,309 @@ public:
         return nOffset;
     }
 
+    void SetMappedRead(bool fMappedReadIn);
+    void SetWalkThread(std::size_t nWalkThreadIn);
+    void SetCacheSize(std::size_t nCacheSize);
+    void GetCacheStat(CTimeSeriesCacheStat& stat);
+    void SetCompress(bool fCompressIn, uint32 nCompressMinSizeIn = DEFAULT_COMPRESS_MIN_SIZE);
+    bool StartCompressThread();
+    void StopCompressThread();
+    bool CompressFile(uint32 nFile);
+    void GetCompressStat(CTimeSeriesCompressStat& stat);
+    bool CheckTail(uint32& nLastFileRet, uint32& nLastPosRet, bool fRepairFile);
+
 protected:
+    class CWalkFrame
+    {
+    public:
+        CWalkFrame(uint32 nOffsetIn = 0, uint32 nSizeIn = 0, bool fCompressedIn = false)
+          : nOffset(nOffsetIn), nSize(nSizeIn), fCompressed(fCompressedIn) {}
+
+    public:
+        uint32 nOffset;
+        uint32 nSize;
+        bool fCompressed;
+    };
+
+    template <typename T>
+    bool WalkThroughParallel(CTSWalker<T>& walker, uint32& nLastFileRet, uint32& nLastPosRet, bool fRepairFile)
+    {
+        // headers are chained on this thread, records are decoded by the pool in segments
+        // and handed to the walker in file order
+        bool fRet = true;
+        uint32 nFile = 1;
+        uint32 nOffset = 0;
+        nLastFileRet = 0;
+        nLastPosRet = 0;
+        std::string pathFile;
+
+        while (GetFilePath(nFile, pathFile) && fRet)
+        {
+            nLastFileRet = nFile;
+            nOffset = 0;
+            bool fFileDataError = false;
+            try
+            {
+                std::size_t nFileSize = boost::filesystem::file_size(pathFile);
+                if (nFileSize > MAX_FILE_SIZE)
+                {
+                    xengine::StdError("TimeSeriesCached", "WalkThrough: File size error, nFile: %d, size: %lu", nFile, nFileSize);
+                    fFileDataError = true;
+                    break;
+                }
+                if (nFileSize != 0)
+                {
+                    CTimeSeriesMappedFile mapped(pathFile);
+                    mapped.AdviseSequential();
+                    const char* pData = mapped.GetData();
+
+                    std::vector<CWalkFrame> vFrame;
+                    uint32 nFrameEnd = 0;
+                    bool fFrameError = !ScanWalkFrame(nFile, pData, nFileSize, vFrame, nFrameEnd);
+
+                    std::vector<std::pair<std::size_t, std::size_t>> vSegment;
+                    for (std::size_t i = 0, nBytes = 0; i < vFrame.size(); i++)
+                    {
+                        if (nBytes == 0)
+                        {
+                            vSegment.push_back(std::make_pair(i, i));
+                        }
+                        vSegment.back().second = i + 1;
+                        nBytes += vFrame[i].nSize + 8;
+                        if (nBytes >= WALK_SEGMENT_SIZE)
+                        {
+                            nBytes = 0;
+                        }
+                    }
+
+                    std::vector<std::vector<T>> vRecord(vSegment.size());
+                    std::vector<std::size_t> vDecoded(vSegment.size(), 0);
+                    CTimeSeriesWalkPool pool(nWalkThread, nWalkThread * WALK_WINDOW_PER_THREAD);
+                    if (!pool.Start(vSegment.size(), [&](std::size_t n) {
+                            DecodeWalkSegment(nFile, pData, vFrame, vSegment[n].first, vSegment[n].second, vRecord[n], vDecoded[n]);
+                        }))
+                    {
+                        xengine::StdError("TimeSeriesCached", "WalkThrough: Start walk pool fail");
+                        fRet = false;
+                        break;
+                    }
+                    for (std::size_t n = 0; n < vSegment.size() && fRet && !fFileDataError; n++)
+                    {
+                        pool.WaitFor(n);
+                        std::size_t nBegin = vSegment[n].first;
+                        for (std::size_t i = 0; i < vDecoded[n]; i++)
+                        {
+                            const CWalkFrame& frame = vFrame[nBegin + i];
+                            if (!walker.Walk(vRecord[n][i], nFile, frame.nOffset))
+                            {
+                                xengine::StdLog("TimeSeriesCached", "WalkThrough: Walk fail");
+                                fRet = false;
+                                break;
+                            }
+                            nOffset = frame.nOffset + frame.nSize;
+                        }
+                        if (fRet && nBegin + vDecoded[n] < vSegment[n].second)
+                        {
+                            nOffset = vFrame[nBegin + vDecoded[n]].nOffset - 8;
+                            fFileDataError = true;
+                        }
+                        std::vector<T>().swap(vRecord[n]);
+                    }
+                    pool.Stop();
+
+                    if (fRet && !fFileDataError && fFrameError)
+                    {
+                        nOffset = nFrameEnd;
+                        fFileDataError = true;
+                    }
+                }
+            }
+            catch (std::exception& e)
+            {
+                xengine::StdError("TimeSeriesCached", "WalkThrough: catch error, nFile: %d, msg: %s", nFile, e.what());
+                fRet = false;
+                break;
+            }
+            if (fFileDataError)
+            {
+                if (fRepairFile)
+                {
+                    if (!RepairTail(nFile, nOffset))
+                    {
+                        xengine::StdError("TimeSeriesCached", "WalkThrough: RepairFile fail");
+                        fRet = false;
+                    }
+                    xengine::StdLog("TimeSeriesCached", "WalkThrough: RepairFile success");
+                }
+                break;
+            }
+            nFile++;
+        }
+        nLastPosRet = nOffset;
+        return fRet;
+    }
+    template <typename T>
+    void DecodeWalkSegment(uint32 nFile, const char* pData, const std::vector<CWalkFrame>& vFrame,
+                           std::size_t nBegin, std::size_t nEnd, std::vector<T>& vRecord, std::size_t& nDecoded)
+    {
+        vRecord.resize(nEnd - nBegin);
+        for (std::size_t i = nBegin; i < nEnd; i++)
+        {
+            const CWalkFrame& frame = vFrame[i];
+            try
+            {
+                const char* p = pData + frame.nOffset;
+                std::string strData;
+                if (frame.fCompressed)
+                {
+                    if (!UncompressRecord(p, frame.nSize, strData))
+                    {
+                        throw std::runtime_error("compressed record error");
+                    }
+                    p = strData.data();
+                }
+                xengine::CMemoryStream ms(p, frame.nSize);
+                ms >> vRecord[i - nBegin];
+                if (ms.GetSize() != 0)
+                {
+                    xengine::StdError("TimeSeriesCached", "WalkThrough: read size error, nFile: %d, nOffset: %d, nSize: %d, left: %lu",
+                                      nFile, frame.nOffset - 8, frame.nSize, ms.GetSize());
+                    break;
+                }
+            }
+            catch (std::exception& e)
+            {
+                xengine::StdError("TimeSeriesCached", "WalkThrough: Read error, nFile: %d, msg: %s", nFile, e.what());
+                break;
+            }
+            nDecoded++;
+        }
+    }
+    void PrefetchFile(uint32 nFile, uint32 nBegin, uint32 nEnd);
+    bool ScanWalkFrame(uint32 nFile, const char* pData, std::size_t nFileSize, std::vector<CWalkFrame>& vFrame, uint32& nEnd);
+    static bool UncompressRecord(const char* pData, uint32 nSize, std::string& strData);
     void ResetCache();
-    bool VacateCache(uint32 nNeeded);
+    // readers are counted, a repair truncating a mapped file waits for them to leave and holds new ones off
+    class CReadGuard
+    {
+    public:
+        CReadGuard(CTimeSeriesCached& tsIn)
+          : ts(tsIn)
+        {
+            ts.BeginRead();
+        }
+        ~CReadGuard()
+        {
+            ts.EndRead();
+        }
+
+    protected:
+        CTimeSeriesCached& ts;
+    };
+    void BeginRead();
+    void EndRead();
+    bool RepairTail(uint32 nFile, uint32 nOffset);
+    boost::shared_ptr<CTimeSeriesMappedFile> GetMappedFile(uint32 nFile, uint32 nOffset);
+    void InvalidateMappedFile(uint32 nFile);
+    void ResetMappedFile();
     template <typename T>
-    bool WriteToCache(const T& t, const CDiskPos& diskpos)
+    bool AppendRecord(const T& t, CDiskPos& pos)
     {
-        if (mapCachePos.count(diskpos))
+        if (!fCompress)
         {
-            return true;
+            return Append(t, pos);
         }
-        uint32 nSize = cacheStream.GetSerializeSize(t);
-        if (!VacateCache(nSize))
+        xengine::CBufStream ss;
+        try
+        {
+            ss << t;
+        }
+        catch (std::exception& e)
+        {
+            xengine::StdError(__PRETTY_FUNCTION__, e.what());
+            return false;
+        }
+        return AppendCompressed(ss, pos);
+    }
+    bool AppendCompressed(xengine::CBufStream& ss, CDiskPos& pos);
+    std::string CompressedMarkPath(uint32 nFile);
+    std::string RawMarkPath(uint32 nFile);
+    bool CreateMark(const std::string& pathMark);
+    bool IsSealedFile(uint32 nFile);
+    bool GetCompressedRecord(uint32 nFile, uint32 nOffset, uint32& nStart, uint32& nSize);
+    void AddCompressedRecord(uint32 nFile, uint32 nStart, uint32 nSize);
+    void ResetCompressedRecord();
+    bool ReadCompressedRecord(uint32 nFile, uint32 nStart, std::string& strData);
+    bool ReadCompressedPayload(xengine::CFileStream& fs, uint32 nSize, std::string& strData);
+    void CompressProc();
+    bool StartSyncThread();
+    void StopSyncThread();
+    void SyncProc();
+    template <typename T>
+    bool ReadFromCompressed(T& t, const CDiskPos& pos, uint32 nStart)
+    {
+        std::string strData;
+        if (!ReadCompressedRecord(pos.nFile, nStart, strData))
         {
             return false;
         }
         try
         {
-            std::size_t nPos;
-            cacheStream << diskpos << nSize;
-            nPos = cacheStream.GetWritePos();
-            cacheStream << t;
-            mapCachePos.insert(std::make_pair(diskpos, nPos));
-            return true;
+            xengine::CMemoryStream ms(strData.data(), strData.size());
+            if (!ms.Seek(pos.nOffset - nStart))
+            {
+                return false;
+            }
+            ms >> t;
         }
         catch (std::exception& e)
         {
             xengine::StdError(__PRETTY_FUNCTION__, e.what());
+            return false;
         }
-        return false;
+        return true;
     }
     template <typename T>
-    bool ReadFromCache(T& t, const CDiskPos& diskpos)
+    bool ReadFromFile(T& t, const CDiskPos& pos)
     {
-        std::map<CDiskPos, size_t>::iterator it = mapCachePos.find(diskpos);
-        if (it != mapCachePos.end())
+        uint32 nStart, nSize;
+        if (GetCompressedRecord(pos.nFile, pos.nOffset, nStart, nSize))
+        {
+            return ReadFromCompressed(t, pos, nStart);
+        }
+
+        if (fMappedRead)
         {
-            if (cacheStream.Seek((*it).second))
+            // Appends leave the mapping as it is, a record past its end is mapped again by GetMappedFile.
+            // A record cut by the end of the mapping was mid-append when mapped and is read from the file.
+            boost::shared_ptr<CTimeSeriesMappedFile> spMapped = GetMappedFile(pos.nFile, pos.nOffset);
+            if (spMapped != nullptr)
             {
                 try
                 {
-                    cacheStream >> t;
+                    xengine::CMemoryStream ms(spMapped->GetData(), spMapped->GetSize());
+                    ms.Seek(pos.nOffset);
+                    ms >> t;
                     return true;
                 }
                 catch (std::exception& e)
                 {
-                    xengine::StdError(__PRETTY_FUNCTION__, e.what());
+                    xengine::StdTrace(__PRETTY_FUNCTION__, e.what());
                 }
             }
-            ResetCache();
         }
-        return false;
-    }
-
-protected:
-    enum
-    {
-        FILE_CACHE_SIZE = 0x2000000
-    };
-    boost::mutex mtxCache;
-    xengine::CCircularStream cacheStream;
-    std::map<CDiskPos, std::size_t> mapCachePos;
-    static const uint32 nMagicNum;
-};
-
-class CTimeSeriesChunk : public CTimeSeriesBase
-{
-public:
-    CTimeSeriesChunk();
-    ~CTimeSeriesChunk();
-    template <typename T>
-    bool Write(const T& t, CDiskPos& pos)
-    {
-        boost::unique_lock<boost::mutex> lock(mtxWriter);
 
         std::string pathFile;
-        if (!GetLastFilePath(pos.nFile, pathFile))
+        if (!GetFilePath(pos.nFile, pathFile))
         {
             return false;
         }
         try
         {
+            // Open history file to read
             xengine::CFileStream fs(pathFile.c_str());
-            fs.SeekToEnd();
-            uint32 nSize = fs.GetSerializeSize(t);
-            fs << nMagicNum << nSize;
-            pos.nOffset = fs.GetCurPos();
-            fs << t;
+            fs.Seek(pos.nOffset);
+            fs >> t;
         }
         catch (std::exception& e)
         {
@@ -476,41 +994,99 @@ public:
         return true;
     }
     template <typename T>
-    bool WriteBatch(const typename std::vector<T>& vBatch, std::vector<CDiskPos>& vPos)
+    void WriteToCache(const T& t, const CDiskPos& diskpos)
     {
-        boost::unique_lock<boost::mutex> lock(mtxWriter);
-
-        size_t n = 0;
-
-        while (n < vBatch.size())
+        try
+        {
+            xengine::CBufStream ss;
+            ss << t;
+            cache.AddNew(diskpos, CTimeSeriesCache::CRecord(new std::vector<char>(ss.GetData(), ss.GetData() + ss.GetSize())));
+        }
+        catch (std::exception& e)
+        {
+            xengine::StdError(__PRETTY_FUNCTION__, e.what());
+        }
+    }
+    template <typename T>
+    bool ReadFromCache(T& t, const CDiskPos& diskpos)
+    {
+        CTimeSeriesCache::CRecord spRecord = cache.Retrieve(diskpos);
+        if (spRecord != nullptr)
         {
-            uint32 nFile, nOffset;
-            std::string pathFile;
-            if (!GetLastFilePath(nFile, pathFile))
-            {
-                return false;
-            }
             try
             {
-                xengine::CFileStream fs(pathFile.c_str());
-                fs.SeekToEnd();
-                do
-                {
-                    uint32 nSize = fs.GetSerializeSize(vBatch[n]);
-                    fs << nMagicNum << nSize;
-                    nOffset = fs.GetCurPos();
-                    fs << vBatch[n++];
-                    vPos.push_back(CDiskPos(nFile, nOffset));
-                } while (n < vBatch.size() && nOffset < MAX_FILE_SIZE - MAX_CHUNK_SIZE - 8);
+                xengine::CMemoryStream ms(spRecord->data(), spRecord->size());
+                ms >> t;
+                return true;
             }
             catch (std::exception& e)
             {
                 xengine::StdError(__PRETTY_FUNCTION__, e.what());
-                return false;
             }
+            cache.Remove(diskpos);
         }
+        return false;
+    }
 
-        return true;
+protected:
+    enum
+    {
+        FILE_CACHE_SIZE = 0x2000000,
+        DEFAULT_COMPRESS_MIN_SIZE = 0x1000,
+        COMPRESS_MIN_SAVING = 0x1000,
+        WALK_SEGMENT_SIZE = 0x800000,
+        WALK_WINDOW_PER_THREAD = 4,
+        READ_RANGE_SEGMENT = 16,
+        READ_RANGE_WINDOW = 4,
+        PREFETCH_SPAN = 0x1000000,
+        PREFETCH_RECORD_SIZE = 0x40000
+    };
+    boost::mutex mtxWriter;
+    CTimeSeriesCache cache;
+    std::atomic<std::size_t> nReading;
+    std::atomic<bool> fRepairing;
+    boost::mutex mtxRepair;
+    boost::condition_variable condRepair;
+    std::atomic<bool> fMappedRead;
+    boost::mutex mtxMapped;
+    std::map<uint32, boost::shared_ptr<CTimeSeriesMappedFile>> mapMappedFile;
+    std::size_t nWalkThread;
+    bool fCompress;
+    uint32 nCompressMinSize;
+    // record tables are looked up on every read, they change only when a file is loaded, compressed or appended
+    xengine::CRWAccess rwCompressed;
+    std::map<uint32, boost::shared_ptr<std::map<uint32, uint32>>> mapCompressedRecord;
+    uint64 nCompressedGeneration;
+    boost::mutex mtxCompressed;
+    CTimeSeriesCompressStat statCompress;
+    boost::mutex mtxCompressThread;
+    boost::condition_variable condCompress;
+    boost::thread* pThreadCompress;
+    bool fStopCompress;
+    boost::mutex mtxSyncThread;
+    boost::condition_variable condSync;
+    boost::thread* pThreadSync;
+    bool fStopSync;
+};
+
+class CTimeSeriesChunk : public CTimeSeriesBase
+{
+public:
+    CTimeSeriesChunk();
+    ~CTimeSeriesChunk();
+    template <typename T>
+    bool Write(const T& t, CDiskPos& pos)
+    {
+        boost::unique_lock<boost::mutex> lock(mtxWriter);
+
+        return Append(t, pos);
+    }
+    template <typename T>
+    bool WriteBatch(const typename std::vector<T>& vBatch, std::vector<CDiskPos>& vPos)
+    {
+        boost::unique_lock<boost::mutex> lock(mtxWriter);
+
+        return AppendBatch(vBatch, vPos);
     }
     template <typename T>
     bool Read(T& t, const CDiskPos& pos)
@@ -534,10 +1110,40 @@ public:
         }
         return true;
     }
+    template <typename T>
+    bool Read(T& t, const CDiskPos& pos, uint32& nSizeRet)
+    {
+        std::string pathFile;
+        if (pos.nOffset < 8 || !GetFilePath(pos.nFile, pathFile))
+        {
+            return false;
+        }
+        try
+        {
+            uint32 nMagic;
+            xengine::CFileStream fs(pathFile.c_str());
+            fs.Seek(pos.nOffset - 8);
+            fs >> nMagic >> nSizeRet >> t;
+            nSizeRet += 8;
+        }
+        catch (std::exception& e)
+        {
+            xengine::StdError(__PRETTY_FUNCTION__, e.what());
+            return false;
+        }
+        return true;
+    }
+    bool GetRecordSize(const CDiskPos& pos, uint32& nSize);
+    bool GetFileSize(uint32 nFile, uint64& nSize);
+    bool RemoveFile(uint32 nFile);
+    bool IsSealedFile(uint32 nFile);
 
 protected:
+    enum
+    {
+        CHUNK_FILE_SIZE = 0x4000000
+    };
     boost::mutex mtxWriter;
-    static const uint32 nMagicNum;
 };
 
 } // namespace storage
@@ -4,8 +4,11 @@
 
 #include "txindexdb.h"
 
+#include <algorithm>
 #include <boost/bind.hpp>
 
+#include "leveldbeng.h"
+
 using namespace std;
 using namespace xengine;
 
@@ -15,6 +18,89 @@ namespace storage
 {
 
 #define TXINDEX_FLUSH_INTERVAL (300) // 5 minutes check
+
+static bool LocatorWalker(CMemoryStream& ssKey, CMemoryStream& ssValue, size_t nKeySize,
+                          map<uint256, vector<uint32>>& mapFingerprint)
+{
+    // fork marker keys differ in size
+    if (ssKey.GetSize() == nKeySize)
+    {
+        int64 nTime;
+        uint256 hashFork;
+        uint32 nFingerprint;
+        ssKey >> nTime >> hashFork >> nFingerprint;
+        mapFingerprint[hashFork].push_back(nFingerprint);
+    }
+    return true;
+}
+
+//////////////////////////////
+// CTxLocatorDB
+
+bool CTxLocatorDB::Initialize(const boost::filesystem::path& pathLocator)
+{
+    CLevelDBArguments args;
+    args.name = "txlocator";
+    args.path = pathLocator.string();
+    args.syncwrite = false;
+    CLevelDBEngine* engine = new CLevelDBEngine(args);
+
+    if (!Open(engine))
+    {
+        delete engine;
+        return false;
+    }
+    return true;
+}
+
+void CTxLocatorDB::Deinitialize()
+{
+    Close();
+}
+
+bool CTxLocatorDB::IsForkReady(const uint256& hashFork)
+{
+    uint8 nReady = 0;
+    return Read(make_pair(string("fork"), hashFork), nReady);
+}
+
+bool CTxLocatorDB::SetForkReady(const uint256& hashFork)
+{
+    boost::unique_lock<boost::mutex> lock(mtxWrite);
+    return Write(make_pair(string("fork"), hashFork), uint8(1));
+}
+
+bool CTxLocatorDB::AddTx(const uint256& hashFork, const vector<pair<int64, uint32>>& vFingerprint)
+{
+    boost::unique_lock<boost::mutex> lock(mtxWrite);
+
+    if (!TxnBegin())
+    {
+        return false;
+    }
+    for (const pair<int64, uint32>& fingerprint : vFingerprint)
+    {
+        Write(make_pair(make_pair(fingerprint.first, hashFork), fingerprint.second), uint8(0));
+    }
+    return TxnCommit();
+}
+
+bool CTxLocatorDB::ListBucket(const int64 nTime, map<uint256, vector<uint32>>& mapFingerprint)
+{
+    CBufStream ssKey;
+    ssKey << make_pair(make_pair(nTime, uint256()), uint32(0));
+    if (!ScanPrefix(nTime, boost::bind(&LocatorWalker, _1, _2, ssKey.GetSize(), boost::ref(mapFingerprint))))
+    {
+        return false;
+    }
+    for (map<uint256, vector<uint32>>::iterator it = mapFingerprint.begin(); it != mapFingerprint.end(); ++it)
+    {
+        // keys are ordered by the serialized bytes, not by value
+        sort((*it).second.begin(), (*it).second.end());
+    }
+    return true;
+}
+
 //////////////////////////////
 // CTxIndexDB
 
@@ -22,6 +108,8 @@ CTxIndexDB::CTxIndexDB()
 {
     pThreadFlush = nullptr;
     fStopFlush = true;
+    nChunkCacheSize = CForkTxDB::CChunkCache::DEFAULT_MAX_SIZE;
+    nLocatorGeneration = 0;
 }
 
 bool CTxIndexDB::Initialize(const boost::filesystem::path& pathData)
@@ -38,6 +126,11 @@ bool CTxIndexDB::Initialize(const boost::filesystem::path& pathData)
         return false;
     }
 
+    if (!dbLocator.Initialize(pathTxIndex / "locator"))
+    {
+        return false;
+    }
+
     fStopFlush = false;
     pThreadFlush = new boost::thread(boost::bind(&CTxIndexDB::FlushProc, this));
     if (pThreadFlush == nullptr)
@@ -66,6 +159,7 @@ void CTxIndexDB::Deinitialize()
     {
         CWriteLock wlock(rwAccess);
 
+        dbLocator.Sync();
         for (map<uint256, std::shared_ptr<CForkTxDB>>::iterator it = mapTxDB.begin();
              it != mapTxDB.end(); ++it)
         {
@@ -76,6 +170,14 @@ void CTxIndexDB::Deinitialize()
         }
         mapTxDB.clear();
     }
+
+    {
+        boost::unique_lock<boost::mutex> lock(mtxLocator);
+        mapLocator.clear();
+        listLocator.clear();
+        nLocatorGeneration++;
+    }
+    dbLocator.Deinitialize();
 }
 
 bool CTxIndexDB::LoadFork(const uint256& hashFork)
@@ -93,7 +195,19 @@ bool CTxIndexDB::LoadFork(const uint256& hashFork)
     {
         return false;
     }
+    if (!dbLocator.IsForkReady(hashFork) && !BuildLocator(hashFork, spTxDB))
+    {
+        spTxDB->Deinitialize();
+        return false;
+    }
     mapTxDB.insert(make_pair(hashFork, spTxDB));
+    SplitChunkCacheSize();
+
+    // buckets located so far do not know about the new fork
+    boost::unique_lock<boost::mutex> lock(mtxLocator);
+    mapLocator.clear();
+    listLocator.clear();
+    nLocatorGeneration++;
     return true;
 }
 
@@ -121,6 +235,38 @@ bool CTxIndexDB::Update(const uint256& hashFork, const vector<pair<uint256, CTxI
         CTxId txid(vTxDel[i]);
         spTxDB->Erase(txid.GetTxTime(), txid.GetTxHash());
     }
+
+    // erased tx are left in the locator, a stale fingerprint only costs a chunk lookup
+    vector<pair<int64, uint32>> vFingerprintNew;
+    vFingerprintNew.reserve(vTxNew.size());
+    for (int i = 0; i < vTxNew.size(); i++)
+    {
+        CTxId txid(vTxNew[i].first);
+        vFingerprintNew.push_back(make_pair(txid.GetTxTime(), TxFingerprint(txid.GetTxHash())));
+    }
+    if (!vFingerprintNew.empty() && !dbLocator.AddTx(hashFork, vFingerprintNew))
+    {
+        StdError("TxIndexDB", "Update: add locator fail, fork: %s", hashFork.GetHex().c_str());
+        return false;
+    }
+
+    boost::unique_lock<boost::mutex> lock(mtxLocator);
+    nLocatorGeneration++;
+    for (int i = 0; i < vTxNew.size(); i++)
+    {
+        CTxId txid(vTxNew[i].first);
+        map<int64, CLocatorEntry>::iterator mi = mapLocator.find(txid.GetTxTime());
+        if (mi != mapLocator.end())
+        {
+            vector<uint32>& vFingerprint = (*mi).second.bucket[hashFork];
+            uint32 nFingerprint = TxFingerprint(txid.GetTxHash());
+            vector<uint32>::iterator vi = lower_bound(vFingerprint.begin(), vFingerprint.end(), nFingerprint);
+            if (vi == vFingerprint.end() || *vi != nFingerprint)
+            {
+                vFingerprint.insert(vi, nFingerprint);
+            }
+        }
+    }
     return true;
 }
 
@@ -141,19 +287,45 @@ bool CTxIndexDB::Retrieve(const uint256& hashFork, const uint256& txidIn, CTxInd
     return spTxDB->Retrieve(txid.GetTxTime(), txid.GetTxHash(), txIndex);
 }
 
+bool CTxIndexDB::RetrieveBatch(const uint256& hashFork, const vector<uint256>& vTxid, vector<CTxIndex>& vTxIndex, size_t& nFound)
+{
+    CReadLock rlock(rwAccess);
+
+    nFound = 0;
+    map<uint256, std::shared_ptr<CForkTxDB>>::iterator it = mapTxDB.find(hashFork);
+    if (it == mapTxDB.end())
+    {
+        return false;
+    }
+
+    vector<pair<int64, uint224>> vKey;
+    vKey.reserve(vTxid.size());
+    for (const uint256& txidIn : vTxid)
+    {
+        CTxId txid(txidIn);
+        vKey.push_back(make_pair(txid.GetTxTime(), txid.GetTxHash()));
+    }
+
+    nFound = (*it).second->RetrieveBatch(vKey, vTxIndex);
+    return true;
+}
+
 bool CTxIndexDB::Retrieve(const uint256& txidIn, CTxIndex& txIndex, uint256& hashFork)
 {
     CReadLock rlock(rwAccess);
 
     CTxId txid(txidIn);
+    uint32 nFingerprint = TxFingerprint(txid.GetTxHash());
 
-    for (map<uint256, std::shared_ptr<CForkTxDB>>::iterator it = mapTxDB.begin();
-         it != mapTxDB.end(); ++it)
+    vector<uint256> vCandidate;
+    GetLocatorCandidate(txid.GetTxTime(), nFingerprint, vCandidate);
+
+    for (const uint256& hash : vCandidate)
     {
-        std::shared_ptr<CForkTxDB> spTxDB = (*it).second;
-        if (spTxDB->Retrieve(txid.GetTxTime(), txid.GetTxHash(), txIndex))
+        map<uint256, std::shared_ptr<CForkTxDB>>::iterator it = mapTxDB.find(hash);
+        if (it != mapTxDB.end() && (*it).second->Retrieve(txid.GetTxTime(), txid.GetTxHash(), txIndex))
         {
-            hashFork = (*it).first;
+            hashFork = hash;
             return true;
         }
     }
@@ -173,6 +345,12 @@ void CTxIndexDB::Clear()
         spTxDB->Deinitialize();
     }
     mapTxDB.clear();
+    dbLocator.RemoveAll();
+
+    boost::unique_lock<boost::mutex> lock(mtxLocator);
+    mapLocator.clear();
+    listLocator.clear();
+    nLocatorGeneration++;
 }
 
 void CTxIndexDB::Flush(const uint256& hashFork)
@@ -186,10 +364,170 @@ void CTxIndexDB::Flush(const uint256& hashFork)
         return;
     }
 
+    // the locator reaches the disk before the chunks it points to
+    dbLocator.Sync();
     std::shared_ptr<CForkTxDB> spTxDB = (*it).second;
     spTxDB->Flush();
 }
 
+bool CTxIndexDB::FlushAll()
+{
+    boost::unique_lock<boost::mutex> lock(mtxFlush);
+    CReadLock rlock(rwAccess);
+
+    if (!dbLocator.Sync())
+    {
+        return false;
+    }
+    for (map<uint256, std::shared_ptr<CForkTxDB>>::iterator it = mapTxDB.begin();
+         it != mapTxDB.end(); ++it)
+    {
+        if (!(*it).second->Flush())
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+void CTxIndexDB::SetChunkCacheSize(size_t nSize)
+{
+    CWriteLock wlock(rwAccess);
+
+    nChunkCacheSize = nSize;
+    SplitChunkCacheSize();
+}
+
+// called with rwAccess write locked
+void CTxIndexDB::SplitChunkCacheSize()
+{
+    if (mapTxDB.empty())
+    {
+        return;
+    }
+    size_t nForkSize = nChunkCacheSize / mapTxDB.size();
+    for (map<uint256, std::shared_ptr<CForkTxDB>>::iterator it = mapTxDB.begin();
+         it != mapTxDB.end(); ++it)
+    {
+        (*it).second->SetChunkCacheSize(nForkSize);
+    }
+}
+
+void CTxIndexDB::GetChunkCacheStat(size_t& nCountRet, size_t& nSizeRet, uint64& nHitRet, uint64& nMissRet)
+{
+    CReadLock rlock(rwAccess);
+
+    nCountRet = nSizeRet = 0;
+    nHitRet = nMissRet = 0;
+    for (map<uint256, std::shared_ptr<CForkTxDB>>::iterator it = mapTxDB.begin();
+         it != mapTxDB.end(); ++it)
+    {
+        size_t nCount = 0, nSize = 0;
+        uint64 nHit = 0, nMiss = 0;
+        (*it).second->GetChunkCacheStat(nCount, nSize, nHit, nMiss);
+        nCountRet += nCount;
+        nSizeRet += nSize;
+        nHitRet += nHit;
+        nMissRet += nMiss;
+    }
+}
+
+// called with rwAccess write locked, before the fork is added
+bool CTxIndexDB::BuildLocator(const uint256& hashFork, std::shared_ptr<CForkTxDB> spTxDB)
+{
+    // a fork indexed before the locator existed, fingerprints of all its buckets are added once
+    set<int64> setTime;
+    if (!spTxDB->ListTime(setTime))
+    {
+        StdError("TxIndexDB", "BuildLocator: list time fail, fork: %s", hashFork.GetHex().c_str());
+        return false;
+    }
+
+    size_t nCount = 0;
+    vector<pair<int64, uint32>> vFingerprint;
+    for (const int64 nTime : setTime)
+    {
+        vector<uint224> vKey;
+        spTxDB->ListKeys(nTime, vKey);
+        for (const uint224& key : vKey)
+        {
+            vFingerprint.push_back(make_pair(nTime, TxFingerprint(key)));
+        }
+        if (vFingerprint.size() >= LOCATOR_BUILD_BATCH)
+        {
+            if (!dbLocator.AddTx(hashFork, vFingerprint))
+            {
+                return false;
+            }
+            nCount += vFingerprint.size();
+            vFingerprint.clear();
+        }
+    }
+    if (!vFingerprint.empty() && !dbLocator.AddTx(hashFork, vFingerprint))
+    {
+        return false;
+    }
+    nCount += vFingerprint.size();
+    if (nCount != 0)
+    {
+        StdLog("TxIndexDB", "BuildLocator: fork: %s, buckets: %lu, tx: %lu", hashFork.GetHex().c_str(), setTime.size(), nCount);
+    }
+    return dbLocator.SetForkReady(hashFork);
+}
+
+void CTxIndexDB::GetLocatorCandidate(const int64 nTime, const uint32 nFingerprint, vector<uint256>& vCandidate)
+{
+    uint64 nGeneration = 0;
+    {
+        boost::unique_lock<boost::mutex> lock(mtxLocator);
+        map<int64, CLocatorEntry>::iterator it = mapLocator.find(nTime);
+        if (it != mapLocator.end())
+        {
+            listLocator.splice(listLocator.begin(), listLocator, (*it).second.itLRU);
+            for (CLocatorBucket::iterator bi = (*it).second.bucket.begin(); bi != (*it).second.bucket.end(); ++bi)
+            {
+                if (binary_search((*bi).second.begin(), (*bi).second.end(), nFingerprint))
+                {
+                    vCandidate.push_back((*bi).first);
+                }
+            }
+            return;
+        }
+        nGeneration = nLocatorGeneration;
+    }
+
+    // read without the lock, one range of the locator db for all forks
+    CLocatorBucket bucket;
+    if (!dbLocator.ListBucket(nTime, bucket))
+    {
+        StdError("TxIndexDB", "GetLocatorCandidate: list bucket fail, time: %ld", nTime);
+        return;
+    }
+    for (CLocatorBucket::iterator bi = bucket.begin(); bi != bucket.end(); ++bi)
+    {
+        if (binary_search((*bi).second.begin(), (*bi).second.end(), nFingerprint))
+        {
+            vCandidate.push_back((*bi).first);
+        }
+    }
+
+    // a tx added meanwhile may be missing from the read, such a bucket is not kept
+    boost::unique_lock<boost::mutex> lock(mtxLocator);
+    if (nGeneration != nLocatorGeneration || mapLocator.count(nTime))
+    {
+        return;
+    }
+    while (mapLocator.size() >= MAX_LOCATOR_BUCKET)
+    {
+        mapLocator.erase(listLocator.back());
+        listLocator.pop_back();
+    }
+    listLocator.push_front(nTime);
+    CLocatorEntry& entry = mapLocator[nTime];
+    entry.bucket.swap(bucket);
+    entry.itLRU = listLocator.begin();
+}
+
 void CTxIndexDB::FlushProc()
 {
     SetThreadName("TxIndexDB");
@@ -221,9 +559,14 @@ void CTxIndexDB::FlushProc()
                     vTxDB.push_back((*it).second);
                 }
             }
+            dbLocator.Sync();
             for (int i = 0; i < vTxDB.size(); i++)
             {
                 vTxDB[i]->Flush(false);
+                if (!vTxDB[i]->Compact())
+                {
+                    StdError("TxIndexDB", "FlushProc: compact fail");
+                }
             }
         }
     }
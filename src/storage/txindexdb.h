@@ -16,9 +16,29 @@ namespace bigbang
 namespace storage
 {
 
+// fingerprints of the tx hashes of all forks, kept as tx are added : (time, fork, fingerprint) -> 0
+// Erased tx are left in, a stale fingerprint only costs a chunk lookup
+class CTxLocatorDB : public xengine::CKVDB
+{
+public:
+    CTxLocatorDB() {}
+    bool Initialize(const boost::filesystem::path& pathLocator);
+    void Deinitialize();
+    bool IsForkReady(const uint256& hashFork);
+    bool SetForkReady(const uint256& hashFork);
+    bool AddTx(const uint256& hashFork, const std::vector<std::pair<int64, uint32>>& vFingerprint);
+    bool ListBucket(const int64 nTime, std::map<uint256, std::vector<uint32>>& mapFingerprint);
+
+protected:
+    // the txn of the engine is shared, writers of different forks take turns
+    boost::mutex mtxWrite;
+};
+
 class CTxIndexDB
 {
-    typedef CCTSDB<uint224, CTxIndex, CCTSChunkSnappy<uint224, CTxIndex>> CForkTxDB;
+    typedef CCTSDB<uint224, CTxIndex, CCTSChunkEytzinger<uint224, CTxIndex>> CForkTxDB;
+    // fork -> sorted fingerprints of the tx hashes in one time bucket
+    typedef std::map<uint256, std::vector<uint32>> CLocatorBucket;
 
 public:
     CTxIndexDB();
@@ -29,17 +49,48 @@ public:
                 const std::vector<uint256>& vTxDel);
     bool Retrieve(const uint256& hashFork, const uint256& txid, CTxIndex& txIndex);
     bool Retrieve(const uint256& txid, CTxIndex& txIndex, uint256& hashFork);
+    // vTxIndex has an entry per txid, null if not found, nFound counts the others
+    bool RetrieveBatch(const uint256& hashFork, const std::vector<uint256>& vTxid, std::vector<CTxIndex>& vTxIndex, std::size_t& nFound);
 
     void Clear();
     void Flush(const uint256& hashFork);
+    bool FlushAll();
+    // the cache size is the budget of all forks
+    void SetChunkCacheSize(std::size_t nSize);
+    void GetChunkCacheStat(std::size_t& nCountRet, std::size_t& nSizeRet, uint64& nHitRet, uint64& nMissRet);
 
 protected:
+    enum
+    {
+        MAX_LOCATOR_BUCKET = 0x10000,
+        LOCATOR_BUILD_BATCH = 100000
+    };
+    class CLocatorEntry
+    {
+    public:
+        CLocatorBucket bucket;
+        std::list<int64>::iterator itLRU;
+    };
+    void SplitChunkCacheSize();
     void FlushProc();
+    bool BuildLocator(const uint256& hashFork, std::shared_ptr<CForkTxDB> spTxDB);
+    void GetLocatorCandidate(const int64 nTime, const uint32 nFingerprint, std::vector<uint256>& vCandidate);
+    static uint32 TxFingerprint(const uint224& hash)
+    {
+        return hash.Get32(0);
+    }
 
 protected:
     boost::filesystem::path pathTxIndex;
     xengine::CRWAccess rwAccess;
     std::map<uint256, std::shared_ptr<CForkTxDB>> mapTxDB;
+    std::size_t nChunkCacheSize;
+    CTxLocatorDB dbLocator;
+    // buckets read from dbLocator, least recently used first out
+    boost::mutex mtxLocator;
+    std::map<int64, CLocatorEntry> mapLocator;
+    std::list<int64> listLocator;
+    uint64 nLocatorGeneration;
 
     boost::mutex mtxFlush;
     boost::condition_variable condFlush;
@@ -4,6 +4,7 @@
 
 #include "unspentdb.h"
 
+#include <algorithm>
 #include <boost/bind.hpp>
 
 #include "leveldbeng.h"
@@ -17,37 +18,346 @@ namespace storage
 {
 
 #define UNSPENT_FLUSH_INTERVAL (60)
+#define UNSPENT_UPGRADE_BATCH (100000)
+#define UNSPENT_MERGE_BATCH (10000)
+#define UNSPENT_MERGE_WAIT (3)
+#define UNSPENT_DB_VERSION (3)
+
+// destination index entries : ((top, "dest"), (destTo, txout)) -> output
+// The top is the largest outpoint, every outpoint and tagged key sorts before the index,
+// so the index is one range at the end of the fork unspent db and walks of outputs stop at it
+typedef pair<CTxOutPoint, string> DestIndexTag;
+
+static inline DestIndexTag DestIndexBegin()
+{
+    return make_pair(CTxOutPoint(~uint256(uint64(0)), 0xFF), string("dest"));
+}
+
+static inline pair<DestIndexTag, CDestination> DestPrefix(const CDestination& dest)
+{
+    return make_pair(DestIndexBegin(), dest);
+}
+
+static inline pair<DestIndexTag, pair<CDestination, CTxOutPoint>> DestKey(const CDestination& dest, const CTxOutPoint& txout)
+{
+    return make_pair(DestIndexBegin(), make_pair(dest, txout));
+}
+
+// version 2 index entries : ("dest", destTo, txout) -> output, among the outpoint keys
+static inline pair<string, pair<CDestination, CTxOutPoint>> LegacyDestKey(const CDestination& dest, const CTxOutPoint& txout)
+{
+    return make_pair(string("dest"), make_pair(dest, txout));
+}
+
+// records of the set copied from the parent fork, kept until the merge completes :
+// ("baseimage", txout) -> parent output overwritten since the copy, null for absent
+// ("basespent", txout) -> output spent by this fork since the copy
+static inline pair<string, CTxOutPoint> BaseImageKey(const CTxOutPoint& txout)
+{
+    return make_pair(string("baseimage"), txout);
+}
+
+static inline pair<string, CTxOutPoint> BaseSpentKey(const CTxOutPoint& txout)
+{
+    return make_pair(string("basespent"), txout);
+}
+
+static bool BaseImageWalker(CMemoryStream& ssKey, CMemoryStream& ssValue, size_t nPrefix, map<CTxOutPoint, CTxOut>& mapImage)
+{
+    CTxOutPoint txout;
+    ssKey.Seek(nPrefix);
+    ssKey >> txout;
+    ssValue >> mapImage[txout];
+    return true;
+}
+
+static bool BaseSpentWalker(CMemoryStream& ssKey, CMemoryStream& ssValue, size_t nPrefix, set<CTxOutPoint>& setSpent)
+{
+    CTxOutPoint txout;
+    ssKey.Seek(nPrefix);
+    ssKey >> txout;
+    setSpent.insert(txout);
+    return true;
+}
+
+static inline size_t GetTagSize(const string& strTag)
+{
+    CBufStream ss;
+    ss << strTag;
+    return ss.GetSize();
+}
+
+static inline bool IsOutPointKey(CBufStream& ssKey)
+{
+    // destination index and marker keys differ in size from an outpoint
+    return (ssKey.GetSize() == uint256::size() + sizeof(uint8));
+}
+
+static inline bool IsDestIndexKey(CBufStream& ssKey)
+{
+    // the index key starts with the top outpoint, all bytes set
+    const size_t nTop = uint256::size() + sizeof(uint8);
+    if (ssKey.GetSize() <= nTop)
+    {
+        return false;
+    }
+    const unsigned char* p = (const unsigned char*)ssKey.GetData();
+    for (size_t i = 0; i < nTop; i++)
+    {
+        if (p[i] != 0xFF)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool LegacyDestWalker(CMemoryStream& ssKey, CMemoryStream& ssValue, size_t nKeySize, size_t nBatch,
+                             vector<pair<CDestination, CTxOutPoint>>& vKey)
+{
+    // an outpoint whose txid starts with the tag is not an index entry
+    if (ssKey.GetSize() == nKeySize)
+    {
+        pair<string, pair<CDestination, CTxOutPoint>> key;
+        ssKey >> key;
+        vKey.push_back(key.second);
+    }
+    return (vKey.size() < nBatch);
+}
+
+//////////////////////////////
+// CUnspentCache
+
+CUnspentCache::CUnspentCache(size_t nMaxSizeIn)
+  : nMaxSize(nMaxSizeIn), nGeneration(0), nHit(0), nMiss(0)
+{
+}
+
+void CUnspentCache::SetMaxSize(size_t nMaxSizeIn)
+{
+    CWriteLock wlock(rwCache);
+    nMaxSize = nMaxSizeIn;
+    Evict();
+}
+
+uint64 CUnspentCache::GetGeneration()
+{
+    CReadLock rlock(rwCache);
+    return nGeneration;
+}
+
+bool CUnspentCache::Retrieve(const CTxOutPoint& txout, CTxOut& output)
+{
+    CReadLock rlock(rwCache);
+    map<CTxOutPoint, CEntry>::iterator it = mapEntry.find(txout);
+    if (it == mapEntry.end())
+    {
+        nMiss++;
+        return false;
+    }
+    if (!(*it).second.fReferenced)
+    {
+        (*it).second.fReferenced = true;
+    }
+    output = (*it).second.output;
+    nHit++;
+    return true;
+}
+
+void CUnspentCache::AddNew(const CTxOutPoint& txout, const CTxOut& output, uint64 nGenerationIn)
+{
+    CWriteLock wlock(rwCache);
+    // db was written since the output was read, it may be stale
+    if (nGenerationIn != nGeneration)
+    {
+        return;
+    }
+    AddEntry(txout, output);
+    Evict();
+}
+
+void CUnspentCache::Update(const map<CTxOutPoint, CTxOut>& mapFlushed)
+{
+    CWriteLock wlock(rwCache);
+    nGeneration++;
+    for (map<CTxOutPoint, CTxOut>::const_iterator it = mapFlushed.begin(); it != mapFlushed.end(); ++it)
+    {
+        map<CTxOutPoint, CEntry>::iterator mi = mapEntry.find((*it).first);
+        if (mi == mapEntry.end())
+        {
+            continue;
+        }
+        if (!(*it).second.IsNull())
+        {
+            (*mi).second.output = (*it).second;
+        }
+        else
+        {
+            listClock.erase((*mi).second.itClock);
+            mapEntry.erase(mi);
+        }
+    }
+}
+
+void CUnspentCache::Remove(const CTxOutPoint& txout)
+{
+    CWriteLock wlock(rwCache);
+    nGeneration++;
+    RemoveEntry(txout);
+}
+
+void CUnspentCache::Clear()
+{
+    CWriteLock wlock(rwCache);
+    nGeneration++;
+    mapEntry.clear();
+    listClock.clear();
+}
+
+void CUnspentCache::GetStat(size_t& nCountRet, size_t& nSizeRet, uint64& nHitRet, uint64& nMissRet)
+{
+    CReadLock rlock(rwCache);
+    nCountRet = mapEntry.size();
+    nSizeRet = mapEntry.size() * ENTRY_SIZE;
+    nHitRet = nHit;
+    nMissRet = nMiss;
+}
+
+void CUnspentCache::AddEntry(const CTxOutPoint& txout, const CTxOut& output)
+{
+    if (nMaxSize < ENTRY_SIZE)
+    {
+        return;
+    }
+    map<CTxOutPoint, CEntry>::iterator it = mapEntry.find(txout);
+    if (it != mapEntry.end())
+    {
+        (*it).second.output = output;
+        (*it).second.fReferenced = true;
+        return;
+    }
+    CEntry& entry = mapEntry[txout];
+    entry.output = output;
+    entry.itClock = listClock.insert(listClock.end(), txout);
+}
+
+void CUnspentCache::RemoveEntry(const CTxOutPoint& txout)
+{
+    map<CTxOutPoint, CEntry>::iterator it = mapEntry.find(txout);
+    if (it != mapEntry.end())
+    {
+        listClock.erase((*it).second.itClock);
+        mapEntry.erase(it);
+    }
+}
+
+void CUnspentCache::Evict()
+{
+    while (!listClock.empty() && mapEntry.size() * ENTRY_SIZE > nMaxSize)
+    {
+        map<CTxOutPoint, CEntry>::iterator it = mapEntry.find(listClock.front());
+        if ((*it).second.fReferenced)
+        {
+            // hit since it was last passed, it gets another round
+            (*it).second.fReferenced = false;
+            listClock.splice(listClock.end(), listClock, listClock.begin());
+            continue;
+        }
+        listClock.pop_front();
+        mapEntry.erase(it);
+    }
+}
+
+//////////////////////////////
+// CForkUnspentBase
+
+bool CForkUnspentBase::Read(const CTxOutPoint& txout, CTxOut& output)
+{
+    boost::unique_lock<boost::mutex> lock(mtxBase);
+
+    MapType::iterator it = mapFrozen.find(txout);
+    if (it == mapFrozen.end())
+    {
+        it = mapPreImage.find(txout);
+        if (it == mapPreImage.end())
+        {
+            return spParent->ReadMerged(txout, output);
+        }
+    }
+    if ((*it).second.IsNull())
+    {
+        return false;
+    }
+    output = (*it).second;
+    return true;
+}
 
 //////////////////////////////
 // CForkUnspentDB
 
 CForkUnspentDB::CForkUnspentDB(const boost::filesystem::path& pathDB)
+  : pThreadMerge(nullptr), fStopMerge(false), fMergeRunning(false), fBaseMerge(false)
 {
     CLevelDBArguments args;
+    args.name = "unspent";
     args.path = pathDB.string();
     args.syncwrite = false;
+    args.syncbatch = false;
     CLevelDBEngine* engine = new CLevelDBEngine(args);
 
     if (!CKVDB::Open(engine))
     {
         delete engine;
+        return;
+    }
+
+    uint8 nVersion = 0;
+    if ((!Read(string("version"), nVersion) || nVersion < UNSPENT_DB_VERSION) && !UpgradeRecords())
+    {
+        StdError("CForkUnspentDB", "Upgrade unspent records failed, path: %s", args.path.c_str());
+    }
+
+    // the merge is resumed once the parent fork is loaded
+    pair<uint256, CTxOutPoint> merge;
+    uint8 nMerging = 0;
+    if (Read(string("basemerge"), merge))
+    {
+        fBaseMerge = true;
+        hashBaseParent = merge.first;
+        txoutMerged = merge.second;
+    }
+    else if (Read(string("basemerge"), nMerging))
+    {
+        StdError("CForkUnspentDB", "Unspent set copied from the parent fork was not fully merged, run with -checkrepair, path: %s",
+                 args.path.c_str());
     }
 }
 
 CForkUnspentDB::~CForkUnspentDB()
 {
+    // an unfinished merge is resumed from its saved progress at the next start
+    AbortMerge();
     Close();
     dblCache.Clear();
 }
 
 bool CForkUnspentDB::RemoveAll()
 {
+    AbortMerge();
+    StopDependent();
+
     if (!CKVDB::RemoveAll())
     {
         return false;
     }
+    {
+        boost::unique_lock<boost::mutex> lock(mtxMerge);
+        fBaseMerge = false;
+        txoutMerged = CTxOutPoint();
+    }
     dblCache.Clear();
-    return true;
+    cacheUnspent.Clear();
+    return Write(string("version"), uint8(UNSPENT_DB_VERSION));
 }
 
 bool CForkUnspentDB::UpdateUnspent(const vector<CTxUnspent>& vAddNew, const vector<CTxOutPoint>& vRemove)
@@ -56,237 +366,964 @@ bool CForkUnspentDB::UpdateUnspent(const vector<CTxUnspent>& vAddNew, const vect
 
     MapType& mapUpper = dblCache.GetUpperMap();
 
-    for (const CTxUnspent& unspent : vAddNew)
+    for (const CTxUnspent& unspent : vAddNew)
+    {
+        mapUpper[static_cast<const CTxOutPoint&>(unspent)] = unspent.output;
+    }
+
+    for (const CTxOutPoint& txout : vRemove)
+    {
+        mapUpper[txout].SetNull();
+    }
+
+    return true;
+}
+
+bool CForkUnspentDB::RepairUnspent(const std::vector<CTxUnspent>& vAddUpdate, const std::vector<CTxOutPoint>& vRemove)
+{
+    WaitMerged();
+    WaitDependent();
+
+    if (!TxnBegin())
+    {
+        return false;
+    }
+
+    for (const CTxUnspent& unspent : vAddUpdate)
+    {
+        const CTxOutPoint& txout = static_cast<const CTxOutPoint&>(unspent);
+        CTxOut output;
+        if (ReadOutput(txout, output) && output.destTo != unspent.output.destTo)
+        {
+            Erase(DestKey(output.destTo, txout));
+        }
+        WriteOutput(txout, unspent.output);
+    }
+
+    for (const CTxOutPoint& txout : vRemove)
+    {
+        CTxOut output;
+        if (ReadOutput(txout, output))
+        {
+            Erase(DestKey(output.destTo, txout));
+        }
+        Erase(txout);
+    }
+
+    if (!TxnCommit())
+    {
+        return false;
+    }
+    cacheUnspent.Clear();
+
+    // the repaired set is complete, a copied set not merged yet is not needed anymore
+    AbortMerge();
+    boost::unique_lock<boost::mutex> lock(mtxMerge);
+    return (!fBaseMerge || EraseBaseMerge());
+}
+
+bool CForkUnspentDB::WriteUnspent(const CTxOutPoint& txout, const CTxOut& output)
+{
+    cacheUnspent.Remove(txout);
+    return WriteOutput(txout, output);
+}
+
+bool CForkUnspentDB::ReadUnspent(const CTxOutPoint& txout, CTxOut& output)
+{
+    {
+        xengine::CReadLock rlock(rwUpper);
+
+        MapType& mapUpper = dblCache.GetUpperMap();
+        typename MapType::iterator it = mapUpper.find(txout);
+        if (it != mapUpper.end())
+        {
+            if (!(*it).second.IsNull())
+            {
+                output = (*it).second;
+                return true;
+            }
+            return false;
+        }
+    }
+
+    {
+        xengine::CReadLock rlock(rwLower);
+        MapType& mapLower = dblCache.GetLowerMap();
+        typename MapType::iterator it = mapLower.find(txout);
+        if (it != mapLower.end())
+        {
+            if (!(*it).second.IsNull())
+            {
+                output = (*it).second;
+                return true;
+            }
+            return false;
+        }
+    }
+
+    if (cacheUnspent.Retrieve(txout, output))
+    {
+        return true;
+    }
+
+    uint64 nGeneration = cacheUnspent.GetGeneration();
+    if (!ReadMerged(txout, output))
+    {
+        return false;
+    }
+    cacheUnspent.AddNew(txout, output, nGeneration);
+    return true;
+}
+
+bool CForkUnspentDB::CopyFrom(const std::shared_ptr<CForkUnspentDB>& spParent, const uint256& hashParent)
+{
+    if (!RemoveAll())
+    {
+        return false;
+    }
+
+    // records the parent flush overwrites are saved from now on
+    {
+        boost::unique_lock<boost::mutex> lock(mtxMerge);
+        fBaseMerge = true;
+        hashBaseParent = hashParent;
+        txoutMerged = CTxOutPoint();
+        if (!Write(string("basemerge"), make_pair(hashBaseParent, txoutMerged)))
+        {
+            fBaseMerge = false;
+            return false;
+        }
+    }
+
+    // a parent still merging its own copied set is read through its base, the merge thread waits for it
+    std::shared_ptr<CForkUnspentBase> spBaseNew(new CForkUnspentBase(spParent, this));
+    spParent->AddDependent(spBaseNew, true);
+
+    MapType mapFrozen;
+    {
+        boost::unique_lock<boost::mutex> lock(spBaseNew->mtxBase);
+        mapFrozen = spBaseNew->mapFrozen;
+    }
+    if (!WriteBaseImage(mapFrozen))
+    {
+        spParent->RemoveDependent(spBaseNew);
+        boost::unique_lock<boost::mutex> lock(mtxMerge);
+        EraseBaseMerge();
+        return false;
+    }
+
+    StartMerge(spBaseNew);
+    return true;
+}
+
+bool CForkUnspentDB::GetPendingMerge(uint256& hashParent)
+{
+    boost::unique_lock<boost::mutex> lock(mtxMerge);
+    if (!fBaseMerge || spBase != nullptr)
+    {
+        return false;
+    }
+    hashParent = hashBaseParent;
+    return true;
+}
+
+bool CForkUnspentDB::ResumeMerge(const std::shared_ptr<CForkUnspentDB>& spParent)
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mtxMerge);
+        if (!fBaseMerge || spBase != nullptr)
+        {
+            return true;
+        }
+    }
+
+    // parent records saved by the previous run stand for the set at the time of the copy
+    std::shared_ptr<CForkUnspentBase> spBaseResume(new CForkUnspentBase(spParent, this));
+    set<CTxOutPoint> setSpentSaved;
+    if (!ScanPrefix(string("baseimage"), boost::bind(&BaseImageWalker, _1, _2, GetTagSize("baseimage"),
+                                                     boost::ref(spBaseResume->mapFrozen)))
+        || !ScanPrefix(string("basespent"), boost::bind(&BaseSpentWalker, _1, _2, GetTagSize("basespent"),
+                                                        boost::ref(setSpentSaved))))
+    {
+        return false;
+    }
+
+    {
+        boost::unique_lock<boost::mutex> lock(mtxMerge);
+        setSpent.swap(setSpentSaved);
+    }
+    spParent->AddDependent(spBaseResume, false);
+
+    StdLog("CForkUnspentDB", "Resume merging unspent set of the parent fork %s, saved records: %lu",
+           hashBaseParent.GetHex().c_str(), spBaseResume->mapFrozen.size());
+    StartMerge(spBaseResume);
+    return true;
+}
+
+void CForkUnspentDB::StopMerge()
+{
+    boost::thread* pThread = nullptr;
+    {
+        boost::unique_lock<boost::mutex> lock(mtxMerge);
+        fStopMerge = true;
+        pThread = pThreadMerge;
+        pThreadMerge = nullptr;
+        condMerge.notify_all();
+    }
+
+    if (pThread)
+    {
+        pThread->join();
+        delete pThread;
+    }
+
+    boost::unique_lock<boost::mutex> lock(mtxMerge);
+    fStopMerge = false;
+    fMergeRunning = false;
+    condMerge.notify_all();
+}
+
+void CForkUnspentDB::AbortMerge()
+{
+    StopMerge();
+    ReleaseBase();
+}
+
+void CForkUnspentDB::WaitMerged()
+{
+    boost::unique_lock<boost::mutex> lock(mtxMerge);
+    while (fMergeRunning)
+    {
+        condMerge.wait(lock);
+    }
+}
+
+bool CForkUnspentDB::WaitMerged(int64 nSeconds)
+{
+    boost::system_time timeout = boost::get_system_time() + boost::posix_time::seconds(nSeconds);
+
+    boost::unique_lock<boost::mutex> lock(mtxMerge);
+    while (fMergeRunning)
+    {
+        if (!condMerge.timed_wait(lock, timeout))
+        {
+            return !fMergeRunning;
+        }
+    }
+    return true;
+}
+
+bool CForkUnspentDB::IsMerging()
+{
+    boost::unique_lock<boost::mutex> lock(mtxMerge);
+    return fMergeRunning;
+}
+
+bool CForkUnspentDB::WalkThroughUnspent(CForkUnspentDBWalker& walker, bool fWaitMerged)
+{
+    // the disk holds the copied set only when the merge is done, a caller may try again later
+    if (fWaitMerged)
+    {
+        WaitMerged();
+    }
+    else if (!WaitMerged(UNSPENT_MERGE_WAIT))
+    {
+        StdWarn("CForkUnspentDB", "WalkThroughUnspent: unspent set of the parent fork is being merged");
+        return false;
+    }
+
+    try
+    {
+        xengine::CReadLock rulock(rwUpper);
+        xengine::CReadLock rdlock(rwLower);
+
+        MapType& mapUpper = dblCache.GetUpperMap();
+        MapType& mapLower = dblCache.GetLowerMap();
+
+        if (!WalkThrough(boost::bind(&CForkUnspentDB::LoadWalker, this, _1, _2, boost::ref(walker),
+                                     boost::ref(mapUpper), boost::ref(mapLower))))
+        {
+            return false;
+        }
+
+        for (MapType::iterator it = mapLower.begin(); it != mapLower.end(); ++it)
+        {
+            const CTxOutPoint& txout = (*it).first;
+            const CTxOut& output = (*it).second;
+            if (!mapUpper.count(txout) && !output.IsNull())
+            {
+                if (!walker.Walk(txout, output))
+                {
+                    return false;
+                }
+            }
+        }
+        for (MapType::iterator it = mapUpper.begin(); it != mapUpper.end(); ++it)
+        {
+            const CTxOutPoint& txout = (*it).first;
+            const CTxOut& output = (*it).second;
+            if (!output.IsNull())
+            {
+                if (!walker.Walk(txout, output))
+                {
+                    return false;
+                }
+            }
+        }
+    }
+    catch (exception& e)
+    {
+        StdError(__PRETTY_FUNCTION__, e.what());
+        return false;
+    }
+    return true;
+}
+
+bool CForkUnspentDB::ListUnspent(const CDestination& dest, uint32 nMax, vector<CTxUnspent>& vUnspent)
+{
+    if (!WaitMerged(UNSPENT_MERGE_WAIT))
+    {
+        StdWarn("CForkUnspentDB", "ListUnspent: unspent set of the parent fork is being merged");
+        return false;
+    }
+
+    try
+    {
+        xengine::CReadLock rulock(rwUpper);
+        xengine::CReadLock rdlock(rwLower);
+
+        MapType& mapUpper = dblCache.GetUpperMap();
+        MapType& mapLower = dblCache.GetLowerMap();
+
+        for (MapType::iterator it = mapLower.begin(); it != mapLower.end(); ++it)
+        {
+            const CTxOut& output = (*it).second;
+            if (output.destTo == dest && !mapUpper.count((*it).first) && !output.IsNull())
+            {
+                if (nMax != 0 && vUnspent.size() >= nMax)
+                {
+                    return true;
+                }
+                vUnspent.push_back(CTxUnspent((*it).first, output));
+            }
+        }
+        for (MapType::iterator it = mapUpper.begin(); it != mapUpper.end(); ++it)
+        {
+            const CTxOut& output = (*it).second;
+            if (output.destTo == dest && !output.IsNull())
+            {
+                if (nMax != 0 && vUnspent.size() >= nMax)
+                {
+                    return true;
+                }
+                vUnspent.push_back(CTxUnspent((*it).first, output));
+            }
+        }
+
+        pair<DestIndexTag, CDestination> prefix = DestPrefix(dest);
+        CBufStream ssPrefix;
+        ssPrefix << prefix;
+        if (!ScanPrefix(prefix, boost::bind(&CForkUnspentDB::DestWalker, this, _1, _2, boost::cref(dest),
+                                            ssPrefix.GetSize(), nMax, boost::ref(vUnspent),
+                                            boost::cref(mapUpper), boost::cref(mapLower))))
+        {
+            return false;
+        }
+    }
+    catch (exception& e)
+    {
+        StdError(__PRETTY_FUNCTION__, e.what());
+        return false;
+    }
+    return true;
+}
+
+bool CForkUnspentDB::ReadOutput(const CTxOutPoint& txout, CTxOut& output)
+{
+    CCompactTxOut compact;
+    if (!Read(txout, compact))
+    {
+        return false;
+    }
+    output = compact.output;
+    return true;
+}
+
+bool CForkUnspentDB::ReadMerged(const CTxOutPoint& txout, CTxOut& output)
+{
+    if (ReadOutput(txout, output))
+    {
+        return true;
+    }
+    // outputs of the parent fork not merged yet
+    std::shared_ptr<CForkUnspentBase> spBaseRead = GetBase(txout);
+    return (spBaseRead != nullptr && spBaseRead->Read(txout, output));
+}
+
+bool CForkUnspentDB::WriteOutput(const CTxOutPoint& txout, const CTxOut& output)
+{
+    // the index key holds the destination already
+    return (Write(txout, CCompactTxOut(output)) && Write(DestKey(output.destTo, txout), CCompactTxOut(output, false)));
+}
+
+bool CForkUnspentDB::UpgradeRecords()
+{
+    // rewrite every output in the compact encoding and (re)build the destination index
+    StdLog("CForkUnspentDB", "Upgrade unspent records");
+
+    // drop the version 2 index, it is built again in its own range below
+    CBufStream ssLegacyKey;
+    ssLegacyKey << LegacyDestKey(CDestination(), CTxOutPoint());
+    vector<pair<CDestination, CTxOutPoint>> vLegacy;
+    do
+    {
+        vLegacy.clear();
+        if (!ScanPrefix(string("dest"), boost::bind(&LegacyDestWalker, _1, _2, ssLegacyKey.GetSize(),
+                                                    UNSPENT_UPGRADE_BATCH, boost::ref(vLegacy))))
+        {
+            return false;
+        }
+
+        if (!TxnBegin())
+        {
+            return false;
+        }
+        for (const pair<CDestination, CTxOutPoint>& key : vLegacy)
+        {
+            Erase(LegacyDestKey(key.first, key.second));
+        }
+        if (!TxnCommit())
+        {
+            return false;
+        }
+    } while (vLegacy.size() >= UNSPENT_UPGRADE_BATCH);
+
+    vector<CTxUnspent> vUnspent;
+    CTxOutPoint txoutLast;
+    do
+    {
+        vUnspent.clear();
+        if (!WalkThrough(boost::bind(&CForkUnspentDB::BatchWalker, this, _1, _2,
+                                     boost::ref(vUnspent), boost::ref(txoutLast), UNSPENT_UPGRADE_BATCH),
+                         txoutLast))
+        {
+            return false;
+        }
+
+        if (!TxnBegin())
+        {
+            return false;
+        }
+        for (const CTxUnspent& unspent : vUnspent)
+        {
+            WriteOutput(unspent, unspent.output);
+        }
+        if (!TxnCommit())
+        {
+            return false;
+        }
+    } while (vUnspent.size() >= UNSPENT_UPGRADE_BATCH);
+
+    Erase(string("destindex"));
+    return Write(string("version"), uint8(UNSPENT_DB_VERSION));
+}
+
+bool CForkUnspentDB::BatchWalker(CBufStream& ssKey, CBufStream& ssValue,
+                                 vector<CTxUnspent>& vUnspent, CTxOutPoint& txoutLast, size_t nBatch)
+{
+    if (IsDestIndexKey(ssKey))
+    {
+        return false;
+    }
+    if (!IsOutPointKey(ssKey))
+    {
+        return true;
+    }
+
+    CTxOutPoint txout;
+    CCompactTxOut compact;
+    ssKey >> txout;
+
+    // the walk resumes from the last outpoint of the previous batch
+    if (txout == txoutLast)
+    {
+        return true;
+    }
+
+    ssValue >> compact;
+    vUnspent.push_back(CTxUnspent(txout, compact.output));
+    txoutLast = txout;
+
+    return (vUnspent.size() < nBatch);
+}
+
+bool CForkUnspentDB::DestWalker(CMemoryStream& ssKey, CMemoryStream& ssValue, const CDestination& dest,
+                                size_t nPrefix, uint32 nMax, vector<CTxUnspent>& vUnspent, const MapType& mapUpper, const MapType& mapLower)
+{
+    if (nMax != 0 && vUnspent.size() >= nMax)
+    {
+        return false;
+    }
+
+    // the scan only returns keys of the destination, skip the tag and the destination
+    CTxOutPoint txout;
+    CCompactTxOut compact(false);
+    ssKey.Seek(nPrefix);
+    ssKey >> txout;
+
+    if (mapUpper.count(txout) || mapLower.count(txout))
+    {
+        return true;
+    }
+
+    ssValue >> compact;
+    compact.output.destTo = dest;
+    vUnspent.push_back(CTxUnspent(txout, compact.output));
+    return true;
+}
+
+bool CForkUnspentDB::LoadWalker(CBufStream& ssKey, CBufStream& ssValue,
+                                CForkUnspentDBWalker& walker, const MapType& mapUpper, const MapType& mapLower)
+{
+    if (IsDestIndexKey(ssKey))
+    {
+        return false;
+    }
+    if (!IsOutPointKey(ssKey))
+    {
+        return true;
+    }
+
+    CTxOutPoint txout;
+    CCompactTxOut compact;
+    ssKey >> txout;
+
+    if (mapUpper.count(txout) || mapLower.count(txout))
+    {
+        return true;
+    }
+
+    ssValue >> compact;
+
+    return walker.Walk(txout, compact.output);
+}
+
+bool CForkUnspentDB::Flush()
+{
+    xengine::CUpgradeLock ulock(rwLower);
+
+    vector<pair<CTxOutPoint, CTxOut>> vAddNew;
+    vector<CTxOutPoint> vRemove;
+    vector<CTxUnspent> vRemoveDest;
+
+    MapType& mapLower = dblCache.GetLowerMap();
+    for (typename MapType::iterator it = mapLower.begin(); it != mapLower.end(); ++it)
+    {
+        CTxOut& output = (*it).second;
+        if (!output.IsNull())
+        {
+            vAddNew.push_back(*it);
+        }
+        else
+        {
+            vRemove.push_back((*it).first);
+        }
+    }
+
+    CaptureDependent(mapLower);
+
+    boost::unique_lock<boost::mutex> lockMerge(mtxMerge);
+    if (spBase != nullptr)
+    {
+        // spent outputs of the parent fork must not be merged afterwards
+        setSpent.insert(vRemove.begin(), vRemove.end());
+    }
+    bool fSaveSpent = fBaseMerge;
+
+    // the destination of a spent output is only known from its disk record
+    for (const CTxOutPoint& txout : vRemove)
+    {
+        CTxOut output;
+        if (ReadOutput(txout, output))
+        {
+            vRemoveDest.push_back(CTxUnspent(txout, output));
+        }
+    }
+
+    if (!TxnBegin())
+    {
+        return false;
+    }
+
+    for (int i = 0; i < vAddNew.size(); i++)
+    {
+        WriteOutput(vAddNew[i].first, vAddNew[i].second);
+    }
+
+    for (int i = 0; i < vRemove.size(); i++)
+    {
+        Erase(vRemove[i]);
+        if (fSaveSpent)
+        {
+            Write(BaseSpentKey(vRemove[i]), uint8(1));
+        }
+    }
+
+    for (int i = 0; i < vRemoveDest.size(); i++)
+    {
+        Erase(DestKey(vRemoveDest[i].output.destTo, vRemoveDest[i]));
+    }
+
+    if (!TxnCommit())
+    {
+        return false;
+    }
+    lockMerge.unlock();
+
+    // only outputs cached already are refreshed, a new output is cached when it is read
+    cacheUnspent.Update(mapLower);
+
+    ulock.Upgrade();
+
+    {
+        xengine::CWriteLock wlock(rwUpper);
+        dblCache.Flip();
+    }
+
+    return true;
+}
+
+bool CForkUnspentDB::AddDependent(const std::shared_ptr<CForkUnspentBase>& spBaseIn, bool fFreeze)
+{
+    // cache maps cover every record a running flush may write, and no flip can happen meanwhile
+    xengine::CReadLock rulock(rwUpper);
+    xengine::CReadLock rdlock(rwLower);
+
+    if (fFreeze)
+    {
+        MapType& mapUpper = dblCache.GetUpperMap();
+        MapType& mapLower = dblCache.GetLowerMap();
+
+        spBaseIn->mapFrozen = mapLower;
+        for (MapType::iterator it = mapUpper.begin(); it != mapUpper.end(); ++it)
+        {
+            spBaseIn->mapFrozen[(*it).first] = (*it).second;
+        }
+    }
+
+    boost::unique_lock<boost::mutex> lock(mtxDependent);
+    vDependent.push_back(spBaseIn);
+    return true;
+}
+
+void CForkUnspentDB::RemoveDependent(const std::shared_ptr<CForkUnspentBase>& spBaseIn)
+{
+    boost::unique_lock<boost::mutex> lock(mtxDependent);
+    vDependent.erase(std::remove(vDependent.begin(), vDependent.end(), spBaseIn), vDependent.end());
+    condDependent.notify_all();
+}
+
+void CForkUnspentDB::WaitDependent()
+{
+    boost::unique_lock<boost::mutex> lock(mtxDependent);
+    while (!vDependent.empty())
+    {
+        condDependent.wait(lock);
+    }
+}
+
+void CForkUnspentDB::StopDependent()
+{
+    vector<std::shared_ptr<CForkUnspentBase>> vStop;
+    {
+        boost::unique_lock<boost::mutex> lock(mtxDependent);
+        vStop = vDependent;
+    }
+    for (const std::shared_ptr<CForkUnspentBase>& spDependent : vStop)
+    {
+        StdError("CForkUnspentDB", "Unspent set is removed before a child fork merged it, run with -checkrepair");
+        spDependent->pChild->AbortMerge();
+    }
+}
+
+void CForkUnspentDB::CaptureDependent(const MapType& mapFlushed)
+{
+    boost::unique_lock<boost::mutex> lock(mtxDependent);
+    for (const std::shared_ptr<CForkUnspentBase>& spDependent : vDependent)
+    {
+        // keep the record a child fork copied before it is overwritten, first capture wins
+        boost::unique_lock<boost::mutex> lockBase(spDependent->mtxBase);
+        MapType mapImage;
+        for (MapType::const_iterator it = mapFlushed.begin(); it != mapFlushed.end(); ++it)
+        {
+            const CTxOutPoint& txout = (*it).first;
+            if (!spDependent->mapFrozen.count(txout) && !spDependent->mapPreImage.count(txout))
+            {
+                CTxOut output;
+                if (!ReadMerged(txout, output))
+                {
+                    output.SetNull();
+                }
+                spDependent->mapPreImage[txout] = output;
+                mapImage[txout] = output;
+            }
+        }
+        // saved before the parent records are overwritten, the child merge resumes with them
+        if (!mapImage.empty() && !spDependent->pChild->WriteBaseImage(mapImage))
+        {
+            StdError("CForkUnspentDB", "Save unspent records copied by a child fork failed");
+        }
+    }
+}
+
+bool CForkUnspentDB::WriteBaseImage(const MapType& mapImage)
+{
+    boost::unique_lock<boost::mutex> lock(mtxMerge);
+    if (!fBaseMerge)
     {
-        mapUpper[static_cast<const CTxOutPoint&>(unspent)] = unspent.output;
+        return true;
     }
 
-    for (const CTxOutPoint& txout : vRemove)
+    if (!TxnBegin())
     {
-        mapUpper[txout].SetNull();
+        return false;
     }
-
-    return true;
+    for (MapType::const_iterator it = mapImage.begin(); it != mapImage.end(); ++it)
+    {
+        Write(BaseImageKey((*it).first), (*it).second);
+    }
+    return TxnCommit();
 }
 
-bool CForkUnspentDB::RepairUnspent(const std::vector<CTxUnspent>& vAddUpdate, const std::vector<CTxOutPoint>& vRemove)
+// called with mtxMerge locked
+bool CForkUnspentDB::EraseBaseMerge()
 {
-    if (!TxnBegin())
+    MapType mapImage;
+    set<CTxOutPoint> setSpentSaved;
+    if (!ScanPrefix(string("baseimage"), boost::bind(&BaseImageWalker, _1, _2, GetTagSize("baseimage"), boost::ref(mapImage)))
+        || !ScanPrefix(string("basespent"), boost::bind(&BaseSpentWalker, _1, _2, GetTagSize("basespent"), boost::ref(setSpentSaved))))
     {
         return false;
     }
 
-    for (const CTxUnspent& unspent : vAddUpdate)
+    if (!TxnBegin())
     {
-        Write(static_cast<const CTxOutPoint&>(unspent), unspent.output);
+        return false;
     }
-
-    for (const CTxOutPoint& txout : vRemove)
+    for (MapType::iterator it = mapImage.begin(); it != mapImage.end(); ++it)
     {
-        Erase(txout);
+        Erase(BaseImageKey((*it).first));
     }
-
+    for (const CTxOutPoint& txout : setSpentSaved)
+    {
+        Erase(BaseSpentKey(txout));
+    }
+    Erase(string("basemerge"));
     if (!TxnCommit())
     {
         return false;
     }
+
+    fBaseMerge = false;
+    txoutMerged = CTxOutPoint();
     return true;
 }
 
-bool CForkUnspentDB::WriteUnspent(const CTxOutPoint& txout, const CTxOut& output)
+bool CForkUnspentDB::IsBaseMerging()
 {
-    return Write(txout, output);
+    boost::unique_lock<boost::mutex> lock(mtxMerge);
+    return fBaseMerge;
 }
 
-bool CForkUnspentDB::ReadUnspent(const CTxOutPoint& txout, CTxOut& output)
+std::shared_ptr<CForkUnspentBase> CForkUnspentDB::GetBase(const CTxOutPoint& txout)
 {
+    boost::unique_lock<boost::mutex> lock(mtxMerge);
+    if (spBase == nullptr || setSpent.count(txout))
     {
-        xengine::CReadLock rlock(rwUpper);
-
-        MapType& mapUpper = dblCache.GetUpperMap();
-        typename MapType::iterator it = mapUpper.find(txout);
-        if (it != mapUpper.end())
-        {
-            if (!(*it).second.IsNull())
-            {
-                output = (*it).second;
-                return true;
-            }
-            return false;
-        }
-    }
-
-    {
-        xengine::CReadLock rlock(rwLower);
-        MapType& mapLower = dblCache.GetLowerMap();
-        typename MapType::iterator it = mapLower.find(txout);
-        if (it != mapLower.end())
-        {
-            if (!(*it).second.IsNull())
-            {
-                output = (*it).second;
-                return true;
-            }
-            return false;
-        }
+        return nullptr;
     }
+    return spBase;
+}
 
-    return Read(txout, output);
+void CForkUnspentDB::StartMerge(const std::shared_ptr<CForkUnspentBase>& spBaseIn)
+{
+    boost::unique_lock<boost::mutex> lock(mtxMerge);
+    spBase = spBaseIn;
+    fStopMerge = false;
+    fMergeRunning = true;
+    pThreadMerge = new boost::thread(boost::bind(&CForkUnspentDB::MergeProc, this));
 }
 
-bool CForkUnspentDB::Copy(CForkUnspentDB& dbUnspent)
+void CForkUnspentDB::MergeProc()
 {
-    if (!dbUnspent.RemoveAll())
+    SetThreadName("UnspentMerge");
+
+    std::shared_ptr<CForkUnspentBase> spBaseMerge;
+    CTxOutPoint txoutLast;
     {
-        return false;
+        boost::unique_lock<boost::mutex> lock(mtxMerge);
+        spBaseMerge = spBase;
+        txoutLast = txoutMerged;
     }
+    CForkUnspentDB* pParent = spBaseMerge->spParent.get();
 
-    try
+    // the parent disk holds its whole set only when its own copied set is merged,
+    // till then the parent records are read through the base
+    for (;;)
     {
-        xengine::CReadLock rulock(rwUpper);
-        xengine::CReadLock rdlock(rwLower);
+        bool fParentMerging = pParent->IsBaseMerging();
 
-        if (!WalkThrough(boost::bind(&CForkUnspentDB::CopyWalker, this, _1, _2, boost::ref(dbUnspent))))
+        boost::unique_lock<boost::mutex> lock(mtxMerge);
+        if (fStopMerge)
         {
-            return false;
+            return;
         }
-
-        dbUnspent.SetCache(dblCache);
-    }
-    catch (exception& e)
-    {
-        StdError(__PRETTY_FUNCTION__, e.what());
-        return false;
+        if (!fParentMerging)
+        {
+            break;
+        }
+        condMerge.timed_wait(lock, boost::posix_time::seconds(1));
     }
-    return true;
-}
 
-bool CForkUnspentDB::WalkThroughUnspent(CForkUnspentDBWalker& walker)
-{
-    try
+    bool fMerged = true;
+    vector<CTxUnspent> vUnspent;
+    do
     {
-        xengine::CReadLock rulock(rwUpper);
-        xengine::CReadLock rdlock(rwLower);
-
-        MapType& mapUpper = dblCache.GetUpperMap();
-        MapType& mapLower = dblCache.GetLowerMap();
-
-        if (!WalkThrough(boost::bind(&CForkUnspentDB::LoadWalker, this, _1, _2, boost::ref(walker),
-                                     boost::ref(mapUpper), boost::ref(mapLower))))
         {
-            return false;
+            boost::unique_lock<boost::mutex> lock(mtxMerge);
+            if (fStopMerge)
+            {
+                return;
+            }
         }
 
-        for (MapType::iterator it = mapLower.begin(); it != mapLower.end(); ++it)
+        vUnspent.clear();
+        vector<CTxUnspent> vMerge;
         {
-            const CTxOutPoint& txout = (*it).first;
-            const CTxOut& output = (*it).second;
-            if (!mapUpper.count(txout) && !output.IsNull())
+            boost::unique_lock<boost::mutex> lock(spBaseMerge->mtxBase);
+            if (!pParent->WalkThrough(boost::bind(&CForkUnspentDB::BatchWalker, pParent, _1, _2,
+                                                  boost::ref(vUnspent), boost::ref(txoutLast), UNSPENT_MERGE_BATCH),
+                                      txoutLast))
             {
-                if (!walker.Walk(txout, output))
+                fMerged = false;
+                break;
+            }
+            // records in the maps are merged at last
+            for (const CTxUnspent& unspent : vUnspent)
+            {
+                if (!spBaseMerge->mapFrozen.count(unspent) && !spBaseMerge->mapPreImage.count(unspent))
                 {
-                    return false;
+                    vMerge.push_back(unspent);
                 }
             }
         }
-        for (MapType::iterator it = mapUpper.begin(); it != mapUpper.end(); ++it)
+        if (!MergeBatch(vMerge, txoutLast))
         {
-            const CTxOutPoint& txout = (*it).first;
-            const CTxOut& output = (*it).second;
-            if (!output.IsNull())
+            fMerged = false;
+            break;
+        }
+    } while (vUnspent.size() >= UNSPENT_MERGE_BATCH);
+
+    if (fMerged)
+    {
+        vector<CTxUnspent> vMerge;
+        {
+            boost::unique_lock<boost::mutex> lock(spBaseMerge->mtxBase);
+            for (MapType::iterator it = spBaseMerge->mapFrozen.begin(); it != spBaseMerge->mapFrozen.end(); ++it)
             {
-                if (!walker.Walk(txout, output))
+                if (!(*it).second.IsNull())
                 {
-                    return false;
+                    vMerge.push_back(CTxUnspent((*it).first, (*it).second));
+                }
+            }
+            for (MapType::iterator it = spBaseMerge->mapPreImage.begin(); it != spBaseMerge->mapPreImage.end(); ++it)
+            {
+                if (!(*it).second.IsNull() && !spBaseMerge->mapFrozen.count((*it).first))
+                {
+                    vMerge.push_back(CTxUnspent((*it).first, (*it).second));
                 }
             }
         }
+        fMerged = MergeBatch(vMerge, txoutLast);
     }
-    catch (exception& e)
+
+    if (!fMerged)
     {
-        StdError(__PRETTY_FUNCTION__, e.what());
-        return false;
+        StdError("CForkUnspentDB", "Merge unspent set of the parent fork failed, run with -checkrepair");
     }
-    return true;
-}
-
-bool CForkUnspentDB::CopyWalker(CBufStream& ssKey, CBufStream& ssValue,
-                                CForkUnspentDB& dbUnspent)
-{
-    CTxOutPoint txout;
-    CTxOut output;
-    ssKey >> txout;
-    ssValue >> output;
-
-    return dbUnspent.WriteUnspent(txout, output);
+    FinishMerge(fMerged);
 }
 
-bool CForkUnspentDB::LoadWalker(CBufStream& ssKey, CBufStream& ssValue,
-                                CForkUnspentDBWalker& walker, const MapType& mapUpper, const MapType& mapLower)
+bool CForkUnspentDB::MergeBatch(const vector<CTxUnspent>& vUnspent, const CTxOutPoint& txoutLast)
 {
-    CTxOutPoint txout;
-    CTxOut output;
-    ssKey >> txout;
+    boost::unique_lock<boost::mutex> lock(mtxMerge);
 
-    if (mapUpper.count(txout) || mapLower.count(txout))
+    if (!TxnBegin())
     {
-        return true;
+        return false;
     }
 
-    ssValue >> output;
-
-    return walker.Walk(txout, output);
-}
-
-bool CForkUnspentDB::Flush()
-{
-    xengine::CUpgradeLock ulock(rwLower);
-
-    vector<pair<CTxOutPoint, CTxOut>> vAddNew;
-    vector<CTxOutPoint> vRemove;
-
-    MapType& mapLower = dblCache.GetLowerMap();
-    for (typename MapType::iterator it = mapLower.begin(); it != mapLower.end(); ++it)
+    for (const CTxUnspent& unspent : vUnspent)
     {
-        CTxOut& output = (*it).second;
-        if (!output.IsNull())
+        // spent or written by this fork since the copy
+        CTxOut output;
+        if (setSpent.count(unspent) || ReadOutput(static_cast<const CTxOutPoint&>(unspent), output))
         {
-            vAddNew.push_back(*it);
-        }
-        else
-        {
-            vRemove.push_back((*it).first);
+            continue;
         }
+        WriteOutput(static_cast<const CTxOutPoint&>(unspent), unspent.output);
     }
+    // the progress is committed with the batch, a stopped merge resumes after it
+    Write(string("basemerge"), make_pair(hashBaseParent, txoutLast));
 
-    if (!TxnBegin())
+    if (!TxnCommit())
     {
         return false;
     }
+    txoutMerged = txoutLast;
+    return true;
+}
 
-    for (int i = 0; i < vAddNew.size(); i++)
+void CForkUnspentDB::ReleaseBase()
+{
+    std::shared_ptr<CForkUnspentBase> spBaseRelease;
     {
-        Write(vAddNew[i].first, vAddNew[i].second);
+        boost::unique_lock<boost::mutex> lock(mtxMerge);
+        spBaseRelease = spBase;
+        spBase = nullptr;
+        setSpent.clear();
+        condMerge.notify_all();
     }
-
-    for (int i = 0; i < vRemove.size(); i++)
+    if (spBaseRelease != nullptr)
     {
-        Erase(vRemove[i]);
+        spBaseRelease->spParent->RemoveDependent(spBaseRelease);
     }
+}
 
-    if (!TxnCommit())
+void CForkUnspentDB::FinishMerge(bool fMerged)
+{
+    std::shared_ptr<CForkUnspentBase> spBaseDone;
     {
-        return false;
+        boost::unique_lock<boost::mutex> lock(mtxMerge);
+        if (fMerged && !EraseBaseMerge())
+        {
+            StdError("CForkUnspentDB", "Erase merged unspent records of the parent fork failed");
+            fMerged = false;
+        }
+        // a failed merge keeps its base, the set is still complete for reading
+        if (fMerged)
+        {
+            spBaseDone = spBase;
+            spBase = nullptr;
+            setSpent.clear();
+        }
+        fMergeRunning = false;
+        condMerge.notify_all();
     }
-
-    ulock.Upgrade();
-
+    if (spBaseDone != nullptr)
     {
-        xengine::CWriteLock wlock(rwUpper);
-        dblCache.Flip();
+        spBaseDone->spParent->RemoveDependent(spBaseDone);
     }
-
-    return true;
 }
 
 //////////////////////////////
@@ -294,6 +1331,7 @@ bool CForkUnspentDB::Flush()
 
 CUnspentDB::CUnspentDB()
 {
+    nCacheSize = CUnspentCache::DEFAULT_MAX_SIZE;
     pThreadFlush = nullptr;
     fStopFlush = true;
 }
@@ -337,16 +1375,22 @@ void CUnspentDB::Deinitialize()
         pThreadFlush = nullptr;
     }
 
+    StopMerge();
+
     {
         CWriteLock wlock(rwAccess);
 
+        // a parent flush saves records to its child forks, sync after all flushed
         for (map<uint256, std::shared_ptr<CForkUnspentDB>>::iterator it = mapUnspentDB.begin();
              it != mapUnspentDB.end(); ++it)
         {
-            std::shared_ptr<CForkUnspentDB> spUnspent = (*it).second;
-
-            spUnspent->Flush();
-            spUnspent->Flush();
+            (*it).second->Flush();
+            (*it).second->Flush();
+        }
+        for (map<uint256, std::shared_ptr<CForkUnspentDB>>::iterator it = mapUnspentDB.begin();
+             it != mapUnspentDB.end(); ++it)
+        {
+            (*it).second->Sync();
         }
         mapUnspentDB.clear();
     }
@@ -368,6 +1412,7 @@ bool CUnspentDB::AddNewFork(const uint256& hashFork)
         return false;
     }
     mapUnspentDB.insert(make_pair(hashFork, spUnspent));
+    SplitCacheSize();
     return true;
 }
 
@@ -380,6 +1425,7 @@ bool CUnspentDB::RemoveFork(const uint256& hashFork)
     {
         (*it).second->RemoveAll();
         mapUnspentDB.erase(it);
+        SplitCacheSize();
         return true;
     }
     return false;
@@ -389,6 +1435,13 @@ void CUnspentDB::Clear()
 {
     CWriteLock wlock(rwAccess);
 
+    // every set goes, no fork is left with a parent removed under it
+    for (map<uint256, std::shared_ptr<CForkUnspentDB>>::iterator it = mapUnspentDB.begin();
+         it != mapUnspentDB.end(); ++it)
+    {
+        (*it).second->AbortMerge();
+    }
+
     map<uint256, std::shared_ptr<CForkUnspentDB>>::iterator it = mapUnspentDB.begin();
     while (it != mapUnspentDB.end())
     {
@@ -450,17 +1503,29 @@ bool CUnspentDB::Copy(const uint256& srcFork, const uint256& destFork)
         return false;
     }
 
-    return ((*itSrc).second->Copy(*(*itDest).second));
+    return ((*itDest).second->CopyFrom((*itSrc).second, srcFork));
+}
+
+bool CUnspentDB::WalkThrough(const uint256& hashFork, CForkUnspentDBWalker& walker, bool fWaitMerged)
+{
+    CReadLock rlock(rwAccess);
+
+    map<uint256, std::shared_ptr<CForkUnspentDB>>::iterator it = mapUnspentDB.find(hashFork);
+    if (it != mapUnspentDB.end())
+    {
+        return (*it).second->WalkThroughUnspent(walker, fWaitMerged);
+    }
+    return false;
 }
 
-bool CUnspentDB::WalkThrough(const uint256& hashFork, CForkUnspentDBWalker& walker)
+bool CUnspentDB::ListUnspent(const uint256& hashFork, const CDestination& dest, uint32 nMax, vector<CTxUnspent>& vUnspent)
 {
     CReadLock rlock(rwAccess);
 
     map<uint256, std::shared_ptr<CForkUnspentDB>>::iterator it = mapUnspentDB.find(hashFork);
     if (it != mapUnspentDB.end())
     {
-        return (*it).second->WalkThroughUnspent(walker);
+        return (*it).second->ListUnspent(dest, nMax, vUnspent);
     }
     return false;
 }
@@ -477,6 +1542,121 @@ void CUnspentDB::Flush(const uint256& hashFork)
     }
 }
 
+bool CUnspentDB::FlushAll()
+{
+    boost::unique_lock<boost::mutex> lock(mtxFlush);
+    CReadLock rlock(rwAccess);
+
+    // a parent flush saves records to its child forks, sync after all flushed
+    for (map<uint256, std::shared_ptr<CForkUnspentDB>>::iterator it = mapUnspentDB.begin();
+         it != mapUnspentDB.end(); ++it)
+    {
+        std::shared_ptr<CForkUnspentDB> spUnspent = (*it).second;
+        if (!spUnspent->Flush() || !spUnspent->Flush())
+        {
+            return false;
+        }
+    }
+    for (map<uint256, std::shared_ptr<CForkUnspentDB>>::iterator it = mapUnspentDB.begin();
+         it != mapUnspentDB.end(); ++it)
+    {
+        if (!(*it).second->Sync())
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+void CUnspentDB::ResumeMerge()
+{
+    CReadLock rlock(rwAccess);
+
+    for (map<uint256, std::shared_ptr<CForkUnspentDB>>::iterator it = mapUnspentDB.begin();
+         it != mapUnspentDB.end(); ++it)
+    {
+        uint256 hashParent;
+        if (!(*it).second->GetPendingMerge(hashParent))
+        {
+            continue;
+        }
+        map<uint256, std::shared_ptr<CForkUnspentDB>>::iterator itParent = mapUnspentDB.find(hashParent);
+        if (itParent == mapUnspentDB.end() || !(*it).second->ResumeMerge((*itParent).second))
+        {
+            StdError("CUnspentDB", "Resume merging unspent set of fork %s failed, parent fork: %s, run with -checkrepair",
+                     (*it).first.GetHex().c_str(), hashParent.GetHex().c_str());
+        }
+    }
+}
+
+void CUnspentDB::StopMerge()
+{
+    CReadLock rlock(rwAccess);
+
+    for (map<uint256, std::shared_ptr<CForkUnspentDB>>::iterator it = mapUnspentDB.begin();
+         it != mapUnspentDB.end(); ++it)
+    {
+        (*it).second->StopMerge();
+    }
+}
+
+bool CUnspentDB::IsMerging()
+{
+    CReadLock rlock(rwAccess);
+
+    for (map<uint256, std::shared_ptr<CForkUnspentDB>>::iterator it = mapUnspentDB.begin();
+         it != mapUnspentDB.end(); ++it)
+    {
+        if ((*it).second->IsMerging())
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+void CUnspentDB::SetCacheSize(size_t nSize)
+{
+    CWriteLock wlock(rwAccess);
+
+    nCacheSize = nSize;
+    SplitCacheSize();
+}
+
+// called with rwAccess write locked
+void CUnspentDB::SplitCacheSize()
+{
+    if (mapUnspentDB.empty())
+    {
+        return;
+    }
+    size_t nForkSize = nCacheSize / mapUnspentDB.size();
+    for (map<uint256, std::shared_ptr<CForkUnspentDB>>::iterator it = mapUnspentDB.begin();
+         it != mapUnspentDB.end(); ++it)
+    {
+        (*it).second->SetCacheSize(nForkSize);
+    }
+}
+
+void CUnspentDB::GetCacheStat(size_t& nCountRet, size_t& nSizeRet, uint64& nHitRet, uint64& nMissRet)
+{
+    CReadLock rlock(rwAccess);
+
+    nCountRet = nSizeRet = 0;
+    nHitRet = nMissRet = 0;
+    for (map<uint256, std::shared_ptr<CForkUnspentDB>>::iterator it = mapUnspentDB.begin();
+         it != mapUnspentDB.end(); ++it)
+    {
+        size_t nCount = 0, nSize = 0;
+        uint64 nHit = 0, nMiss = 0;
+        (*it).second->GetCacheStat(nCount, nSize, nHit, nMiss);
+        nCountRet += nCount;
+        nSizeRet += nSize;
+        nHitRet += nHit;
+        nMissRet += nMiss;
+    }
+}
+
 void CUnspentDB::FlushProc()
 {
     SetThreadName("UnspentDB");
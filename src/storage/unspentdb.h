@@ -5,7 +5,11 @@
 #ifndef STORAGE_UNSPENTDB_H
 #define STORAGE_UNSPENTDB_H
 
+#include <atomic>
 #include <boost/thread/thread.hpp>
+#include <list>
+#include <memory>
+#include <set>
 
 #include "transaction.h"
 #include "xengine.h"
@@ -24,6 +28,95 @@ public:
     virtual bool Walk(const CTxOutPoint& txout, const CTxOut& output) = 0;
 };
 
+//////////////////////////////
+// CCompactTxOut
+
+// On-disk unspent output : flags, [destTo], varint amount, tx time, [lock until]
+// Legacy records are the plain CTxOut, whose first byte (destination prefix) never has FLAG_COMPACT set
+class CCompactTxOut
+{
+    friend class xengine::CStream;
+
+public:
+    enum
+    {
+        FLAG_COMPACT = 0x80,
+        FLAG_NODEST = 0x02,
+        FLAG_LOCKED = 0x01
+    };
+    CCompactTxOut(bool fDestIn = true)
+      : fDest(fDestIn) {}
+    CCompactTxOut(const CTxOut& outputIn, bool fDestIn = true)
+      : output(outputIn), fDest(fDestIn) {}
+
+protected:
+    uint8 GetFlags() const
+    {
+        return (FLAG_COMPACT | (fDest ? 0 : FLAG_NODEST) | (output.nLockUntil != 0 ? FLAG_LOCKED : 0));
+    }
+    void Serialize(xengine::CStream& s, xengine::SaveType& opt)
+    {
+        uint8 nFlags = GetFlags();
+        s.Serialize(nFlags, opt);
+        if (fDest)
+        {
+            s.Serialize(output.destTo, opt);
+        }
+        xengine::CVarInt var(output.nAmount);
+        s.Serialize(var, opt);
+        s.Serialize(output.nTxTime, opt);
+        if (output.nLockUntil != 0)
+        {
+            s.Serialize(output.nLockUntil, opt);
+        }
+    }
+    void Serialize(xengine::CStream& s, xengine::LoadType& opt)
+    {
+        uint8 nFlags = 0;
+        s.Serialize(nFlags, opt);
+        if (!(nFlags & FLAG_COMPACT))
+        {
+            output.destTo.prefix = nFlags;
+            s.Serialize(output.destTo.data, opt);
+            s.Serialize(output.nAmount, opt);
+            s.Serialize(output.nTxTime, opt);
+            s.Serialize(output.nLockUntil, opt);
+            return;
+        }
+        // without destination the caller restores destTo from the key
+        if (!(nFlags & FLAG_NODEST))
+        {
+            s.Serialize(output.destTo, opt);
+        }
+        xengine::CVarInt var;
+        s.Serialize(var, opt);
+        output.nAmount = var.nValue;
+        s.Serialize(output.nTxTime, opt);
+        output.nLockUntil = 0;
+        if (nFlags & FLAG_LOCKED)
+        {
+            s.Serialize(output.nLockUntil, opt);
+        }
+    }
+    void Serialize(xengine::CStream& s, std::size_t& serSize)
+    {
+        xengine::CVarInt var(output.nAmount);
+        serSize += sizeof(uint8) + xengine::GetSerializeSize(var) + sizeof(output.nTxTime);
+        if (fDest)
+        {
+            serSize += xengine::GetSerializeSize(output.destTo);
+        }
+        if (output.nLockUntil != 0)
+        {
+            serSize += sizeof(output.nLockUntil);
+        }
+    }
+
+public:
+    CTxOut output;
+    bool fDest;
+};
+
 //////////////////////////////
 // CForkUnspentCheckWalker
 
@@ -58,85 +151,86 @@ public:
 };
 
 //////////////////////////////
-// CListUnspentWalker
+// CUnspentCache
 
-class CListUnspentWalker : public CForkUnspentDBWalker
+class CUnspentCache
 {
 public:
-    CListUnspentWalker(const uint256& forkidIn, const CDestination& destOwnerIn, uint32 maxIn)
-      : forkId(forkidIn), destOwner(destOwnerIn), nMax(maxIn), nCounter(0) {}
-    bool Walk(const CTxOutPoint& txout, const CTxOut& output) override
+    enum
     {
-        if (nMax != 0 && nCounter >= nMax)
-        {
-            return false; //exit walk through processing
-        }
-        if (destOwner == output.destTo)
-        {
-            vUnspent.push_back(CTxUnspent(txout, output));
-            ++nCounter;
-        }
-        return true; //continue walk through processing
-    }
+        DEFAULT_MAX_SIZE = 0x2000000
+    };
+    CUnspentCache(std::size_t nMaxSizeIn = DEFAULT_MAX_SIZE);
+    void SetMaxSize(std::size_t nMaxSizeIn);
+    uint64 GetGeneration();
+    bool Retrieve(const CTxOutPoint& txout, CTxOut& output);
+    void AddNew(const CTxOutPoint& txout, const CTxOut& output, uint64 nGenerationIn);
+    // refresh the cached entries a flush has written, spent ones are dropped
+    void Update(const std::map<CTxOutPoint, CTxOut>& mapFlushed);
+    void Remove(const CTxOutPoint& txout);
+    void Clear();
+    void GetStat(std::size_t& nCountRet, std::size_t& nSizeRet, uint64& nHitRet, uint64& nMissRet);
 
-public:
-    const uint256& forkId;
-    const CDestination& destOwner;
-    uint32 nMax;
-    uint32 nCounter;
-    std::vector<CTxUnspent> vUnspent;
+protected:
+    enum
+    {
+        ENTRY_SIZE = sizeof(CTxOutPoint) * 2 + sizeof(CTxOut) + 64
+    };
+    // second chance eviction, a hit only marks the entry so lookups share the lock
+    class CEntry
+    {
+    public:
+        CEntry()
+          : fReferenced(false) {}
+
+    public:
+        CTxOut output;
+        std::list<CTxOutPoint>::iterator itClock;
+        std::atomic<bool> fReferenced;
+    };
+    void AddEntry(const CTxOutPoint& txout, const CTxOut& output);
+    void RemoveEntry(const CTxOutPoint& txout);
+    void Evict();
+
+protected:
+    xengine::CRWAccess rwCache;
+    std::size_t nMaxSize;
+    uint64 nGeneration;
+    std::atomic<uint64> nHit;
+    std::atomic<uint64> nMiss;
+    std::list<CTxOutPoint> listClock;
+    std::map<CTxOutPoint, CEntry> mapEntry;
 };
 
+class CForkUnspentDB;
+
 //////////////////////////////
-// CListUnspentBatchWalker
+// CForkUnspentBase
 
-class CListUnspentBatchWalker : public CForkUnspentDBWalker
+class CForkUnspentBase
 {
-public:
-    CListUnspentBatchWalker(const uint256& forkidIn, std::map<CDestination, std::vector<CTxUnspent>>& mapOwnersIn, uint32 maxIn)
-      : forkId(forkidIn), mapUnspent(mapOwnersIn), nMax(maxIn)
-    {
-        for (const auto& i : mapUnspent)
-        {
-            mapCount.insert(std::make_pair(i.first, 0));
-        }
-    }
-    bool Walk(const CTxOutPoint& txout, const CTxOut& output) override
-    {
-        if (nMax != 0 && AllFill())
-        {
-            return false; //exit walk through processing
-        }
-        if (mapUnspent.count(output.destTo) && (nMax == 0 || mapUnspent[output.destTo].size() < nMax))
-        {
-            mapUnspent[output.destTo].emplace_back(CTxUnspent(txout, output));
-            ++mapCount[output.destTo];
-        }
-        return true; //continue walk through processing
-    }
+    typedef std::map<CTxOutPoint, CTxOut> MapType;
 
-private:
-    bool AllFill() const
-    {
-        for (const auto& i : mapCount)
-        {
-            if (i.second < nMax)
-            {
-                return false;
-            }
-        }
-        return true;
-    }
+public:
+    CForkUnspentBase(const std::shared_ptr<CForkUnspentDB>& spParentIn, CForkUnspentDB* pChildIn)
+      : spParent(spParentIn), pChild(pChildIn) {}
+    bool Read(const CTxOutPoint& txout, CTxOut& output);
 
 public:
-    const uint256& forkId;
-    uint32 nMax;
-    std::map<CDestination, std::vector<CTxUnspent>>& mapUnspent;
-    std::map<CDestination, uint8> mapCount;
+    // unspent set of the parent fork at the time it was copied
+    std::shared_ptr<CForkUnspentDB> spParent;
+    // fork merging the set, it keeps the captured records on disk to resume the merge
+    CForkUnspentDB* pChild;
+    boost::mutex mtxBase;
+    // parent cache maps at copy time, null output for spent
+    MapType mapFrozen;
+    // parent disk records overwritten since copy, null output for absent
+    MapType mapPreImage;
 };
 
 class CForkUnspentDB : public xengine::CKVDB
 {
+    friend class CForkUnspentBase;
     typedef std::map<CTxOutPoint, CTxOut> MapType;
     class CDblMap
     {
@@ -177,24 +271,82 @@ public:
     bool RepairUnspent(const std::vector<CTxUnspent>& vAddUpdate, const std::vector<CTxOutPoint>& vRemove);
     bool WriteUnspent(const CTxOutPoint& txout, const CTxOut& output);
     bool ReadUnspent(const CTxOutPoint& txout, CTxOut& output);
-    bool Copy(CForkUnspentDB& dbUnspent);
-    void SetCache(const CDblMap& dblCacheIn)
+    bool CopyFrom(const std::shared_ptr<CForkUnspentDB>& spParent, const uint256& hashParent);
+    // the merge of a copied set was stopped before it completed, it resumes from the saved progress
+    bool GetPendingMerge(uint256& hashParent);
+    bool ResumeMerge(const std::shared_ptr<CForkUnspentDB>& spParent);
+    // stop the merge thread at a batch boundary, the copied set is kept to resume later
+    void StopMerge();
+    // stop the merge and drop the copied set, the fork must be repaired if it was not merged
+    void AbortMerge();
+    void WaitMerged();
+    // false if the merge is still running after the timeout
+    bool WaitMerged(int64 nSeconds);
+    bool IsMerging();
+    // while the copied set is merged both wait a few seconds at most and fail if it is not done,
+    // fWaitMerged waits for the whole merge
+    bool WalkThroughUnspent(CForkUnspentDBWalker& walker, bool fWaitMerged = false);
+    // unflushed outputs come first, then flushed ones in index key order; nMax cuts this sequence,
+    // so the result is not sorted by outpoint
+    bool ListUnspent(const CDestination& dest, uint32 nMax, std::vector<CTxUnspent>& vUnspent);
+    bool Flush();
+    void SetCacheSize(std::size_t nSize)
     {
-        dblCache = dblCacheIn;
+        cacheUnspent.SetMaxSize(nSize);
+    }
+    void GetCacheStat(std::size_t& nCountRet, std::size_t& nSizeRet, uint64& nHitRet, uint64& nMissRet)
+    {
+        cacheUnspent.GetStat(nCountRet, nSizeRet, nHitRet, nMissRet);
     }
-    bool WalkThroughUnspent(CForkUnspentDBWalker& walker);
-    bool Flush();
 
 protected:
-    bool CopyWalker(xengine::CBufStream& ssKey, xengine::CBufStream& ssValue,
-                    CForkUnspentDB& dbUnspent);
+    bool ReadOutput(const CTxOutPoint& txout, CTxOut& output);
+    // output on disk, or in the set copied from the parent fork and not merged yet
+    bool ReadMerged(const CTxOutPoint& txout, CTxOut& output);
+    bool WriteOutput(const CTxOutPoint& txout, const CTxOut& output);
+    bool UpgradeRecords();
+    bool BatchWalker(xengine::CBufStream& ssKey, xengine::CBufStream& ssValue,
+                     std::vector<CTxUnspent>& vUnspent, CTxOutPoint& txoutLast, std::size_t nBatch);
+    bool DestWalker(xengine::CMemoryStream& ssKey, xengine::CMemoryStream& ssValue, const CDestination& dest,
+                    std::size_t nPrefix, uint32 nMax, std::vector<CTxUnspent>& vUnspent, const MapType& mapUpper, const MapType& mapLower);
     bool LoadWalker(xengine::CBufStream& ssKey, xengine::CBufStream& ssValue,
                     CForkUnspentDBWalker& walker, const MapType& mapUpper, const MapType& mapLower);
+    bool AddDependent(const std::shared_ptr<CForkUnspentBase>& spBaseIn, bool fFreeze);
+    void RemoveDependent(const std::shared_ptr<CForkUnspentBase>& spBaseIn);
+    void WaitDependent();
+    void StopDependent();
+    void CaptureDependent(const MapType& mapFlushed);
+    bool WriteBaseImage(const MapType& mapImage);
+    bool EraseBaseMerge();
+    bool IsBaseMerging();
+    std::shared_ptr<CForkUnspentBase> GetBase(const CTxOutPoint& txout);
+    void StartMerge(const std::shared_ptr<CForkUnspentBase>& spBaseIn);
+    void MergeProc();
+    bool MergeBatch(const std::vector<CTxUnspent>& vUnspent, const CTxOutPoint& txoutLast);
+    void ReleaseBase();
+    void FinishMerge(bool fMerged);
 
 protected:
     xengine::CRWAccess rwUpper;
     xengine::CRWAccess rwLower;
     CDblMap dblCache;
+    CUnspentCache cacheUnspent;
+
+    boost::mutex mtxDependent;
+    boost::condition_variable condDependent;
+    std::vector<std::shared_ptr<CForkUnspentBase>> vDependent;
+
+    boost::mutex mtxMerge;
+    boost::condition_variable condMerge;
+    std::shared_ptr<CForkUnspentBase> spBase;
+    std::set<CTxOutPoint> setSpent;
+    boost::thread* pThreadMerge;
+    bool fStopMerge;
+    bool fMergeRunning;
+    // "basemerge" marker : parent fork and the last outpoint merged from its disk
+    bool fBaseMerge;
+    uint256 hashBaseParent;
+    CTxOutPoint txoutMerged;
 };
 
 class CUnspentDB
@@ -215,16 +367,28 @@ public:
     bool RepairUnspent(const uint256& hashFork, const std::vector<CTxUnspent>& vAddUpdate, const std::vector<CTxOutPoint>& vRemove);
     bool Retrieve(const uint256& hashFork, const CTxOutPoint& txout, CTxOut& output);
     bool Copy(const uint256& srcFork, const uint256& destFork);
-    bool WalkThrough(const uint256& hashFork, CForkUnspentDBWalker& walker);
+    bool WalkThrough(const uint256& hashFork, CForkUnspentDBWalker& walker, bool fWaitMerged = false);
+    bool ListUnspent(const uint256& hashFork, const CDestination& dest, uint32 nMax, std::vector<CTxUnspent>& vUnspent);
     void Flush(const uint256& hashFork);
+    // write both cache maps of every fork and sync them to disk
+    bool FlushAll();
+    // restart the merges of copied sets stopped at the last shutdown
+    void ResumeMerge();
+    void StopMerge();
+    bool IsMerging();
+    // the cache size is the budget of all forks
+    void SetCacheSize(std::size_t nSize);
+    void GetCacheStat(std::size_t& nCountRet, std::size_t& nSizeRet, uint64& nHitRet, uint64& nMissRet);
 
 protected:
+    void SplitCacheSize();
     void FlushProc();
 
 protected:
     boost::filesystem::path pathUnspent;
     xengine::CRWAccess rwAccess;
     std::map<uint256, std::shared_ptr<CForkUnspentDB>> mapUnspentDB;
+    std::size_t nCacheSize;
 
     boost::mutex mtxFlush;
     boost::condition_variable condFlush;
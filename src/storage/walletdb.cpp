@@ -23,6 +23,7 @@ namespace storage
 bool CWalletAddrDB::Initialize(const boost::filesystem::path& pathWallet)
 {
     CLevelDBArguments args;
+    args.name = "walletaddr";
     args.path = (pathWallet / "addr").string();
     args.syncwrite = true;
     args.files = 8;
@@ -104,6 +105,7 @@ bool CWalletAddrDB::AddressDBWalker(CBufStream& ssKey, CBufStream& ssValue, CWal
 bool CWalletTxDB::Initialize(const boost::filesystem::path& pathWallet)
 {
     CLevelDBArguments args;
+    args.name = "wallettx";
     args.path = (pathWallet / "wtx").string();
 
     CLevelDBEngine* engine = new CLevelDBEngine(args);
@@ -273,57 +275,26 @@ size_t CWalletTxDB::GetTxCount()
 
 bool CWalletTxDB::WalkThroughTxSeq(CWalletDBTxSeqWalker& walker)
 {
-    return WalkThrough(boost::bind(&CWalletTxDB::TxSeqWalker, this, _1, _2, boost::ref(walker)),
-                       make_pair(string("seq"), BSwap64(uint64(0))));
+    return ScanPrefix(string("seq"), boost::bind(&CWalletTxDB::TxSeqWalker, this, _1, _2, boost::ref(walker)));
 }
 
 bool CWalletTxDB::WalkThroughTx(CWalletDBTxWalker& walker)
 {
-    return WalkThrough(boost::bind(&CWalletTxDB::TxWalker, this, _1, _2, boost::ref(walker)),
-                       make_pair(string("seq"), BSwap64(uint64(0))));
+    return ScanPrefix(string("seq"), boost::bind(&CWalletTxDB::TxWalker, this, _1, _2, boost::ref(walker)));
 }
 
-bool CWalletTxDB::TxSeqWalker(CBufStream& ssKey, CBufStream& ssValue, CWalletDBTxSeqWalker& walker)
+bool CWalletTxDB::TxSeqWalker(CMemoryStream& ssKey, CMemoryStream& ssValue, CWalletDBTxSeqWalker& walker)
 {
-    string strPrefix;
-    uint64 nSeqNum;
+    // the sequence is in the key order already
     CWalletTxSeq txSeq;
-
-    ssKey >> strPrefix;
-    if (strPrefix != "seq")
-    {
-        if (!(strPrefix == "txcount" || strPrefix == "sequence" || strPrefix == "wtx"))
-        {
-            StdLog("CWalletTxDB", "TxSeqWalker: strPrefix != seq, strPrefix: %s", strPrefix.c_str());
-            return false;
-        }
-        return true;
-    }
-
-    ssKey >> nSeqNum;
     ssValue >> txSeq;
 
     return walker.Walk(txSeq.txid, txSeq.hashFork, txSeq.nBlockHeight);
 }
 
-bool CWalletTxDB::TxWalker(CBufStream& ssKey, CBufStream& ssValue, CWalletDBTxWalker& walker)
+bool CWalletTxDB::TxWalker(CMemoryStream& ssKey, CMemoryStream& ssValue, CWalletDBTxWalker& walker)
 {
-    string strPrefix;
-    uint64 nSeqNum;
     CWalletTxSeq txSeq;
-
-    ssKey >> strPrefix;
-    if (strPrefix != "seq")
-    {
-        if (!(strPrefix == "txcount" || strPrefix == "sequence" || strPrefix == "wtx"))
-        {
-            StdLog("CWalletTxDB", "TxWalker: strPrefix != seq, strPrefix: %s", strPrefix.c_str());
-            return false;
-        }
-        return true;
-    }
-
-    ssKey >> nSeqNum;
     ssValue >> txSeq;
 
     CWalletTx wtx;
@@ -101,8 +101,8 @@ public:
     bool WalkThroughTx(CWalletDBTxWalker& walker);
 
 protected:
-    bool TxSeqWalker(xengine::CBufStream& ssKey, xengine::CBufStream& ssValue, CWalletDBTxSeqWalker& walker);
-    bool TxWalker(xengine::CBufStream& ssKey, xengine::CBufStream& ssValue, CWalletDBTxWalker& walker);
+    bool TxSeqWalker(xengine::CMemoryStream& ssKey, xengine::CMemoryStream& ssValue, CWalletDBTxSeqWalker& walker);
+    bool TxWalker(xengine::CMemoryStream& ssKey, xengine::CMemoryStream& ssValue, CWalletDBTxWalker& walker);
     bool Reset();
 
 protected:
@@ -6,6 +6,7 @@
 #define XENGINE_KVDB_H
 
 #include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/thread.hpp>
 
 #include "stream/stream.h"
@@ -14,9 +15,21 @@
 namespace xengine
 {
 
+// Point-in-time view of an engine, released by the engine which created it
+class CKVDBSnapshot
+{
+public:
+    virtual ~CKVDBSnapshot() {}
+};
+
+// Get must be safe to call concurrently with each other and with Put/Remove/MoveNext,
+// the others are serialized by CKVDB
 class CKVDBEngine
 {
 public:
+    // key and value point into engine buffers, valid only until the function returns
+    typedef boost::function<bool(CMemoryStream&, CMemoryStream&)> ScanFunc;
+
     virtual ~CKVDBEngine() {}
 
     virtual bool Open() = 0;
@@ -31,6 +44,55 @@ public:
     virtual bool MoveFirst() = 0;
     virtual bool MoveTo(CBufStream& ssKey) = 0;
     virtual bool MoveNext(CBufStream& ssKey, CBufStream& ssValue) = 0;
+    // make the writes done so far durable
+    virtual bool Sync() = 0;
+    // engines without snapshot support read the latest data
+    virtual CKVDBSnapshot* NewSnapshot()
+    {
+        return nullptr;
+    }
+    virtual void ReleaseSnapshot(CKVDBSnapshot* snapshot) {}
+    virtual bool Get(CBufStream& ssKey, CBufStream& ssValue, const CKVDBSnapshot* snapshot)
+    {
+        return Get(ssKey, ssValue);
+    }
+    // keys in [ssBegin, ssEnd) in byte order, an empty end is unbounded.
+    // Engines with their own iterators should not copy the records
+    virtual bool Scan(CBufStream& ssBegin, CBufStream& ssEnd, ScanFunc fnScan)
+    {
+        if (!MoveTo(ssBegin))
+        {
+            return false;
+        }
+
+        CMemoryStream ssKeyView(nullptr, 0), ssValueView(nullptr, 0);
+        for (;;)
+        {
+            CBufStream ssKey, ssValue;
+            if (!MoveNext(ssKey, ssValue))
+            {
+                break;
+            }
+            if (ssEnd.GetSize() != 0 && CompareKey(ssKey.GetData(), ssKey.GetSize(), ssEnd.GetData(), ssEnd.GetSize()) >= 0)
+            {
+                break;
+            }
+            ssKeyView.Attach(ssKey.GetData(), ssKey.GetSize());
+            ssValueView.Attach(ssValue.GetData(), ssValue.GetSize());
+            if (!fnScan(ssKeyView, ssValueView))
+            {
+                break;
+            }
+        }
+        return true;
+    }
+
+protected:
+    static int CompareKey(const char* pA, std::size_t nA, const char* pB, std::size_t nB)
+    {
+        int r = memcmp(pA, pB, std::min(nA, nB));
+        return (r != 0 ? r : (nA < nB ? -1 : (nA > nB ? 1 : 0)));
+    }
 };
 
 class CKVDB
@@ -38,38 +100,34 @@ class CKVDB
 public:
     typedef boost::function<bool(CBufStream&, CBufStream&)> WalkerFunc;
 
-    CKVDB()
-      : dbEngine(nullptr) {}
+    CKVDB() {}
     CKVDB(CKVDBEngine* engine)
-      : dbEngine(engine)
     {
         boost::recursive_mutex::scoped_lock lock(mtx);
-        if (dbEngine != nullptr)
+        if (engine != nullptr)
         {
-            if (!dbEngine->Open())
+            if (engine->Open())
             {
-                delete dbEngine;
-                dbEngine = nullptr;
+                SetEngine(boost::shared_ptr<CKVDBEngine>(engine));
+            }
+            else
+            {
+                delete engine;
             }
         }
     }
 
     virtual ~CKVDB()
     {
-        boost::recursive_mutex::scoped_lock lock(mtx);
-        if (dbEngine != nullptr)
-        {
-            dbEngine->Close();
-            delete dbEngine;
-        }
+        Close();
     }
 
     bool Open(CKVDBEngine* engine)
     {
+        boost::recursive_mutex::scoped_lock lock(mtx);
         if (dbEngine == nullptr && engine != nullptr && engine->Open())
         {
-            boost::recursive_mutex::scoped_lock lock(mtx);
-            dbEngine = engine;
+            SetEngine(boost::shared_ptr<CKVDBEngine>(engine));
             return true;
         }
 
@@ -79,11 +137,10 @@ public:
     void Close()
     {
         boost::recursive_mutex::scoped_lock lock(mtx);
-        if (dbEngine != nullptr)
+        boost::shared_ptr<CKVDBEngine> spEngine = DetachEngine();
+        if (spEngine != nullptr)
         {
-            dbEngine->Close();
-            delete dbEngine;
-            dbEngine = nullptr;
+            spEngine->Close();
         }
     }
 
@@ -116,60 +173,81 @@ public:
         }
     }
 
-    bool RemoveAll()
+    bool Sync()
     {
         boost::recursive_mutex::scoped_lock lock(mtx);
         if (dbEngine != nullptr)
         {
-            if (dbEngine->RemoveAll())
+            return dbEngine->Sync();
+        }
+        return false;
+    }
+
+    bool RemoveAll()
+    {
+        boost::recursive_mutex::scoped_lock lock(mtx);
+        boost::shared_ptr<CKVDBEngine> spEngine = DetachEngine();
+        if (spEngine != nullptr)
+        {
+            if (spEngine->RemoveAll())
             {
+                SetEngine(spEngine);
                 return true;
             }
-            Close();
+            spEngine->Close();
         }
         return false;
     }
 
     bool IsValid() const
     {
-        return (dbEngine != nullptr);
+        return (GetEngine() != nullptr);
     }
 
 protected:
-    virtual bool DBWalker(CBufStream& ssKey, CBufStream& ssValue)
+    // Consistent view for multi-key reads, writes made after it was taken are invisible.
+    // It keeps the engine alive, so release it before closing the database on the same thread
+    class CReadSnapshot
     {
-        return false;
-    }
-    template <typename K, typename T>
-    bool Read(const K& key, T& value)
-    {
-        CBufStream ssKey, ssValue;
-        ssKey << key;
-
-        try
+    public:
+        CReadSnapshot(CKVDB& db)
+          : spEngine(db.GetEngine()), snapshot(nullptr)
         {
-            boost::recursive_mutex::scoped_lock lock(mtx);
-
-            if (dbEngine == nullptr)
-                return false;
-
-            if (dbEngine->Get(ssKey, ssValue))
+            if (spEngine != nullptr)
             {
-                ssValue >> value;
-                return true;
+                snapshot = spEngine->NewSnapshot();
             }
         }
-        catch (const boost::thread_interrupted&)
+        ~CReadSnapshot()
         {
-            throw;
+            if (snapshot != nullptr)
+            {
+                spEngine->ReleaseSnapshot(snapshot);
+            }
         }
-        catch (std::exception& e)
+        template <typename K, typename T>
+        bool Read(const K& key, T& value)
         {
-            StdError(__PRETTY_FUNCTION__, e.what());
+            return CKVDB::Read(spEngine.get(), snapshot, key, value);
         }
 
+    protected:
+        boost::shared_ptr<CKVDBEngine> spEngine;
+        CKVDBSnapshot* snapshot;
+    };
+
+protected:
+    virtual bool DBWalker(CBufStream& ssKey, CBufStream& ssValue)
+    {
         return false;
     }
+    // reads do not take mtx, they only hold the engine until the read returns
+    template <typename K, typename T>
+    bool Read(const K& key, T& value)
+    {
+        boost::shared_ptr<CKVDBEngine> spEngine = GetEngine();
+        return Read(spEngine.get(), nullptr, key, value);
+    }
 
     template <typename K, typename T>
     bool Write(const K& key, const T& value, bool fOverwrite = true)
@@ -321,9 +399,112 @@ protected:
         return false;
     }
 
+    // records whose serialized key starts with the serialized prefix
+    template <typename K>
+    bool ScanPrefix(const K& keyPrefix, CKVDBEngine::ScanFunc fnScan)
+    {
+        CBufStream ssBegin, ssEnd;
+        ssBegin << keyPrefix;
+
+        // the end is the shortest key after all keys with the prefix
+        std::string strEnd(ssBegin.GetData(), ssBegin.GetSize());
+        while (!strEnd.empty() && (unsigned char)strEnd.back() == 0xFF)
+        {
+            strEnd.pop_back();
+        }
+        if (!strEnd.empty())
+        {
+            strEnd.back() = (char)((unsigned char)strEnd.back() + 1);
+            ssEnd.Write(strEnd.data(), strEnd.size());
+        }
+        return Scan(ssBegin, ssEnd, fnScan);
+    }
+
+    // records with keyBegin <= key < keyEnd
+    template <typename K, typename E>
+    bool ScanRange(const K& keyBegin, const E& keyEnd, CKVDBEngine::ScanFunc fnScan)
+    {
+        CBufStream ssBegin, ssEnd;
+        ssBegin << keyBegin;
+        ssEnd << keyEnd;
+        return Scan(ssBegin, ssEnd, fnScan);
+    }
+
+    bool Scan(CBufStream& ssBegin, CBufStream& ssEnd, CKVDBEngine::ScanFunc fnScan)
+    {
+        try
+        {
+            boost::recursive_mutex::scoped_lock lock(mtx);
+
+            if (dbEngine == nullptr)
+                return false;
+
+            return dbEngine->Scan(ssBegin, ssEnd, fnScan);
+        }
+        catch (std::exception& e)
+        {
+            StdError(__PRETTY_FUNCTION__, e.what());
+        }
+
+        return false;
+    }
+
+    // lock free for readers, boost guards the pointer copy with a spinlock only
+    boost::shared_ptr<CKVDBEngine> GetEngine() const
+    {
+        return boost::atomic_load(&dbEngine);
+    }
+
+private:
+    template <typename K, typename T>
+    static bool Read(CKVDBEngine* engine, const CKVDBSnapshot* snapshot, const K& key, T& value)
+    {
+        if (engine == nullptr)
+            return false;
+
+        CBufStream ssKey, ssValue;
+        ssKey << key;
+
+        try
+        {
+            if (engine->Get(ssKey, ssValue, snapshot))
+            {
+                ssValue >> value;
+                return true;
+            }
+        }
+        catch (const boost::thread_interrupted&)
+        {
+            throw;
+        }
+        catch (std::exception& e)
+        {
+            StdError(__PRETTY_FUNCTION__, e.what());
+        }
+
+        return false;
+    }
+    // called with mtx locked
+    void SetEngine(const boost::shared_ptr<CKVDBEngine>& spEngine)
+    {
+        boost::atomic_store(&dbEngine, spEngine);
+    }
+    // called with mtx locked, waits for the readers still holding the engine
+    boost::shared_ptr<CKVDBEngine> DetachEngine()
+    {
+        boost::shared_ptr<CKVDBEngine> spEngine = boost::atomic_exchange(&dbEngine, boost::shared_ptr<CKVDBEngine>());
+        while (spEngine != nullptr && !spEngine.unique())
+        {
+            boost::this_thread::sleep_for(boost::chrono::microseconds(100));
+        }
+        return spEngine;
+    }
+
 protected:
+    // serializes writes, transactions and walks
     boost::recursive_mutex mtx;
-    CKVDBEngine* dbEngine;
+    // engine is replaced atomically with mtx locked, so holders of mtx read it directly
+    boost::shared_ptr<CKVDBEngine> dbEngine;
 };
 
 } // namespace xengine
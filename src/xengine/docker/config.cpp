@@ -84,6 +84,12 @@ bool CConfig::Load(int argc, char* argv[], const fs::path& pathDefault, const st
     return true;
 }
 
+bool CConfig::IsSet(const string& strOpt) const
+{
+    po::variables_map::const_iterator it = vm.find(strOpt);
+    return (it != vm.end() && !(*it).second.defaulted());
+}
+
 bool CConfig::PostLoad()
 {
     pathData = pathRoot;
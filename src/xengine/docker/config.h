@@ -29,6 +29,8 @@ public:
     virtual std::string Help() const;
 
     void SetIgnoreCmd(int number);
+    // the option was given on the command line or in the config file, not taken from its default
+    bool IsSet(const std::string& strOpt) const;
 
 protected:
     static std::pair<std::string, std::string> ExtraParser(const std::string& s);
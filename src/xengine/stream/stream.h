@@ -374,6 +374,52 @@ public:
     }
 };
 
+// Read only stream over external memory (e.g. mapped file), no copy into stream buffer
+class CMemoryStream : public std::streambuf, public CStream
+{
+public:
+    CMemoryStream(const char* pData, std::size_t nSize)
+      : CStream(this)
+    {
+        char* p = const_cast<char*>(pData);
+        setg(p, p, p + nSize);
+    }
+
+    // point to other memory, so one stream serves many records
+    void Attach(const char* pData, std::size_t nSize)
+    {
+        char* p = const_cast<char*>(pData);
+        ios.clear();
+        setg(p, p, p + nSize);
+    }
+
+    std::size_t GetSize()
+    {
+        return (std::size_t)(egptr() - gptr());
+    }
+
+    std::size_t GetCurPos() const
+    {
+        return (std::size_t)(gptr() - eback());
+    }
+
+    const char* GetData() const
+    {
+        return gptr();
+    }
+
+    bool Seek(std::size_t nPos)
+    {
+        if (nPos > (std::size_t)(egptr() - eback()))
+        {
+            return false;
+        }
+        ios.clear();
+        setg(eback(), eback() + nPos, egptr());
+        return true;
+    }
+};
+
 // R/W compact size
 //  size <  253        -- 1 byte
 //  size <= USHRT_MAX  -- 3 bytes  (253 + 2 bytes)
@@ -36,6 +36,7 @@ class CMetaData
 };
 
 typedef CCTSDB<uint224, CMetaData, CCTSChunkSnappy<uint224, CMetaData>> CMetaDB;
+typedef CCTSDB<uint224, CMetaData, CCTSChunkEytzinger<uint224, CMetaData>> CMetaSearchDB;
 //typedef CCTSDB<uint224,CMetaData> CMetaDB;
 
 BOOST_AUTO_TEST_CASE(ctsdb)
@@ -95,4 +96,297 @@ BOOST_AUTO_TEST_CASE(ctsdb)
     boost::filesystem::remove_all(fullpath);
 }
 
+BOOST_AUTO_TEST_CASE(chunkcache)
+{
+    CMetaDB db;
+
+    std::string fullpath = boost::filesystem::initial_path<boost::filesystem::path>().string() + "/dbpath_cache";
+    BOOST_CHECK(db.Initialize(boost::filesystem::path(fullpath)));
+    db.RemoveAll();
+
+    std::vector<std::pair<int64, uint224>> vTest;
+    for (int64 nTime = 0; nTime < 10; nTime++)
+    {
+        for (int j = 0; j < 500; j++)
+        {
+            uint256 txid;
+            bigbang::crypto::CryptoGetRand256(txid);
+
+            CMetaData data;
+            data.hash = uint224(txid);
+            data.file = 1;
+            data.offset = j;
+            data.blocktime = nTime;
+            db.Update(nTime, data.hash, data);
+            vTest.push_back(std::make_pair(nTime, data.hash));
+        }
+    }
+    BOOST_CHECK(db.Flush());
+
+    size_t nCount, nSize;
+    uint64 nHit, nMiss;
+    for (int loop = 0; loop < 2; loop++)
+    {
+        xengine::CTicks t;
+        for (int i = 0; i < vTest.size(); i++)
+        {
+            CMetaData data;
+            BOOST_CHECK(db.Retrieve(vTest[i].first, vTest[i].second, data));
+            BOOST_CHECK(data.hash == vTest[i].second);
+        }
+        std::cout << "Retrieve cached loop " << loop << " : " << (t.Elapse() / vTest.size()) << "\n";
+    }
+    db.GetChunkCacheStat(nCount, nSize, nHit, nMiss);
+    BOOST_CHECK(nCount == 10 && nSize > 0);
+    BOOST_CHECK(nMiss == 10 && nHit == vTest.size() * 2 - 10);
+
+    // a flushed bucket is reloaded from disk with the new value
+    CMetaData data;
+    BOOST_CHECK(db.Retrieve(vTest[0].first, vTest[0].second, data));
+    data.offset = 12345;
+    db.Update(vTest[0].first, vTest[0].second, data);
+    BOOST_CHECK(db.Flush());
+    db.GetChunkCacheStat(nCount, nSize, nHit, nMiss);
+    BOOST_CHECK(nCount == 9);
+    BOOST_CHECK(db.Retrieve(vTest[0].first, vTest[0].second, data) && data.offset == 12345);
+
+    // budget smaller than one chunk disables caching
+    db.SetChunkCacheSize(1024);
+    db.GetChunkCacheStat(nCount, nSize, nHit, nMiss);
+    BOOST_CHECK(nCount == 0 && nSize == 0);
+    BOOST_CHECK(db.Retrieve(vTest[1].first, vTest[1].second, data));
+    db.GetChunkCacheStat(nCount, nSize, nHit, nMiss);
+    BOOST_CHECK(nCount == 0);
+
+    db.Deinitialize();
+    boost::filesystem::remove_all(fullpath);
+}
+
+BOOST_AUTO_TEST_CASE(deltachunk)
+{
+    // tx import: a block every 60s, tx time up to an hour before the block, flush every 5 blocks
+    // 1M tx, bytes written to chunk files per byte of index entries:
+    //   whole chunk rewrite on each flush : ~3.20 (size of the chunk files, nothing was reclaimed)
+    //   delta chunks + compaction         : ~1.13 (GetWriteSize, printed below)
+    const int nBlockCount = 1000;
+    const int nTxPerBlock = 1000;
+    CMetaDB db;
+
+    std::string fullpath = boost::filesystem::initial_path<boost::filesystem::path>().string() + "/dbpath_delta";
+    boost::filesystem::remove_all(fullpath);
+    db.SetChunkFileSize(0x400000);
+    BOOST_CHECK(db.Initialize(boost::filesystem::path(fullpath)));
+
+    std::vector<std::pair<int64, uint224>> vTest;
+    std::vector<CMetaData> vReorg;
+    for (int b = 0; b < nBlockCount; b++)
+    {
+        for (int j = 0; j < nTxPerBlock; j++)
+        {
+            uint256 txid;
+            bigbang::crypto::CryptoGetRand256(txid);
+
+            CMetaData data;
+            data.hash = uint224(txid);
+            data.file = b;
+            data.offset = j;
+            data.blocktime = 3600 + b * 60 - txid.Get32(0) % 3600;
+            db.Update(data.blocktime, data.hash, data);
+            if (j % 100 == 0)
+            {
+                vTest.push_back(std::make_pair(data.blocktime, data.hash));
+            }
+            if (b >= nBlockCount - 100)
+            {
+                vReorg.push_back(data);
+            }
+        }
+        if (b % 5 == 4)
+        {
+            BOOST_CHECK(db.Flush());
+            BOOST_CHECK(db.Compact());
+        }
+    }
+    BOOST_CHECK(db.Flush());
+    for (int i = 0; i < 20; i++)
+    {
+        BOOST_CHECK(db.Compact());
+    }
+
+    uint64 nWriteSize = db.GetWriteSize();
+    uint64 nDataSize = (uint64)nBlockCount * nTxPerBlock * sizeof(std::pair<uint224, CMetaData>);
+    std::cout << "Import " << nBlockCount * nTxPerBlock << " tx : write amplification "
+              << (double)nWriteSize / nDataSize << "\n";
+
+    // a reorg of the last 100 blocks rewrites their buckets as a whole, the old copies are reclaimed
+    for (const CMetaData& data : vReorg)
+    {
+        db.Erase(data.blocktime, data.hash);
+    }
+    BOOST_CHECK(db.Flush());
+    for (const CMetaData& data : vReorg)
+    {
+        db.Update(data.blocktime, data.hash, data);
+    }
+    BOOST_CHECK(db.Flush());
+    for (int i = 0; i < 20; i++)
+    {
+        BOOST_CHECK(db.Compact());
+    }
+
+    nWriteSize = db.GetWriteSize();
+    uint64 nFileSize = 0;
+    for (boost::filesystem::directory_iterator it(fullpath); it != boost::filesystem::directory_iterator(); ++it)
+    {
+        if (it->path().extension() == ".dat")
+        {
+            nFileSize += boost::filesystem::file_size(it->path());
+        }
+    }
+    std::cout << "Reorg " << vReorg.size() << " tx : written " << (double)nWriteSize / nDataSize
+              << ", on disk " << (double)nFileSize / nDataSize << "\n";
+    BOOST_CHECK(nFileSize < nWriteSize);
+
+    for (int i = 0; i < vTest.size(); i++)
+    {
+        CMetaData data;
+        BOOST_CHECK(db.Retrieve(vTest[i].first, vTest[i].second, data));
+        BOOST_CHECK(data.hash == vTest[i].second);
+    }
+
+    // an erase rewrites the bucket, the other keys stay
+    CMetaData data;
+    db.Erase(vTest[0].first, vTest[0].second);
+    BOOST_CHECK(!db.Retrieve(vTest[0].first, vTest[0].second, data));
+    BOOST_CHECK(db.Flush());
+    BOOST_CHECK(!db.Retrieve(vTest[0].first, vTest[0].second, data));
+    for (int i = 1; i < vTest.size(); i++)
+    {
+        if (vTest[i].first == vTest[0].first)
+        {
+            BOOST_CHECK(db.Retrieve(vTest[i].first, vTest[i].second, data));
+        }
+    }
+
+    db.Deinitialize();
+    boost::filesystem::remove_all(fullpath);
+}
+
+BOOST_AUTO_TEST_CASE(chunksearch)
+{
+    typedef CCTSChunkSnappy<uint224, CMetaData> CChunkBinary;
+    typedef CCTSChunkEytzinger<uint224, CMetaData> CChunkEytzinger;
+
+    const int nLookup = 1000000;
+    for (int nSize : { 1000, 10000, 100000 })
+    {
+        std::map<uint224, CMetaData> mapValue;
+        std::vector<uint224> vKey;
+        for (int i = 0; i < nSize; i++)
+        {
+            uint256 txid;
+            bigbang::crypto::CryptoGetRand256(txid);
+
+            CMetaData data;
+            data.hash = uint224(txid);
+            data.offset = i;
+            mapValue[data.hash] = data;
+            vKey.push_back(data.hash);
+
+            // missing key
+            bigbang::crypto::CryptoGetRand256(txid);
+            vKey.push_back(uint224(txid));
+        }
+        CChunkBinary chunkBinary(mapValue.begin(), mapValue.end());
+        CChunkEytzinger chunkEytzinger(mapValue.begin(), mapValue.end());
+
+        std::vector<uint224> vLookup;
+        for (int i = 0; i < nLookup; i++)
+        {
+            vLookup.push_back(vKey[bigbang::crypto::CryptoGetRand32() % vKey.size()]);
+        }
+
+        int nFoundBinary = 0, nFoundEytzinger = 0;
+        xengine::CTicks tBinary;
+        for (const uint224& key : vLookup)
+        {
+            CMetaData data;
+            nFoundBinary += chunkBinary.Find(key, data);
+        }
+        int64 nBinary = tBinary.Elapse();
+
+        xengine::CTicks tEytzinger;
+        for (const uint224& key : vLookup)
+        {
+            CMetaData data;
+            nFoundEytzinger += chunkEytzinger.Find(key, data);
+        }
+        int64 nEytzinger = tEytzinger.Elapse();
+
+        BOOST_CHECK(nFoundBinary == nFoundEytzinger);
+        // the cache charges the search index as well
+        BOOST_CHECK(chunkEytzinger.GetMemorySize() >= chunkBinary.GetMemorySize() + nSize * (sizeof(uint64) + sizeof(uint32)));
+        std::cout << "Find " << nSize << " entries : binary " << (nBinary * 1000 / nLookup) << " ns"
+                  << ", eytzinger " << (nEytzinger * 1000 / nLookup) << " ns\n";
+
+        for (int i = 0; i < vKey.size(); i++)
+        {
+            CMetaData data;
+            bool fFound = chunkEytzinger.Find(vKey[i], data);
+            BOOST_CHECK(fFound == (i % 2 == 0));
+            BOOST_CHECK(!fFound || data.hash == vKey[i]);
+        }
+    }
+
+    // keys sharing the 64-bit prefix
+    std::map<uint224, CMetaData> mapValue;
+    uint256 txid;
+    bigbang::crypto::CryptoGetRand256(txid);
+    for (int i = 0; i < 100; i += 2)
+    {
+        CMetaData data;
+        data.hash = uint224(txid);
+        data.hash ^= uint224(i);
+        mapValue[data.hash] = data;
+    }
+    CChunkEytzinger chunk(mapValue.begin(), mapValue.end());
+    for (int i = 0; i < 100; i++)
+    {
+        uint224 key(txid);
+        key ^= uint224(i);
+        CMetaData data;
+        BOOST_CHECK(chunk.Find(key, data) == (i % 2 == 0));
+    }
+    CMetaData data;
+    BOOST_CHECK(!CChunkEytzinger().Find(uint224(txid), data));
+
+    // search index is rebuilt after load and delta merge
+    CMetaSearchDB db;
+    std::string fullpath = boost::filesystem::initial_path<boost::filesystem::path>().string() + "/dbpath_search";
+    BOOST_CHECK(db.Initialize(boost::filesystem::path(fullpath)));
+    db.RemoveAll();
+    db.SetChunkCacheSize(0);
+
+    std::vector<uint224> vKey;
+    for (int loop = 0; loop < 3; loop++)
+    {
+        for (int i = 0; i < 1000; i++)
+        {
+            bigbang::crypto::CryptoGetRand256(txid);
+            data.hash = uint224(txid);
+            data.offset = loop;
+            db.Update(0, data.hash, data);
+            vKey.push_back(data.hash);
+        }
+        BOOST_CHECK(db.Flush());
+    }
+    for (int i = 0; i < vKey.size(); i++)
+    {
+        BOOST_CHECK(db.Retrieve(0, vKey[i], data) && data.hash == vKey[i] && data.offset == i / 1000);
+    }
+
+    db.Deinitialize();
+    boost::filesystem::remove_all(fullpath);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
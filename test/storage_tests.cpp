@@ -6,8 +6,13 @@
 
 #include "address.h"
 #include "block.h"
+#include "blockbase.h"
+#include "leveldbeng.h"
+#include "mappedeng.h"
+#include "memoryeng.h"
 #include "test_big.h"
 #include "timeseries.h"
+#include "walletdb.h"
 
 using namespace std;
 using namespace xengine;
@@ -167,4 +172,2227 @@ BOOST_AUTO_TEST_CASE(fileread)
     free(pBuf);
 }
 
+class CRecordWalker : public CTSWalker<vector<unsigned char>>
+{
+public:
+    CRecordWalker()
+      : nCount(0) {}
+    bool Walk(const vector<unsigned char>& vData, uint32 nFile, uint32 nOffset) override
+    {
+        nCount++;
+        return true;
+    }
+
+public:
+    int nCount;
+};
+
+class CTestRecordWalker : public CTSWalker<pair<vector<unsigned char>, vector<unsigned char>>>
+{
+public:
+    bool Walk(const pair<vector<unsigned char>, vector<unsigned char>>& record, uint32 nFile, uint32 nOffset) override
+    {
+        vRecord.push_back(record);
+        return true;
+    }
+
+public:
+    vector<pair<vector<unsigned char>, vector<unsigned char>>> vRecord;
+};
+
+BOOST_AUTO_TEST_CASE(mappedread)
+{
+    const int nRecordCount = 5000;
+    const size_t nRecordSize = 4096;
+    path pathTest = path("./.bigbang") / "mappedread";
+    boost::filesystem::remove_all(pathTest);
+
+    CTimeSeriesCached tsBlock;
+    BOOST_CHECK(tsBlock.Initialize(pathTest, BLOCKFILE_PREFIX));
+
+    vector<CDiskPos> vPos;
+    for (int i = 0; i < nRecordCount; i++)
+    {
+        vector<unsigned char> vData(nRecordSize, (unsigned char)i);
+        CDiskPos pos;
+        BOOST_CHECK(tsBlock.Write(vData, pos, false));
+        vPos.push_back(pos);
+    }
+
+    vector<size_t> vRandom(vPos.size());
+    for (size_t i = 0; i < vRandom.size(); i++)
+    {
+        vRandom[i] = i;
+    }
+    random_shuffle(vRandom.begin(), vRandom.end());
+
+    for (int nMode = 0; nMode < 2; nMode++)
+    {
+        tsBlock.SetMappedRead(nMode == 1);
+        const char* pszMode = (nMode == 1) ? "mmap" : "file";
+
+        xengine::CTicks tSeq;
+        for (size_t i = 0; i < vPos.size(); i++)
+        {
+            vector<unsigned char> vData;
+            BOOST_CHECK(tsBlock.Read(vData, vPos[i], false));
+            BOOST_CHECK(vData.size() == nRecordSize && vData[0] == (unsigned char)i);
+        }
+        int64 nSeq = tSeq.Elapse();
+
+        xengine::CTicks tRand;
+        for (size_t i = 0; i < vRandom.size(); i++)
+        {
+            vector<unsigned char> vData;
+            BOOST_CHECK(tsBlock.Read(vData, vPos[vRandom[i]], false));
+            BOOST_CHECK(vData.size() == nRecordSize && vData[0] == (unsigned char)vRandom[i]);
+        }
+        int64 nRand = tRand.Elapse();
+
+        cout << "Read " << pszMode << " : sequential " << (nSeq / nRecordCount) << " us/record"
+             << ", random " << (nRand / nRecordCount) << " us/record" << endl;
+    }
+
+    // appends keep the mapping, a record behind its end maps the file again
+    for (int i = 0; i < 10; i++)
+    {
+        vector<unsigned char> vData(nRecordSize, (unsigned char)(nRecordCount + i)), vRead;
+        CDiskPos pos;
+        BOOST_CHECK(tsBlock.Write(vData, pos, false));
+        BOOST_CHECK(tsBlock.Read(vRead, pos, false) && vRead == vData);
+        BOOST_CHECK(tsBlock.Read(vRead, vPos[i], false) && vRead[0] == (unsigned char)i);
+    }
+
+    tsBlock.Deinitialize();
+    boost::filesystem::remove_all(pathTest);
+}
+
+BOOST_AUTO_TEST_CASE(appendwrite)
+{
+    const int nRecordCount = 5000;
+    const int nGroupSize = 100;
+    const size_t nRecordSize = 4096;
+    path pathTest = path("./.bigbang") / "appendwrite";
+
+    for (int nMode = 0; nMode < 2; nMode++)
+    {
+        boost::filesystem::remove_all(pathTest);
+
+        CTimeSeriesCached tsBlock;
+        BOOST_CHECK(tsBlock.Initialize(pathTest, BLOCKFILE_PREFIX));
+        tsBlock.SetSyncPolicy(CTimeSeriesCached::SYNC_ON_CLOSE);
+
+        vector<CDiskPos> vPos;
+        xengine::CTicks t;
+        if (nMode == 0)
+        {
+            for (int i = 0; i < nRecordCount; i++)
+            {
+                CDiskPos pos;
+                BOOST_CHECK(tsBlock.Write(vector<unsigned char>(nRecordSize, (unsigned char)i), pos, false));
+                vPos.push_back(pos);
+            }
+        }
+        else
+        {
+            for (int i = 0; i < nRecordCount; i += nGroupSize)
+            {
+                vector<vector<unsigned char>> vBatch;
+                for (int j = i; j < i + nGroupSize; j++)
+                {
+                    vBatch.push_back(vector<unsigned char>(nRecordSize, (unsigned char)j));
+                }
+                BOOST_CHECK(tsBlock.WriteBatch(vBatch, vPos, false));
+            }
+        }
+        int64 nElapse = t.Elapse();
+        cout << "Write " << ((nMode == 1) ? "group" : "single") << " : " << (nElapse / nRecordCount) << " us/record" << endl;
+
+        BOOST_CHECK(vPos.size() == nRecordCount);
+        for (size_t i = 0; i < vPos.size(); i++)
+        {
+            vector<unsigned char> vData;
+            BOOST_CHECK(tsBlock.Read(vData, vPos[i], false));
+            BOOST_CHECK(vData.size() == nRecordSize && vData[0] == (unsigned char)i);
+        }
+        tsBlock.Deinitialize();
+
+        uint32 nLastFile, nLastPos;
+        CRecordWalker walker;
+        BOOST_CHECK(tsBlock.WalkThrough(walker, nLastFile, nLastPos, false));
+        BOOST_CHECK(walker.nCount == nRecordCount);
+    }
+    boost::filesystem::remove_all(pathTest);
+}
+
+BOOST_AUTO_TEST_CASE(cacheconcurrency)
+{
+    const int nRecordCount = 2000;
+    const int nReadPerThread = 200000;
+    path pathTest = path("./.bigbang") / "cacheconcurrency";
+    boost::filesystem::remove_all(pathTest);
+
+    CTimeSeriesCached tsBlock;
+    BOOST_CHECK(tsBlock.Initialize(pathTest, BLOCKFILE_PREFIX));
+
+    vector<CDiskPos> vPos;
+    for (int i = 0; i < nRecordCount; i++)
+    {
+        CDiskPos pos;
+        BOOST_CHECK(tsBlock.Write(vector<unsigned char>(256, (unsigned char)i), pos));
+        vPos.push_back(pos);
+    }
+
+    for (int nThread = 1; nThread <= 8; nThread *= 2)
+    {
+        atomic<int> nFail(0);
+        boost::thread_group group;
+        xengine::CTicks t;
+        for (int n = 0; n < nThread; n++)
+        {
+            group.create_thread([&, n]() {
+                for (int i = 0; i < nReadPerThread; i++)
+                {
+                    size_t nIndex = (i * 7 + n * 13) % vPos.size();
+                    vector<unsigned char> vData;
+                    if (!tsBlock.Read(vData, vPos[nIndex]) || vData.size() != 256 || vData[0] != (unsigned char)nIndex)
+                    {
+                        ++nFail;
+                    }
+                }
+            });
+        }
+        group.join_all();
+        int64 nElapse = t.Elapse();
+        BOOST_CHECK(nFail == 0);
+        cout << "Cache read threads " << nThread << " : " << ((int64)nThread * nReadPerThread * 1000000 / (nElapse + 1)) << " reads/s" << endl;
+    }
+
+    CTimeSeriesCacheStat stat;
+    tsBlock.GetCacheStat(stat);
+    cout << "Cache stat : hit " << stat.nHit << ", miss " << stat.nMiss << ", eviction " << stat.nEviction
+         << ", count " << stat.nCount << ", size " << stat.nSize << "/" << stat.nMaxSize << endl;
+    BOOST_CHECK(stat.nMiss == 0 && stat.nCount == nRecordCount);
+
+    tsBlock.SetCacheSize(nRecordCount * 64);
+    for (size_t i = 0; i < vPos.size(); i++)
+    {
+        vector<unsigned char> vData;
+        BOOST_CHECK(tsBlock.Read(vData, vPos[i]) && vData[0] == (unsigned char)i);
+    }
+    tsBlock.GetCacheStat(stat);
+    BOOST_CHECK(stat.nEviction > 0 && stat.nSize <= stat.nMaxSize);
+
+    // a torn tail is repaired while readers are on the mapped file
+    path pathFile = pathTest / "block_000001.dat";
+    size_t nFileSize = file_size(pathFile);
+    FILE* fp = fopen(pathFile.string().c_str(), "ab");
+    BOOST_CHECK(fp != nullptr && fwrite("torntail", 1, 8, fp) == 8);
+    fclose(fp);
+
+    atomic<bool> fStop(false);
+    atomic<int> nFail(0);
+    boost::thread_group group;
+    for (int n = 0; n < 4; n++)
+    {
+        group.create_thread([&, n]() {
+            for (int i = 0; !fStop; i++)
+            {
+                size_t nIndex = (i * 7 + n * 13) % vPos.size();
+                vector<unsigned char> vData;
+                if (!tsBlock.Read(vData, vPos[nIndex]) || vData.size() != 256 || vData[0] != (unsigned char)nIndex)
+                {
+                    ++nFail;
+                }
+            }
+        });
+    }
+    uint32 nLastFile = 0, nLastPos = 0;
+    BOOST_CHECK(tsBlock.CheckTail(nLastFile, nLastPos, true));
+    fStop = true;
+    group.join_all();
+    BOOST_CHECK(nFail == 0 && nLastPos == nFileSize && file_size(pathFile) == nFileSize);
+
+    tsBlock.Deinitialize();
+    boost::filesystem::remove_all(pathTest);
+}
+
+class CTestTsBlock : public CTimeSeriesCached
+{
+public:
+    void SealLastFile()
+    {
+        boost::unique_lock<boost::mutex> lock(mtxWriter);
+        CloseAppendFile();
+        nLastFile++;
+    }
+    bool IsSynced()
+    {
+        boost::unique_lock<boost::mutex> lock(mtxWriter);
+        return (nSyncedSize == nAppendSize);
+    }
+};
+
+BOOST_AUTO_TEST_CASE(compressrecord)
+{
+    typedef pair<vector<unsigned char>, vector<unsigned char>> CTestRecord;
+    const int nRecordCount = 200;
+    path pathTest = path("./.bigbang") / "compressrecord";
+    boost::filesystem::remove_all(pathTest);
+
+    CTestTsBlock tsBlock;
+    BOOST_CHECK(tsBlock.Initialize(pathTest, BLOCKFILE_PREFIX));
+
+    // file 1 is written raw and converted later, file 2 is written compressed
+    vector<CTestRecord> vRecord;
+    vector<CDiskPos> vPos;
+    for (int i = 0; i < nRecordCount; i++)
+    {
+        if (i == nRecordCount / 2)
+        {
+            tsBlock.SealLastFile();
+            tsBlock.SetCompress(true);
+        }
+        size_t nSize = (i % 4 == 0) ? 100 : 0x8000;
+        CTestRecord record(vector<unsigned char>(nSize, (unsigned char)i), vector<unsigned char>(16, (unsigned char)(i + 1)));
+        CDiskPos pos;
+        BOOST_CHECK(tsBlock.Write(record, pos, false));
+        vRecord.push_back(record);
+        vPos.push_back(pos);
+    }
+    BOOST_CHECK(tsBlock.CompressFile(1));
+    BOOST_CHECK(!tsBlock.CompressFile(2));
+    // the mark is written after the data file is replaced
+    BOOST_CHECK(exists(pathTest / "block_000001.cmp") && !exists(pathTest / "block_000001.cmp.temp"));
+
+    CTimeSeriesCompressStat stat;
+    tsBlock.GetCompressStat(stat);
+    cout << "Compress : records " << stat.nRecord << ", compressed " << stat.nCompressedRecord
+         << ", raw " << stat.nRawSize << ", stored " << stat.nStoredSize << ", ratio " << stat.GetRatio() << endl;
+    BOOST_CHECK(stat.nRecord == nRecordCount && stat.nCompressedRecord > 0 && stat.GetRatio() < 0.5);
+
+    for (int nMode = 0; nMode < 2; nMode++)
+    {
+        tsBlock.SetMappedRead(nMode == 1);
+        for (size_t i = 0; i < vPos.size(); i++)
+        {
+            // whole record and the second member at its interior offset
+            CTestRecord record;
+            BOOST_CHECK(tsBlock.Read(record, vPos[i], false) && record == vRecord[i]);
+            vector<unsigned char> vSecond;
+            CDiskPos posSecond(vPos[i].nFile, vPos[i].nOffset + xengine::GetSerializeSize(vRecord[i].first));
+            BOOST_CHECK(tsBlock.Read(vSecond, posSecond, false) && vSecond == vRecord[i].second);
+            BOOST_CHECK(tsBlock.ReadDirect(vSecond, posSecond.nFile, posSecond.nOffset) && vSecond == vRecord[i].second);
+        }
+    }
+
+    // file 2 starts with a small raw record, the raw mark keeps it for the convert pass until converted
+    tsBlock.SealLastFile();
+    BOOST_CHECK(exists(pathTest / "block_000002.cmp") && exists(pathTest / "block_000002.raw"));
+    BOOST_CHECK(tsBlock.CompressFile(2));
+    BOOST_CHECK(exists(pathTest / "block_000002.cmp") && !exists(pathTest / "block_000002.raw"));
+    CTestRecord recordRaw;
+    BOOST_CHECK(tsBlock.Read(recordRaw, vPos[nRecordCount / 2], false) && recordRaw == vRecord[nRecordCount / 2]);
+
+    CTestTsBlock tsReopen;
+    BOOST_CHECK(tsReopen.Initialize(pathTest, BLOCKFILE_PREFIX));
+    CTestRecord record;
+    BOOST_CHECK(tsReopen.Read(record, vPos[1], false) && record == vRecord[1]);
+    uint32 nLastFile, nLastPos;
+    CTestRecordWalker walker;
+    BOOST_CHECK(tsReopen.WalkThrough(walker, nLastFile, nLastPos, false));
+    BOOST_CHECK(walker.vRecord == vRecord);
+
+    tsReopen.Deinitialize();
+    tsBlock.Deinitialize();
+    boost::filesystem::remove_all(pathTest);
+}
+
+class CStopRecordWalker : public CTSWalker<pair<vector<unsigned char>, vector<unsigned char>>>
+{
+public:
+    CStopRecordWalker(int nStopIn)
+      : nStop(nStopIn), nCount(0) {}
+    bool Walk(const pair<vector<unsigned char>, vector<unsigned char>>& record, uint32 nFile, uint32 nOffset) override
+    {
+        return (++nCount != nStop);
+    }
+
+public:
+    int nStop;
+    int nCount;
+};
+
+BOOST_AUTO_TEST_CASE(idlesync)
+{
+    path pathTest = path("./.bigbang") / "idlesync";
+    boost::filesystem::remove_all(pathTest);
+
+    CTestTsBlock tsBlock;
+    BOOST_CHECK(tsBlock.Initialize(pathTest, BLOCKFILE_PREFIX));
+    tsBlock.SetSyncPolicy(CTimeSeriesCached::SYNC_INTERVAL, 200);
+
+    // both writes come within the interval after the file is opened, neither syncs
+    CDiskPos pos;
+    BOOST_CHECK(tsBlock.Write(vector<unsigned char>(100, 1), pos, false));
+    BOOST_CHECK(tsBlock.Write(vector<unsigned char>(100, 2), pos, false));
+    BOOST_CHECK(!tsBlock.IsSynced());
+
+    // no further write comes, the sync thread picks it up
+    for (int i = 0; i < 50 && !tsBlock.IsSynced(); i++)
+    {
+        boost::this_thread::sleep_for(boost::chrono::milliseconds(20));
+    }
+    BOOST_CHECK(tsBlock.IsSynced());
+
+    tsBlock.Deinitialize();
+    boost::filesystem::remove_all(pathTest);
+}
+
+BOOST_AUTO_TEST_CASE(parallelwalk)
+{
+    typedef pair<vector<unsigned char>, vector<unsigned char>> CTestRecord;
+    const int nRecordCount = 6000;
+    path pathTest = path("./.bigbang") / "parallelwalk";
+    boost::filesystem::remove_all(pathTest);
+
+    // two plain files and a compressed one, segments cut across records of mixed size
+    CTestTsBlock tsBlock;
+    BOOST_CHECK(tsBlock.Initialize(pathTest, BLOCKFILE_PREFIX));
+    vector<CTestRecord> vRecord;
+    for (int i = 0; i < nRecordCount; i++)
+    {
+        if (i == nRecordCount / 3 || i == nRecordCount * 2 / 3)
+        {
+            tsBlock.SealLastFile();
+            tsBlock.SetCompress(i == nRecordCount * 2 / 3);
+        }
+        size_t nSize = (i % 7 == 0) ? 0x5000 : (size_t)(i % 1000);
+        CTestRecord record(vector<unsigned char>(nSize, (unsigned char)i), vector<unsigned char>(8, (unsigned char)(i + 1)));
+        CDiskPos pos;
+        BOOST_CHECK(tsBlock.Write(record, pos, false));
+        vRecord.push_back(record);
+    }
+    tsBlock.Deinitialize();
+
+    uint32 nLastFile[2], nLastPos[2];
+    for (int nMode = 0; nMode < 2; nMode++)
+    {
+        tsBlock.SetWalkThread(nMode == 1 ? 4 : 0);
+        CTestRecordWalker walker;
+        xengine::CTicks t;
+        BOOST_CHECK(tsBlock.WalkThrough(walker, nLastFile[nMode], nLastPos[nMode], false));
+        cout << "WalkThrough " << ((nMode == 1) ? "parallel" : "sequential") << " : " << t.Elapse() << " us" << endl;
+        BOOST_CHECK(walker.vRecord == vRecord);
+
+        CStopRecordWalker walkerStop(nRecordCount / 2);
+        uint32 nFile, nPos;
+        BOOST_CHECK(!tsBlock.WalkThrough(walkerStop, nFile, nPos, false));
+        BOOST_CHECK(walkerStop.nCount == nRecordCount / 2);
+    }
+    BOOST_CHECK(nLastFile[0] == 3 && nLastFile[1] == 3 && nLastPos[0] == nLastPos[1]);
+
+    // a torn record at the tail is reported and repaired at the same offset
+    string strLastFile = (pathTest / (string(BLOCKFILE_PREFIX) + "_000003.dat")).string();
+    {
+        FILE* f = fopen(strLastFile.c_str(), "ab");
+        BOOST_CHECK(f != nullptr);
+        uint32 nHeader[2] = { nMagicNum, 0x100 };
+        fwrite(nHeader, sizeof(nHeader), 1, f);
+        fwrite(nHeader, sizeof(nHeader), 1, f);
+        fclose(f);
+    }
+    for (int nMode = 0; nMode < 2; nMode++)
+    {
+        tsBlock.SetWalkThread(nMode == 1 ? 4 : 0);
+        CTestRecordWalker walker;
+        uint32 nFile, nPos;
+        BOOST_CHECK(tsBlock.WalkThrough(walker, nFile, nPos, false));
+        BOOST_CHECK(walker.vRecord == vRecord && nFile == 3 && nPos == nLastPos[0]);
+    }
+    tsBlock.SetWalkThread(4);
+    CTestRecordWalker walker;
+    uint32 nFile, nPos;
+    BOOST_CHECK(tsBlock.WalkThrough(walker, nFile, nPos, true));
+    BOOST_CHECK(boost::filesystem::file_size(strLastFile) == nLastPos[0]);
+
+    tsBlock.Deinitialize();
+    boost::filesystem::remove_all(pathTest);
+}
+
+BOOST_AUTO_TEST_CASE(indexfile)
+{
+    typedef pair<vector<unsigned char>, vector<unsigned char>> CTestRecord;
+    const int nRecordCount = 300;
+    path pathTest = path("./.bigbang") / "indexfile";
+    boost::filesystem::remove_all(pathTest);
+
+    // a plain file, a file converted later and a file written compressed
+    CTestTsBlock tsBlock;
+    BOOST_CHECK(tsBlock.Initialize(pathTest, BLOCKFILE_PREFIX));
+    vector<CTestRecord> vRecord;
+    for (int i = 0; i < nRecordCount; i++)
+    {
+        if (i == nRecordCount / 3 || i == nRecordCount * 2 / 3)
+        {
+            tsBlock.SealLastFile();
+            tsBlock.SetCompress(i == nRecordCount * 2 / 3);
+        }
+        size_t nSize = (i % 5 == 0) ? 0x6000 : (size_t)(i * 3);
+        CTestRecord record(vector<unsigned char>(nSize, (unsigned char)i), vector<unsigned char>(8, (unsigned char)(i + 1)));
+        CDiskPos pos;
+        BOOST_CHECK(tsBlock.Write(record, pos, false));
+        vRecord.push_back(record);
+    }
+    BOOST_CHECK(tsBlock.CompressFile(2));
+    tsBlock.Deinitialize();
+
+    vector<string> vDataFile, vIndexFile;
+    for (int i = 1; i <= 3; i++)
+    {
+        string strName = string(BLOCKFILE_PREFIX) + "_00000" + to_string(i);
+        vDataFile.push_back((pathTest / (strName + ".dat")).string());
+        vIndexFile.push_back((pathTest / (strName + ".idx")).string());
+        BOOST_CHECK(boost::filesystem::file_size(vIndexFile.back()) == (nRecordCount / 3) * 20);
+    }
+
+    uint32 nLastFile, nLastPos;
+    BOOST_CHECK(tsBlock.CheckTail(nLastFile, nLastPos, false));
+    BOOST_CHECK(nLastFile == 3 && nLastPos == boost::filesystem::file_size(vDataFile[2]));
+
+    // a torn record at the tail is found from the sidecar and cut off
+    uint32 nGoodSize = nLastPos;
+    {
+        FILE* f = fopen(vDataFile[2].c_str(), "ab");
+        BOOST_CHECK(f != nullptr);
+        uint32 nHeader[2] = { nMagicNum, 0x100 };
+        fwrite(nHeader, sizeof(nHeader), 1, f);
+        fclose(f);
+    }
+    BOOST_CHECK(!tsBlock.CheckTail(nLastFile, nLastPos, false));
+    BOOST_CHECK(nLastFile == 3 && nLastPos == nGoodSize);
+    BOOST_CHECK(tsBlock.CheckTail(nLastFile, nLastPos, true));
+    BOOST_CHECK(boost::filesystem::file_size(vDataFile[2]) == nGoodSize);
+
+    // stale or missing entries are dropped and indexed again
+    boost::filesystem::resize_file(vIndexFile[2], 20 * 10 + 7);
+    boost::filesystem::remove(vIndexFile[0]);
+    BOOST_CHECK(tsBlock.CheckTail(nLastFile, nLastPos, false) && nLastPos == nGoodSize);
+    BOOST_CHECK(boost::filesystem::file_size(vIndexFile[0]) == (nRecordCount / 3) * 20);
+    BOOST_CHECK(boost::filesystem::file_size(vIndexFile[2]) == (nRecordCount / 3) * 20);
+
+    // appends continue the sidecar of the last file
+    CDiskPos pos;
+    BOOST_CHECK(tsBlock.Write(vRecord[0], pos, false) && pos.nFile == 3);
+    tsBlock.Deinitialize();
+    BOOST_CHECK(boost::filesystem::file_size(vIndexFile[2]) == (nRecordCount / 3 + 1) * 20);
+    vRecord.push_back(vRecord[0]);
+
+    BOOST_CHECK(tsBlock.RebuildIndexFile(nLastFile, nLastPos));
+    BOOST_CHECK(nLastFile == 3 && nLastPos == boost::filesystem::file_size(vDataFile[2]));
+    CTestRecordWalker walker;
+    BOOST_CHECK(tsBlock.WalkThrough(walker, nLastFile, nLastPos, false));
+    BOOST_CHECK(walker.vRecord == vRecord);
+
+    tsBlock.Deinitialize();
+    boost::filesystem::remove_all(pathTest);
+}
+
+BOOST_AUTO_TEST_CASE(readrange)
+{
+    typedef pair<vector<unsigned char>, vector<unsigned char>> CTestRecord;
+    const int nRecordCount = 3000;
+    path pathTest = path("./.bigbang") / "readrange";
+    boost::filesystem::remove_all(pathTest);
+
+    CTestTsBlock tsBlock;
+    BOOST_CHECK(tsBlock.Initialize(pathTest, BLOCKFILE_PREFIX));
+    vector<CTestRecord> vRecord;
+    vector<CDiskPos> vPos;
+    for (int i = 0; i < nRecordCount; i++)
+    {
+        if (i == nRecordCount / 2)
+        {
+            tsBlock.SealLastFile();
+        }
+        CTestRecord record(vector<unsigned char>((i % 9) * 300, (unsigned char)i), vector<unsigned char>(8, (unsigned char)(i + 1)));
+        CDiskPos pos;
+        BOOST_CHECK(tsBlock.Write(record, pos, false));
+        vRecord.push_back(record);
+        vPos.push_back(pos);
+    }
+
+    for (int nMode = 0; nMode < 2; nMode++)
+    {
+        tsBlock.SetMappedRead(nMode == 1);
+        vector<CTestRecord> vRead;
+        xengine::CTicks t;
+        for (size_t i = 0; i < vPos.size(); i++)
+        {
+            CTestRecord record;
+            BOOST_CHECK(tsBlock.Read(record, vPos[i], false));
+            vRead.push_back(record);
+        }
+        int64 nReadTime = t.Elapse();
+        BOOST_CHECK(vRead == vRecord);
+
+        vRead.clear();
+        vector<size_t> vIndex;
+        t = xengine::CTicks();
+        BOOST_CHECK(tsBlock.ReadRange<CTestRecord>(vPos, [&](size_t n, const CTestRecord& record) -> bool {
+            vIndex.push_back(n);
+            vRead.push_back(record);
+            return true;
+        }));
+        cout << "Read " << ((nMode == 1) ? "mapped" : "stream") << " : " << nReadTime << " us, ReadRange : " << t.Elapse() << " us" << endl;
+        BOOST_CHECK(vRead == vRecord && vIndex.size() == vPos.size() && vIndex.back() == vPos.size() - 1);
+    }
+
+    // positions in any order, the callback sees them as given
+    vector<CDiskPos> vReverse(vPos.rbegin(), vPos.rend());
+    int nCount = 0;
+    BOOST_CHECK(tsBlock.ReadRange<CTestRecord>(vReverse, [&](size_t n, const CTestRecord& record) -> bool {
+        return (record == vRecord[nRecordCount - 1 - n] && ++nCount > 0);
+    }));
+    BOOST_CHECK(nCount == nRecordCount);
+
+    // the callback stops the range, a bad position fails it
+    nCount = 0;
+    BOOST_CHECK(!tsBlock.ReadRange<CTestRecord>(vPos, [&](size_t n, const CTestRecord& record) -> bool {
+        return (++nCount != 100);
+    }));
+    BOOST_CHECK(nCount == 100);
+    vector<CDiskPos> vBad(vPos.begin(), vPos.begin() + 50);
+    vBad.push_back(CDiskPos(9, 0));
+    nCount = 0;
+    BOOST_CHECK(!tsBlock.ReadRange<CTestRecord>(vBad, [&](size_t n, const CTestRecord& record) -> bool {
+        return (++nCount > 0);
+    }));
+    BOOST_CHECK(nCount == 50);
+
+    tsBlock.Deinitialize();
+    boost::filesystem::remove_all(pathTest);
+}
+
+BOOST_AUTO_TEST_CASE(blockexcache)
+{
+    vector<uint256> vHash;
+    vector<std::shared_ptr<const CBlockEx>> vBlock;
+    for (int i = 0; i < 100; i++)
+    {
+        std::shared_ptr<CBlockEx> spBlock = std::make_shared<CBlockEx>();
+        spBlock->nTimeStamp = i;
+        spBlock->vtx.resize(10);
+        spBlock->vTxContxt.resize(10);
+        vHash.push_back(uint256(i + 1));
+        vBlock.push_back(spBlock);
+    }
+
+    CBlockExCache cache;
+    for (size_t i = 0; i < vBlock.size(); i++)
+    {
+        cache.AddNew(vHash[i], vBlock[i]);
+    }
+    for (size_t i = 0; i < vBlock.size(); i++)
+    {
+        std::shared_ptr<const CBlockEx> spBlock;
+        BOOST_CHECK(cache.Retrieve(vHash[i], spBlock));
+        BOOST_CHECK(spBlock == vBlock[i]);
+    }
+
+    size_t nCount, nSize;
+    uint64 nHit, nMiss;
+    cache.GetStat(nCount, nSize, nHit, nMiss);
+    BOOST_CHECK(nCount == vBlock.size() && nHit == vBlock.size() && nMiss == 0);
+
+    // touch the first block, then shrink: the least recently used blocks go first
+    std::shared_ptr<const CBlockEx> spFirst;
+    BOOST_CHECK(cache.Retrieve(vHash[0], spFirst));
+    cache.SetMaxSize(nSize / 10);
+    cache.GetStat(nCount, nSize, nHit, nMiss);
+    BOOST_CHECK(nCount > 0 && nCount <= vBlock.size() / 10);
+    BOOST_CHECK(cache.Retrieve(vHash[0], spFirst));
+    BOOST_CHECK(!cache.Retrieve(vHash[1], spFirst));
+
+    cache.SetMaxSize(0);
+    cache.AddNew(vHash[1], vBlock[1]);
+    BOOST_CHECK(!cache.Retrieve(vHash[1], spFirst));
+}
+
+BOOST_AUTO_TEST_CASE(txlocator)
+{
+    const int nForkCount = 60;
+    const int nTxPerFork = 300;
+    path pathTest = path("./.bigbang") / "txlocator";
+    boost::filesystem::remove_all(pathTest);
+
+    CTxIndexDB dbTxIndex;
+    BOOST_CHECK(dbTxIndex.Initialize(pathTest));
+
+    // every fork has tx in the same time buckets, like forks sharing block times
+    vector<pair<uint256, uint256>> vTx;
+    for (int i = 0; i < nForkCount; i++)
+    {
+        uint256 hashFork = crypto::CryptoHash(&i, sizeof(i));
+        BOOST_CHECK(dbTxIndex.LoadFork(hashFork));
+
+        vector<pair<uint256, CTxIndex>> vTxNew;
+        for (int j = 0; j < nTxPerFork; j++)
+        {
+            uint256 hash;
+            crypto::CryptoGetRand256(hash);
+            uint256 txid(1600000000 + j % 60, uint224(hash));
+            vTxNew.push_back(make_pair(txid, CTxIndex(j, i, j)));
+            vTx.push_back(make_pair(txid, hashFork));
+        }
+        BOOST_CHECK(dbTxIndex.Update(hashFork, vTxNew, vector<uint256>()));
+        dbTxIndex.Flush(hashFork);
+    }
+    random_shuffle(vTx.begin(), vTx.end());
+
+    xengine::CTicks tScan;
+    for (size_t i = 0; i < vTx.size(); i++)
+    {
+        for (int n = 0; n < nForkCount; n++)
+        {
+            CTxIndex txIndex;
+            if (dbTxIndex.Retrieve(crypto::CryptoHash(&n, sizeof(n)), vTx[i].first, txIndex))
+            {
+                break;
+            }
+        }
+    }
+    int64 nScan = tScan.Elapse();
+
+    xengine::CTicks tLocate;
+    for (size_t i = 0; i < vTx.size(); i++)
+    {
+        CTxIndex txIndex;
+        uint256 hashFork;
+        BOOST_CHECK(dbTxIndex.Retrieve(vTx[i].first, txIndex, hashFork));
+        BOOST_CHECK(hashFork == vTx[i].second);
+    }
+    int64 nLocate = tLocate.Elapse();
+    cout << "Retrieve " << nForkCount << " forks : fork scan " << (nScan / (int64)vTx.size()) << " us/tx"
+         << ", locator " << (nLocate / (int64)vTx.size()) << " us/tx" << endl;
+
+    // the chunk cache budget bounds all forks together
+    const size_t nBudget = 64 * 1024;
+    dbTxIndex.SetChunkCacheSize(nBudget);
+    for (size_t i = 0; i < vTx.size(); i++)
+    {
+        CTxIndex txIndex;
+        BOOST_CHECK(dbTxIndex.Retrieve(vTx[i].second, vTx[i].first, txIndex));
+    }
+    size_t nCount, nSize;
+    uint64 nHit, nMiss;
+    dbTxIndex.GetChunkCacheStat(nCount, nSize, nHit, nMiss);
+    BOOST_CHECK(nCount > 0 && nSize <= nBudget);
+
+    // tx added after the bucket was located
+    uint256 hash;
+    crypto::CryptoGetRand256(hash);
+    uint256 txidNew(1600000000, uint224(hash));
+    vector<pair<uint256, CTxIndex>> vTxNew(1, make_pair(txidNew, CTxIndex(1, 2, 3)));
+    BOOST_CHECK(dbTxIndex.Update(vTx[0].second, vTxNew, vector<uint256>()));
+    CTxIndex txIndex;
+    uint256 hashFork;
+    BOOST_CHECK(dbTxIndex.Retrieve(txidNew, txIndex, hashFork));
+    BOOST_CHECK(hashFork == vTx[0].second && txIndex.nOffset == 3);
+
+    crypto::CryptoGetRand256(hash);
+    BOOST_CHECK(!dbTxIndex.Retrieve(uint256(1600000000, uint224(hash)), txIndex, hashFork));
+
+    // forks indexed before the locator existed have it built when they are loaded
+    dbTxIndex.Deinitialize();
+    boost::filesystem::remove_all(pathTest / "txindex" / "locator");
+    BOOST_CHECK(dbTxIndex.Initialize(pathTest));
+    for (int i = 0; i < nForkCount; i++)
+    {
+        BOOST_CHECK(dbTxIndex.LoadFork(crypto::CryptoHash(&i, sizeof(i))));
+    }
+    for (size_t i = 0; i < vTx.size(); i += 7)
+    {
+        BOOST_CHECK(dbTxIndex.Retrieve(vTx[i].first, txIndex, hashFork) && hashFork == vTx[i].second);
+    }
+    BOOST_CHECK(dbTxIndex.Retrieve(txidNew, txIndex, hashFork) && hashFork == vTx[0].second);
+
+    dbTxIndex.Clear();
+    dbTxIndex.Deinitialize();
+    boost::filesystem::remove_all(pathTest);
+}
+
+BOOST_AUTO_TEST_CASE(txindexbatch)
+{
+    const int nTxCount = 20000;
+    path pathTest = path("./.bigbang") / "txindexbatch";
+    boost::filesystem::remove_all(pathTest);
+
+    CTxIndexDB dbTxIndex;
+    BOOST_CHECK(dbTxIndex.Initialize(pathTest));
+
+    uint256 hashFork = crypto::CryptoHash("txindexbatch", 12);
+    BOOST_CHECK(dbTxIndex.LoadFork(hashFork));
+
+    vector<uint256> vTxid;
+    vector<pair<uint256, CTxIndex>> vTxNew;
+    for (int i = 0; i < nTxCount; i++)
+    {
+        uint256 hash;
+        crypto::CryptoGetRand256(hash);
+        uint256 txid(1600000000 + i / 100, uint224(hash));
+        vTxNew.push_back(make_pair(txid, CTxIndex(i, 1, i)));
+        vTxid.push_back(txid);
+    }
+    BOOST_CHECK(dbTxIndex.Update(hashFork, vTxNew, vector<uint256>()));
+    dbTxIndex.Flush(hashFork);
+
+    // unflushed tx in a flushed bucket, and tx that do not exist
+    vTxNew.clear();
+    for (int i = 0; i < 10; i++)
+    {
+        uint256 hash;
+        crypto::CryptoGetRand256(hash);
+        uint256 txid(1600000000, uint224(hash));
+        vTxNew.push_back(make_pair(txid, CTxIndex(nTxCount + i, 1, nTxCount + i)));
+        vTxid.push_back(txid);
+
+        crypto::CryptoGetRand256(hash);
+        vTxid.push_back(uint256(1600000000 + i, uint224(hash)));
+    }
+    BOOST_CHECK(dbTxIndex.Update(hashFork, vTxNew, vector<uint256>()));
+    random_shuffle(vTxid.begin(), vTxid.end());
+
+    xengine::CTicks tSingle;
+    vector<CTxIndex> vSingle(vTxid.size());
+    for (size_t i = 0; i < vTxid.size(); i++)
+    {
+        dbTxIndex.Retrieve(hashFork, vTxid[i], vSingle[i]);
+    }
+    int64 nSingle = tSingle.Elapse();
+
+    xengine::CTicks tBatch;
+    vector<CTxIndex> vBatch;
+    size_t nFound = 0;
+    BOOST_CHECK(dbTxIndex.RetrieveBatch(hashFork, vTxid, vBatch, nFound));
+    int64 nBatch = tBatch.Elapse();
+    cout << "Retrieve " << vTxid.size() << " tx : single " << nSingle << " us, batch " << nBatch << " us" << endl;
+
+    BOOST_CHECK(vBatch.size() == vTxid.size());
+    size_t nMissing = 0;
+    for (size_t i = 0; i < vTxid.size(); i++)
+    {
+        BOOST_CHECK(vBatch[i].nBlockHeight == vSingle[i].nBlockHeight && vBatch[i].nOffset == vSingle[i].nOffset);
+        if (vBatch[i].IsNull())
+        {
+            nMissing++;
+        }
+    }
+    BOOST_CHECK(nMissing == 10 && nFound == vTxid.size() - 10);
+
+    vector<CTxIndex> vOther;
+    BOOST_CHECK(!dbTxIndex.RetrieveBatch(uint256(), vTxid, vOther, nFound) && nFound == 0);
+
+    dbTxIndex.Clear();
+    dbTxIndex.Deinitialize();
+    boost::filesystem::remove_all(pathTest);
+}
+
+class CLegacyForkUnspentDB : public CForkUnspentDB
+{
+public:
+    CLegacyForkUnspentDB(const path& pathDB)
+      : CForkUnspentDB(pathDB) {}
+    bool ReadRecord(const CTxOutPoint& txout, CTxOut& output)
+    {
+        return ReadOutput(txout, output);
+    }
+    void WriteLegacy(const vector<CTxUnspent>& vUnspent)
+    {
+        Erase(string("version"));
+        for (const CTxUnspent& unspent : vUnspent)
+        {
+            Write(static_cast<const CTxOutPoint&>(unspent), unspent.output);
+        }
+    }
+    // index entries of version 2, kept among the outpoint keys
+    void WriteLegacyIndex(const vector<CTxUnspent>& vUnspent)
+    {
+        for (const CTxUnspent& unspent : vUnspent)
+        {
+            Write(make_pair(string("dest"), make_pair(unspent.output.destTo, static_cast<const CTxOutPoint&>(unspent))),
+                  CCompactTxOut(unspent.output, false));
+        }
+        Write(string("version"), uint8(2));
+    }
+    bool ExistsLegacyIndex(const CTxUnspent& unspent)
+    {
+        CCompactTxOut compact(false);
+        return Read(make_pair(string("dest"), make_pair(unspent.output.destTo, static_cast<const CTxOutPoint&>(unspent))), compact);
+    }
+};
+
+class CCountUnspentWalker : public CForkUnspentDBWalker
+{
+public:
+    CCountUnspentWalker(const CDestination& destIn)
+      : dest(destIn), nCount(0) {}
+    bool Walk(const CTxOutPoint& txout, const CTxOut& output) override
+    {
+        nCount += (output.destTo == dest);
+        return true;
+    }
+
+public:
+    CDestination dest;
+    size_t nCount;
+};
+
+BOOST_AUTO_TEST_CASE(unspentdest)
+{
+    const int nDestCount = 1000;
+    const int nUnspentCount = 150000;
+    path pathTest = path("./.bigbang") / "unspentdest";
+    boost::filesystem::remove_all(pathTest);
+
+    vector<CDestination> vDest;
+    for (int i = 0; i < nDestCount; i++)
+    {
+        uint256 hash;
+        crypto::CryptoGetRand256(hash);
+        vDest.push_back(CDestination(CTemplateId(hash)));
+    }
+    vector<CTxUnspent> vUnspent;
+    map<CDestination, set<CTxOutPoint>> mapDestUnspent;
+    for (int i = 0; i < nUnspentCount; i++)
+    {
+        uint256 txid;
+        crypto::CryptoGetRand256(txid);
+        const CDestination& dest = vDest[i % nDestCount];
+        vUnspent.push_back(CTxUnspent(CTxOutPoint(txid, i % 3), CTxOut(dest, i + 1, 0, 0)));
+        mapDestUnspent[dest].insert(vUnspent.back());
+    }
+
+    // unspent db written before the destination index existed
+    uint256 hashFork = crypto::CryptoHash("unspentdest", 11);
+    boost::filesystem::create_directories(pathTest / "unspent");
+    {
+        CLegacyForkUnspentDB dbLegacy(pathTest / "unspent" / hashFork.GetHex());
+        dbLegacy.WriteLegacy(vUnspent);
+    }
+
+    CUnspentDB dbUnspent;
+    BOOST_CHECK(dbUnspent.Initialize(pathTest));
+    BOOST_CHECK(dbUnspent.AddNewFork(hashFork));
+
+    auto fnCheck = [&](const CDestination& dest) -> bool {
+        vector<CTxUnspent> vList;
+        if (!dbUnspent.ListUnspent(hashFork, dest, 0, vList) || vList.size() != mapDestUnspent[dest].size())
+        {
+            return false;
+        }
+        for (const CTxUnspent& unspent : vList)
+        {
+            if (!mapDestUnspent[dest].count(unspent) || unspent.output.destTo != dest)
+            {
+                return false;
+            }
+        }
+        return true;
+    };
+
+    xengine::CTicks tList;
+    for (int i = 0; i < 100; i++)
+    {
+        BOOST_CHECK(fnCheck(vDest[i]));
+    }
+    int64 nList = tList.Elapse() / 100;
+
+    xengine::CTicks tWalk;
+    CCountUnspentWalker walker(vDest[0]);
+    BOOST_CHECK(dbUnspent.WalkThrough(hashFork, walker) && walker.nCount == mapDestUnspent[vDest[0]].size());
+    cout << "ListUnspent " << nUnspentCount << " utxo : full walk " << tWalk.Elapse() << " us, index " << nList << " us" << endl;
+
+    vector<CTxUnspent> vList;
+    BOOST_CHECK(dbUnspent.ListUnspent(hashFork, vDest[0], 10, vList) && vList.size() == 10);
+
+    // spent and new outputs, before and after flush
+    const CDestination& dest = vDest[0];
+    vector<CTxOutPoint> vRemove;
+    for (int i = 0; i < nUnspentCount; i += nDestCount * 2)
+    {
+        vRemove.push_back(vUnspent[i]);
+        mapDestUnspent[dest].erase(vUnspent[i]);
+    }
+    vector<CTxUnspent> vAddNew;
+    for (int i = 0; i < 10; i++)
+    {
+        uint256 txid;
+        crypto::CryptoGetRand256(txid);
+        vAddNew.push_back(CTxUnspent(CTxOutPoint(txid, 0), CTxOut(dest, i + 1, 0, 0)));
+        mapDestUnspent[dest].insert(vAddNew.back());
+    }
+    BOOST_CHECK(dbUnspent.Update(hashFork, vAddNew, vRemove));
+    BOOST_CHECK(fnCheck(dest));
+    dbUnspent.Flush(hashFork);
+    BOOST_CHECK(fnCheck(dest));
+    dbUnspent.Flush(hashFork);
+    BOOST_CHECK(fnCheck(dest));
+
+    vList.clear();
+    BOOST_CHECK(dbUnspent.ListUnspent(hashFork, CDestination(), 0, vList) && vList.empty());
+    dbUnspent.Deinitialize();
+
+    // a version 2 db keeps its index among the outpoints, the upgrade moves it and drops stale entries
+    uint256 txidStale;
+    crypto::CryptoGetRand256(txidStale);
+    CTxUnspent unspentStale(CTxOutPoint(txidStale, 0), CTxOut(vDest[1], 1, 0, 0));
+    vector<CTxUnspent> vLegacyIndex(1, unspentStale);
+    vLegacyIndex.push_back(vUnspent[1]);
+    {
+        CLegacyForkUnspentDB dbLegacy(pathTest / "unspent" / hashFork.GetHex());
+        dbLegacy.WriteLegacyIndex(vLegacyIndex);
+    }
+    BOOST_CHECK(dbUnspent.Initialize(pathTest));
+    BOOST_CHECK(dbUnspent.AddNewFork(hashFork));
+    BOOST_CHECK(fnCheck(vDest[1]));
+    BOOST_CHECK(fnCheck(dest));
+    dbUnspent.Deinitialize();
+    {
+        CLegacyForkUnspentDB dbLegacy(pathTest / "unspent" / hashFork.GetHex());
+        BOOST_CHECK(!dbLegacy.ExistsLegacyIndex(unspentStale) && !dbLegacy.ExistsLegacyIndex(vUnspent[1]));
+    }
+    boost::filesystem::remove_all(pathTest);
+}
+
+BOOST_AUTO_TEST_CASE(unspentcompact)
+{
+    const int nUnspentCount = 20000;
+    path pathTest = path("./.bigbang") / "unspentcompact";
+    boost::filesystem::remove_all(pathTest);
+
+    auto fnEqual = [](const CTxOut& a, const CTxOut& b) -> bool {
+        return (a.destTo == b.destTo && a.nAmount == b.nAmount && a.nTxTime == b.nTxTime && a.nLockUntil == b.nLockUntil);
+    };
+
+    uint256 hash;
+    crypto::CryptoGetRand256(hash);
+    CDestination dest = CDestination(CTemplateId(hash));
+    vector<CTxUnspent> vUnspent;
+    size_t nLegacySize = 0, nCompactSize = 0;
+    for (int i = 0; i < nUnspentCount; i++)
+    {
+        uint256 txid;
+        crypto::CryptoGetRand256(txid);
+        int64 nAmount = (i % 100 == 0 ? 0x7FFFFFFFFFFFFFFFLL - i : (int64)(i + 1) * 1000000);
+        uint32 nLockUntil = (i % 10 == 0 ? 100000 + i : 0);
+        vUnspent.push_back(CTxUnspent(CTxOutPoint(txid, i % 3), CTxOut(dest, nAmount, 1500000000 + i, nLockUntil)));
+
+        const CTxOut& output = vUnspent.back().output;
+        xengine::CBufStream ssLegacy, ssCompact, ssIndex;
+        ssLegacy << output;
+        ssCompact << CCompactTxOut(output);
+        ssIndex << CCompactTxOut(output, false);
+        nLegacySize += ssLegacy.GetSize() * 2;
+        nCompactSize += ssCompact.GetSize() + ssIndex.GetSize();
+
+        CCompactTxOut compact, legacy, index(false);
+        ssCompact >> compact;
+        ssLegacy >> legacy;
+        ssIndex >> index;
+        index.output.destTo = dest;
+        BOOST_CHECK(fnEqual(compact.output, output) && fnEqual(legacy.output, output) && fnEqual(index.output, output));
+    }
+    cout << "Unspent record size : legacy " << nLegacySize / nUnspentCount << " bytes, compact "
+         << nCompactSize / nUnspentCount << " bytes" << endl;
+    BOOST_CHECK(nCompactSize * 3 < nLegacySize * 2);
+
+    // legacy records are upgraded on open
+    uint256 hashFork = crypto::CryptoHash("unspentcompact", 14);
+    boost::filesystem::create_directories(pathTest / "unspent");
+    {
+        CLegacyForkUnspentDB dbLegacy(pathTest / "unspent" / hashFork.GetHex());
+        dbLegacy.WriteLegacy(vUnspent);
+    }
+
+    CUnspentDB dbUnspent;
+    BOOST_CHECK(dbUnspent.Initialize(pathTest));
+    BOOST_CHECK(dbUnspent.AddNewFork(hashFork));
+
+    size_t nMatched = 0;
+    for (const CTxUnspent& unspent : vUnspent)
+    {
+        CTxOut output;
+        nMatched += (dbUnspent.Retrieve(hashFork, unspent, output) && fnEqual(output, unspent.output));
+    }
+    BOOST_CHECK(nMatched == vUnspent.size());
+
+    vector<CTxUnspent> vList;
+    BOOST_CHECK(dbUnspent.ListUnspent(hashFork, dest, 0, vList) && vList.size() == vUnspent.size());
+    map<CTxOutPoint, CTxOut> mapUnspent;
+    for (const CTxUnspent& unspent : vUnspent)
+    {
+        mapUnspent[unspent] = unspent.output;
+    }
+    nMatched = 0;
+    for (const CTxUnspent& unspent : vList)
+    {
+        nMatched += (mapUnspent.count(unspent) && fnEqual(mapUnspent[unspent], unspent.output));
+    }
+    BOOST_CHECK(nMatched == vUnspent.size());
+
+    dbUnspent.Deinitialize();
+    boost::filesystem::remove_all(pathTest);
+}
+
+BOOST_AUTO_TEST_CASE(unspentcache)
+{
+    const int nUnspentCount = 20000;
+    path pathTest = path("./.bigbang") / "unspentcache";
+    boost::filesystem::remove_all(pathTest);
+
+    CUnspentDB dbUnspent;
+    BOOST_CHECK(dbUnspent.Initialize(pathTest));
+    uint256 hashFork = crypto::CryptoHash("unspentcache", 12);
+    BOOST_CHECK(dbUnspent.AddNewFork(hashFork));
+
+    uint256 hash;
+    crypto::CryptoGetRand256(hash);
+    CDestination dest = CDestination(CTemplateId(hash));
+    vector<CTxUnspent> vUnspent;
+    for (int i = 0; i < nUnspentCount; i++)
+    {
+        uint256 txid;
+        crypto::CryptoGetRand256(txid);
+        vUnspent.push_back(CTxUnspent(CTxOutPoint(txid, 0), CTxOut(dest, i + 1, 0, 0)));
+    }
+    BOOST_CHECK(dbUnspent.Update(hashFork, vUnspent, vector<CTxOutPoint>()));
+    dbUnspent.Flush(hashFork);
+    dbUnspent.Flush(hashFork);
+
+    // a flush does not fill the cache, outputs are cached when read
+    size_t nCount, nSize;
+    uint64 nHit, nMiss;
+    dbUnspent.GetCacheStat(nCount, nSize, nHit, nMiss);
+    BOOST_CHECK(nCount == 0);
+
+    for (int loop = 0; loop < 2; loop++)
+    {
+        xengine::CTicks t;
+        for (const CTxUnspent& unspent : vUnspent)
+        {
+            CTxOut output;
+            BOOST_CHECK(dbUnspent.Retrieve(hashFork, unspent, output) && output.nAmount == unspent.output.nAmount);
+        }
+        cout << "Retrieve unspent loop " << loop << " : " << (t.Elapse() * 1000 / nUnspentCount) << " ns" << endl;
+    }
+    dbUnspent.GetCacheStat(nCount, nSize, nHit, nMiss);
+    BOOST_CHECK(nCount == nUnspentCount && nHit == nUnspentCount && nMiss == nUnspentCount);
+
+    // spent outputs are dropped from the cache when flushed
+    vector<CTxOutPoint> vRemove(vUnspent.begin(), vUnspent.begin() + 100);
+    BOOST_CHECK(dbUnspent.Update(hashFork, vector<CTxUnspent>(), vRemove));
+    dbUnspent.Flush(hashFork);
+    dbUnspent.Flush(hashFork);
+    dbUnspent.GetCacheStat(nCount, nSize, nHit, nMiss);
+    BOOST_CHECK(nCount == nUnspentCount - vRemove.size());
+    CTxOut output;
+    for (const CTxOutPoint& txout : vRemove)
+    {
+        BOOST_CHECK(!dbUnspent.Retrieve(hashFork, txout, output));
+    }
+
+    // repaired outputs replace cached ones
+    vector<CTxUnspent> vRepair(1, vUnspent[100]);
+    vRepair[0].output.nAmount = 12345;
+    BOOST_CHECK(dbUnspent.RepairUnspent(hashFork, vRepair, vector<CTxOutPoint>()));
+    BOOST_CHECK(dbUnspent.Retrieve(hashFork, vRepair[0], output) && output.nAmount == 12345);
+
+    // bounded by the size budget
+    dbUnspent.SetCacheSize(1024 * 1024);
+    dbUnspent.GetCacheStat(nCount, nSize, nHit, nMiss);
+    BOOST_CHECK(nCount > 0 && nSize <= 1024 * 1024);
+
+    // the budget is shared by all forks
+    BOOST_CHECK(dbUnspent.AddNewFork(crypto::CryptoHash("unspentcache2", 13)));
+    dbUnspent.GetCacheStat(nCount, nSize, nHit, nMiss);
+    BOOST_CHECK(nCount > 0 && nSize <= 512 * 1024);
+
+    dbUnspent.Deinitialize();
+    boost::filesystem::remove_all(pathTest);
+}
+
+class CCollectUnspentWalker : public CForkUnspentDBWalker
+{
+public:
+    bool Walk(const CTxOutPoint& txout, const CTxOut& output) override
+    {
+        mapUnspent[txout] = output.nAmount;
+        return true;
+    }
+
+public:
+    map<CTxOutPoint, int64> mapUnspent;
+};
+
+BOOST_AUTO_TEST_CASE(unspentcopy)
+{
+    const int nUnspentCount = 200000;
+    path pathTest = path("./.bigbang") / "unspentcopy";
+    boost::filesystem::remove_all(pathTest);
+
+    CUnspentDB dbUnspent;
+    BOOST_CHECK(dbUnspent.Initialize(pathTest));
+    uint256 hashParent = crypto::CryptoHash("parent", 6);
+    uint256 hashChild = crypto::CryptoHash("child", 5);
+    BOOST_CHECK(dbUnspent.AddNewFork(hashParent));
+    BOOST_CHECK(dbUnspent.AddNewFork(hashChild));
+
+    uint256 hash;
+    crypto::CryptoGetRand256(hash);
+    CDestination dest = CDestination(CTemplateId(hash));
+    auto fnNew = [&](int nCount, vector<CTxUnspent>& vUnspent) {
+        vUnspent.clear();
+        for (int i = 0; i < nCount; i++)
+        {
+            uint256 txid;
+            crypto::CryptoGetRand256(txid);
+            vUnspent.push_back(CTxUnspent(CTxOutPoint(txid, 0), CTxOut(dest, i + 1, 0, 0)));
+        }
+    };
+
+    // parent set : flushed outputs, some spent and some added in the cache maps
+    vector<CTxUnspent> vUnspent, vAddNew;
+    fnNew(nUnspentCount, vUnspent);
+    BOOST_CHECK(dbUnspent.Update(hashParent, vUnspent, vector<CTxOutPoint>()));
+    dbUnspent.Flush(hashParent);
+    dbUnspent.Flush(hashParent);
+    fnNew(1000, vAddNew);
+    vector<CTxOutPoint> vRemove(vUnspent.begin(), vUnspent.begin() + 1000);
+    BOOST_CHECK(dbUnspent.Update(hashParent, vAddNew, vRemove));
+
+    map<CTxOutPoint, int64> mapBase;
+    for (int i = 1000; i < nUnspentCount; i++)
+    {
+        mapBase[vUnspent[i]] = vUnspent[i].output.nAmount;
+    }
+    for (const CTxUnspent& unspent : vAddNew)
+    {
+        mapBase[unspent] = unspent.output.nAmount;
+    }
+
+    xengine::CTicks tCopy;
+    BOOST_CHECK(dbUnspent.Copy(hashParent, hashChild));
+    int64 nCopy = tCopy.Elapse();
+    xengine::CTicks tMerge;
+
+    // a list during the merge waits a few seconds at most, it fails only when the merge is not done by then
+    vector<CTxUnspent> vListMerging;
+    xengine::CTicks tList;
+    bool fList = dbUnspent.ListUnspent(hashChild, dest, 0, vListMerging);
+    int64 nList = tList.Elapse();
+    BOOST_CHECK(fList || nList >= 3000000);
+    BOOST_CHECK(nList < 5000000);
+
+    // child reads through the parent set before it is merged
+    CTxOut output;
+    BOOST_CHECK(dbUnspent.Retrieve(hashChild, vUnspent[5000], output) && output.nAmount == vUnspent[5000].output.nAmount);
+    BOOST_CHECK(dbUnspent.Retrieve(hashChild, vAddNew[0], output));
+    BOOST_CHECK(!dbUnspent.Retrieve(hashChild, vUnspent[0], output));
+
+    // child and parent go on separately while merging
+    map<CTxOutPoint, int64> mapChild = mapBase, mapParent = mapBase;
+    vector<CTxUnspent> vChildNew, vParentNew;
+    fnNew(100, vChildNew);
+    fnNew(100, vParentNew);
+    vector<CTxOutPoint> vChildSpent, vParentSpent;
+    for (int i = 0; i < 100; i++)
+    {
+        vChildSpent.push_back(vUnspent[nUnspentCount - 1 - i * 7]);
+        vParentSpent.push_back(vUnspent[nUnspentCount - 2 - i * 11]);
+    }
+    vChildSpent.push_back(vAddNew[1]);
+    vParentSpent.push_back(vAddNew[2]);
+    for (const CTxOutPoint& txout : vChildSpent)
+    {
+        mapChild.erase(txout);
+    }
+    for (const CTxOutPoint& txout : vParentSpent)
+    {
+        mapParent.erase(txout);
+    }
+    for (const CTxUnspent& unspent : vChildNew)
+    {
+        mapChild[unspent] = unspent.output.nAmount;
+    }
+    for (const CTxUnspent& unspent : vParentNew)
+    {
+        mapParent[unspent] = unspent.output.nAmount;
+    }
+    BOOST_CHECK(dbUnspent.Update(hashChild, vChildNew, vChildSpent));
+    BOOST_CHECK(dbUnspent.Update(hashParent, vParentNew, vParentSpent));
+    for (int i = 0; i < 2; i++)
+    {
+        dbUnspent.Flush(hashParent);
+        dbUnspent.Flush(hashChild);
+    }
+    BOOST_CHECK(!dbUnspent.Retrieve(hashChild, vChildSpent[0], output));
+    BOOST_CHECK(dbUnspent.Retrieve(hashChild, vParentSpent[0], output));
+
+    // this walk waits for the whole merge
+    CCollectUnspentWalker walkerChild, walkerParent;
+    BOOST_CHECK(dbUnspent.WalkThrough(hashChild, walkerChild, true));
+    int64 nMerge = tMerge.Elapse();
+    BOOST_CHECK(dbUnspent.WalkThrough(hashParent, walkerParent));
+    BOOST_CHECK(walkerChild.mapUnspent == mapChild);
+    BOOST_CHECK(walkerParent.mapUnspent == mapParent);
+    cout << "Copy " << nUnspentCount << " utxo : " << nCopy << " us, merged in background " << nMerge << " us" << endl;
+
+    vector<CTxUnspent> vList;
+    BOOST_CHECK(dbUnspent.ListUnspent(hashChild, dest, 0, vList) && vList.size() == mapChild.size());
+
+    dbUnspent.Deinitialize();
+    boost::filesystem::remove_all(pathTest);
+}
+
+BOOST_AUTO_TEST_CASE(unspentresume)
+{
+    const int nUnspentCount = 200000;
+    path pathTest = path("./.bigbang") / "unspentresume";
+    boost::filesystem::remove_all(pathTest);
+
+    uint256 hashParent = crypto::CryptoHash("parent", 6);
+    uint256 hashChild = crypto::CryptoHash("child", 5);
+    uint256 hashGrand = crypto::CryptoHash("grandchild", 10);
+    vector<uint256> vFork = { hashParent, hashChild, hashGrand };
+
+    uint256 hash;
+    crypto::CryptoGetRand256(hash);
+    CDestination dest = CDestination(CTemplateId(hash));
+    auto fnNew = [&](int nCount, vector<CTxUnspent>& vUnspent) {
+        vUnspent.clear();
+        for (int i = 0; i < nCount; i++)
+        {
+            uint256 txid;
+            crypto::CryptoGetRand256(txid);
+            vUnspent.push_back(CTxUnspent(CTxOutPoint(txid, 0), CTxOut(dest, i + 1, 0, 0)));
+        }
+    };
+
+    CUnspentDB dbUnspent;
+    BOOST_CHECK(dbUnspent.Initialize(pathTest));
+    for (const uint256& hashFork : vFork)
+    {
+        BOOST_CHECK(dbUnspent.AddNewFork(hashFork));
+    }
+
+    vector<CTxUnspent> vUnspent;
+    fnNew(nUnspentCount, vUnspent);
+    BOOST_CHECK(dbUnspent.Update(hashParent, vUnspent, vector<CTxOutPoint>()));
+    dbUnspent.Flush(hashParent);
+    dbUnspent.Flush(hashParent);
+
+    // copy returns at once, a chained copy does not wait for the merge of its parent
+    xengine::CTicks tCopy;
+    BOOST_CHECK(dbUnspent.Copy(hashParent, hashChild));
+    vector<CTxUnspent> vChildNew;
+    fnNew(100, vChildNew);
+    vector<CTxOutPoint> vChildSpent(vUnspent.begin(), vUnspent.begin() + 100);
+    BOOST_CHECK(dbUnspent.Update(hashChild, vChildNew, vChildSpent));
+    dbUnspent.Flush(hashChild);
+    dbUnspent.Flush(hashChild);
+    BOOST_CHECK(dbUnspent.Copy(hashChild, hashGrand));
+    BOOST_CHECK(tCopy.Elapse() < 1000000);
+
+    map<CTxOutPoint, int64> mapChild;
+    for (int i = 100; i < nUnspentCount; i++)
+    {
+        mapChild[vUnspent[i]] = vUnspent[i].output.nAmount;
+    }
+    for (const CTxUnspent& unspent : vChildNew)
+    {
+        mapChild[unspent] = unspent.output.nAmount;
+    }
+    map<CTxOutPoint, int64> mapGrand = mapChild;
+
+    // the parent goes on and overwrites records both children copied
+    vector<CTxUnspent> vParentNew;
+    fnNew(100, vParentNew);
+    vector<CTxOutPoint> vParentSpent(vUnspent.begin() + 1000, vUnspent.begin() + 1100);
+    BOOST_CHECK(dbUnspent.Update(hashParent, vParentNew, vParentSpent));
+    dbUnspent.Flush(hashParent);
+    dbUnspent.Flush(hashParent);
+
+    // stopped at a batch boundary and resumed from the saved progress
+    dbUnspent.Deinitialize();
+    BOOST_CHECK(dbUnspent.Initialize(pathTest));
+    for (const uint256& hashFork : vFork)
+    {
+        BOOST_CHECK(dbUnspent.AddNewFork(hashFork));
+    }
+    dbUnspent.ResumeMerge();
+
+    CTxOut output;
+    BOOST_CHECK(dbUnspent.Retrieve(hashGrand, vUnspent[1000], output) && output.nAmount == vUnspent[1000].output.nAmount);
+    BOOST_CHECK(!dbUnspent.Retrieve(hashGrand, vChildSpent[0], output));
+
+    CCollectUnspentWalker walkerChild, walkerGrand;
+    BOOST_CHECK(dbUnspent.WalkThrough(hashChild, walkerChild, true));
+    BOOST_CHECK(dbUnspent.WalkThrough(hashGrand, walkerGrand, true));
+    BOOST_CHECK(walkerChild.mapUnspent == mapChild);
+    BOOST_CHECK(walkerGrand.mapUnspent == mapGrand);
+    BOOST_CHECK(!dbUnspent.IsMerging());
+
+    // merged sets need nothing from the parent at the next start
+    dbUnspent.Deinitialize();
+    BOOST_CHECK(dbUnspent.Initialize(pathTest));
+    BOOST_CHECK(dbUnspent.AddNewFork(hashGrand));
+    CCollectUnspentWalker walkerReopen;
+    BOOST_CHECK(dbUnspent.WalkThrough(hashGrand, walkerReopen));
+    BOOST_CHECK(walkerReopen.mapUnspent == mapGrand);
+
+    dbUnspent.Deinitialize();
+    boost::filesystem::remove_all(pathTest);
+}
+
+BOOST_AUTO_TEST_CASE(snapshotfile)
+{
+    const int nRecordCount = 100000;
+    path pathTest = path("./.bigbang") / "snapshotfile";
+    boost::filesystem::remove_all(pathTest);
+    boost::filesystem::create_directories(pathTest);
+
+    vector<pair<CTxOutPoint, CCompactTxOut>> vRecord;
+    for (int i = 0; i < nRecordCount; i++)
+    {
+        uint256 txid;
+        crypto::CryptoGetRand256(txid);
+        CDestination dest = CDestination(CTemplateId(txid));
+        vRecord.push_back(make_pair(CTxOutPoint(txid, i % 2), CCompactTxOut(CTxOut(dest, (int64)(i + 1) * 1000000, 1500000000 + i, 0))));
+    }
+
+    CSnapshotWriter writer;
+    uint256 hashChecksum;
+    BOOST_CHECK(writer.Open(pathTest / "record.dat"));
+    for (const auto& record : vRecord)
+    {
+        BOOST_CHECK(writer.Write(record));
+    }
+    BOOST_CHECK(writer.GetCount() == nRecordCount);
+    BOOST_CHECK(writer.Close(hashChecksum));
+
+    // the copy checksum covers the raw file, the record checksum the chunks
+    uint256 hashCopy, hashCopyAgain;
+    BOOST_CHECK(SnapshotCopyFile(pathTest / "record.dat", pathTest / "copy.dat", hashCopy));
+    BOOST_CHECK(SnapshotCopyFile(pathTest / "copy.dat", pathTest / "copyagain.dat", hashCopyAgain));
+    BOOST_CHECK(hashCopy != 0 && hashCopy == hashCopyAgain);
+
+    CSnapshotReader reader;
+    BOOST_CHECK(reader.Open(pathTest / "copy.dat", hashChecksum));
+    pair<CTxOutPoint, CCompactTxOut> record;
+    int nRead = 0;
+    while (reader.Read(record))
+    {
+        BOOST_CHECK(nRead < nRecordCount && record.first == vRecord[nRead].first
+                    && record.second.output.destTo == vRecord[nRead].second.output.destTo
+                    && record.second.output.nAmount == vRecord[nRead].second.output.nAmount);
+        nRead++;
+    }
+    BOOST_CHECK(reader.IsCompleted() && nRead == nRecordCount);
+    reader.Close();
+
+    // a damaged chunk is reported instead of a clean end
+    {
+        FILE* fp = fopen((pathTest / "copy.dat").string().c_str(), "r+b");
+        BOOST_CHECK(fp != nullptr);
+        fseek(fp, 100, SEEK_SET);
+        unsigned char c = 0;
+        BOOST_CHECK(fread(&c, 1, 1, fp) == 1);
+        c ^= 0xFF;
+        fseek(fp, 100, SEEK_SET);
+        BOOST_CHECK(fwrite(&c, 1, 1, fp) == 1);
+        fclose(fp);
+    }
+    BOOST_CHECK(reader.Open(pathTest / "copy.dat", hashChecksum));
+    while (reader.Read(record))
+    {
+    }
+    BOOST_CHECK(!reader.IsCompleted());
+    reader.Close();
+
+    // a wrong expected checksum is rejected
+    BOOST_CHECK(reader.Open(pathTest / "record.dat", hashCopy));
+    while (reader.Read(record))
+    {
+    }
+    BOOST_CHECK(!reader.IsCompleted());
+    reader.Close();
+
+    boost::filesystem::remove_all(pathTest);
+}
+
+class CTestReadDB : public CKVDB
+{
+public:
+    CTestReadDB(const path& pathDB)
+    {
+        CLevelDBArguments args;
+        args.path = pathDB.string();
+        Open(new CLevelDBEngine(args));
+    }
+    CTestReadDB(CKVDBEngine* engine)
+      : CKVDB(engine) {}
+    using CKVDB::CReadSnapshot;
+    using CKVDB::Erase;
+    using CKVDB::IsValid;
+    using CKVDB::ScanPrefix;
+    using CKVDB::ScanRange;
+    using CKVDB::TxnBegin;
+    using CKVDB::TxnCommit;
+    using CKVDB::WalkThrough;
+    template <typename K, typename T>
+    bool ReadValue(const K& key, T& value)
+    {
+        return Read(key, value);
+    }
+    template <typename K, typename T>
+    bool WriteValue(const K& key, const T& value)
+    {
+        return Write(key, value);
+    }
+};
+
+BOOST_AUTO_TEST_CASE(kvdbread)
+{
+    const int nRecordCount = 50000;
+    const int nReadPerThread = 50000;
+    path pathTest = path("./.bigbang") / "kvdbread";
+    boost::filesystem::remove_all(pathTest);
+    boost::filesystem::create_directories(pathTest);
+
+    vector<CTxUnspent> vUnspent;
+    vector<CWalletTx> vWalletTx;
+    for (int i = 0; i < nRecordCount; i++)
+    {
+        uint256 txid;
+        crypto::CryptoGetRand256(txid);
+        CDestination dest = CDestination(CTemplateId(txid));
+        vUnspent.push_back(CTxUnspent(CTxOutPoint(txid, 0), CTxOut(dest, (int64)(i + 1) * 1000000, 1500000000 + i, 0)));
+
+        CWalletTx wtx;
+        wtx.txid = txid;
+        wtx.sendTo = dest;
+        wtx.nAmount = (int64)(i + 1) * 1000000;
+        vWalletTx.push_back(wtx);
+    }
+
+    CLegacyForkUnspentDB dbUnspent(pathTest / "unspent");
+    dbUnspent.WriteLegacy(vUnspent);
+    CWalletTxDB dbWtx;
+    BOOST_CHECK(dbWtx.Initialize(pathTest));
+    BOOST_CHECK(dbWtx.UpdateTx(vWalletTx, vector<uint256>()));
+
+    auto fnRead = [&](const string& strName, int nThread, function<bool(size_t)> fnReadOne) {
+        atomic<int> nFail(0);
+        boost::thread_group group;
+        xengine::CTicks t;
+        for (int n = 0; n < nThread; n++)
+        {
+            group.create_thread([&, n]() {
+                for (int i = 0; i < nReadPerThread; i++)
+                {
+                    if (!fnReadOne((i * 7 + n * 13) % nRecordCount))
+                    {
+                        ++nFail;
+                    }
+                }
+            });
+        }
+        group.join_all();
+        int64 nElapse = t.Elapse();
+        BOOST_CHECK(nFail == 0);
+        cout << strName << " point read threads " << nThread << " : "
+             << ((int64)nThread * nReadPerThread * 1000000 / (nElapse + 1)) << " reads/s" << endl;
+    };
+
+    for (int nThread = 1; nThread <= 8; nThread *= 2)
+    {
+        fnRead("Unspent", nThread, [&](size_t nIndex) -> bool {
+            CTxOut output;
+            return (dbUnspent.ReadRecord(vUnspent[nIndex], output) && output.nAmount == vUnspent[nIndex].output.nAmount);
+        });
+        fnRead("Wallet tx", nThread, [&](size_t nIndex) -> bool {
+            CWalletTx wtx;
+            return (dbWtx.RetrieveTx(vWalletTx[nIndex].txid, wtx) && wtx.nAmount == vWalletTx[nIndex].nAmount);
+        });
+    }
+
+    // snapshot reads see a pair written in one batch either before or after the batch
+    CTestReadDB db(pathTest / "snapshot");
+    BOOST_CHECK(db.WriteValue(0, 0) && db.WriteValue(1, 0));
+    atomic<bool> fStop(false);
+    atomic<int> nMismatch(0), nRead(0);
+    boost::thread_group group;
+    group.create_thread([&]() {
+        for (int i = 1; i <= 10000; i++)
+        {
+            db.TxnBegin();
+            db.WriteValue(0, i);
+            db.WriteValue(1, i);
+            db.TxnCommit();
+        }
+        fStop = true;
+    });
+    group.create_thread([&]() {
+        while (!fStop)
+        {
+            CTestReadDB::CReadSnapshot snapshot(db);
+            int n0 = -1, n1 = -2;
+            if (!snapshot.Read(0, n0) || !snapshot.Read(1, n1) || n0 != n1)
+            {
+                ++nMismatch;
+            }
+            ++nRead;
+        }
+    });
+    group.join_all();
+    BOOST_CHECK(nMismatch == 0 && nRead > 0);
+
+    CTestReadDB::CReadSnapshot* pSnapshot = new CTestReadDB::CReadSnapshot(db);
+    BOOST_CHECK(db.WriteValue(0, -1));
+    int nValue = 0;
+    BOOST_CHECK(pSnapshot->Read(0, nValue) && nValue == 10000);
+    BOOST_CHECK(db.ReadValue(0, nValue) && nValue == -1);
+    delete pSnapshot;
+    db.Close();
+    BOOST_CHECK(!db.ReadValue(0, nValue) && !db.IsValid());
+
+    dbWtx.Deinitialize();
+    dbUnspent.Close();
+    boost::filesystem::remove_all(pathTest);
+}
+
+BOOST_AUTO_TEST_CASE(leveldbstat)
+{
+    const int nRecordCount = 20000;
+    path pathTest = path("./.bigbang") / "leveldbstat";
+    boost::filesystem::remove_all(pathTest);
+    boost::filesystem::create_directories(pathTest);
+
+    vector<CTxUnspent> vUnspent;
+    for (int i = 0; i < nRecordCount; i++)
+    {
+        uint256 txid;
+        crypto::CryptoGetRand256(txid);
+        vUnspent.push_back(CTxUnspent(CTxOutPoint(txid, 0), CTxOut(CDestination(CTemplateId(txid)), i + 1, 1500000000 + i, 0)));
+    }
+
+    // sizing applies to the databases opened later
+    CLevelDBEngine::SetSizing("unspent", 4 << 20, 1 << 20);
+    for (int nFilterBits : { 10, 0 })
+    {
+        CLevelDBEngine::SetFilterBits(nFilterBits);
+        path pathDB = pathTest / ("unspent" + to_string(nFilterBits));
+        {
+            CLegacyForkUnspentDB dbUnspent(pathDB);
+            dbUnspent.WriteLegacy(vUnspent);
+        }
+        CLegacyForkUnspentDB dbUnspent(pathDB);
+
+        xengine::CTicks t;
+        int nFound = 0;
+        for (int i = 0; i < nRecordCount; i++)
+        {
+            uint256 txid;
+            crypto::CryptoGetRand256(txid);
+            CTxOut output;
+            nFound += dbUnspent.ReadRecord(CTxOutPoint(txid, 0), output);
+        }
+        int64 nElapse = t.Elapse();
+        BOOST_CHECK(nFound == 0);
+
+        vector<CLevelDBStat> vStat;
+        CLevelDBEngine::GetStat("unspent", vStat);
+        BOOST_CHECK(vStat.size() == 1);
+        if (vStat.size() == 1)
+        {
+            const CLevelDBStat& stat = vStat[0];
+            BOOST_CHECK(stat.strPath == pathDB.string() && stat.nCacheSize == (4 << 20) && stat.nWriteBufferSize == (1 << 20));
+            BOOST_CHECK(stat.nFilterBits == nFilterBits && stat.vLevelFile.size() == 7 && !stat.strCompaction.empty());
+            cout << "Filter bits " << nFilterBits << " : " << ((int64)nRecordCount * 1000000 / (nElapse + 1))
+                 << " negative lookups/s, memory " << stat.nMemoryUsage << ", cache " << stat.nCacheUsage << endl;
+        }
+    }
+    CLevelDBEngine::SetFilterBits(10);
+    CLevelDBEngine::SetSizing("unspent", 0, 0);
+
+    vector<CLevelDBStat> vStat;
+    CLevelDBEngine::GetStat("unspent", vStat);
+    BOOST_CHECK(vStat.empty());
+
+    boost::filesystem::remove_all(pathTest);
+}
+
+class CTestOutlineWalker : public CBlockDBWalker
+{
+public:
+    bool Walk(CBlockOutline& outline) override
+    {
+        setHash.insert(outline.hashBlock);
+        return true;
+    }
+
+public:
+    set<uint256> setHash;
+};
+
+BOOST_AUTO_TEST_CASE(blockjournal)
+{
+    path pathTest = path("./.bigbang") / "blockjournal";
+    boost::filesystem::remove_all(pathTest);
+    boost::filesystem::create_directories(pathTest);
+
+    // a torn tail is cut off and later records follow the valid ones
+    {
+        CBlockJournal journal;
+        BOOST_CHECK(journal.Open(pathTest / "records.dat"));
+        for (int i = 0; i < 3; i++)
+        {
+            CBufStream ss;
+            ss << i << string(i * 100, 'x');
+            BOOST_CHECK(journal.Append(i + 1, ss, i == 2));
+        }
+        uint64 nSize = journal.GetSize();
+        journal.Close();
+        BOOST_CHECK(file_size(pathTest / "records.dat") == nSize);
+
+        FILE* fp = fopen((pathTest / "records.dat").string().c_str(), "ab");
+        BOOST_CHECK(fp != nullptr);
+        uint32 nTorn[2] = { 1000, 0 };
+        BOOST_CHECK(fwrite(nTorn, sizeof(nTorn), 1, fp) == 1);
+        fclose(fp);
+
+        BOOST_CHECK(journal.Open(pathTest / "records.dat"));
+        BOOST_CHECK(journal.GetSize() == nSize && file_size(pathTest / "records.dat") == nSize);
+        CBufStream ss;
+        ss << 3;
+        BOOST_CHECK(journal.Append(4, ss, true));
+
+        vector<CBlockJournal::CRecord> vRecord;
+        BOOST_CHECK(journal.Load(vRecord));
+        BOOST_CHECK(vRecord.size() == 4);
+        for (int i = 0; i < vRecord.size(); i++)
+        {
+            CBufStream ssRecord;
+            ssRecord.Write(&vRecord[i].vData[0], vRecord[i].vData.size());
+            int n = -1;
+            ssRecord >> n;
+            BOOST_CHECK(vRecord[i].nType == i + 1 && n == i);
+        }
+
+        BOOST_CHECK(journal.Reset());
+        BOOST_CHECK(journal.Load(vRecord) && vRecord.empty());
+
+        // a sync covers every record appended before it, a rotated journal goes on empty
+        BOOST_CHECK(journal.Append(5, ss, false) && journal.Append(6, ss, false));
+        BOOST_CHECK(journal.SyncTo(journal.GetAppended()) && journal.SyncTo(journal.GetAppended()));
+        BOOST_CHECK(journal.Rotate(pathTest / "rotated.dat"));
+        uint64 nValidSize = 0;
+        BOOST_CHECK(CBlockJournal::Read(pathTest / "rotated.dat", vRecord, nValidSize) && vRecord.size() == 2);
+        BOOST_CHECK(journal.GetSize() == 8 && journal.Load(vRecord) && vRecord.empty());
+    }
+
+    // changes journaled by one node are replayed into a database that lost them
+    uint256 hashFork = crypto::CryptoHash("blockjournal", 12);
+    CBlockOutline outline;
+    outline.hashBlock = crypto::CryptoHash("block", 5);
+    CTxUnspent unspent(CTxOutPoint(crypto::CryptoHash("tx", 2), 0),
+                       CTxOut(CDestination(CTemplateId(hashFork)), 1000000, 1600000000, 0));
+    uint256 txid(1600000000, uint224(crypto::CryptoHash("tx", 2)));
+    {
+        // the block itself reached the block file of the node that lost the database changes
+        CTimeSeriesCached tsBlock;
+        BOOST_CHECK(tsBlock.Initialize(pathTest / "restored" / "block", "block"));
+        BOOST_CHECK(tsBlock.Write(CBlock(), outline.nFile, outline.nOffset));
+        tsBlock.Deinitialize();
+    }
+    {
+        create_directories(pathTest / "crashed");
+        CBlockDB dbBlock;
+        BOOST_CHECK(dbBlock.Initialize(pathTest / "crashed"));
+        CForkContext ctxt;
+        ctxt.hashFork = hashFork;
+        BOOST_CHECK(dbBlock.AddNewForkContext(ctxt));
+        BOOST_CHECK(dbBlock.AddNewFork(hashFork));
+        BOOST_CHECK(dbBlock.AddNewBlock(outline));
+        BOOST_CHECK(dbBlock.UpdateFork(hashFork, outline.hashBlock, hashFork,
+                                       vector<pair<uint256, CTxIndex>>(1, make_pair(txid, CTxIndex(1, 1, 100))),
+                                       vector<uint256>(), vector<CTxUnspent>(1, unspent), vector<CTxOutPoint>()));
+        copy_file(pathTest / "crashed" / "journal.dat", pathTest / "journal.dat");
+        dbBlock.Deinitialize();
+    }
+    {
+        create_directories(pathTest / "restored");
+        CBlockDB dbBlock;
+        BOOST_CHECK(dbBlock.Initialize(pathTest / "restored"));
+        dbBlock.Deinitialize();
+    }
+    BOOST_CHECK(CBlockDB::IsJournalReplayable(pathTest / "restored"));
+    // the records were rotated out for a checkpoint that did not finish
+    copy_file(pathTest / "journal.dat", pathTest / "restored" / "journal.ckp");
+    BOOST_CHECK(CBlockDB::IsJournalReplayable(pathTest / "restored"));
+    {
+        CBlockDB dbBlock;
+        BOOST_CHECK(dbBlock.Initialize(pathTest / "restored"));
+
+        vector<pair<uint256, uint256>> vFork;
+        BOOST_CHECK(dbBlock.ListFork(vFork) && vFork.size() == 1);
+        BOOST_CHECK(vFork[0].first == hashFork && vFork[0].second == outline.hashBlock);
+
+        CTestOutlineWalker walker;
+        BOOST_CHECK(dbBlock.WalkThroughBlock(walker) && walker.setHash.count(outline.hashBlock));
+
+        CTxOut output;
+        BOOST_CHECK(dbBlock.RetrieveTxUnspent(hashFork, unspent, output) && output.nAmount == unspent.output.nAmount);
+        CTxIndex txIndex;
+        BOOST_CHECK(dbBlock.RetrieveTxIndex(hashFork, txid, txIndex) && txIndex.nOffset == 100);
+        dbBlock.Deinitialize();
+    }
+    BOOST_CHECK(file_size(pathTest / "restored" / "journal.dat") == 8);
+    BOOST_CHECK(!exists(pathTest / "restored" / "journal.ckp"));
+
+    // a block index record past the valid tail of the block files can not be replayed
+    copy_file(pathTest / "journal.dat", pathTest / "restored" / "journal.dat", copy_option::overwrite_if_exists);
+    BOOST_CHECK(CBlockDB::IsJournalReplayable(pathTest / "restored"));
+    resize_file(pathTest / "restored" / "block" / "block_000001.dat", outline.nOffset + 4);
+    BOOST_CHECK(!CBlockDB::IsJournalReplayable(pathTest / "restored"));
+
+    // a fork copied from its parent can not be replayed
+    {
+        CBlockJournal journal;
+        BOOST_CHECK(journal.Open(pathTest / "restored" / "journal.dat"));
+        CBufStream ss;
+        ss << hashFork;
+        BOOST_CHECK(journal.Append(0x80, ss, true));
+    }
+    BOOST_CHECK(!CBlockDB::IsJournalReplayable(pathTest / "restored"));
+    BOOST_CHECK(!CBlockDB::IsJournalReplayable(pathTest / "missing"));
+
+    boost::filesystem::remove_all(pathTest);
+}
+
+BOOST_AUTO_TEST_CASE(kvdbscan)
+{
+    const int nRecordCount = 100000;
+    const int nScanRound = 1000;
+    path pathTest = path("./.bigbang") / "kvdbscan";
+    boost::filesystem::remove_all(pathTest);
+    boost::filesystem::create_directories(pathTest);
+
+    // three tags, keys of a tag in numeric order
+    const string vTag[3] = { "a", "seq", string(2, (char)0xFF) };
+    {
+        CTestReadDB db(pathTest / "db");
+        BOOST_CHECK(db.TxnBegin());
+        for (int i = 0; i < nRecordCount; i++)
+        {
+            for (const string& strTag : vTag)
+            {
+                BOOST_CHECK(db.WriteValue(make_pair(strTag, BSwap64(uint64(i))), uint64(i)));
+            }
+        }
+        BOOST_CHECK(db.TxnCommit());
+
+        for (const string& strTag : vTag)
+        {
+            int nCount = 0;
+            bool fOrdered = true;
+            BOOST_CHECK(db.ScanPrefix(strTag, [&](CMemoryStream& ssKey, CMemoryStream& ssValue) {
+                string strKeyTag;
+                uint64 nKey, nValue;
+                ssKey >> strKeyTag >> nKey;
+                ssValue >> nValue;
+                fOrdered = fOrdered && (strKeyTag == strTag && nValue == nCount && BSwap64(nKey) == nValue);
+                nCount++;
+                return true;
+            }));
+            BOOST_CHECK(fOrdered && nCount == nRecordCount);
+        }
+
+        int nCount = 0;
+        BOOST_CHECK(db.ScanRange(make_pair(vTag[1], BSwap64(uint64(100))), make_pair(vTag[1], BSwap64(uint64(150))),
+                                 [&](CMemoryStream& ssKey, CMemoryStream& ssValue) {
+                                     nCount++;
+                                     return true;
+                                 }));
+        BOOST_CHECK(nCount == 50);
+
+        nCount = 0;
+        BOOST_CHECK(db.ScanPrefix(vTag[0], [&](CMemoryStream& ssKey, CMemoryStream& ssValue) {
+            return (++nCount < 10);
+        }));
+        BOOST_CHECK(nCount == 10);
+
+        // the first records of a tag, as a walk would read them before and after the scan API
+        const int nFirst = 10;
+        xengine::CTicks tWalk;
+        for (int n = 0; n < nScanRound; n++)
+        {
+            nCount = 0;
+            db.WalkThrough([&](CBufStream& ssKey, CBufStream& ssValue) {
+                string strKeyTag;
+                ssKey >> strKeyTag;
+                return (strKeyTag == vTag[1] && ++nCount < nFirst);
+            },
+                           make_pair(vTag[1], BSwap64(uint64(0))));
+        }
+        int64 nWalk = tWalk.Elapse();
+        xengine::CTicks tScan;
+        for (int n = 0; n < nScanRound; n++)
+        {
+            nCount = 0;
+            db.ScanPrefix(vTag[1], [&](CMemoryStream& ssKey, CMemoryStream& ssValue) {
+                return (++nCount < nFirst);
+            });
+        }
+        int64 nScan = tScan.Elapse();
+        cout << "First " << nFirst << " records of a tag, " << nScanRound << " rounds : walk " << nWalk
+             << " us, scan " << nScan << " us" << endl;
+    }
+
+    // the generic engine scan and the LevelDB one agree
+    {
+        CLevelDBArguments args;
+        args.path = (pathTest / "db").string();
+        CLevelDBEngine engine(args);
+        BOOST_CHECK(engine.Open());
+
+        // serialized tags sort by their length first, so the last tag directly follows the first one
+        CBufStream ssBegin, ssEnd;
+        ssBegin << make_pair(vTag[0], BSwap64(uint64(nRecordCount - 20)));
+        ssEnd << vTag[2];
+        vector<uint64> vNative, vGeneric;
+        BOOST_CHECK(engine.Scan(ssBegin, ssEnd, [&](CMemoryStream& ssKey, CMemoryStream& ssValue) {
+            uint64 n;
+            ssValue >> n;
+            vNative.push_back(n);
+            return true;
+        }));
+        BOOST_CHECK(engine.CKVDBEngine::Scan(ssBegin, ssEnd, [&](CMemoryStream& ssKey, CMemoryStream& ssValue) {
+            uint64 n;
+            ssValue >> n;
+            vGeneric.push_back(n);
+            return true;
+        }));
+        BOOST_CHECK(vNative.size() == 20 && vNative == vGeneric);
+        engine.Close();
+    }
+
+    boost::filesystem::remove_all(pathTest);
+}
+
+BOOST_AUTO_TEST_CASE(kvdbengine)
+{
+    const int nRecordCount = 50000;
+    path pathTest = path("./.bigbang") / "kvdbengine";
+    boost::filesystem::remove_all(pathTest);
+    boost::filesystem::create_directories(pathTest);
+
+    CLevelDBArguments args;
+    args.path = (pathTest / "db").string();
+    CTestReadDB dbLevel(new CLevelDBEngine(args));
+    CTestReadDB dbMemory(new CMemoryEngine());
+    BOOST_CHECK(dbLevel.IsValid() && dbMemory.IsValid());
+
+    // the same writes, removes and transactions give the same records
+    for (CTestReadDB* pdb : { &dbLevel, &dbMemory })
+    {
+        BOOST_CHECK(pdb->TxnBegin());
+        for (int i = 0; i < nRecordCount; i++)
+        {
+            BOOST_CHECK(pdb->WriteValue(BSwap64(uint64(i)), uint64(i)));
+        }
+        BOOST_CHECK(pdb->TxnCommit());
+        for (int i = 0; i < nRecordCount; i += 10)
+        {
+            BOOST_CHECK(pdb->Erase(BSwap64(uint64(i))));
+        }
+    }
+
+    const uint64 nBegin = BSwap64(uint64(1000)), nEnd = BSwap64(uint64(2000));
+    auto fnCollect = [](CTestReadDB& db, uint64 nBeginKey, uint64 nEndKey, vector<uint64>& vValue) {
+        return db.ScanRange(nBeginKey, nEndKey, [&](CMemoryStream& ssKey, CMemoryStream& ssValue) {
+            uint64 n;
+            ssValue >> n;
+            vValue.push_back(n);
+            return true;
+        });
+    };
+    vector<uint64> vLevel, vMemory;
+    BOOST_CHECK(fnCollect(dbLevel, nBegin, nEnd, vLevel) && fnCollect(dbMemory, nBegin, nEnd, vMemory));
+    BOOST_CHECK(vLevel.size() == 900 && vLevel == vMemory);
+
+    // the walk cursor of the memory engine survives writes made by the walker
+    int nWalk = 0;
+    BOOST_CHECK(dbMemory.WalkThrough([&](CBufStream& ssKey, CBufStream& ssValue) {
+        uint64 nKey;
+        ssKey >> nKey;
+        nWalk++;
+        return (BSwap64(nKey) != 5 || dbMemory.Erase(BSwap64(uint64(6))));
+    }));
+    BOOST_CHECK(nWalk == nRecordCount - nRecordCount / 10 - 1);
+
+    // a table built from leveldb reads like it and refuses writes
+    path pathTable = pathTest / "table.dat";
+    {
+        CLevelDBEngine engine(args);
+        dbLevel.Close();
+        BOOST_CHECK(engine.Open());
+        BOOST_CHECK(CMappedTableEngine::Build(engine, pathTable));
+        engine.Close();
+    }
+    CTestReadDB dbTable(new CMappedTableEngine(pathTable));
+    BOOST_CHECK(dbTable.IsValid());
+
+    vector<uint64> vTable;
+    BOOST_CHECK(fnCollect(dbTable, nBegin, nEnd, vTable));
+    BOOST_CHECK(vTable == vLevel);
+
+    uint64 nValue = 0;
+    BOOST_CHECK(dbTable.ReadValue(BSwap64(uint64(nRecordCount - 1)), nValue) && nValue == nRecordCount - 1);
+    BOOST_CHECK(!dbTable.ReadValue(BSwap64(uint64(10)), nValue));
+    BOOST_CHECK(!dbTable.ReadValue(BSwap64(uint64(nRecordCount)), nValue));
+    BOOST_CHECK(!dbTable.WriteValue(BSwap64(uint64(10)), uint64(10)));
+    BOOST_CHECK(!dbTable.TxnBegin());
+
+    nWalk = 0;
+    BOOST_CHECK(dbTable.WalkThrough([&](CBufStream& ssKey, CBufStream& ssValue) {
+        nWalk++;
+        return true;
+    }));
+    BOOST_CHECK(nWalk == nRecordCount - nRecordCount / 10);
+
+    // point reads of every engine
+    for (CTestReadDB* pdb : { &dbMemory, &dbTable })
+    {
+        xengine::CTicks t;
+        int nHit = 0;
+        for (int i = 0; i < nRecordCount; i++)
+        {
+            nHit += pdb->ReadValue(BSwap64(uint64(i)), nValue);
+        }
+        cout << (pdb == &dbMemory ? "Memory" : "Mapped table") << " engine, " << nRecordCount << " reads : "
+             << t.Elapse() << " us" << endl;
+        BOOST_CHECK(nHit >= nRecordCount - nRecordCount / 10 - 1);
+    }
+
+    dbTable.Close();
+    boost::filesystem::remove_all(pathTest);
+}
+
+BOOST_AUTO_TEST_CASE(blockskip)
+{
+    const int nHeightCount = 200000;
+
+    // a chain with two extended blocks after every fifth height
+    vector<uint256> vHash;
+    vector<CBlockIndex> vIndex;
+    for (int h = 0; h < nHeightCount; h++)
+    {
+        for (int n = 0; n < (h % 5 == 4 ? 3 : 1); n++)
+        {
+            CBlockIndex index;
+            index.nHeight = h;
+            index.nType = (n == 0 ? CBlock::BLOCK_SUBSIDIARY : CBlock::BLOCK_EXTENDED);
+            vIndex.push_back(index);
+        }
+    }
+    vHash.resize(vIndex.size());
+    for (size_t i = 0; i < vIndex.size(); i++)
+    {
+        vHash[i] = uint256(uint64(i));
+        vIndex[i].phashBlock = &vHash[i];
+        vIndex[i].pPrev = (i > 0 ? &vIndex[i - 1] : nullptr);
+        vIndex[i].BuildSkip();
+    }
+
+    // the last block at or below the height, as the pPrev walk finds it
+    auto fnWalk = [](CBlockIndex* pIndex, int nHeight) {
+        while (pIndex != nullptr && pIndex->GetBlockHeight() > nHeight)
+        {
+            pIndex = pIndex->pPrev;
+        }
+        return pIndex;
+    };
+    CBlockIndex* pTip = &vIndex.back();
+    bool fMatch = true;
+    for (int i = 0; i < 2000; i++)
+    {
+        CBlockIndex* pFrom = &vIndex[rand() % vIndex.size()];
+        int nHeight = rand() % (pFrom->GetBlockHeight() + 1);
+        fMatch = fMatch && (pFrom->GetAncestor(nHeight) == fnWalk(pFrom, nHeight));
+    }
+    BOOST_CHECK(fMatch);
+    BOOST_CHECK(pTip->GetAncestor(pTip->GetBlockHeight() + 1) == nullptr && pTip->GetAncestor(-1) == nullptr);
+    BOOST_CHECK(pTip->GetAncestor(pTip->GetBlockHeight()) == pTip && pTip->GetAncestor(0) == &vIndex[0]);
+    BOOST_CHECK(vIndex[14].GetAncestor(9)->IsExtended() && vIndex[14].GetAncestor(9)->pPrev->GetBlockHeight() == 9);
+
+    xengine::CTicks tWalk;
+    CBlockIndex* pWalk = fnWalk(pTip, 1);
+    int64 nWalk = tWalk.Elapse();
+    xengine::CTicks tSkip;
+    CBlockIndex* pSkip = pTip->GetAncestor(1);
+    int64 nSkip = tSkip.Elapse();
+    BOOST_CHECK(pWalk == pSkip && pSkip == &vIndex[1]);
+    cout << "Height 1 from a tip at " << pTip->GetBlockHeight() << " : walk " << nWalk << " us, skip " << nSkip << " us" << endl;
+}
+
+BOOST_AUTO_TEST_CASE(blockactive)
+{
+    const int nParentHeight = 100;
+    const int nBranchHeight = 20000;
+    const int nServeRound = 1000;
+    const int nServeCount = 500;
+
+    // a parent chain, a fork origin on top of it and two branches of the fork splitting at nBranchHeight / 2,
+    // both with two extended blocks after every fifth height
+    deque<CBlockIndex> vIndex;
+    deque<uint256> vHash;
+    auto fnAdd = [&](CBlockIndex* pPrev, int nHeight, uint16 nType) {
+        vIndex.push_back(CBlockIndex());
+        vHash.push_back(uint256(uint64(vHash.size() + 1)));
+        CBlockIndex* pIndex = &vIndex.back();
+        pIndex->phashBlock = &vHash.back();
+        pIndex->nHeight = nHeight;
+        pIndex->nType = nType;
+        pIndex->pPrev = pPrev;
+        pIndex->pOrigin = (pIndex->IsOrigin() ? pIndex : pPrev->pOrigin);
+        pIndex->BuildSkip();
+        return pIndex;
+    };
+    auto fnBranch = [&](CBlockIndex* pIndex, int nCount, vector<CBlockIndex*>& vBranch) {
+        for (int i = 0; i < nCount; i++)
+        {
+            int nHeight = pIndex->GetBlockHeight() + 1;
+            for (int n = 0; n < (nHeight % 5 == 4 ? 3 : 1); n++)
+            {
+                pIndex = fnAdd(pIndex, nHeight, (n == 0 ? CBlock::BLOCK_SUBSIDIARY : CBlock::BLOCK_EXTENDED));
+                vBranch.push_back(pIndex);
+            }
+        }
+    };
+
+    CBlockIndex* pIndex = fnAdd(nullptr, 0, CBlock::BLOCK_GENESIS);
+    for (int h = 1; h < nParentHeight; h++)
+    {
+        pIndex = fnAdd(pIndex, h, CBlock::BLOCK_PRIMARY);
+    }
+    CBlockIndex* pOrigin = fnAdd(pIndex, nParentHeight, CBlock::BLOCK_ORIGIN);
+    vector<CBlockIndex*> vMain, vSide;
+    fnBranch(pOrigin, nBranchHeight, vMain);
+    CBlockIndex* pSplit = pOrigin->GetAncestor(0);
+    for (CBlockIndex* p : vMain)
+    {
+        if (p->GetBlockHeight() == nParentHeight + nBranchHeight / 2)
+        {
+            pSplit = p;
+            break;
+        }
+    }
+    fnBranch(pSplit, nBranchHeight / 4, vSide);
+
+    // the active chain matches the pPrev walk from the last block, blocks off it have no position
+    auto fnCheck = [&](CBlockFork& fork) {
+        vector<CBlockIndex*> vWalk;
+        for (CBlockIndex* p = fork.GetLast(); p != pOrigin->pPrev; p = p->pPrev)
+        {
+            vWalk.push_back(p);
+        }
+        reverse(vWalk.begin(), vWalk.end());
+        bool fMatch = (fork.GetActiveCount() == vWalk.size());
+        for (size_t i = 0; fMatch && i < vWalk.size(); i++)
+        {
+            fMatch = (fork.GetActive(i) == vWalk[i] && fork.GetActivePos(vWalk[i]) == (int)i);
+        }
+        for (int h = 0; fMatch && h <= fork.GetLast()->GetBlockHeight(); h += 7)
+        {
+            fMatch = (fork.GetActiveOfHeight(h) == fork.GetLast()->GetAncestor(h));
+        }
+        set<CBlockIndex*> setWalk(vWalk.begin(), vWalk.end());
+        for (const vector<CBlockIndex*>* pBranch : { &vMain, &vSide })
+        {
+            for (size_t i = 0; fMatch && i < pBranch->size(); i += 3)
+            {
+                CBlockIndex* p = (*pBranch)[i];
+                fMatch = ((fork.GetActivePos(p) >= 0) == (setWalk.count(p) != 0));
+            }
+        }
+        return (fMatch && fork.GetActive(vWalk.size()) == nullptr && fork.GetActiveOfHeight(fork.GetLast()->GetBlockHeight() + 1) == nullptr);
+    };
+
+    CBlockFork fork(CProfile(), pOrigin);
+    fork.UpdateNext();
+    fork.UpdateActive();
+    BOOST_CHECK(fnCheck(fork));
+
+    // grow block by block, then reorg to the side branch, back to the main one and into the
+    // extended blocks of a height
+    bool fGrow = true;
+    for (size_t i = 0; i < vMain.size(); i++)
+    {
+        fork.UpdateLast(vMain[i]);
+        fGrow = fGrow && (fork.GetActive(fork.GetActiveCount() - 1) == vMain[i]);
+    }
+    BOOST_CHECK(fGrow && fnCheck(fork));
+    fork.UpdateLast(vSide.back());
+    BOOST_CHECK(fnCheck(fork));
+    BOOST_CHECK(fork.GetActivePos(vMain.back()) < 0 && fork.GetActivePos(pSplit) >= 0);
+    fork.UpdateLast(vMain.back());
+    BOOST_CHECK(fnCheck(fork));
+    CBlockIndex* pExtended = vSide[vSide.size() / 2];
+    while (!pExtended->IsExtended() || pExtended->pPrev->IsExtended())
+    {
+        pExtended = pExtended->pPrev;
+    }
+    fork.UpdateLast(pExtended);
+    BOOST_CHECK(fnCheck(fork));
+    BOOST_CHECK(fork.GetActiveOfHeight(pExtended->GetBlockHeight()) == pExtended);
+    fork.UpdateLast(vMain.back());
+    BOOST_CHECK(fnCheck(fork));
+
+    // inventory served to peers whose locators stop at random active blocks
+    vector<CBlockIndex*> vPeer;
+    for (int i = 0; i < nServeRound; i++)
+    {
+        vPeer.push_back(vMain[rand() % vMain.size()]);
+    }
+    size_t nNext = 0, nActive = 0;
+    xengine::CTicks tNext;
+    for (CBlockIndex* p : vPeer)
+    {
+        vector<uint256> vBlockHash;
+        for (p = p->pNext; p != nullptr && vBlockHash.size() < nServeCount; p = p->pNext)
+        {
+            vBlockHash.push_back(p->GetBlockHash());
+        }
+        nNext += vBlockHash.size();
+    }
+    int64 nNextTime = tNext.Elapse();
+    xengine::CTicks tActive;
+    for (CBlockIndex* p : vPeer)
+    {
+        vector<uint256> vBlockHash;
+        int nPos = fork.GetActivePos(p);
+        for (p = fork.GetActive(++nPos); p != nullptr && vBlockHash.size() < nServeCount; p = fork.GetActive(++nPos))
+        {
+            vBlockHash.push_back(p->GetBlockHash());
+        }
+        nActive += vBlockHash.size();
+    }
+    int64 nActiveTime = tActive.Elapse();
+    BOOST_CHECK(nNext == nActive);
+    cout << "Block inventory for " << nServeRound << " peers : next links " << nNextTime << " us, active chain "
+         << nActiveTime << " us" << endl;
+}
+
 BOOST_AUTO_TEST_SUITE_END()